@@ -32,8 +32,9 @@
 #error "don't include directly this header, use gdsync.h always"
 #endif
 
-#define GDS_API_MAJOR_VERSION    2U
-#define GDS_API_MINOR_VERSION    1U
+// 3.0: struct gds_cq, gds_qp and gds_send_request_t changed layout
+#define GDS_API_MAJOR_VERSION    3U
+#define GDS_API_MINOR_VERSION    0U
 #define GDS_API_VERSION          ((GDS_API_MAJOR_VERSION << 16) | GDS_API_MINOR_VERSION)
 #define GDS_API_VERSION_COMPATIBLE(v) \
     ( ((((v) & 0xffff0000U) >> 16) == GDS_API_MAJOR_VERSION) &&   \
@@ -41,9 +42,22 @@
 
 typedef enum gds_param {
     GDS_PARAM_VERSION,
+    GDS_PARAM_DB_STRATEGY, // gds_db_strategy_t picked for the current GPU, -1 if not autotuned
     GDS_NUM_PARAMS
 } gds_param_t;
 
+// orderings of the DBREC update and of the doorbell write in a send request,
+// picked per GPU by the autotuner when GDS_ENABLE_AUTOTUNE=1
+typedef enum gds_db_strategy {
+    GDS_DB_PLAIN_MEMBAR = 0,   // plain writes, native 64-bits doorbell if any, fence as memory barrier
+    GDS_DB_PLAIN,              // plain writes, fence as pre-barrier
+    GDS_DB_SIM64_MEMBAR,       // 64-bits doorbell as inline copy, memory barrier
+    GDS_DB_SIM64,              // ditto, all writes as inline copies
+    GDS_DB_INLCPY_MEMBAR,      // whole WQE as inline copy, memory barrier
+    GDS_DB_INLCPY,             // ditto, all writes as inline copies
+    GDS_DB_NUM_STRATEGIES
+} gds_db_strategy_t;
+
 int gds_query_param(gds_param_t param, int *value);
 
 enum gds_create_qp_flags {
@@ -57,15 +71,31 @@ enum gds_create_qp_flags {
 typedef struct ibv_exp_qp_init_attr gds_qp_init_attr_t;
 typedef struct ibv_exp_send_wr gds_send_wr;
 
+#define GDS_CACHELINE_SIZE 64
+
 struct gds_cq {
         struct ibv_cq *cq;
-        uint32_t curr_offset;
+        // CQ created by gds_create_shared_cq, which holds the CQE cursor,
+        // NULL for a private CQ
+        struct gds_cq *shared;
+        // next CQE to be waited on, claimed atomically by gds_prepare_wait_cq
+        // so that concurrent streams never peek the same CQE. Kept on its
+        // own cache line, away from the read-mostly fields above.
+        uint32_t curr_offset __attribute__((aligned(GDS_CACHELINE_SIZE)));
 };
 
 struct gds_qp {
         struct ibv_qp *qp;
         struct gds_cq send_cq;
         struct gds_cq recv_cq;
+        // send queue bounds, used when posting from the CPU to copy WQEs
+        // which wrap around the end of the SQ, NULL when unknown
+        const uint64_t *sq_begin;
+        const uint64_t *sq_end;
+        // the GDS_CREATE_QP_WQ_ON_GPU and GDS_CREATE_QP_WQ_DBREC_ON_GPU
+        // flags whose buffers did end up in GPU memory, the provider
+        // silently falls back to host memory otherwise
+        int on_gpu;
 };
 
 // consider enabling GDS_CREATE_QP_GPU_INVALIDATE_T/RX_CQ when
@@ -75,6 +105,67 @@ struct gds_qp *gds_create_qp(struct ibv_pd *pd, struct ibv_context *context,
                              int gpu_id, int flags);
 int gds_destroy_qp(struct gds_qp *qp);
 
+enum gds_create_qp_attr_mask {
+        GDS_CREATE_QP_ATTR_NUMA_NODE = 1<<0,
+        GDS_CREATE_QP_ATTR_SEND_CQ   = 1<<1,
+        GDS_CREATE_QP_ATTR_RECV_CQ   = 1<<2,
+        GDS_CREATE_QP_ATTR_SRQ       = 1<<3
+};
+
+typedef struct gds_create_qp_attr {
+        uint32_t comp_mask;  // gds_create_qp_attr_mask, fields below are valid if set
+        int      numa_node;  // node of host side CQ/WQ/DBREC memory, -1 for none,
+                             // by default the node of the HCA
+        struct gds_cq *send_cq; // out of gds_create_shared_cq, used instead of
+        struct gds_cq *recv_cq; // a new CQ, GDS_CREATE_QP_TX/RX_CQ_ON_GPU are ignored
+        struct gds_srq *srq;    // out of gds_create_srq, receives are posted there
+} gds_create_qp_attr_t;
+
+// same as gds_create_qp, attr can be NULL
+struct gds_qp *gds_create_qp_ex(struct ibv_pd *pd, struct ibv_context *context,
+                                gds_qp_init_attr_t *qp_init_attr,
+                                int gpu_id, int flags, gds_create_qp_attr_t *attr);
+
+enum gds_create_cq_flags {
+    GDS_CREATE_CQ_DEFAULT   = 0,
+    GDS_CREATE_CQ_ON_GPU    = 1<<0,
+};
+
+/* \brief: CQ which can be shared by many QPs, see GDS_CREATE_QP_ATTR_SEND/RECV_CQ
+ *
+ * Waits prepared on the shared CQ, or on the send_cq/recv_cq of any QP
+ * using it, claim the CQEs in order, so each one targets the next
+ * completion of whichever QP. Only CPU polling tells which QP that was:
+ * a stream wait just consumes the next CQE, whoever it belongs to. Use
+ * gds_shared_cq_qp() on the qp_num of the CQE, as returned by
+ * ibv_poll_cq, to find out which QP completed.
+ *
+ * gds_destroy_shared_cq fails with EBUSY while some QP is still using cq.
+ */
+struct gds_cq *gds_create_shared_cq(struct ibv_context *context, int cqe, int gpu_id, int flags);
+int gds_destroy_shared_cq(struct gds_cq *cq);
+// NULL if no QP using cq has number qp_num
+struct gds_qp *gds_shared_cq_qp(struct gds_cq *cq, uint32_t qp_num);
+
+struct gds_srq {
+        struct ibv_srq *srq;
+        uint32_t max_wr;
+};
+
+/* \brief: receive queue shared by many QPs, see GDS_CREATE_QP_ATTR_SRQ
+ *
+ * Notes:
+ * - receive WQEs are only ever written by the CPU, so the SRQ buffers
+ *   live in host memory next to the HCA.
+ * - receive completions still land in the RX CQ of each QP, or in its
+ *   shared RX CQ, hence gds_prepare_wait_cq/gds_stream_wait_cq work as
+ *   usual. A private RX CQ is sized after max_wr.
+ */
+struct gds_srq *gds_create_srq(struct ibv_pd *pd, struct ibv_context *context, uint32_t max_wr, uint32_t max_sge);
+int gds_destroy_srq(struct gds_srq *srq);
+// CPU-synchronous post recv, as gds_post_recv
+int gds_post_srq_recv(struct gds_srq *srq, struct ibv_recv_wr *wr, struct ibv_recv_wr **bad_wr);
+
 /* \brief: CPU-synchronous post send for peer QPs
  *
  * Notes:
@@ -92,6 +183,17 @@ int gds_post_recv(struct gds_qp *qp, struct ibv_recv_wr *wr, struct ibv_recv_wr
 
 int gds_stream_wait_cq(CUstream stream, struct gds_cq *cq, int flags);
 
+/* \brief: waits on the next CQE in stream, then releases streams[0..n_streams)
+ *
+ * Notes:
+ * - stream peeks the CQE, then writes a flag which the other streams wait
+ *   on, instead of recording and waiting on a CUDA event per stream.
+ * - flags: GDS_MEMORY_HOST (default) or GDS_MEMORY_GPU, where the flag lives.
+ * - flags come from a recycled pool, a flag is reused only after its
+ *   previous release has been executed.
+ */
+int gds_stream_wait_cq_bcast(CUstream stream, struct gds_cq *cq, int n_streams, CUstream *streams, int flags);
+
 /* \brief: GPU stream-synchronous send for peer QPs
  *
  * Notes:
@@ -139,12 +241,37 @@ enum {
 typedef struct gds_send_request {
         struct ibv_exp_peer_commit commit;
         struct peer_op_wr wr[GDS_SEND_INFO_MAX_OPS];
+        // copied from the QP by the prepare functions
+        const uint64_t *sq_begin;
+        const uint64_t *sq_end;
 } gds_send_request_t;
 
 int gds_prepare_send(struct gds_qp *qp, gds_send_wr *p_ewr, gds_send_wr **bad_ewr, gds_send_request_t *request);
 int gds_stream_post_send(CUstream stream, gds_send_request_t *request);
 int gds_stream_post_send_all(CUstream stream, int count, gds_send_request_t *request);
 
+/* \brief: CPU-synchronous counterpart of gds_stream_post_send_all
+ *
+ * Notes:
+ * - count must be at least 1, EINVAL is returned otherwise.
+ * - doorbells of requests on the same QP are coalesced, and the whole
+ *   batch is flushed out of the write-combining buffers at once.
+ * - set GDS_DISABLE_DB_BATCHING=1 to ring every request in turn.
+ */
+int gds_post_send_all(int count, gds_send_request_t *request);
+
+/**
+ * Prepares one send per QP, i.e. wrs[i] is posted on qps[i].
+ *
+ * Successfully prepared requests are packed at the front of requests, so
+ * that requests[0..*n_ready) can be passed as is to
+ * gds_stream_post_send_all. A failing entry does not stop the batch: its
+ * uncommitted WQEs are rolled back, status[i] (optional) is set to the
+ * error code and the first error is returned.
+ */
+int gds_prepare_send_multi(int n, struct gds_qp **qps, gds_send_wr **wrs,
+                           gds_send_request_t *requests, int *status, int *n_ready);
+
 
 /**
  * Represents a wait operation on a particular CQ
@@ -157,7 +284,7 @@ typedef struct gds_wait_request {
 
 /**
  * Initializes a wait request out of the next heading CQE, which is kept in
- * cq->curr_offset.
+ * cq->curr_offset, or in cq->shared->curr_offset for a shared CQ.
  *
  * flags: must be 0
  */
@@ -233,7 +360,54 @@ int gds_prepare_write_value32(gds_write_value32_t *desc, uint32_t *ptr, uint32_t
 
 
 
-typedef enum gds_tag { GDS_TAG_SEND, GDS_TAG_WAIT, GDS_TAG_WAIT_VALUE32, GDS_TAG_WRITE_VALUE32 } gds_tag_t;
+/**
+ * Represents a wait operation on a 64-bits memory word
+ *
+ * Uses the native 64-bits wait when the GPU supports it, otherwise it is
+ * emulated with 32-bits waits, which is exact for words which are updated
+ * atomically and monotonically, i.e. 64-bits sequence counters:
+ * - GEQ waits on the low word, so value must be within 2^31 of the counter
+ * - EQ waits on the high, the low and again on the high word
+ * - AND requires the mask to lie within either the low or the high word
+ * - NOR requires either word of value to be all ones
+ */
+
+typedef struct gds_wait_value64 {
+        uint64_t  *ptr;
+        uint64_t   value;
+        gds_wait_cond_flag_t cond_flags;
+        int        flags; // takes gds_memory_type_t | gds_wait_flags_t
+} gds_wait_value64_t;
+
+/**
+ * flags: gds_memory_type_t | gds_wait_flags_t
+ */
+int gds_prepare_wait_value64(gds_wait_value64_t *desc, uint64_t *ptr, uint64_t value, gds_wait_cond_flag_t cond_flags, int flags);
+
+
+
+/**
+ * Represents a write operation on a 64-bits memory word
+ *
+ * Uses the native 64-bits write when the GPU supports it, otherwise an
+ * 8 bytes inline copy. The value is never written as two halves, so
+ * posting fails with ENOTSUP when neither is available.
+ */
+
+typedef struct gds_write_value64 {
+        uint64_t  *ptr;
+        uint64_t   value;
+        int        flags; // takes gds_memory_type_t | gds_write_flags_t
+} gds_write_value64_t;
+
+/**
+ * flags:  gds_memory_type_t | gds_write_flags_t
+ */
+int gds_prepare_write_value64(gds_write_value64_t *desc, uint64_t *ptr, uint64_t value, int flags);
+
+
+
+typedef enum gds_tag { GDS_TAG_SEND, GDS_TAG_WAIT, GDS_TAG_WAIT_VALUE32, GDS_TAG_WRITE_VALUE32, GDS_TAG_WAIT_VALUE64, GDS_TAG_WRITE_VALUE64 } gds_tag_t;
 
 typedef struct gds_descriptor {
         gds_tag_t tag; /**< selector for union below */
@@ -242,6 +416,8 @@ typedef struct gds_descriptor {
                 gds_wait_request_t  *wait;
                 gds_wait_value32_t   wait32;
                 gds_write_value32_t  write32;
+                gds_wait_value64_t   wait64;
+                gds_write_value64_t  write64;
         };
 } gds_descriptor_t;
 
@@ -250,6 +426,196 @@ typedef struct gds_descriptor {
  */
 int gds_stream_post_descriptors(CUstream stream, size_t n_descs, gds_descriptor_t *descs, int flags);
 
+/**
+ * CUDA graph counterpart of gds_stream_post_descriptors, adds a batch
+ * memop node to graph, depending on deps[0..n_deps).
+ *
+ * CQE offsets, DBREC and doorbell values change on every iteration, so
+ * before each replay prepare a new set of requests with the same shape,
+ * i.e. same tags in the same order, and pass them to
+ * gds_graph_exec_update_descriptors to patch the instantiated node.
+ *
+ * Inline copies are rejected with EINVAL, as their source is only valid
+ * while posting: they come from BlueFlame WQE pushes and doorbells, so
+ * create the QPs with GDS_DISABLE_INLINECOPY=1, and from 64-bit writes on
+ * GPUs without native 64-bit memops.
+ *
+ * Requires CUDA 11.7 or later, ENOTSUP otherwise.
+ * flags: must be 0
+ */
+int gds_graph_add_descriptors_node(CUgraphNode *node, CUgraph graph, const CUgraphNode *deps, size_t n_deps,
+                                   size_t n_descs, gds_descriptor_t *descs, int flags);
+int gds_graph_exec_update_descriptors(CUgraphExec exec, CUgraphNode node, size_t n_descs, gds_descriptor_t *descs, int flags);
+
+
+/**
+ * Request pools
+ *
+ * A pool owns n_reqs send and n_reqs wait requests, whose op lists are
+ * linked once at creation time.  Requests prepared through a pool must be
+ * posted with gds_request_pool_post_descriptors(), which appends a write
+ * of a per-stream sequence number to the batch; once that stream has
+ * executed it, the requests of the batch are recycled by later prepare
+ * calls, resetting only the ops actually used. A pool can be posted on
+ * several streams.
+ *
+ * Pools are not thread-safe, typically one is created per QP.
+ */
+typedef struct gds_request_pool gds_request_pool_t;
+
+int gds_create_request_pool(size_t n_reqs, gds_request_pool_t **ppool);
+int gds_destroy_request_pool(gds_request_pool_t *pool);
+
+/**
+ * returns EAGAIN when all requests are in use
+ */
+int gds_request_pool_prepare_send(gds_request_pool_t *pool, struct gds_qp *qp, gds_send_wr *p_ewr, gds_send_wr **bad_ewr, gds_send_request_t **prequest);
+int gds_request_pool_prepare_wait_cq(gds_request_pool_t *pool, struct gds_cq *cq, gds_wait_request_t **prequest, int flags);
+
+/**
+ * same as gds_stream_post_descriptors, additionally the requests of pool
+ * found in descs are returned to it once the stream is done with them.
+ * Prepared requests which are not in descs stay with the caller, as do
+ * all the requests of descs on error.
+ */
+int gds_request_pool_post_descriptors(CUstream stream, gds_request_pool_t *pool, size_t n_descs, gds_descriptor_t *descs, int flags);
+
+/**
+ * returns the prepared, not posted, requests of pool found in descs to
+ * it, e.g. after gds_request_pool_post_descriptors has failed; the CQE
+ * claimed by a released wait request is not waited for by later waits
+ * returns EINVAL, releasing nothing, if some of them is not prepared
+ */
+int gds_request_pool_release(gds_request_pool_t *pool, size_t n_descs, gds_descriptor_t *descs);
+
+
+/**
+ * Compact requests
+ *
+ * Variable-length send and wait requests, stored back to back in
+ * cache-line aligned slots which hold only the ops actually used, i.e.
+ * a few hundred bytes per request rather than sizeof(gds_send_request_t).
+ * The buffer is owned by the library and grows on demand.
+ */
+typedef struct gds_compact_requests {
+        void   *buf;
+        size_t  size;  /**< bytes allocated */
+        size_t  used;  /**< bytes in use */
+        size_t  count; /**< number of requests */
+} gds_compact_requests_t;
+
+/**
+ * size: initial buffer size in bytes, 0 for a default
+ */
+int gds_compact_requests_init(gds_compact_requests_t *creqs, size_t size);
+int gds_compact_requests_fini(gds_compact_requests_t *creqs);
+/**
+ * drops all requests, keeping the buffer
+ */
+void gds_compact_requests_reset(gds_compact_requests_t *creqs);
+
+/**
+ * same as gds_prepare_send/gds_prepare_wait_cq, appending the request to creqs
+ */
+int gds_compact_prepare_send(struct gds_qp *qp, gds_send_wr *p_ewr, gds_send_wr **bad_ewr, gds_compact_requests_t *creqs);
+int gds_compact_prepare_wait_cq(struct gds_cq *cq, gds_compact_requests_t *creqs, int flags);
+
+/**
+ * converters from/to the fixed-size request types
+ */
+int gds_compact_requests_append_send(gds_compact_requests_t *creqs, const gds_send_request_t *request);
+int gds_compact_requests_append_wait(gds_compact_requests_t *creqs, const gds_wait_request_t *request);
+int gds_compact_requests_get_send(gds_compact_requests_t *creqs, size_t index, gds_send_request_t *request);
+int gds_compact_requests_get_wait(gds_compact_requests_t *creqs, size_t index, gds_wait_request_t *request);
+
+/**
+ * posts all requests in creqs, in order
+ * The memops are submitted in batches of at most 256, each holding only
+ * whole requests, whereas gds_stream_post_descriptors submits a single
+ * batch whatever its size.
+ * flags: must be 0
+ */
+int gds_stream_post_compact_requests(CUstream stream, gds_compact_requests_t *creqs, int flags);
+
+
+/**
+ * Aggregation endpoints
+ *
+ * Small messages are packed, in stream order, into the slots of a
+ * registered staging buffer, each message behind a gds_agg_msg_hdr_t and
+ * padded to GDS_AGG_ALIGN bytes. A slot goes out as a single send when the
+ * next message does not fit, or at an explicit gds_agg_flush() marker.
+ * On the receiver, gds_agg_unpack() or gdsync::device::agg_unpack() walk
+ * the received buffer and signal one flag per message.
+ *
+ * Before a slot is reused, the stream waits for the completion of the
+ * send which used it last, so the endpoint owns the send CQ of qp:
+ * reap its completions with gds_agg_poll() only.
+ *
+ * Endpoints are not thread-safe and are bound to a single stream.
+ */
+#define GDS_AGG_ALIGN 8
+
+typedef struct gds_agg_msg_hdr {
+        uint32_t len; /**< payload bytes, not including the padding */
+        uint32_t id;  /**< selects the flag to be signaled at the receiver */
+} gds_agg_msg_hdr_t;
+
+typedef struct gds_agg_attr {
+        size_t       slot_size; /**< bytes per send, headers included, multiple of GDS_AGG_ALIGN */
+        int          n_slots;   /**< slots in flight, less than the depth of the send CQ */
+        int          flags;     /**< gds_memory_type_t of the staging buffer, GDS_MEMORY_HOST or GDS_MEMORY_GPU */
+        gds_send_wr *wr;        /**< template of the sends: IBV_EXP_WR_SEND(_WITH_IMM), AH for UD QPs;
+                                     sg_list, num_sge, wr_id and next are overwritten */
+} gds_agg_attr_t;
+
+typedef struct gds_agg gds_agg_t;
+
+int gds_agg_create(struct gds_qp *qp, struct ibv_pd *pd, CUstream stream, const gds_agg_attr_t *attr, gds_agg_t **pagg);
+/**
+ * returns EBUSY while sends are still to be reaped, see gds_agg_poll
+ */
+int gds_agg_destroy(gds_agg_t *agg);
+
+/**
+ * Appends a message of len bytes, copied from src in stream order, so src
+ * can be the output of a kernel launched earlier on the stream. src is a
+ * device pointer or pinned host memory, and can be NULL when len is 0.
+ *
+ * Flushes the current slot first if the message does not fit, returns
+ * EINVAL if it does not fit an empty slot either.
+ */
+int gds_agg_append(gds_agg_t *agg, const void *src, uint32_t len, uint32_t id);
+
+/**
+ * Stream marker: sends the messages appended so far, if any
+ */
+int gds_agg_flush(gds_agg_t *agg);
+
+enum gds_agg_poll_flags {
+        GDS_AGG_POLL_ALL = 1<<0,
+};
+
+/**
+ * Reaps, without blocking, the completions of the sends whose slot the
+ * stream has already waited on for reuse. With GDS_AGG_POLL_ALL, those of
+ * all sends, which requires the stream to be idle.
+ *
+ * n_pending: optional, sends still to be reaped
+ */
+int gds_agg_poll(gds_agg_t *agg, int flags, int *n_pending);
+
+/**
+ * Receiver side, for buffers in host memory: walks the len bytes of a
+ * received slot, copies each payload to dst[id] unless dst or dst[id] is
+ * NULL, then sets flags[id] = value.
+ *
+ * n_ids: entries of flags, and of dst if not NULL; a message with a
+ *        larger id stops the walk with EINVAL
+ * n_msgs: optional, number of messages found
+ */
+int gds_agg_unpack(const void *buf, size_t len, void **dst, uint32_t *flags, uint32_t n_ids, uint32_t value, int *n_msgs);
+
 /*
  * Local variables:
  *  c-indent-level: 8
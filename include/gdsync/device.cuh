@@ -155,6 +155,44 @@ namespace gdsync {
             return ret;
         }
 
+        // device counterpart of gds_agg_unpack, for a received slot of
+        // len bytes: payloads are copied by all the threads of a 1D block,
+        // which must all call it, flags are set by thread 0
+        __device__ inline int agg_unpack(const void *buf, size_t len, void **dst, uint32_t *flags, uint32_t n_ids, uint32_t value, int *n_msgs) {
+            const size_t align_mask = GDS_AGG_ALIGN - 1;
+            const char *p = (const char *)buf;
+            size_t off = 0;
+            int ret = 0;
+            int n = 0;
+            while (off + sizeof(gds_agg_msg_hdr_t) <= len) {
+                const gds_agg_msg_hdr_t *hdr = (const gds_agg_msg_hdr_t *)(p + off);
+                uint32_t msg_len = hdr->len;
+                uint32_t id = hdr->id;
+                size_t size = sizeof(gds_agg_msg_hdr_t) + ((msg_len + align_mask) & ~align_mask);
+                if (off + size > ((len + align_mask) & ~align_mask) || id >= n_ids) {
+                    ret = ERROR_INVALID;
+                    break;
+                }
+                if (dst && dst[id]) {
+                    char *d = (char *)dst[id];
+                    const char *s = p + off + sizeof(gds_agg_msg_hdr_t);
+                    for (uint32_t i = threadIdx.x; i < msg_len; i += blockDim.x)
+                        d[i] = s[i];
+                }
+                __syncthreads();
+                if (0 == threadIdx.x) {
+                    // payload before flag, for GPU and CPU waiters alike
+                    __threadfence_system();
+                    *(volatile uint32_t *)&flags[id] = value;
+                }
+                off += size;
+                ++n;
+            }
+            if (n_msgs && 0 == threadIdx.x)
+                *n_msgs = n;
+            return ret;
+        }
+
     } // namespace device
 #endif
 
@@ -46,6 +46,30 @@ typedef struct gds_mem_desc {
 int gds_alloc_mapped_memory(gds_mem_desc_t *desc, size_t size, int flags);
 int gds_free_mapped_memory(gds_mem_desc_t *desc);
 
+typedef struct gds_mem_range {
+    void       *ptr;
+    size_t      size;
+} gds_mem_range_t;
+// registers many buffers at once, for use at application start-up
+// ranges are page-rounded, sorted and coalesced, so that each merged extent
+// is pinned with a single cuMemHostRegister
+// on error, the extents pinned by the call are unpinned again
+// flags: gds_memory_type_t
+int gds_register_mem_bulk(gds_mem_range_t *ranges, size_t n_ranges, int flags);
+// drops the registrations overlapping [ptr,ptr+size) from the pin-down cache
+// and unpins them, to be called before the memory is released
+// ptr==NULL and size==0 flush the whole cache, e.g. after the CUDA context
+// has been destroyed; memory allocated by libgdsync itself stays pinned
+// until the object owning it is destroyed
+// preloading libgdsync_memhooks.so does this automatically, see below
+int gds_invalidate_mem(void *ptr, size_t size);
+// reports that [ptr,ptr+size) is about to be unmapped or to lose its pages
+// only queues the range, the registrations overlapping it are dropped by
+// the next libgdsync call; safe to call from any thread, never blocks
+// used by libgdsync_memhooks.so, an opt-in LD_PRELOAD helper which calls it
+// from munmap, mremap, madvise, free and realloc
+void gds_mem_notify_unmap(void *ptr, size_t size);
+
 // flags is combination of gds_memory_type and gds_poll_flags
 int gds_stream_post_poll_dword(CUstream stream, uint32_t *ptr, uint32_t magic, gds_wait_cond_flag_t cond_flag, int flags);
 int gds_stream_post_poke_dword(CUstream stream, uint32_t *ptr, uint32_t value, int flags);
@@ -57,4 +81,61 @@ int gds_stream_post_polls_and_immediate_copies(CUstream stream,
 						size_t n_polls, uint32_t *ptrs[], uint32_t magics[], gds_wait_cond_flag_t cond_flags[], int poll_flags[], 
 						size_t n_imms, void *imm_ptrs[], void *imm_datas[], size_t imm_bytes[], int imm_flags[]);
 
+// binary event tracing, enabled by GDS_ENABLE_TRACE=1
+// GDS_TRACE_RING_SIZE: records per thread, default 65536
+// GDS_TRACE_FILE: default dump path, default gds_trace.<pid>.bin
+// GDS_TRACE_SIGNAL: signal number which triggers a dump to GDS_TRACE_FILE
+//
+// path==NULL means GDS_TRACE_FILE
+int gds_trace_dump(const char *path);
+// converts a binary dump into Chrome/Perfetto trace-event JSON
+int gds_trace_export_chrome(const char *trace_path, const char *json_path);
+
+// capture of the descriptor batches, enabled by GDS_RECORD_FILE=<prefix>
+// which writes to <prefix>.<pid>
+// every batch posted via gds_stream_post_descriptors and friends is stored
+// with its peer ops and with the memops it was translated into
+typedef struct gds_replay_stats {
+    size_t n_batches;
+    size_t n_descs;
+    size_t n_peer_ops;
+    size_t n_recorded_params;
+    size_t n_params;
+    // host time spent translating the batches, in the replay and at
+    // capture time
+    double translate_us;
+    double recorded_translate_us;
+} gds_replay_stats_t;
+// translates the batches of a capture again, without touching GPU nor HCA
+// db_strategy: gds_db_strategy_t, or -1 for the env defaults
+int gds_replay_file(const char *path, int db_strategy, gds_replay_stats_t *stats);
+
+// GPU timestamp probes, enabled by GDS_ENABLE_PROBES=1
+// GDS_PROBE_RING_SIZE: timestamp slots per CUDA context, default 4096
+// gds_stream_post_descriptors brackets each group of consecutive waits,
+// sends and writes, and the flush of the last wait, with kernels storing
+// %globaltimer into host memory
+typedef enum gds_probe_kind {
+    GDS_PROBE_WAIT = 0,     // wait on CQ or on a dword/qword
+    GDS_PROBE_SEND,
+    GDS_PROBE_FLUSH,        // flush of remote writes after a wait
+    GDS_PROBE_WRITE,        // write of a dword/qword
+    GDS_PROBE_LAUNCH,       // host post to GPU start of the batch
+    GDS_PROBE_NUM_KINDS
+} gds_probe_kind_t;
+
+#define GDS_PROBE_HIST_BUCKETS 32
+typedef struct gds_probe_hist {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    // bucket i counts latencies in [2^i,2^(i+1)) nsecs, the last one
+    // everything above
+    uint64_t buckets[GDS_PROBE_HIST_BUCKETS];
+} gds_probe_hist_t;
+// collects the probes landed so far, ENOTSUP if probes are disabled
+int gds_probe_get_hist(gds_probe_kind_t kind, gds_probe_hist_t *hist);
+void gds_probe_reset(void);
+
 GDS_END_DECLS
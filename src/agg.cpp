@@ -0,0 +1,493 @@
+/* Copyright (c) 2016, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include <new>
+#include <vector>
+#include <algorithm>
+
+#include <gdsync.h>
+#include <gdsync/tools.h>
+
+#include "utils.hpp"
+#include "archutils.h"
+
+//-----------------------------------------------------------------------------
+
+// Slot k spans [k*slot_size, (k+1)*slot_size) of the staging buffer and is
+// filled in round-robin order. Payloads are copied by cuMemcpyAsync as soon
+// as they are appended, while headers are 64-bits writes queued in hdrs and
+// posted ahead of the send, in batches of GDS_AGG_HDRS_PER_BATCH so as to
+// stay within the 256 memops of a cuStreamBatchMemOp, and to bound the
+// params array gds_stream_post_descriptors keeps on the stack.
+//
+// Sends are numbered from 1. slot_send[k] is the last send out of slot k,
+// the stream waits for its CQE before the first copy into the slot, and
+// then writes the number of waited sends into *done, which tells
+// gds_agg_poll() which CQEs the stream is done with.
+
+// GDS_MAX_OPS_PER_VALUE64 memops at most each, leaving room for the send
+#define GDS_AGG_HDRS_PER_BATCH 64
+
+struct gds_agg {
+        struct gds_qp *qp;
+        CUstream stream;
+        gds_send_wr wr;
+        int flags;
+        size_t slot_size;
+        int n_slots;
+        gds_mem_desc_t buf_desc;
+        struct ibv_mr *mr;
+        // base of the staging buffer as seen by the HCA, by mem ops and by copies
+        uintptr_t nic_base;
+        char *ops_base;
+        CUdeviceptr dev_base;
+        // slot being filled and bytes used in it
+        int cur;
+        size_t used;
+        std::vector<gds_descriptor_t> hdrs;
+        std::vector<uint32_t> slot_send;
+        uint32_t n_sent;
+        uint32_t n_waited;
+        uint32_t n_polled;
+        gds_send_request_t send_req;
+        std::vector<gds_wait_request_t> wait_reqs;
+        std::vector<gds_descriptor_t> descs;
+        gds_mem_desc_t done_desc;
+        uint32_t *done;
+};
+
+static inline size_t gds_agg_msg_size(uint32_t len)
+{
+        return sizeof(gds_agg_msg_hdr_t) + ROUND_UP((size_t)len, GDS_AGG_ALIGN);
+}
+
+//-----------------------------------------------------------------------------
+
+int gds_agg_create(struct gds_qp *qp, struct ibv_pd *pd, CUstream stream, const gds_agg_attr_t *attr, gds_agg_t **pagg)
+{
+        int retcode = 0;
+        gds_agg_t *agg = NULL;
+        int mem_type;
+        size_t size;
+        void *reg_ptr;
+
+        if (!qp || !pd || !attr || !attr->wr || !pagg) {
+                gds_err("invalid arguments\n");
+                return EINVAL;
+        }
+        mem_type = attr->flags & GDS_MEMORY_MASK;
+        if (attr->n_slots < 1 || attr->slot_size <= sizeof(gds_agg_msg_hdr_t) ||
+            attr->slot_size % GDS_AGG_ALIGN || attr->slot_size > UINT32_MAX ||
+            (mem_type != GDS_MEMORY_HOST && mem_type != GDS_MEMORY_GPU) ||
+            (attr->flags & ~GDS_MEMORY_MASK)) {
+                gds_err("invalid attributes n_slots=%d slot_size=%zu flags=%x\n",
+                        attr->n_slots, attr->slot_size, attr->flags);
+                return EINVAL;
+        }
+        if (attr->wr->exp_opcode != IBV_EXP_WR_SEND && attr->wr->exp_opcode != IBV_EXP_WR_SEND_WITH_IMM) {
+                gds_err("unsupported opcode %d\n", attr->wr->exp_opcode);
+                return EINVAL;
+        }
+
+        agg = new (std::nothrow) gds_agg;
+        if (!agg) {
+                retcode = ENOMEM;
+                goto out;
+        }
+        agg->qp = qp;
+        agg->stream = stream;
+        agg->wr = *attr->wr;
+        agg->wr.sg_list = NULL;
+        agg->wr.num_sge = 1;
+        agg->wr.next = NULL;
+        agg->wr.exp_send_flags |= IBV_EXP_SEND_SIGNALED;
+        agg->flags = mem_type;
+        agg->slot_size = attr->slot_size;
+        agg->n_slots = attr->n_slots;
+        agg->mr = NULL;
+        agg->done = NULL;
+        agg->cur = 0;
+        agg->used = 0;
+        agg->n_sent = 0;
+        agg->n_waited = 0;
+        agg->n_polled = 0;
+        memset(&agg->buf_desc, 0, sizeof(agg->buf_desc));
+        memset(&agg->done_desc, 0, sizeof(agg->done_desc));
+        memset(&agg->send_req, 0, sizeof(agg->send_req));
+        agg->slot_send.assign(agg->n_slots, 0);
+        agg->wait_reqs.resize(agg->n_slots);
+        // every message takes at least one header, a batch is made of up to
+        // GDS_AGG_HDRS_PER_BATCH of them plus the send, or of the waits plus
+        // the done write
+        agg->hdrs.reserve(agg->slot_size / sizeof(gds_agg_msg_hdr_t));
+        agg->descs.reserve(std::max((size_t)GDS_AGG_HDRS_PER_BATCH, (size_t)agg->n_slots) + 1);
+
+        size = agg->slot_size * agg->n_slots;
+        retcode = gds_alloc_mapped_memory(&agg->buf_desc, size, mem_type);
+        if (retcode) {
+                gds_err("error %d while allocating %zu bytes of staging buffer\n", retcode, size);
+                goto out;
+        }
+        agg->dev_base = agg->buf_desc.d_ptr;
+        if (mem_type == GDS_MEMORY_HOST) {
+                reg_ptr = agg->buf_desc.h_ptr;
+                agg->ops_base = (char *)agg->buf_desc.h_ptr;
+        } else {
+                // registered through the peer memory client
+                reg_ptr = (void *)agg->buf_desc.d_ptr;
+                agg->ops_base = (char *)agg->buf_desc.d_ptr;
+        }
+        agg->nic_base = (uintptr_t)reg_ptr;
+        agg->mr = ibv_reg_mr(pd, reg_ptr, size, IBV_ACCESS_LOCAL_WRITE);
+        if (!agg->mr) {
+                retcode = errno ? errno : EINVAL;
+                gds_err("error %d while registering staging buffer\n", retcode);
+                goto out;
+        }
+
+        retcode = gds_alloc_mapped_memory(&agg->done_desc, sizeof(uint32_t), GDS_MEMORY_HOST);
+        if (retcode) {
+                gds_err("error %d while allocating tracking word\n", retcode);
+                goto out;
+        }
+        agg->done = (uint32_t *)agg->done_desc.h_ptr;
+        ACCESS_ONCE(*agg->done) = 0;
+
+        gds_dbg("agg=%p qp=%p n_slots=%d slot_size=%zu mem=%s lkey=%x\n", agg, qp, agg->n_slots, agg->slot_size,
+                mem_type == GDS_MEMORY_HOST ? "host" : "gpu", agg->mr->lkey);
+        *pagg = agg;
+out:
+        if (retcode && agg) {
+                if (agg->done)
+                        gds_free_mapped_memory(&agg->done_desc);
+                if (agg->mr)
+                        ibv_dereg_mr(agg->mr);
+                if (agg->buf_desc.alloc_size)
+                        gds_free_mapped_memory(&agg->buf_desc);
+                delete agg;
+        }
+        return retcode;
+}
+
+//-----------------------------------------------------------------------------
+
+int gds_agg_destroy(gds_agg_t *agg)
+{
+        int retcode = 0;
+        int ret;
+
+        if (!agg)
+                return EINVAL;
+
+        if (agg->used)
+                gds_warn("dropping %zu bytes never flushed\n", agg->used);
+        if (agg->n_sent != agg->n_polled) {
+                gds_err("%u sends still to be reaped, synchronize the stream and call gds_agg_poll first\n",
+                        agg->n_sent - agg->n_polled);
+                return EBUSY;
+        }
+
+        ret = ibv_dereg_mr(agg->mr);
+        if (ret) {
+                gds_err("error %d while deregistering staging buffer\n", ret);
+                retcode = ret;
+        }
+        ret = gds_free_mapped_memory(&agg->buf_desc);
+        if (ret) {
+                gds_err("error %d while freeing staging buffer\n", ret);
+                retcode = retcode ? retcode : ret;
+        }
+        ret = gds_free_mapped_memory(&agg->done_desc);
+        if (ret) {
+                gds_err("error %d while freeing tracking word\n", ret);
+                retcode = retcode ? retcode : ret;
+        }
+        delete agg;
+        return retcode;
+}
+
+//-----------------------------------------------------------------------------
+
+// makes the stream wait for the sends still reading from the current slot
+static int gds_agg_open_slot(gds_agg_t *agg)
+{
+        int retcode = 0;
+        uint32_t last = agg->slot_send[agg->cur];
+        int n = 0;
+
+        agg->descs.clear();
+        while ((int32_t)(last - agg->n_waited) > 0) {
+                // sends in flight never outnumber the slots
+                assert(n < agg->n_slots);
+                gds_wait_request_t *req = &agg->wait_reqs[n++];
+                retcode = gds_prepare_wait_cq(&agg->qp->send_cq, req, 0);
+                if (retcode) {
+                        gds_err("error %d while preparing wait for send %u\n", retcode, agg->n_waited + 1);
+                        goto out;
+                }
+                gds_descriptor_t desc;
+                desc.tag = GDS_TAG_WAIT;
+                desc.wait = req;
+                agg->descs.push_back(desc);
+                ++agg->n_waited;
+        }
+        if (!n)
+                goto out;
+
+        {
+                gds_descriptor_t desc;
+                desc.tag = GDS_TAG_WRITE_VALUE32;
+                retcode = gds_prepare_write_value32(&desc.write32, agg->done, agg->n_waited, GDS_MEMORY_HOST);
+                if (retcode)
+                        goto out;
+                agg->descs.push_back(desc);
+        }
+        gds_dbg("agg=%p slot=%d waiting up to send %u\n", agg, agg->cur, agg->n_waited);
+        retcode = gds_stream_post_descriptors(agg->stream, agg->descs.size(), &agg->descs[0], 0);
+        if (retcode)
+                gds_err("error %d while posting waits for slot %d\n", retcode, agg->cur);
+out:
+        return retcode;
+}
+
+//-----------------------------------------------------------------------------
+
+int gds_agg_flush(gds_agg_t *agg)
+{
+        int retcode = 0;
+        struct ibv_sge sge;
+        gds_send_wr wr, *bad_wr = NULL;
+        gds_descriptor_t desc;
+        size_t n_hdrs;
+        size_t first = 0;
+
+        if (!agg)
+                return EINVAL;
+        if (!agg->used)
+                return 0;
+
+        // all but the last batch of headers go first, on their own; should
+        // that fail, they are posted again by the next flush, which is
+        // harmless as nothing has been sent out of the slot yet
+        n_hdrs = agg->hdrs.size();
+        while (n_hdrs - first > GDS_AGG_HDRS_PER_BATCH) {
+                retcode = gds_stream_post_descriptors(agg->stream, GDS_AGG_HDRS_PER_BATCH, &agg->hdrs[first], 0);
+                if (retcode) {
+                        gds_err("error %d while posting headers of slot %d\n", retcode, agg->cur);
+                        goto out;
+                }
+                first += GDS_AGG_HDRS_PER_BATCH;
+        }
+
+        sge.addr   = agg->nic_base + (size_t)agg->cur * agg->slot_size;
+        sge.length = agg->used;
+        sge.lkey   = agg->mr->lkey;
+        wr = agg->wr;
+        wr.sg_list = &sge;
+        wr.wr_id = agg->n_sent + 1;
+        retcode = gds_prepare_send(agg->qp, &wr, &bad_wr, &agg->send_req);
+        if (retcode) {
+                gds_err("error %d while preparing send of slot %d\n", retcode, agg->cur);
+                goto out;
+        }
+
+        // the stream executes the batches in order, so the headers land
+        // before the send rings the doorbell
+        agg->descs.assign(agg->hdrs.begin() + first, agg->hdrs.end());
+        desc.tag = GDS_TAG_SEND;
+        desc.send = &agg->send_req;
+        agg->descs.push_back(desc);
+        retcode = gds_stream_post_descriptors(agg->stream, agg->descs.size(), &agg->descs[0], 0);
+        if (retcode) {
+                gds_err("error %d while posting send of slot %d\n", retcode, agg->cur);
+                goto out;
+        }
+        gds_dbg("agg=%p slot=%d send=%u msgs=%zu bytes=%zu\n", agg, agg->cur, agg->n_sent + 1, agg->hdrs.size(), agg->used);
+
+        ++agg->n_sent;
+        agg->slot_send[agg->cur] = agg->n_sent;
+        agg->cur = (agg->cur + 1) % agg->n_slots;
+        agg->used = 0;
+        agg->hdrs.clear();
+out:
+        return retcode;
+}
+
+//-----------------------------------------------------------------------------
+
+int gds_agg_append(gds_agg_t *agg, const void *src, uint32_t len, uint32_t id)
+{
+        int retcode = 0;
+        size_t size;
+        size_t off;
+        gds_descriptor_t desc;
+
+        if (!agg || (len && !src)) {
+                gds_err("invalid arguments\n");
+                return EINVAL;
+        }
+        size = gds_agg_msg_size(len);
+        if (size > agg->slot_size) {
+                gds_err("message of %u bytes does not fit a slot of %zu bytes\n", len, agg->slot_size);
+                return EINVAL;
+        }
+
+        if (agg->used + size > agg->slot_size) {
+                retcode = gds_agg_flush(agg);
+                if (retcode)
+                        goto out;
+        }
+        if (!agg->used) {
+                retcode = gds_agg_open_slot(agg);
+                if (retcode)
+                        goto out;
+        }
+
+        off = (size_t)agg->cur * agg->slot_size + agg->used;
+        if (len) {
+                CUresult res = cuMemcpyAsync(agg->dev_base + off + sizeof(gds_agg_msg_hdr_t), (CUdeviceptr)src, len, agg->stream);
+                if (CUDA_SUCCESS != res) {
+                        const char *err_str = NULL;
+                        cuGetErrorString(res, &err_str);
+                        gds_err("got CUDA result %d (%s) while copying message %u\n", res, err_str, id);
+                        retcode = gds_curesult_to_errno(res);
+                        goto out;
+                }
+        }
+        // gds_agg_msg_hdr_t as seen by a little-endian receiver
+        desc.tag = GDS_TAG_WRITE_VALUE64;
+        retcode = gds_prepare_write_value64(&desc.write64, (uint64_t *)(agg->ops_base + off),
+                                            (uint64_t)len | ((uint64_t)id << 32), agg->flags);
+        if (retcode) {
+                gds_err("error %d while preparing header of message %u\n", retcode, id);
+                goto out;
+        }
+        agg->hdrs.push_back(desc);
+        agg->used += size;
+out:
+        return retcode;
+}
+
+//-----------------------------------------------------------------------------
+
+int gds_agg_poll(gds_agg_t *agg, int flags, int *n_pending)
+{
+        int retcode = 0;
+        uint32_t limit;
+
+        if (!agg || (flags & ~GDS_AGG_POLL_ALL)) {
+                gds_err("invalid arguments\n");
+                return EINVAL;
+        }
+
+        // polling a CQE before the stream has waited on it could let a
+        // later completion overwrite it
+        limit = (flags & GDS_AGG_POLL_ALL) ? agg->n_sent : ACCESS_ONCE(*agg->done);
+        while ((int32_t)(limit - agg->n_polled) > 0) {
+                struct ibv_wc wc[16];
+                int n = std::min((uint32_t)16, limit - agg->n_polled);
+                int ne = ibv_poll_cq(agg->qp->send_cq.cq, n, wc);
+                if (ne < 0) {
+                        gds_err("error %d while polling send CQ\n", ne);
+                        retcode = EIO;
+                        goto out;
+                }
+                for (int i = 0; i < ne; ++i) {
+                        if (wc[i].status != IBV_WC_SUCCESS) {
+                                gds_err("send %" PRIu64 " completed with status %d\n", (uint64_t)wc[i].wr_id, wc[i].status);
+                                retcode = EIO;
+                        }
+                }
+                agg->n_polled += ne;
+                if (retcode || ne < n)
+                        break;
+        }
+out:
+        if (n_pending)
+                *n_pending = agg->n_sent - agg->n_polled;
+        return retcode;
+}
+
+//-----------------------------------------------------------------------------
+
+int gds_agg_unpack(const void *buf, size_t len, void **dst, uint32_t *flags, uint32_t n_ids, uint32_t value, int *n_msgs)
+{
+        int retcode = 0;
+        const char *p = (const char *)buf;
+        size_t off = 0;
+        int n = 0;
+
+        if (!buf || !flags) {
+                gds_err("invalid arguments\n");
+                return EINVAL;
+        }
+
+        while (off + sizeof(gds_agg_msg_hdr_t) <= len) {
+                gds_agg_msg_hdr_t hdr;
+                memcpy(&hdr, p + off, sizeof(hdr));
+                if (off + gds_agg_msg_size(hdr.len) > ROUND_UP(len, GDS_AGG_ALIGN)) {
+                        gds_err("message %d at offset %zu overflows the buffer\n", n, off);
+                        retcode = EINVAL;
+                        goto out;
+                }
+                if (hdr.id >= n_ids) {
+                        gds_err("message %d has id %u, out of %u\n", n, hdr.id, n_ids);
+                        retcode = EINVAL;
+                        goto out;
+                }
+                if (dst && dst[hdr.id] && hdr.len)
+                        memcpy(dst[hdr.id], p + off + sizeof(hdr), hdr.len);
+                // payload before flag
+                wmb();
+                ACCESS_ONCE(flags[hdr.id]) = value;
+                off += gds_agg_msg_size(hdr.len);
+                ++n;
+        }
+out:
+        if (n_msgs)
+                *n_msgs = n;
+        return retcode;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ *  indent-tabs-mode: nil
+ * End:
+ */
@@ -34,6 +34,8 @@
 #include <assert.h>
 #include <inttypes.h>
 
+#include <vector>
+
 //#include <map>
 //#include <algorithm>
 //#include <string>
@@ -48,6 +50,7 @@
 #include "objs.hpp"
 #include "utils.hpp"
 #include "memmgr.hpp"
+#include "trace.hpp"
 //#include "mem.hpp"
 
 
@@ -88,6 +91,51 @@ static void gds_init_wait_request(gds_wait_request_t *request, uint32_t offset)
 
 //-----------------------------------------------------------------------------
 
+// the op list is left linked, only the entries used by the provider are
+// cleared
+static void gds_clear_ops(struct peer_op_wr *op, size_t count)
+{
+        for (size_t i = 0; i < count; ++i) {
+                op[i].type = (enum ibv_exp_peer_op)0;
+                memset(&op[i].wr, 0, sizeof(op[i].wr));
+                op[i].comp_mask = 0;
+        }
+}
+
+void gds_reset_send_info(gds_send_request_t *info)
+{
+        size_t max_entries = sizeof(info->wr)/sizeof(info->wr[0]);
+        size_t n_used = info->commit.entries < max_entries ? info->commit.entries : max_entries;
+        gds_dbg("send_request=%p n_used=%zu\n", info, n_used);
+        if (info->commit.storage != info->wr) {
+                gds_init_send_info(info);
+                return;
+        }
+        gds_clear_ops(info->wr, n_used);
+        memset(&info->commit, 0, sizeof(info->commit));
+        info->commit.storage = info->wr;
+        info->commit.entries = max_entries;
+}
+
+void gds_reset_wait_request(gds_wait_request_t *request, uint32_t offset)
+{
+        size_t max_entries = sizeof(request->wr)/sizeof(request->wr[0]);
+        size_t n_used = request->peek.entries < max_entries ? request->peek.entries : max_entries;
+        gds_dbg("wait_request=%p offset=%08x n_used=%zu\n", request, offset, n_used);
+        if (request->peek.storage != request->wr) {
+                gds_init_wait_request(request, offset);
+                return;
+        }
+        gds_clear_ops(request->wr, n_used);
+        memset(&request->peek, 0, sizeof(request->peek));
+        request->peek.storage = request->wr;
+        request->peek.entries = max_entries;
+        request->peek.whence = IBV_EXP_PEER_PEEK_ABSOLUTE;
+        request->peek.offset = offset;
+}
+
+//-----------------------------------------------------------------------------
+
 static int gds_rollback_qp(struct gds_qp *qp, gds_send_request_t * send_info, enum ibv_exp_rollback_flags flag)
 {
         struct ibv_exp_rollback_ctx rollback;
@@ -125,6 +173,7 @@ out:
 
 int gds_post_send(struct gds_qp *qp, gds_send_wr *p_ewr, gds_send_wr **bad_ewr)
 {
+        GDS_TRACE_API(POST_SEND);
         int ret = 0, ret_roll=0;
         gds_send_request_t send_info;
         ret = gds_prepare_send(qp, p_ewr, bad_ewr, &send_info);
@@ -150,8 +199,22 @@ out:
 
 //-----------------------------------------------------------------------------
 
+int gds_post_send_all(int count, gds_send_request_t *request)
+{
+        GDS_TRACE_API(POST_SEND_ALL);
+        int ret = 0;
+        ret = gds_post_pokes_on_cpu(count, request, NULL, 0);
+        if (ret) {
+                gds_err("error %d in gds_post_pokes_on_cpu\n", ret);
+        }
+        return ret;
+}
+
+//-----------------------------------------------------------------------------
+
 int gds_post_recv(struct gds_qp *qp, struct ibv_recv_wr *wr, struct ibv_recv_wr **bad_wr)
 {
+        GDS_TRACE_API(POST_RECV);
         int ret = 0;
 
         gds_dbg("qp=%p wr=%p\n", qp, wr);
@@ -169,12 +232,42 @@ out:
 
 //-----------------------------------------------------------------------------
 
+int gds_post_srq_recv(struct gds_srq *srq, struct ibv_recv_wr *wr, struct ibv_recv_wr **bad_wr)
+{
+        GDS_TRACE_API(POST_SRQ_RECV);
+        int ret = 0;
+
+        gds_dbg("srq=%p wr=%p\n", srq, wr);
+        assert(srq);
+        assert(srq->srq);
+        ret = ibv_post_srq_recv(srq->srq, wr, bad_wr);
+        if (ret) {
+                gds_err("error %d in ibv_post_srq_recv\n", ret);
+                goto out;
+        }
+
+out:
+        return ret;
+}
+
+//-----------------------------------------------------------------------------
+
 int gds_prepare_send(struct gds_qp *qp, gds_send_wr *p_ewr, 
                      gds_send_wr **bad_ewr, 
                      gds_send_request_t *request)
 {
-        int ret = 0;
+        GDS_TRACE_API(PREPARE_SEND);
         gds_init_send_info(request);
+        return gds_prepare_send_ops(qp, p_ewr, bad_ewr, request);
+}
+
+//-----------------------------------------------------------------------------
+
+int gds_prepare_send_ops(struct gds_qp *qp, gds_send_wr *p_ewr, 
+                         gds_send_wr **bad_ewr, 
+                         gds_send_request_t *request)
+{
+        int ret = 0;
         assert(qp);
         assert(qp->qp);
         ret = ibv_exp_post_send(qp->qp, p_ewr, bad_ewr);
@@ -195,14 +288,76 @@ int gds_prepare_send(struct gds_qp *qp, gds_send_wr *p_ewr,
                 //gds_wait_kernel();
                 goto out;
         }
+        request->sq_begin = qp->sq_begin;
+        request->sq_end = qp->sq_end;
 out:
         return ret;
 }
 
 //-----------------------------------------------------------------------------
 
+int gds_prepare_send_multi(int n, struct gds_qp **qps, gds_send_wr **wrs,
+                           gds_send_request_t *requests, int *status, int *n_ready)
+{
+        GDS_TRACE_API(PREPARE_SEND_MULTI);
+        int ret = 0;
+        int i, k = 0;
+
+        if (n < 0 || (n && (!qps || !wrs || !requests)) || !n_ready) {
+                gds_err("invalid arguments\n");
+                return EINVAL;
+        }
+
+        for (i = 0; i < n; ++i) {
+                struct gds_qp *qp = qps[i];
+                gds_send_request_t *request = requests + k;
+                gds_send_wr *bad_ewr = NULL;
+                int retcode;
+
+                assert(qp);
+                assert(qp->qp);
+                // requests are reused across calls, so only the
+                // entries touched last time need to be cleared
+                gds_reset_send_info(request);
+                retcode = ibv_exp_post_send(qp->qp, wrs[i], &bad_ewr);
+                if (retcode) {
+                        if (retcode == ENOMEM)
+                                gds_dbg("ENOMEM error in ibv_exp_post_send on entry %d\n", i);
+                        else
+                                gds_err("error %d in ibv_exp_post_send on entry %d\n", retcode, i);
+                } else {
+                        retcode = ibv_exp_peer_commit_qp(qp->qp, &request->commit);
+                        if (retcode)
+                                gds_err("error %d in ibv_exp_peer_commit_qp on entry %d\n", retcode, i);
+                        request->sq_begin = qp->sq_begin;
+                        request->sq_end = qp->sq_end;
+                }
+                if (retcode) {
+                        // WQEs of a partially posted chain are not committed
+                        // yet, drop them and leave the rest of the batch alone
+                        if (bad_ewr != wrs[i]) {
+                                int ret_roll = gds_rollback_qp(qp, request, IBV_EXP_ROLLBACK_ABORT_UNCOMMITED);
+                                if (ret_roll)
+                                        gds_err("error %d in gds_rollback_qp on entry %d\n", ret_roll, i);
+                        }
+                        if (!ret)
+                                ret = retcode;
+                } else {
+                        ++k;
+                }
+                if (status)
+                        status[i] = retcode;
+        }
+        *n_ready = k;
+        gds_dbg("n=%d n_ready=%d ret=%d\n", n, k, ret);
+        return ret;
+}
+
+//-----------------------------------------------------------------------------
+
 int gds_stream_queue_send(CUstream stream, struct gds_qp *qp, gds_send_wr *p_ewr, gds_send_wr **bad_ewr)
 {
+        GDS_TRACE_API(STREAM_QUEUE_SEND);
         int ret = 0, ret_roll = 0;
 	gds_send_request_t send_info;
 
@@ -228,6 +383,7 @@ out:
 
 int gds_stream_post_send(CUstream stream, gds_send_request_t *request)
 {
+        GDS_TRACE_API(STREAM_POST_SEND);
     int ret = 0;
     //struct ibv_exp_send_ex_info *info = (struct ibv_exp_send_ex_info *) request;
     ret = gds_post_pokes(stream, 1, request, NULL, 0);
@@ -241,6 +397,7 @@ int gds_stream_post_send(CUstream stream, gds_send_request_t *request)
 
 int gds_stream_post_send_all(CUstream stream, int count, gds_send_request_t *request)
 {
+        GDS_TRACE_API(STREAM_POST_SEND_ALL);
     int ret = 0;
 
     //struct ibv_exp_send_ex_info *info = (struct ibv_exp_send_ex_info *) request;
@@ -256,6 +413,7 @@ int gds_stream_post_send_all(CUstream stream, int count, gds_send_request_t *req
 
 int gds_prepare_wait_cq(struct gds_cq *cq, gds_wait_request_t *request, int flags)
 {
+        GDS_TRACE_API(PREPARE_WAIT_CQ);
 	int retcode = 0;
 
         if (flags != 0) {
@@ -263,7 +421,18 @@ int gds_prepare_wait_cq(struct gds_cq *cq, gds_wait_request_t *request, int flag
                 return EINVAL;
         }
 
-        gds_init_wait_request(request, cq->curr_offset++);
+        gds_init_wait_request(request, gds_cq_claim_offset(cq));
+
+        retcode = gds_prepare_wait_ops(cq, request);
+
+	return retcode;
+}
+
+//-----------------------------------------------------------------------------
+
+int gds_prepare_wait_ops(struct gds_cq *cq, gds_wait_request_t *request)
+{
+	int retcode = 0;
 
         retcode = ibv_exp_peer_peek_cq(cq->cq, &request->peek);
         if (retcode == -ENOSPC) {
@@ -317,6 +486,7 @@ out:
 
 int gds_stream_post_wait_cq(CUstream stream, gds_wait_request_t *request)
 {
+        GDS_TRACE_API(STREAM_POST_WAIT_CQ);
 	return gds_stream_post_wait_cq_multi(stream, 1, request, NULL, 0);
 }
 
@@ -324,6 +494,7 @@ int gds_stream_post_wait_cq(CUstream stream, gds_wait_request_t *request)
 
 int gds_stream_post_wait_cq_all(CUstream stream, int count, gds_wait_request_t *requests)
 {
+        GDS_TRACE_API(STREAM_POST_WAIT_CQ_ALL);
 	return gds_stream_post_wait_cq_multi(stream, count, requests, NULL, 0);
 }
 
@@ -343,6 +514,7 @@ static int gds_abort_wait_cq(struct gds_cq *cq, gds_wait_request_t *request)
 
 int gds_stream_wait_cq(CUstream stream, struct gds_cq *cq, int flags)
 {
+        GDS_TRACE_API(STREAM_WAIT_CQ);
         int retcode = 0;
         int ret;
         gds_wait_request_t request;
@@ -378,8 +550,69 @@ out:
 
 //-----------------------------------------------------------------------------
 
+int gds_stream_wait_cq_bcast(CUstream stream, struct gds_cq *cq, int n_streams, CUstream *streams, int flags)
+{
+        GDS_TRACE_API(STREAM_WAIT_CQ_BCAST);
+        int retcode = 0;
+        int ret;
+        int mem_type = (flags & GDS_MEMORY_MASK) ? (flags & GDS_MEMORY_MASK) : GDS_MEMORY_HOST;
+        gds_wait_request_t request;
+        uint32_t *flag = NULL;
+        uint32_t value = 0;
+
+        assert(cq);
+        assert(stream);
+
+        if ((flags & ~GDS_MEMORY_MASK) || (mem_type != GDS_MEMORY_HOST && mem_type != GDS_MEMORY_GPU) ||
+            n_streams < 0 || (n_streams && !streams)) {
+                gds_err("invalid arguments\n");
+                retcode = EINVAL;
+                goto out;
+        }
+
+        retcode = gds_flag_slot_get(mem_type, &flag, &value);
+        if (retcode) {
+                gds_err("error %d while getting a flag slot\n", retcode);
+                goto out;
+        }
+
+        retcode = gds_prepare_wait_cq(cq, &request, 0);
+        if (retcode) {
+                gds_err("error %d in gds_prepare_wait_cq\n", retcode);
+                gds_flag_slot_cancel(flag, value);
+                goto out;
+        }
+
+        // wait on the CQE, then release the other streams
+        retcode = gds_stream_post_wait_cq_multi(stream, 1, &request, flag, value, mem_type);
+        if (retcode) {
+                gds_err("error %d in gds_stream_post_wait_cq_multi\n", retcode);
+                ret = gds_abort_wait_cq(cq, &request);
+                if (ret) {
+                        gds_err("nested error %d while aborting request\n", ret);
+                }
+                gds_flag_slot_cancel(flag, value);
+                goto out;
+        }
+
+        for (int i = 0; i < n_streams; ++i) {
+                retcode = gds_stream_post_poll_dword(streams[i], flag, value, GDS_WAIT_COND_GEQ, mem_type);
+                if (retcode) {
+                        // the release is already queued, the slot recycles by itself
+                        gds_err("error %d while posting wait on stream %d\n", retcode, i);
+                        goto out;
+                }
+        }
+
+out:
+	return retcode;
+}
+
+//-----------------------------------------------------------------------------
+
 int gds_post_wait_cq(struct gds_cq *cq, gds_wait_request_t *request, int flags)
 {
+        GDS_TRACE_API(POST_WAIT_CQ);
         int retcode = 0;
 
         if (flags) {
@@ -450,8 +683,70 @@ out:
 
 //-----------------------------------------------------------------------------
 
+int gds_prepare_wait_value64(gds_wait_value64_t *desc, uint64_t *ptr, uint64_t value, gds_wait_cond_flag_t cond_flags, int flags)
+{
+        int ret = 0;
+        assert(desc);
+
+        gds_dbg("desc=%p ptr=%p value=0x%016"PRIx64" cond_flags=0x%x flags=0x%x\n",
+                desc, ptr, value, cond_flags, flags);
+
+        if (flags & ~(GDS_WAIT_POST_FLUSH|GDS_MEMORY_MASK)) {
+                gds_err("invalid flags\n");
+                ret = EINVAL;
+                goto out;
+        }
+        if (!is_valid(memtype_from_flags(flags))) {
+                gds_err("invalid memory type in flags\n");
+                ret = EINVAL;
+                goto out;
+        }
+        if (((unsigned long)ptr) & 0x7) {
+                gds_err("ptr=%p is not 8 bytes aligned\n", ptr);
+                ret = EINVAL;
+                goto out;
+        }
+        desc->ptr = ptr;
+        desc->value = value;
+        desc->flags = flags;
+        desc->cond_flags = cond_flags;
+out:
+        return ret;
+}
+
+//-----------------------------------------------------------------------------
+
+int gds_prepare_write_value64(gds_write_value64_t *desc, uint64_t *ptr, uint64_t value, int flags)
+{
+        int ret = 0;
+        assert(desc);
+        if (!is_valid(memtype_from_flags(flags))) {
+                gds_err("invalid memory type in flags\n");
+                ret = EINVAL;
+                goto out;
+        }
+        if (flags & ~(GDS_WRITE_PRE_BARRIER|GDS_MEMORY_MASK)) {
+                gds_err("invalid flags\n");
+                ret = EINVAL;
+                goto out;
+        }
+        if (((unsigned long)ptr) & 0x7) {
+                gds_err("ptr=%p is not 8 bytes aligned\n", ptr);
+                ret = EINVAL;
+                goto out;
+        }
+        desc->ptr = ptr;
+        desc->value = value;
+        desc->flags = flags;
+out:
+        return ret;
+}
+
+//-----------------------------------------------------------------------------
+
 int gds_stream_post_poll_dword(CUstream stream, uint32_t *ptr, uint32_t magic, gds_wait_cond_flag_t cond_flags, int flags)
 {
+        GDS_TRACE_API(STREAM_POST_POLL_DWORD);
         int retcode = 0;
 	CUstreamBatchMemOpParams param[1];
         retcode = gds_fill_poll(param, ptr, magic, cond_flags, flags);
@@ -472,6 +767,7 @@ out:
 
 int gds_stream_post_poke_dword(CUstream stream, uint32_t *ptr, uint32_t value, int flags)
 {
+        GDS_TRACE_API(STREAM_POST_POKE_DWORD);
         int retcode = 0;
 	CUstreamBatchMemOpParams param[1];
         retcode = gds_fill_poke(param, ptr, value, flags);
@@ -492,6 +788,7 @@ out:
 
 int gds_stream_post_inline_copy(CUstream stream, void *ptr, void *src, size_t nbytes, int flags)
 {
+        GDS_TRACE_API(STREAM_POST_INLINE_COPY);
         int retcode = 0;
 	CUstreamBatchMemOpParams param[1];
 
@@ -524,6 +821,8 @@ static bool no_network_descs_after_entry(size_t n_descs, gds_descriptor_t *descs
                         goto out;
                 case GDS_TAG_WAIT_VALUE32:
                 case GDS_TAG_WRITE_VALUE32:
+                case GDS_TAG_WAIT_VALUE64:
+                case GDS_TAG_WRITE_VALUE64:
                         break;
                 default:
                         gds_err("invalid tag\n");
@@ -549,6 +848,8 @@ static int get_wait_info(size_t n_descs, gds_descriptor_t *descs, size_t &n_wait
                 case GDS_TAG_SEND:
                 case GDS_TAG_WAIT_VALUE32:
                 case GDS_TAG_WRITE_VALUE32:
+                case GDS_TAG_WAIT_VALUE64:
+                case GDS_TAG_WRITE_VALUE64:
                         break;
                 default:
                         gds_err("invalid tag\n");
@@ -575,6 +876,10 @@ static size_t calc_n_mem_ops(size_t n_descs, gds_descriptor_t *descs)
                 case GDS_TAG_WRITE_VALUE32:
                         n_mem_ops += 2; // ditto
                         break;
+                case GDS_TAG_WAIT_VALUE64:
+                case GDS_TAG_WRITE_VALUE64:
+                        n_mem_ops += GDS_MAX_OPS_PER_VALUE64; // emulation, worst case
+                        break;
                 default:
                         gds_err("invalid tag\n");
                 }
@@ -582,17 +887,41 @@ static size_t calc_n_mem_ops(size_t n_descs, gds_descriptor_t *descs)
         return n_mem_ops;
 }
 
-int gds_stream_post_descriptors(CUstream stream, size_t n_descs, gds_descriptor_t *descs, int flags)
+size_t gds_descriptors_n_mem_ops(size_t n_descs, gds_descriptor_t *descs)
+{
+        return calc_n_mem_ops(n_descs, descs);
+}
+
+//-----------------------------------------------------------------------------
+
+int gds_descriptors_to_params(size_t n_descs, gds_descriptor_t *descs, CUstreamBatchMemOpParams *params, int &idx,
+                              int *first_param)
 {
         size_t i;
-        int idx = 0;
         int ret = 0;
         int retcode = 0;
         size_t n_mem_ops = 0;
         size_t n_waits = 0;
         size_t last_wait = 0;
         bool move_flush = false;
-
+        const bool record = gds_record_enabled();
+        const int idx_start = idx;
+        // 64-bits ops depend on the GPU, looked up once per batch
+        gds_gpu_caps_t caps;
+        bool have_caps = false;
+        // per-descriptor bookkeeping of the recorder, off the stack as
+        // n_descs is only bounded by the caller
+        std::vector<int> rec_first_param;
+        std::vector<int> post_flags;
+        uint64_t t0 = record ? gds_now_ns() : 0;
+
+        if (record) {
+                post_flags.resize(n_descs + 1);
+                if (!first_param) {
+                        rec_first_param.resize(n_descs + 1);
+                        first_param = &rec_first_param[0];
+                }
+        }
         n_mem_ops = calc_n_mem_ops(n_descs, descs);
         get_wait_info(n_descs, descs, n_waits, last_wait);
 
@@ -605,10 +934,12 @@ int gds_stream_post_descriptors(CUstream stream, size_t n_descs, gds_descriptor_
         }
         // alternatively, remove flush for wait is next op is a wait too
 
-        CUstreamBatchMemOpParams params[n_mem_ops];
-
         for(i = 0; i < n_descs; ++i) {
                 gds_descriptor_t *desc = descs + i;
+                if (first_param)
+                        first_param[i] = idx - idx_start;
+                if (record)
+                        post_flags[i] = 0;
                 switch(desc->tag) {
                 case GDS_TAG_SEND: {
                         gds_send_request_t *sreq = desc->send;
@@ -631,6 +962,8 @@ int gds_stream_post_descriptors(CUstream stream, size_t n_descs, gds_descriptor_
                         int flags = 0;
                         if (move_flush && i != last_wait)
                                 flags = GDS_POST_OPS_DISCARD_WAIT_FLUSH;
+                        if (record)
+                                post_flags[i] = flags;
                         retcode = gds_post_ops(wreq->peek.entries, wreq->peek.storage, params, idx, flags);
                         if (retcode) {
                                 gds_err("error %d in gds_post_ops\n", retcode);
@@ -659,23 +992,228 @@ int gds_stream_post_descriptors(CUstream stream, size_t n_descs, gds_descriptor_
                         }
                         ++idx;
                         break;
+                case GDS_TAG_WAIT_VALUE64:
+                        if (!have_caps) {
+                                caps = gds_current_gpu_caps();
+                                have_caps = true;
+                        }
+                        retcode = gds_fill_poll64(params, idx, desc->wait64.ptr, desc->wait64.value, desc->wait64.cond_flags, desc->wait64.flags, caps);
+                        if (retcode) {
+                                gds_err("error %d in gds_fill_poll64\n", retcode);
+                                ret = retcode;
+                                goto out;
+                        }
+                        break;
+                case GDS_TAG_WRITE_VALUE64:
+                        if (!have_caps) {
+                                caps = gds_current_gpu_caps();
+                                have_caps = true;
+                        }
+                        retcode = gds_fill_poke64(params, idx, desc->write64.ptr, &desc->write64.value, desc->write64.flags, caps);
+                        if (retcode) {
+                                gds_err("error %d in gds_fill_poke64\n", retcode);
+                                ret = retcode;
+                                goto out;
+                        }
+                        break;
                 default:
                         assert(0);
                         break;
                 }
         }
-        retcode = gds_stream_batch_ops(stream, idx, params, 0);
+        if (first_param)
+                first_param[n_descs] = idx - idx_start;
+        if (record)
+                gds_record_batch(n_descs, descs, first_param, &post_flags[0], idx - idx_start,
+                                 params + idx_start, gds_now_ns() - t0);
+out:
+        return ret;
+}
+
+//-----------------------------------------------------------------------------
+
+int gds_stream_post_descriptors(CUstream stream, size_t n_descs, gds_descriptor_t *descs, int flags)
+{
+        GDS_TRACE_API(STREAM_POST_DESCRIPTORS);
+        int idx = 0;
+        int retcode = 0;
+        size_t n_mem_ops = calc_n_mem_ops(n_descs, descs);
+
+        CUstreamBatchMemOpParams params[n_mem_ops];
+        const bool probe = gds_probe_enabled();
+        // sized by the caller, keep it off the stack
+        std::vector<int> first_param(probe ? n_descs + 1 : 0);
+
+        retcode = gds_descriptors_to_params(n_descs, descs, params, idx, probe ? &first_param[0] : NULL);
+        if (retcode)
+                goto out;
+
+        if (probe)
+                retcode = gds_probe_post_descriptors(stream, n_descs, descs, params, &first_param[0]);
+        else
+                retcode = gds_stream_batch_ops(stream, idx, params, 0);
         if (retcode) {
                 gds_err("error in batch_ops\n");
                 goto out;
         }
 
 out:
-        return ret;
+        return retcode;
 }
 
 //-----------------------------------------------------------------------------
 
+#if HAVE_DECL_CUGRAPHADDBATCHMEMOPNODE
+
+static int gds_graph_fill_node_params(CUDA_BATCH_MEM_OP_NODE_PARAMS *node_params, CUstreamBatchMemOpParams *params, int nops)
+{
+        CUresult res = cuCtxGetCurrent(&node_params->ctx);
+        if (CUDA_SUCCESS != res || !node_params->ctx) {
+                gds_err("no current CUDA context\n");
+                return EINVAL;
+        }
+        node_params->count = nops;
+        node_params->paramArray = params;
+        node_params->flags = gds_batch_ops_flags();
+        return 0;
+}
+
+// inline copies read their source, i.e. a doorbell or WQE in the request
+// or a gds_write_value64_t, when they are posted; a graph node keeps the
+// pointer and replays it later, when that storage may be long gone
+static int gds_graph_check_params(CUstreamBatchMemOpParams *params, int nops)
+{
+#if HAVE_DECL_CU_STREAM_MEM_OP_INLINE_COPY
+        for (int i = 0; i < nops; ++i) {
+                if (params[i].operation == CU_STREAM_MEM_OP_INLINE_COPY) {
+                        gds_err("memop %d is an inline copy, which cannot be replayed by a graph\n", i);
+                        return EINVAL;
+                }
+        }
+#endif
+        return 0;
+}
+
+int gds_graph_add_descriptors_node(CUgraphNode *node, CUgraph graph, const CUgraphNode *deps, size_t n_deps,
+                                   size_t n_descs, gds_descriptor_t *descs, int flags)
+{
+        GDS_TRACE_API(GRAPH_ADD_DESCRIPTORS_NODE);
+        int idx = 0;
+        int retcode = 0;
+        CUresult res;
+        CUDA_BATCH_MEM_OP_NODE_PARAMS node_params;
+        size_t n_mem_ops = calc_n_mem_ops(n_descs, descs);
+
+        CUstreamBatchMemOpParams params[n_mem_ops];
+
+        if (flags) {
+                gds_err("invalid flags\n");
+                return EINVAL;
+        }
+        retcode = gds_descriptors_to_params(n_descs, descs, params, idx);
+        if (retcode)
+                goto out;
+        retcode = gds_graph_check_params(params, idx);
+        if (retcode)
+                goto out;
+        retcode = gds_graph_fill_node_params(&node_params, params, idx);
+        if (retcode)
+                goto out;
+        // params are copied into the node
+        res = cuGraphAddBatchMemOpNode(node, graph, deps, n_deps, &node_params);
+        if (CUDA_SUCCESS != res) {
+                const char *err_str = NULL;
+                cuGetErrorString(res, &err_str);
+                gds_err("got CUDA result %d (%s) while adding batch mem op node\n", res, err_str);
+                retcode = gds_curesult_to_errno(res);
+                goto out;
+        }
+        gds_dbg("graph=%p node=%p nops=%d\n", graph, *node, idx);
+        if (gds_trace_enabled())
+                gds_trace_record_memops(idx, params);
+out:
+        return retcode;
+}
+
+int gds_graph_exec_update_descriptors(CUgraphExec exec, CUgraphNode node, size_t n_descs, gds_descriptor_t *descs, int flags)
+{
+        GDS_TRACE_API(GRAPH_EXEC_UPDATE_DESCRIPTORS);
+        int idx = 0;
+        int retcode = 0;
+        CUresult res;
+        CUDA_BATCH_MEM_OP_NODE_PARAMS node_params, orig_params;
+        size_t n_mem_ops = calc_n_mem_ops(n_descs, descs);
+
+        CUstreamBatchMemOpParams params[n_mem_ops];
+
+        if (flags) {
+                gds_err("invalid flags\n");
+                return EINVAL;
+        }
+        retcode = gds_descriptors_to_params(n_descs, descs, params, idx);
+        if (retcode)
+                goto out;
+        retcode = gds_graph_check_params(params, idx);
+        if (retcode)
+                goto out;
+
+        // only values may change across replays, not the shape of the batch
+        res = cuGraphBatchMemOpNodeGetParams(node, &orig_params);
+        if (CUDA_SUCCESS != res) {
+                gds_err("got CUDA result %d while querying node %p\n", res, node);
+                retcode = gds_curesult_to_errno(res);
+                goto out;
+        }
+        if (orig_params.count != (unsigned int)idx) {
+                gds_err("descriptors translate to %d memops, node %p was created with %u\n", idx, node, orig_params.count);
+                retcode = EINVAL;
+                goto out;
+        }
+        for (int i = 0; i < idx; ++i) {
+                if (orig_params.paramArray[i].operation != params[i].operation) {
+                        gds_err("memop %d changed from type %d to %d\n", i,
+                                orig_params.paramArray[i].operation, params[i].operation);
+                        retcode = EINVAL;
+                        goto out;
+                }
+        }
+
+        retcode = gds_graph_fill_node_params(&node_params, params, idx);
+        if (retcode)
+                goto out;
+        res = cuGraphExecBatchMemOpNodeSetParams(exec, node, &node_params);
+        if (CUDA_SUCCESS != res) {
+                const char *err_str = NULL;
+                cuGetErrorString(res, &err_str);
+                gds_err("got CUDA result %d (%s) while updating batch mem op node\n", res, err_str);
+                retcode = gds_curesult_to_errno(res);
+                goto out;
+        }
+        if (gds_trace_enabled())
+                gds_trace_record_memops(idx, params);
+out:
+        return retcode;
+}
+
+#else
+
+int gds_graph_add_descriptors_node(CUgraphNode *node, CUgraph graph, const CUgraphNode *deps, size_t n_deps,
+                                   size_t n_descs, gds_descriptor_t *descs, int flags)
+{
+        gds_err("batch mem op graph nodes are not supported by this CUDA version\n");
+        return ENOTSUP;
+}
+
+int gds_graph_exec_update_descriptors(CUgraphExec exec, CUgraphNode node, size_t n_descs, gds_descriptor_t *descs, int flags)
+{
+        gds_err("batch mem op graph nodes are not supported by this CUDA version\n");
+        return ENOTSUP;
+}
+
+#endif
+
+//-----------------------------------------------------------------------------
+
 /*
  * Local variables:
  *  c-indent-level: 8
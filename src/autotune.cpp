@@ -0,0 +1,261 @@
+/* Copyright (c) 2016, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+
+#include <gdsync.h>
+#include <gdsync/tools.h>
+
+#include "utils.hpp"
+#include "objs.hpp"
+#include "archutils.h"
+
+//-----------------------------------------------------------------------------
+// Doorbell strategy autotuner, see the A-F orderings above gds_post_ops.
+//
+// Each strategy runs a fake send sequence, i.e. DBREC update, fence,
+// doorbell write, targeting host memory, followed by a poke of a flag the CPU
+// spins on. The round trip of the cheapest strategy is at most a few usecs, so
+// the differences among strategies are well above the measurement noise.
+//
+// Tuning runs at the first registration of a peer. The strategy being
+// measured is forced for the tuning thread only, so other threads keep
+// posting with their own strategy meanwhile.
+
+enum {
+        GDS_TUNE_WARMUP = 16,
+        GDS_TUNE_ITERS = 256,
+        GDS_TUNE_DBREC_OFF = 0,
+        GDS_TUNE_DB_OFF = 64,
+        GDS_TUNE_DB_SIZE = 64,  // a basic WQE
+        GDS_TUNE_DONE_OFF = 256,
+        GDS_TUNE_BUF_SIZE = 4096,
+        GDS_TUNE_MAX_PARAMS = 16
+};
+
+static const double gds_tune_timeout_us = 1000000.0;
+
+static const char *gds_db_strategy_names[GDS_DB_NUM_STRATEGIES] = {
+        "plain+membar",
+        "plain",
+        "sim64+membar",
+        "sim64",
+        "inlcpy+membar",
+        "inlcpy"
+};
+
+bool gds_enable_autotune()
+{
+        static int gds_enable_autotune = -1;
+        if (-1 == gds_enable_autotune) {
+                const char *env = getenv("GDS_ENABLE_AUTOTUNE");
+                if (env)
+                        gds_enable_autotune = !!atoi(env);
+                else
+                        gds_enable_autotune = 0;
+                gds_dbg("GDS_ENABLE_AUTOTUNE=%d\n", gds_enable_autotune);
+        }
+        return gds_enable_autotune;
+}
+
+static inline double gds_tune_now_us()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (double)ts.tv_sec * 1000000.0 + (double)ts.tv_nsec / 1000.0;
+}
+
+//-----------------------------------------------------------------------------
+
+// average round trip of strategy, in usecs
+static int gds_tune_strategy(int strategy, CUstream stream, gds_mem_desc_t *desc, double *lat_us)
+{
+        int retcode = 0;
+        gds_range range;
+        struct peer_op_wr ops[5];
+        uint8_t wqe[GDS_TUNE_DB_SIZE];
+        CUstreamBatchMemOpParams params[GDS_TUNE_MAX_PARAMS];
+        volatile uint32_t *done = (volatile uint32_t *)((uint8_t *)desc->h_ptr + GDS_TUNE_DONE_OFF);
+        double start = 0;
+        int i, nops;
+
+        range.va = desc->h_ptr;
+        range.dptr = desc->d_ptr;
+        range.size = GDS_TUNE_BUF_SIZE;
+        range.buf = NULL;
+        range.type = GDS_MEMORY_HOST;
+        // caps of the current GPU, i.e. the one being tuned
+        range.peer = NULL;
+
+        memset(wqe, 0xa5, sizeof(wqe));
+        memset(ops, 0, sizeof(ops));
+        ops[0].type = IBV_EXP_PEER_OP_STORE_DWORD;
+        ops[0].wr.dword_va.target_id = range_to_id(&range);
+        ops[0].wr.dword_va.offset = GDS_TUNE_DBREC_OFF;
+        ops[1].type = IBV_EXP_PEER_OP_FENCE;
+        ops[1].wr.fence.fence_flags = IBV_EXP_PEER_FENCE_OP_WRITE | IBV_EXP_PEER_FENCE_FROM_HCA | IBV_EXP_PEER_FENCE_MEM_SYS;
+        // the mlx5 provider rings with the whole WQE when inline copies are available
+        if (strategy == GDS_DB_INLCPY_MEMBAR || strategy == GDS_DB_INLCPY) {
+                ops[2].type = IBV_EXP_PEER_OP_COPY_BLOCK;
+                ops[2].wr.copy_op.src = wqe;
+                ops[2].wr.copy_op.target_id = range_to_id(&range);
+                ops[2].wr.copy_op.offset = GDS_TUNE_DB_OFF;
+                ops[2].wr.copy_op.len = sizeof(wqe);
+        } else {
+                ops[2].type = IBV_EXP_PEER_OP_STORE_QWORD;
+                ops[2].wr.qword_va.data = 0xa5a5a5a5a5a5a5a5ULL;
+                ops[2].wr.qword_va.target_id = range_to_id(&range);
+                ops[2].wr.qword_va.offset = GDS_TUNE_DB_OFF;
+        }
+        ops[3].type = IBV_EXP_PEER_OP_FENCE;
+        ops[3].wr.fence.fence_flags = ops[1].wr.fence.fence_flags;
+        ops[4].type = IBV_EXP_PEER_OP_STORE_DWORD;
+        ops[4].wr.dword_va.target_id = range_to_id(&range);
+        ops[4].wr.dword_va.offset = GDS_TUNE_DONE_OFF;
+        for (i = 0; i < 4; ++i)
+                ops[i].next = &ops[i+1];
+
+        *done = 0;
+        for (i = 1; i <= GDS_TUNE_WARMUP + GDS_TUNE_ITERS; ++i) {
+                double t0;
+                ops[0].wr.dword_va.data = i;
+                ops[4].wr.dword_va.data = i;
+                nops = 0;
+                retcode = gds_post_ops(5, ops, params, nops);
+                if (retcode) {
+                        gds_dbg("strategy %s not usable, error %d\n", gds_db_strategy_names[strategy], retcode);
+                        goto out;
+                }
+                assert(nops <= GDS_TUNE_MAX_PARAMS);
+                if (i == GDS_TUNE_WARMUP + 1)
+                        start = gds_tune_now_us();
+                t0 = gds_tune_now_us();
+                retcode = gds_stream_batch_ops(stream, nops, params, 0);
+                if (retcode) {
+                        gds_dbg("strategy %s not usable, error %d\n", gds_db_strategy_names[strategy], retcode);
+                        goto out;
+                }
+                while (*done != (uint32_t)i) {
+                        if (gds_tune_now_us() - t0 > gds_tune_timeout_us) {
+                                gds_warn("timeout while tuning strategy %s\n", gds_db_strategy_names[strategy]);
+                                retcode = ETIMEDOUT;
+                                goto out;
+                        }
+                        arch_cpu_relax();
+                }
+        }
+        *lat_us = (gds_tune_now_us() - start) / GDS_TUNE_ITERS;
+out:
+        // don't leave any memop behind, desc is going to be released
+        cuStreamSynchronize(stream);
+        return retcode;
+}
+
+//-----------------------------------------------------------------------------
+
+int gds_autotune_db_strategy(int gpu_id)
+{
+        int retcode = 0;
+        CUdevice dev, ctx_dev;
+        CUstream stream = NULL;
+        gds_mem_desc_t desc;
+        double lat_us[GDS_DB_NUM_STRATEGIES];
+        int best = -1;
+
+        if (CUDA_SUCCESS != cuDeviceGet(&dev, gpu_id) ||
+            CUDA_SUCCESS != cuCtxGetDevice(&ctx_dev) ||
+            dev != ctx_dev) {
+                gds_warn("GPU %d is not current, skipping doorbell strategy tuning\n", gpu_id);
+                return EINVAL;
+        }
+        if (gds_db_strategy_get(dev) >= 0) {
+                gds_dbg("GPU %d already tuned\n", gpu_id);
+                return 0;
+        }
+
+        memset(&desc, 0, sizeof(desc));
+        retcode = gds_alloc_mapped_memory(&desc, GDS_TUNE_BUF_SIZE, GDS_MEMORY_HOST);
+        if (retcode) {
+                gds_err("error %d while allocating tuning buffer\n", retcode);
+                return retcode;
+        }
+        memset(desc.h_ptr, 0, GDS_TUNE_BUF_SIZE);
+        if (CUDA_SUCCESS != cuStreamCreate(&stream, CU_STREAM_NON_BLOCKING)) {
+                gds_err("error while creating tuning stream\n");
+                retcode = EINVAL;
+                goto out;
+        }
+
+        for (int s = 0; s < GDS_DB_NUM_STRATEGIES; ++s) {
+                lat_us[s] = -1;
+                if (!gds_db_strategy_is_available(s)) {
+                        gds_dbg("strategy %s not supported by this CUDA driver\n", gds_db_strategy_names[s]);
+                        continue;
+                }
+                gds_db_strategy_force(s);
+                if (gds_tune_strategy(s, stream, &desc, &lat_us[s]))
+                        lat_us[s] = -1;
+                gds_db_strategy_force(-1);
+                if (lat_us[s] < 0)
+                        continue;
+                gds_info("GPU %d strategy %s: %.2f usecs\n", gpu_id, gds_db_strategy_names[s], lat_us[s]);
+                if (best < 0 || lat_us[s] < lat_us[best])
+                        best = s;
+        }
+
+        if (best < 0) {
+                gds_warn("no doorbell strategy usable on GPU %d, keeping env defaults\n", gpu_id);
+                retcode = ENOTSUP;
+                goto out;
+        }
+        gds_db_strategy_set(dev, best);
+        gds_info("GPU %d using doorbell strategy %s (%.2f usecs)\n", gpu_id, gds_db_strategy_names[best], lat_us[best]);
+out:
+        if (stream)
+                cuStreamDestroy(stream);
+        gds_free_mapped_memory(&desc);
+        return retcode;
+}
+
+//-----------------------------------------------------------------------------
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ *  indent-tabs-mode: nil
+ * End:
+ */
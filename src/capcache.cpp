@@ -0,0 +1,286 @@
+/* Copyright (c) 2016, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <vector>
+
+#include <gdsync.h>
+#include <gdsync/tools.h>
+
+#include "utils.hpp"
+
+//-----------------------------------------------------------------------------
+// Per-node cache of the GPU caps and of the autotuner results, enabled by
+// pointing GDS_CAPS_CACHE to a file shared by the ranks of a node.
+//
+// Entries are keyed by GPU UUID, CUDA driver version and HCA firmware, so a
+// driver or firmware upgrade simply misses and gets probed again. The file
+// is read with a single read() at the first peer registration, then updated
+// by writing a new file and renaming it over the old one: readers see either
+// version, never a torn one. Concurrent writers may drop each other's new
+// entries, which are then re-probed and stored by a later process.
+
+#define GDS_CAPS_CACHE_MAGIC   "GDSCAPS"
+#define GDS_CAPS_CACHE_VERSION 1
+
+struct gds_caps_cache_hdr {
+        char     magic[8];
+        uint32_t version;
+        uint32_t entry_size;
+        uint32_t n_entries;
+        uint32_t pad;
+};
+
+enum {
+        GDS_CAPS_MEMOPS64 = 1<<0,
+        GDS_CAPS_WAIT_NOR = 1<<1
+};
+
+struct gds_caps_cache_entry {
+        // key
+        char     gpu_uuid[16];
+        int32_t  driver_version;
+        char     hca_fw_ver[64];
+        // value
+        uint32_t gpu_caps;      // GDS_CAPS_*
+        int32_t  db_strategy;   // -1 if not tuned
+};
+
+static pthread_mutex_t gds_caps_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<gds_caps_cache_entry> gds_caps_cache_entries;
+static bool gds_caps_cache_loaded = false;
+
+static const char *gds_caps_cache_path()
+{
+        static int initialized = 0;
+        static const char *path = NULL;
+        if (!initialized) {
+                path = getenv("GDS_CAPS_CACHE");
+                if (path && !*path)
+                        path = NULL;
+                gds_dbg("GDS_CAPS_CACHE=%s\n", path ? path : "");
+                initialized = 1;
+        }
+        return path;
+}
+
+//-----------------------------------------------------------------------------
+
+static int gds_caps_cache_make_key(struct ibv_context *context, int gpu_id, CUdevice *dev, gds_caps_cache_entry *key)
+{
+        CUuuid uuid;
+        int driver_version = 0;
+        struct ibv_device_attr attr;
+
+        memset(key, 0, sizeof(*key));
+        if (CUDA_SUCCESS != cuDeviceGet(dev, gpu_id) ||
+            CUDA_SUCCESS != cuDeviceGetUuid(&uuid, *dev) ||
+            CUDA_SUCCESS != cuDriverGetVersion(&driver_version)) {
+                gds_warn("cannot identify GPU %d, not using the caps cache\n", gpu_id);
+                return EINVAL;
+        }
+        memcpy(key->gpu_uuid, uuid.bytes, sizeof(key->gpu_uuid));
+        key->driver_version = driver_version;
+        if (context && !ibv_query_device(context, &attr))
+                snprintf(key->hca_fw_ver, sizeof(key->hca_fw_ver), "%s", attr.fw_ver);
+        return 0;
+}
+
+static bool gds_caps_cache_same_key(const gds_caps_cache_entry *a, const gds_caps_cache_entry *b)
+{
+        return !memcmp(a->gpu_uuid, b->gpu_uuid, sizeof(a->gpu_uuid)) &&
+                a->driver_version == b->driver_version &&
+                !strncmp(a->hca_fw_ver, b->hca_fw_ver, sizeof(a->hca_fw_ver));
+}
+
+// must be called with the lock held
+static void gds_caps_cache_load(const char *path)
+{
+        int fd;
+        struct stat st;
+        char *buf = NULL;
+        ssize_t len;
+        struct gds_caps_cache_hdr *hdr;
+
+        if (gds_caps_cache_loaded)
+                return;
+        gds_caps_cache_loaded = true;
+
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+                gds_dbg("no caps cache at %s\n", path);
+                return;
+        }
+        if (fstat(fd, &st) || st.st_size < (off_t)sizeof(*hdr))
+                goto out;
+        buf = (char *)malloc(st.st_size);
+        if (!buf)
+                goto out;
+        len = read(fd, buf, st.st_size);
+        hdr = (struct gds_caps_cache_hdr *)buf;
+        if (len != st.st_size ||
+            memcmp(hdr->magic, GDS_CAPS_CACHE_MAGIC, sizeof(hdr->magic)) ||
+            hdr->version != GDS_CAPS_CACHE_VERSION ||
+            hdr->entry_size != sizeof(gds_caps_cache_entry) ||
+            (size_t)len != sizeof(*hdr) + (size_t)hdr->n_entries * sizeof(gds_caps_cache_entry)) {
+                gds_warn("ignoring stale or corrupted caps cache %s\n", path);
+                goto out;
+        }
+        gds_caps_cache_entries.assign((gds_caps_cache_entry *)(hdr + 1),
+                                      (gds_caps_cache_entry *)(hdr + 1) + hdr->n_entries);
+        gds_dbg("loaded %u entries from caps cache %s\n", hdr->n_entries, path);
+out:
+        free(buf);
+        close(fd);
+}
+
+// must be called with the lock held
+static int gds_caps_cache_write(const char *path)
+{
+        int retcode = 0;
+        char tmp_path[4096];
+        struct gds_caps_cache_hdr hdr;
+        size_t size = gds_caps_cache_entries.size() * sizeof(gds_caps_cache_entry);
+        int fd;
+
+        snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, getpid());
+        fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if (fd < 0) {
+                retcode = errno;
+                gds_warn("cannot create %s, error %d\n", tmp_path, retcode);
+                return retcode;
+        }
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, GDS_CAPS_CACHE_MAGIC, sizeof(hdr.magic));
+        hdr.version = GDS_CAPS_CACHE_VERSION;
+        hdr.entry_size = sizeof(gds_caps_cache_entry);
+        hdr.n_entries = gds_caps_cache_entries.size();
+        if (write(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr) ||
+            write(fd, &gds_caps_cache_entries[0], size) != (ssize_t)size) {
+                retcode = errno ? errno : EIO;
+                gds_warn("error %d while writing %s\n", retcode, tmp_path);
+        }
+        close(fd);
+        if (!retcode && rename(tmp_path, path)) {
+                retcode = errno;
+                gds_warn("error %d while renaming %s\n", retcode, tmp_path);
+        }
+        if (retcode)
+                unlink(tmp_path);
+        return retcode;
+}
+
+//-----------------------------------------------------------------------------
+
+bool gds_caps_cache_restore(struct ibv_context *context, int gpu_id)
+{
+        bool complete = false;
+        const char *path = gds_caps_cache_path();
+        gds_caps_cache_entry key;
+        CUdevice dev;
+
+        if (!path || gds_caps_cache_make_key(context, gpu_id, &dev, &key))
+                return false;
+
+        pthread_mutex_lock(&gds_caps_cache_lock);
+        gds_caps_cache_load(path);
+        for (size_t i = 0; i < gds_caps_cache_entries.size(); ++i) {
+                const gds_caps_cache_entry &e = gds_caps_cache_entries[i];
+                if (!gds_caps_cache_same_key(&e, &key))
+                        continue;
+                gds_gpu_caps_t caps;
+                memset(&caps, 0, sizeof(caps));
+                caps.memops64 = !!(e.gpu_caps & GDS_CAPS_MEMOPS64);
+                caps.wait_nor = !!(e.gpu_caps & GDS_CAPS_WAIT_NOR);
+                gds_gpu_caps_seed(dev, caps);
+                if (e.db_strategy >= 0 && e.db_strategy < GDS_DB_NUM_STRATEGIES)
+                        gds_db_strategy_set(dev, e.db_strategy);
+                // an entry stored before autotuning was enabled is not enough
+                complete = !gds_enable_autotune() || e.db_strategy >= 0;
+                gds_dbg("GPU %d: caps cache hit, caps=%x db_strategy=%d\n", gpu_id, e.gpu_caps, e.db_strategy);
+                break;
+        }
+        pthread_mutex_unlock(&gds_caps_cache_lock);
+        return complete;
+}
+
+int gds_caps_cache_save(struct ibv_context *context, int gpu_id)
+{
+        int retcode = 0;
+        const char *path = gds_caps_cache_path();
+        gds_caps_cache_entry entry;
+        gds_gpu_caps_t caps;
+        CUdevice dev;
+        size_t i;
+
+        if (!path)
+                return 0;
+        retcode = gds_caps_cache_make_key(context, gpu_id, &dev, &entry);
+        if (retcode)
+                return retcode;
+        caps = gds_gpu_caps(dev);
+        entry.gpu_caps = (caps.memops64 ? GDS_CAPS_MEMOPS64 : 0) | (caps.wait_nor ? GDS_CAPS_WAIT_NOR : 0);
+        entry.db_strategy = gds_db_strategy_get(dev);
+
+        pthread_mutex_lock(&gds_caps_cache_lock);
+        gds_caps_cache_load(path);
+        for (i = 0; i < gds_caps_cache_entries.size(); ++i)
+                if (gds_caps_cache_same_key(&gds_caps_cache_entries[i], &entry))
+                        break;
+        if (i < gds_caps_cache_entries.size())
+                gds_caps_cache_entries[i] = entry;
+        else
+                gds_caps_cache_entries.push_back(entry);
+        retcode = gds_caps_cache_write(path);
+        pthread_mutex_unlock(&gds_caps_cache_lock);
+        if (!retcode)
+                gds_dbg("GPU %d: stored caps=%x db_strategy=%d in %s\n", gpu_id, entry.gpu_caps, entry.db_strategy, path);
+        return retcode;
+}
+
+//-----------------------------------------------------------------------------
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ *  indent-tabs-mode: nil
+ * End:
+ */
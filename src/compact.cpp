@@ -0,0 +1,447 @@
+/* Copyright (c) 2016, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <assert.h>
+
+#include <gdsync.h>
+#include <gdsync/tools.h>
+
+#include "utils.hpp"
+
+//-----------------------------------------------------------------------------
+
+// Slots are laid out back to back in creqs->buf, each one starting on a
+// cache line and holding only the ops actually used by the request.  Op
+// lists are linked within the slot, so they can be fed to gds_post_ops()
+// as they are.
+
+struct gds_compact_slot {
+        uint32_t size;          // including this header, multiple of GDS_COMPACT_ALIGN
+        uint16_t tag;           // GDS_TAG_SEND or GDS_TAG_WAIT
+        uint16_t n_ops;
+        uint32_t offset;        // peek offset, waits only
+        uint32_t comp_mask;
+        uint64_t id;            // rollback_id or peek_id
+        const uint64_t *sq_begin; // SQ bounds, sends only
+        const uint64_t *sq_end;
+        struct peer_op_wr ops[0];
+};
+
+#define GDS_COMPACT_ALIGN         64
+#define GDS_COMPACT_MAX_OPS       GDS_SEND_INFO_MAX_OPS
+#define GDS_COMPACT_MAX_SLOT_SIZE ROUND_UP(sizeof(struct gds_compact_slot) + GDS_COMPACT_MAX_OPS*sizeof(struct peer_op_wr), GDS_COMPACT_ALIGN)
+// max number of mem ops submitted with a single cuStreamBatchMemOp
+#define GDS_COMPACT_MAX_BATCH     256
+
+static inline size_t gds_compact_slot_size(size_t n_ops)
+{
+        return ROUND_UP(sizeof(struct gds_compact_slot) + n_ops*sizeof(struct peer_op_wr), GDS_COMPACT_ALIGN);
+}
+
+static inline struct gds_compact_slot *gds_compact_slot_at(gds_compact_requests_t *creqs, size_t off)
+{
+        return (struct gds_compact_slot *)((char *)creqs->buf + off);
+}
+
+static void gds_compact_link_ops(struct peer_op_wr *op, size_t count)
+{
+        for (size_t i = 0; i + 1 < count; ++i)
+                op[i].next = &op[i+1];
+        if (count)
+                op[count-1].next = NULL;
+}
+
+//-----------------------------------------------------------------------------
+
+int gds_compact_requests_init(gds_compact_requests_t *creqs, size_t size)
+{
+        if (!creqs) {
+                gds_err("NULL creqs\n");
+                return EINVAL;
+        }
+        memset(creqs, 0, sizeof(*creqs));
+        size = ROUND_UP(size ? size : GDS_COMPACT_MAX_SLOT_SIZE, GDS_COMPACT_ALIGN);
+        if (posix_memalign(&creqs->buf, GDS_COMPACT_ALIGN, size)) {
+                gds_err("cannot allocate %zu bytes\n", size);
+                creqs->buf = NULL;
+                return ENOMEM;
+        }
+        creqs->size = size;
+        return 0;
+}
+
+//-----------------------------------------------------------------------------
+
+int gds_compact_requests_fini(gds_compact_requests_t *creqs)
+{
+        if (!creqs) {
+                gds_err("NULL creqs\n");
+                return EINVAL;
+        }
+        free(creqs->buf);
+        memset(creqs, 0, sizeof(*creqs));
+        return 0;
+}
+
+//-----------------------------------------------------------------------------
+
+void gds_compact_requests_reset(gds_compact_requests_t *creqs)
+{
+        assert(creqs);
+        creqs->used = 0;
+        creqs->count = 0;
+}
+
+//-----------------------------------------------------------------------------
+
+// make room for one more slot of max size, relinking the op lists if the
+// buffer moves
+static int gds_compact_reserve(gds_compact_requests_t *creqs)
+{
+        size_t size = creqs->size;
+        void *buf = NULL;
+
+        if (creqs->used + GDS_COMPACT_MAX_SLOT_SIZE <= creqs->size)
+                return 0;
+
+        while (creqs->used + GDS_COMPACT_MAX_SLOT_SIZE > size)
+                size = size ? size * 2 : GDS_COMPACT_MAX_SLOT_SIZE;
+        if (posix_memalign(&buf, GDS_COMPACT_ALIGN, size)) {
+                gds_err("cannot grow to %zu bytes\n", size);
+                return ENOMEM;
+        }
+        gds_dbg("growing creqs=%p from %zu to %zu bytes\n", creqs, creqs->size, size);
+        if (creqs->used)
+                memcpy(buf, creqs->buf, creqs->used);
+        free(creqs->buf);
+        creqs->buf = buf;
+        creqs->size = size;
+
+        for (size_t off = 0; off < creqs->used; ) {
+                struct gds_compact_slot *slot = gds_compact_slot_at(creqs, off);
+                gds_compact_link_ops(slot->ops, slot->n_ops);
+                off += slot->size;
+        }
+        return 0;
+}
+
+static void gds_compact_commit_slot(gds_compact_requests_t *creqs, struct gds_compact_slot *slot, gds_tag_t tag, size_t n_ops)
+{
+        slot->tag = tag;
+        slot->n_ops = n_ops;
+        slot->size = gds_compact_slot_size(n_ops);
+        if (n_ops)
+                slot->ops[n_ops-1].next = NULL;
+        creqs->used += slot->size;
+        ++creqs->count;
+}
+
+//-----------------------------------------------------------------------------
+
+int gds_compact_prepare_send(struct gds_qp *qp, gds_send_wr *p_ewr, gds_send_wr **bad_ewr, gds_compact_requests_t *creqs)
+{
+        int retcode = 0;
+        struct gds_compact_slot *slot;
+        struct ibv_exp_peer_commit commit;
+
+        assert(creqs);
+        retcode = gds_compact_reserve(creqs);
+        if (retcode)
+                goto out;
+
+        // let the provider fill the slot in place
+        slot = gds_compact_slot_at(creqs, creqs->used);
+        memset(slot, 0, sizeof(*slot));
+        gds_compact_link_ops(slot->ops, GDS_COMPACT_MAX_OPS);
+        memset(&commit, 0, sizeof(commit));
+        commit.storage = slot->ops;
+        commit.entries = GDS_COMPACT_MAX_OPS;
+
+        assert(qp);
+        assert(qp->qp);
+        retcode = ibv_exp_post_send(qp->qp, p_ewr, bad_ewr);
+        if (retcode) {
+                if (retcode == ENOMEM) {
+                        // out of space error can happen too often to report
+                        gds_dbg("ENOMEM error %d in ibv_exp_post_send\n", retcode);
+                } else {
+                        gds_err("error %d in ibv_exp_post_send\n", retcode);
+                }
+                goto out;
+        }
+        retcode = ibv_exp_peer_commit_qp(qp->qp, &commit);
+        if (retcode) {
+                gds_err("error %d in ibv_exp_peer_commit_qp\n", retcode);
+                goto out;
+        }
+        slot->id = commit.rollback_id;
+        slot->comp_mask = commit.comp_mask;
+        slot->sq_begin = qp->sq_begin;
+        slot->sq_end = qp->sq_end;
+        gds_compact_commit_slot(creqs, slot, GDS_TAG_SEND, commit.entries);
+out:
+        return retcode;
+}
+
+//-----------------------------------------------------------------------------
+
+int gds_compact_prepare_wait_cq(struct gds_cq *cq, gds_compact_requests_t *creqs, int flags)
+{
+        int retcode = 0;
+        struct gds_compact_slot *slot;
+        struct ibv_exp_peer_peek peek;
+
+        assert(cq);
+        assert(creqs);
+        if (flags != 0) {
+                gds_err("invalid flags != 0\n");
+                return EINVAL;
+        }
+        retcode = gds_compact_reserve(creqs);
+        if (retcode)
+                goto out;
+
+        slot = gds_compact_slot_at(creqs, creqs->used);
+        memset(slot, 0, sizeof(*slot));
+        gds_compact_link_ops(slot->ops, GDS_COMPACT_MAX_OPS);
+        memset(&peek, 0, sizeof(peek));
+        peek.storage = slot->ops;
+        peek.entries = GDS_COMPACT_MAX_OPS;
+        peek.whence = IBV_EXP_PEER_PEEK_ABSOLUTE;
+        peek.offset = gds_cq_claim_offset(cq);
+
+        retcode = ibv_exp_peer_peek_cq(cq->cq, &peek);
+        if (retcode) {
+                gds_err("error %d in peer_peek_cq\n", retcode);
+                goto out;
+        }
+        slot->offset = peek.offset;
+        slot->id = peek.peek_id;
+        slot->comp_mask = peek.comp_mask;
+        gds_compact_commit_slot(creqs, slot, GDS_TAG_WAIT, peek.entries);
+out:
+        return retcode;
+}
+
+//-----------------------------------------------------------------------------
+
+static int gds_compact_append_ops(gds_compact_requests_t *creqs, gds_tag_t tag, size_t n_ops, struct peer_op_wr *op, struct gds_compact_slot **pslot)
+{
+        int retcode = 0;
+        struct gds_compact_slot *slot;
+        size_t n;
+
+        if (n_ops > GDS_COMPACT_MAX_OPS) {
+                gds_err("too many ops %zu\n", n_ops);
+                return EINVAL;
+        }
+        retcode = gds_compact_reserve(creqs);
+        if (retcode)
+                return retcode;
+
+        slot = gds_compact_slot_at(creqs, creqs->used);
+        memset(slot, 0, sizeof(*slot));
+        for (n = 0; op && n < n_ops; op = op->next, ++n)
+                slot->ops[n] = *op;
+        if (n != n_ops) {
+                gds_err("op list shorter than %zu entries\n", n_ops);
+                return EINVAL;
+        }
+        gds_compact_link_ops(slot->ops, n_ops);
+        gds_compact_commit_slot(creqs, slot, tag, n_ops);
+        *pslot = slot;
+        return 0;
+}
+
+int gds_compact_requests_append_send(gds_compact_requests_t *creqs, const gds_send_request_t *request)
+{
+        int retcode = 0;
+        struct gds_compact_slot *slot = NULL;
+
+        assert(creqs);
+        assert(request);
+        retcode = gds_compact_append_ops(creqs, GDS_TAG_SEND, request->commit.entries, request->commit.storage, &slot);
+        if (retcode)
+                return retcode;
+        slot->id = request->commit.rollback_id;
+        slot->comp_mask = request->commit.comp_mask;
+        slot->sq_begin = request->sq_begin;
+        slot->sq_end = request->sq_end;
+        return 0;
+}
+
+int gds_compact_requests_append_wait(gds_compact_requests_t *creqs, const gds_wait_request_t *request)
+{
+        int retcode = 0;
+        struct gds_compact_slot *slot = NULL;
+
+        assert(creqs);
+        assert(request);
+        retcode = gds_compact_append_ops(creqs, GDS_TAG_WAIT, request->peek.entries, request->peek.storage, &slot);
+        if (retcode)
+                return retcode;
+        slot->offset = request->peek.offset;
+        slot->id = request->peek.peek_id;
+        slot->comp_mask = request->peek.comp_mask;
+        return 0;
+}
+
+//-----------------------------------------------------------------------------
+
+static struct gds_compact_slot *gds_compact_find(gds_compact_requests_t *creqs, size_t index)
+{
+        size_t off = 0;
+        if (index >= creqs->count)
+                return NULL;
+        while (index--)
+                off += gds_compact_slot_at(creqs, off)->size;
+        return gds_compact_slot_at(creqs, off);
+}
+
+int gds_compact_requests_get_send(gds_compact_requests_t *creqs, size_t index, gds_send_request_t *request)
+{
+        assert(creqs);
+        assert(request);
+        struct gds_compact_slot *slot = gds_compact_find(creqs, index);
+        if (!slot || slot->tag != GDS_TAG_SEND) {
+                gds_err("no send request at index %zu\n", index);
+                return EINVAL;
+        }
+        memset(request, 0, sizeof(*request));
+        memcpy(request->wr, slot->ops, slot->n_ops * sizeof(slot->ops[0]));
+        gds_compact_link_ops(request->wr, GDS_SEND_INFO_MAX_OPS);
+        request->commit.storage = request->wr;
+        request->commit.entries = slot->n_ops;
+        request->commit.rollback_id = slot->id;
+        request->commit.comp_mask = slot->comp_mask;
+        request->sq_begin = slot->sq_begin;
+        request->sq_end = slot->sq_end;
+        return 0;
+}
+
+int gds_compact_requests_get_wait(gds_compact_requests_t *creqs, size_t index, gds_wait_request_t *request)
+{
+        assert(creqs);
+        assert(request);
+        struct gds_compact_slot *slot = gds_compact_find(creqs, index);
+        if (!slot || slot->tag != GDS_TAG_WAIT) {
+                gds_err("no wait request at index %zu\n", index);
+                return EINVAL;
+        }
+        memset(request, 0, sizeof(*request));
+        memcpy(request->wr, slot->ops, slot->n_ops * sizeof(slot->ops[0]));
+        gds_compact_link_ops(request->wr, GDS_WAIT_INFO_MAX_OPS);
+        request->peek.storage = request->wr;
+        request->peek.entries = slot->n_ops;
+        request->peek.whence = IBV_EXP_PEER_PEEK_ABSOLUTE;
+        request->peek.offset = slot->offset;
+        request->peek.peek_id = slot->id;
+        request->peek.comp_mask = slot->comp_mask;
+        return 0;
+}
+
+//-----------------------------------------------------------------------------
+
+int gds_stream_post_compact_requests(CUstream stream, gds_compact_requests_t *creqs, int flags)
+{
+        int retcode = 0;
+        int idx = 0;
+        size_t off;
+        size_t last_wait;
+        bool move_flush = false;
+        CUstreamBatchMemOpParams params[GDS_COMPACT_MAX_BATCH];
+
+        assert(creqs);
+        last_wait = creqs->used;
+        if (flags != 0) {
+                gds_err("invalid flags != 0\n");
+                return EINVAL;
+        }
+
+        // as in gds_stream_post_descriptors, a single flush on the last
+        // wait is enough if no send follows it
+        for (off = 0; off < creqs->used; off += gds_compact_slot_at(creqs, off)->size) {
+                struct gds_compact_slot *slot = gds_compact_slot_at(creqs, off);
+                if (slot->tag == GDS_TAG_WAIT) {
+                        last_wait = off;
+                        move_flush = true;
+                } else {
+                        move_flush = false;
+                }
+        }
+        gds_dbg("count=%zu used=%zu move_flush=%d\n", creqs->count, creqs->used, move_flush);
+
+        for (off = 0; off < creqs->used; ) {
+                struct gds_compact_slot *slot = gds_compact_slot_at(creqs, off);
+                int post_flags = 0;
+
+                // worst case expansion is 2 mem ops per peer op
+                if (idx + 2 * slot->n_ops + 2 > GDS_COMPACT_MAX_BATCH) {
+                        retcode = gds_stream_batch_ops(stream, idx, params, 0);
+                        if (retcode) {
+                                gds_err("error %d in stream_batch_ops\n", retcode);
+                                goto out;
+                        }
+                        idx = 0;
+                }
+                if (slot->tag == GDS_TAG_WAIT && move_flush && off != last_wait)
+                        post_flags = GDS_POST_OPS_DISCARD_WAIT_FLUSH;
+                retcode = gds_post_ops(slot->n_ops, slot->ops, params, idx, post_flags);
+                if (retcode) {
+                        gds_err("error %d in gds_post_ops\n", retcode);
+                        goto out;
+                }
+                off += slot->size;
+        }
+        if (idx) {
+                retcode = gds_stream_batch_ops(stream, idx, params, 0);
+                if (retcode) {
+                        gds_err("error %d in stream_batch_ops\n", retcode);
+                        goto out;
+                }
+        }
+out:
+        return retcode;
+}
+
+//-----------------------------------------------------------------------------
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ *  indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,157 @@
+/* Copyright (c) 2016, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include <vector>
+
+#include <gdsync.h>
+#include <gdsync/tools.h>
+
+#include "utils.hpp"
+
+//-----------------------------------------------------------------------------
+// Pool of dword flags, written by one stream and waited on by others.
+//
+// Every slot carries a monotonic sequence number. A stream releases its
+// waiters by writing the new value, waiters use a GEQ condition. A slot is
+// handed out again only once the previous value has landed, otherwise a
+// later release could overtake an earlier one and wake its waiters early.
+
+enum {
+        GDS_FLAG_CHUNK_SIZE = 4096,
+        GDS_FLAG_STRIDE = 64 // one flag per cache line
+};
+
+struct gds_flag_slot {
+        uint32_t *ptr;
+        uint32_t  seq; // last value handed out
+};
+
+struct gds_flag_pool {
+        std::vector<gds_mem_desc_t> chunks;
+        std::vector<gds_flag_slot> slots;
+        size_t next;
+        pthread_mutex_t lock;
+};
+
+static gds_flag_pool gds_flag_pools[2];
+static pthread_once_t gds_flag_pools_once = PTHREAD_ONCE_INIT;
+
+static void gds_flag_pools_init()
+{
+        for (int i = 0; i < 2; ++i) {
+                gds_flag_pools[i].next = 0;
+                pthread_mutex_init(&gds_flag_pools[i].lock, NULL);
+        }
+}
+
+static int gds_flag_pool_grow(gds_flag_pool *pool, int mem_type)
+{
+        gds_mem_desc_t desc;
+        int retcode;
+
+        memset(&desc, 0, sizeof(desc));
+        retcode = gds_alloc_mapped_memory(&desc, GDS_FLAG_CHUNK_SIZE, mem_type);
+        if (retcode) {
+                gds_err("error %d while allocating flags\n", retcode);
+                return retcode;
+        }
+        pool->chunks.push_back(desc);
+        for (size_t off = 0; off < GDS_FLAG_CHUNK_SIZE; off += GDS_FLAG_STRIDE) {
+                gds_flag_slot slot;
+                slot.ptr = (uint32_t *)((char *)desc.h_ptr + off);
+                slot.seq = 0;
+                ACCESS_ONCE(*slot.ptr) = 0;
+                pool->slots.push_back(slot);
+        }
+        gds_dbg("flag pool mem_type=%d grown to %zu slots\n", mem_type, pool->slots.size());
+        return 0;
+}
+
+int gds_flag_slot_get(int mem_type, uint32_t **ptr, uint32_t *value)
+{
+        int retcode = 0;
+        gds_flag_pool *pool;
+        size_t n, idx;
+
+        switch (mem_type) {
+        case GDS_MEMORY_HOST: pool = &gds_flag_pools[0]; break;
+        case GDS_MEMORY_GPU:  pool = &gds_flag_pools[1]; break;
+        default:
+                gds_err("invalid memory type %d\n", mem_type);
+                return EINVAL;
+        }
+        pthread_once(&gds_flag_pools_once, gds_flag_pools_init);
+
+        pthread_mutex_lock(&pool->lock);
+        n = pool->slots.size();
+        for (idx = 0; idx < n; ++idx) {
+                gds_flag_slot &slot = pool->slots[(pool->next + idx) % n];
+                if ((int32_t)(ACCESS_ONCE(*slot.ptr) - slot.seq) >= 0)
+                        break;
+        }
+        if (idx < n) {
+                idx = (pool->next + idx) % n;
+        } else {
+                // all slots have a release in flight
+                retcode = gds_flag_pool_grow(pool, mem_type);
+                if (retcode)
+                        goto out;
+                idx = n;
+        }
+        pool->next = (idx + 1) % pool->slots.size();
+        *ptr = pool->slots[idx].ptr;
+        *value = ++pool->slots[idx].seq;
+        gds_dbg("flag slot %zu ptr=%p value=%u\n", idx, *ptr, *value);
+out:
+        pthread_mutex_unlock(&pool->lock);
+        return retcode;
+}
+
+void gds_flag_slot_cancel(uint32_t *ptr, uint32_t value)
+{
+        // nothing was posted, land the value from the CPU
+        ACCESS_ONCE(*ptr) = value;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ *  indent-tabs-mode: nil
+ * End:
+ */
@@ -32,6 +32,11 @@
 #include <unistd.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+
+#include <map>
+#include <algorithm>
+#include <new>
 
 #include <gdsync.h>
 #include <gdsync/tools.h>
@@ -42,6 +47,12 @@
 #include "objs.hpp"
 #include "archutils.h"
 #include "mlnxutils.h"
+#include "trace.hpp"
+#include "topo.hpp"
+
+#if HAVE_DECL_IBV_MLX5_EXP_GET_QP_INFO
+#include <infiniband/mlx5_hw.h>
+#endif
 
 //-----------------------------------------------------------------------------
 
@@ -70,6 +81,18 @@ int gds_dbg_enabled()
 #define GDS_HAS_WRITE64     0
 #endif
 
+#if HAVE_DECL_CU_DEVICE_ATTRIBUTE_CAN_USE_64_BIT_STREAM_MEM_OPS
+#define GDS_HAS_MEMOPS64    1
+#else
+#define GDS_HAS_MEMOPS64    0
+#endif
+
+#if HAVE_DECL_CU_DEVICE_ATTRIBUTE_CAN_USE_STREAM_WAIT_VALUE_NOR
+#define GDS_HAS_WAIT_NOR    1
+#else
+#define GDS_HAS_WAIT_NOR    0
+#endif
+
 #if HAVE_DECL_CU_STREAM_MEM_OP_INLINE_COPY
 #warning "enabling inline_copy extensions"
 #define GDS_HAS_INLINE_COPY 1
@@ -91,10 +114,6 @@ int gds_dbg_enabled()
 #define GDS_HAS_MEMBAR      0
 #endif
 
-// TODO: use corret value
-// TODO: make it dependent upon the particular GPU
-const size_t GDS_GPU_MAX_INLINE_SIZE = 256;
-
 //-----------------------------------------------------------------------------
 
 // Note: inlcpy has precedence
@@ -103,12 +122,154 @@ const size_t GDS_GPU_MAX_INLINE_SIZE = 256;
 //bool gds_has_weak_consistency = GDS_HAS_WEAK_API;
 //bool gds_has_membar = GDS_HAS_MEMBAR;
 
-static bool gpu_does_support_nor(gds_peer *peer) { return false; }
+static gds_gpu_caps_t gds_probe_gpu_caps(CUdevice dev)
+{
+        gds_gpu_caps_t caps;
+        int attr = 0;
+        memset(&caps, 0, sizeof(caps));
+#if GDS_HAS_MEMOPS64
+        if (CUDA_SUCCESS == cuDeviceGetAttribute(&attr, CU_DEVICE_ATTRIBUTE_CAN_USE_64_BIT_STREAM_MEM_OPS, dev))
+                caps.memops64 = !!attr;
+#endif
+#if GDS_HAS_WAIT_NOR
+        if (CUDA_SUCCESS == cuDeviceGetAttribute(&attr, CU_DEVICE_ATTRIBUTE_CAN_USE_STREAM_WAIT_VALUE_NOR, dev))
+                caps.wait_nor = !!attr;
+#endif
+        gds_dbg("dev=%d memops64=%d wait_nor=%d\n", dev, caps.memops64, caps.wait_nor);
+        return caps;
+}
+
+static pthread_mutex_t gds_gpu_caps_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::map<CUdevice, gds_gpu_caps_t> gds_gpu_caps_devs;
+
+gds_gpu_caps_t gds_gpu_caps(CUdevice dev)
+{
+        gds_gpu_caps_t caps;
+
+        pthread_mutex_lock(&gds_gpu_caps_lock);
+        std::map<CUdevice, gds_gpu_caps_t>::iterator it = gds_gpu_caps_devs.find(dev);
+        if (it == gds_gpu_caps_devs.end())
+                it = gds_gpu_caps_devs.insert(std::make_pair(dev, gds_probe_gpu_caps(dev))).first;
+        caps = it->second;
+        pthread_mutex_unlock(&gds_gpu_caps_lock);
+        return caps;
+}
+
+void gds_gpu_caps_seed(CUdevice dev, gds_gpu_caps_t caps)
+{
+        pthread_mutex_lock(&gds_gpu_caps_lock);
+        gds_gpu_caps_devs[dev] = caps;
+        pthread_mutex_unlock(&gds_gpu_caps_lock);
+}
+
+gds_gpu_caps_t gds_current_gpu_caps()
+{
+        CUdevice dev;
+        if (CUDA_SUCCESS != cuCtxGetDevice(&dev)) {
+                gds_gpu_caps_t caps;
+                gds_dbg("no current CUDA context, assuming no caps\n");
+                memset(&caps, 0, sizeof(caps));
+                return caps;
+        }
+        return gds_gpu_caps(dev);
+}
+
+//-----------------------------------------------------------------------------
+
+static bool gds_enable_wait_nor()
+{
+        static int gds_disable_wait_nor = -1;
+        if (-1 == gds_disable_wait_nor) {
+                const char *env = getenv("GDS_DISABLE_WAIT_NOR");
+                if (env)
+                        gds_disable_wait_nor = !!atoi(env);
+                else
+                        gds_disable_wait_nor = 0;
+                gds_dbg("GDS_DISABLE_WAIT_NOR=%d\n", gds_disable_wait_nor);
+        }
+        return GDS_HAS_WAIT_NOR && !gds_disable_wait_nor;
+}
+
+static bool gpu_does_support_nor(gds_peer *peer)
+{
+        if (!gds_enable_wait_nor())
+                return false;
+        if (peer && peer->gpu_dev >= 0)
+                return peer->caps.wait_nor;
+        return gds_current_gpu_caps().wait_nor;
+}
 
 //-----------------------------------------------------------------------------
 
-// BUG: this feature is GPU device dependent
-static bool gds_enable_write64()
+// the A-F orderings listed above gds_post_ops, as the feature toggles below
+static const struct {
+        bool membar;
+        bool sim64;
+        bool inlcpy;
+} gds_db_strategies[GDS_DB_NUM_STRATEGIES] = {
+        { true,  false, false }, // A) plain+membar
+        { false, false, false }, // B) plain
+        { true,  true,  false }, // C) sim64+membar
+        { false, true,  false }, // D) sim64
+        { true,  false, true  }, // E) inlcpy+membar
+        { false, false, true  }, // F) inlcpy
+};
+
+// strategy being measured by the autotuner or replayed, overrides
+// everything else, only for the thread doing so
+static __thread int gds_db_strategy_forced = -1;
+// strategy picked by the autotuner for each GPU, plus one, 0 when not tuned
+static int gds_db_strategy_tuned[max_gpus];
+
+bool gds_db_strategy_is_available(int strategy)
+{
+        assert(strategy >= 0 && strategy < GDS_DB_NUM_STRATEGIES);
+        if (gds_db_strategies[strategy].membar && !GDS_HAS_MEMBAR)
+                return false;
+        if ((gds_db_strategies[strategy].sim64 || gds_db_strategies[strategy].inlcpy) && !GDS_HAS_INLINE_COPY)
+                return false;
+        return true;
+}
+
+void gds_db_strategy_force(int strategy)
+{
+        gds_db_strategy_forced = strategy;
+}
+
+void gds_db_strategy_set(int gpu_id, int strategy)
+{
+        assert(gpu_id >= 0 && gpu_id < (int)max_gpus);
+        gds_db_strategy_tuned[gpu_id] = strategy + 1;
+}
+
+int gds_db_strategy_get(int gpu_id)
+{
+        if (gpu_id < 0 || gpu_id >= (int)max_gpus)
+                return -1;
+        return gds_db_strategy_tuned[gpu_id] - 1;
+}
+
+// strategy in use for the GPU of peer, or for the GPU of the current
+// context when peer is NULL, -1 for the env defaults. Resolve it once per
+// batch of ops and pass it to the toggles below.
+static int gds_db_strategy_current(gds_peer *peer)
+{
+        CUdevice dev;
+        if (gds_db_strategy_forced >= 0)
+                return gds_db_strategy_forced;
+        if (!gds_enable_autotune())
+                return -1;
+        if (peer)
+                return peer->db_strategy;
+        if (CUDA_SUCCESS != cuCtxGetDevice(&dev))
+                return -1;
+        return gds_db_strategy_get(dev);
+}
+
+//-----------------------------------------------------------------------------
+
+// native 64-bits writes, depends on the GPU the ops are posted for
+static bool gds_enable_write64(const gds_gpu_caps_t &caps)
 {
         static int gds_disable_write64 = -1;
         if (-1 == gds_disable_write64) {
@@ -119,14 +280,14 @@ static bool gds_enable_write64()
                         gds_disable_write64 = 0;
                 gds_dbg("GDS_DISABLE_WRITE64=%d\n", gds_disable_write64);
         }
-        // BUG: need to query device property for write64 capability
-        //return GDS_HAS_WRITE64 && !gds_disable_write64;
-        return false;
+        return GDS_HAS_MEMOPS64 && !gds_disable_write64 && caps.memops64;
 }
 
-static bool gds_enable_inlcpy()
+static bool gds_enable_inlcpy(int strategy)
 {
         static int gds_disable_inlcpy = -1;
+        if (strategy >= 0)
+                return GDS_HAS_INLINE_COPY && gds_db_strategies[strategy].inlcpy;
         if (-1 == gds_disable_inlcpy) {
                 const char *env = getenv("GDS_DISABLE_INLINECOPY");
                 if (env)
@@ -138,9 +299,11 @@ static bool gds_enable_inlcpy()
         return GDS_HAS_INLINE_COPY && !gds_disable_inlcpy;
 }
 
-static bool gds_simulate_write64()
+static bool gds_simulate_write64(int strategy)
 {
         static int gds_simulate_write64 = -1;
+        if (strategy >= 0)
+                return GDS_HAS_INLINE_COPY && gds_db_strategies[strategy].sim64;
         if (-1 == gds_simulate_write64) {
                 const char *env = getenv("GDS_SIMULATE_WRITE64");
                 if (env)
@@ -149,7 +312,7 @@ static bool gds_simulate_write64()
                         gds_simulate_write64 = 0; // default
                 gds_dbg("GDS_SIMULATE_WRITE64=%d\n", gds_simulate_write64);
 
-                if (gds_simulate_write64 && gds_enable_inlcpy()) {
+                if (gds_simulate_write64 && gds_enable_inlcpy(-1)) {
                         gds_warn("INLINECOPY has priority over SIMULATE_WRITE64, using the former\n");
                         gds_simulate_write64 = 0;
                 }
@@ -158,9 +321,11 @@ static bool gds_simulate_write64()
         return GDS_HAS_INLINE_COPY && gds_simulate_write64;
 }
 
-static bool gds_enable_membar()
+static bool gds_enable_membar(int strategy)
 {
         static int gds_disable_membar = -1;
+        if (strategy >= 0)
+                return GDS_HAS_MEMBAR && gds_db_strategies[strategy].membar;
         if (-1 == gds_disable_membar) {
                 const char *env = getenv("GDS_DISABLE_MEMBAR");
                 if (env)
@@ -172,6 +337,38 @@ static bool gds_enable_membar()
         return GDS_HAS_MEMBAR && !gds_disable_membar;
 }
 
+//-----------------------------------------------------------------------------
+
+static gds_bf_copy_fn_t gds_bf_copy_impl()
+{
+        static gds_bf_copy_fn_t gds_bf_copy_fn = NULL;
+        if (!gds_bf_copy_fn) {
+                const char *env = getenv("GDS_BF_COPY");
+                gds_bf_copy_fn_t fn = gds_bf_copy_select(env);
+                if (!fn) {
+                        gds_warn("GDS_BF_COPY=%s is not supported on this CPU, using default\n", env);
+                        fn = gds_bf_copy_select(NULL);
+                }
+                gds_dbg("GDS_BF_COPY=%s\n", env ? env : "(default)");
+                gds_bf_copy_fn = fn;
+        }
+        return gds_bf_copy_fn;
+}
+
+static bool gds_enable_db_batching()
+{
+        static int gds_disable_db_batching = -1;
+        if (-1 == gds_disable_db_batching) {
+                const char *env = getenv("GDS_DISABLE_DB_BATCHING");
+                if (env)
+                        gds_disable_db_batching = !!atoi(env);
+                else
+                        gds_disable_db_batching = 0;
+                gds_dbg("GDS_DISABLE_DB_BATCHING=%d\n", gds_disable_db_batching);
+        }
+        return !gds_disable_db_batching;
+}
+
 static bool gds_enable_weak_consistency()
 {
         static int gds_disable_weak_consistency = -1;
@@ -188,6 +385,29 @@ static bool gds_enable_weak_consistency()
 
 //-----------------------------------------------------------------------------
 
+// largest WQE pushed whole to the BlueFlame register by inline copy, bigger
+// ones only get their first 8 bytes written there, i.e. a plain doorbell,
+// and are fetched by the HCA
+static size_t gds_inline_wqe_max_size()
+{
+        static long gds_inline_wqe_max_size = -1;
+        if (-1 == gds_inline_wqe_max_size) {
+                const char *env = getenv("GDS_INLINE_WQE_MAX_SIZE");
+                if (env)
+                        gds_inline_wqe_max_size = strtol(env, NULL, 0);
+                else
+                        gds_inline_wqe_max_size = GDS_GPU_MAX_INLINE_SIZE;
+                if (gds_inline_wqe_max_size < (long)sizeof(uint64_t))
+                        gds_inline_wqe_max_size = sizeof(uint64_t);
+                if (gds_inline_wqe_max_size > (long)GDS_GPU_MAX_INLINE_SIZE)
+                        gds_inline_wqe_max_size = GDS_GPU_MAX_INLINE_SIZE;
+                gds_dbg("GDS_INLINE_WQE_MAX_SIZE=%ld\n", gds_inline_wqe_max_size);
+        }
+        return gds_inline_wqe_max_size;
+}
+
+//-----------------------------------------------------------------------------
+
 static bool gds_enable_dump_memops()
 {
         static int gds_enable_dump_memops = -1;
@@ -404,6 +624,40 @@ out:
 
 //-----------------------------------------------------------------------------
 
+static int gds_wait_cond_to_cu(int cond_flag, unsigned int *cu_flags, const char **cond_str)
+{
+        int retcode = 0;
+        switch(cond_flag) {
+        case GDS_WAIT_COND_GEQ:
+                *cu_flags = CU_STREAM_WAIT_VALUE_GEQ;
+                *cond_str = "CU_STREAM_WAIT_VALUE_GEQ";
+                break;
+        case GDS_WAIT_COND_EQ:
+                *cu_flags = CU_STREAM_WAIT_VALUE_EQ;
+                *cond_str = "CU_STREAM_WAIT_VALUE_EQ";
+                break;
+        case GDS_WAIT_COND_AND:
+                *cu_flags = CU_STREAM_WAIT_VALUE_AND;
+                *cond_str = "CU_STREAM_WAIT_VALUE_AND";
+                break;
+        case GDS_WAIT_COND_NOR:
+#if GDS_HAS_WAIT_NOR
+                if (gpu_does_support_nor(NULL)) {
+                        *cu_flags = CU_STREAM_WAIT_VALUE_NOR;
+                        *cond_str = "CU_STREAM_WAIT_VALUE_NOR";
+                        break;
+                }
+#endif
+                gds_err("NOR wait is not supported by this GPU\n");
+                retcode = ENOTSUP;
+                break;
+        default: 
+                gds_err("invalid wait condition flag\n");
+                retcode = EINVAL;
+        }
+        return retcode;
+}
+
 static int gds_fill_poll(CUstreamBatchMemOpParams *param, CUdeviceptr ptr, uint32_t magic, int cond_flag, int flags)
 {
         int retcode = 0;
@@ -418,24 +672,9 @@ static int gds_fill_poll(CUstreamBatchMemOpParams *param, CUdeviceptr ptr, uint3
         param->operation = CU_STREAM_MEM_OP_WAIT_VALUE_32;
         param->waitValue.address = dev_ptr;
         param->waitValue.value = magic;
-        switch(cond_flag) {
-        case GDS_WAIT_COND_GEQ:
-                param->waitValue.flags = CU_STREAM_WAIT_VALUE_GEQ;
-                cond_str = "CU_STREAM_WAIT_VALUE_GEQ";
-                break;
-        case GDS_WAIT_COND_EQ:
-                param->waitValue.flags = CU_STREAM_WAIT_VALUE_EQ;
-                cond_str = "CU_STREAM_WAIT_VALUE_EQ";
-                break;
-        case GDS_WAIT_COND_AND:
-                param->waitValue.flags = CU_STREAM_WAIT_VALUE_AND;
-                cond_str = "CU_STREAM_WAIT_VALUE_AND";
-                break;
-        default: 
-                gds_err("invalid wait condition flag\n");
-                retcode = EINVAL;
+        retcode = gds_wait_cond_to_cu(cond_flag, &param->waitValue.flags, &cond_str);
+        if (retcode)
                 goto out;
-        }
         if (need_flush)
                 param->waitValue.flags |= CU_STREAM_WAIT_VALUE_FLUSH;
         gds_dbg("op=%d addr=%p value=%08x cond=%s flags=%08x\n",
@@ -468,14 +707,230 @@ out:
 
 //-----------------------------------------------------------------------------
 
-int gds_stream_batch_ops(CUstream stream, int nops, CUstreamBatchMemOpParams *params, int flags)
+static int gds_fill_poke64(CUstreamBatchMemOpParams *param, CUdeviceptr addr, uint64_t value, int flags)
+{
+        int retcode = 0;
+#if GDS_HAS_MEMOPS64
+        assert(addr);
+        assert((((unsigned long)addr) & 0x7) == 0);
+
+        bool need_barrier = (flags  & GDS_WRITE_PRE_BARRIER ) ? true : false;
+
+        param->operation = CU_STREAM_MEM_OP_WRITE_VALUE_64;
+        param->writeValue.address = addr;
+        param->writeValue.value64 = value;
+        param->writeValue.flags = CU_STREAM_WRITE_VALUE_NO_MEMORY_BARRIER;
+        if (need_barrier)
+                param->writeValue.flags = 0;
+        gds_dbg("op=%d addr=%p value=%016"PRIx64" flags=%08x\n",
+                param->operation,
+                (void*)param->writeValue.address,
+                (uint64_t)param->writeValue.value64,
+                param->writeValue.flags);
+#else
+        gds_err("error, 64-bits write is unsupported\n");
+        retcode = EINVAL;
+#endif
+        return retcode;
+}
+
+// value is read when the ops are submitted, when an inline copy is used
+int gds_fill_poke64(CUstreamBatchMemOpParams *params, int &idx, uint64_t *ptr, const uint64_t *value, int flags,
+                    const gds_gpu_caps_t &caps)
+{
+        int retcode = 0;
+        CUdeviceptr dev_ptr = 0;
+
+        gds_dbg("addr=%p value=%016"PRIx64" flags=%08x\n", ptr, *value, flags);
+
+        if (((unsigned long)ptr) & 0x7) {
+                gds_err("misaligned 64-bits word %p\n", ptr);
+                retcode = EINVAL;
+                goto out;
+        }
+        retcode = gds_map_mem(ptr, sizeof(*ptr), memtype_from_flags(flags), &dev_ptr);
+        if (retcode) {
+                gds_err("error %d while looking up %p\n", retcode, ptr);
+                goto out;
+        }
+
+        if (gds_enable_write64(caps)) {
+                retcode = gds_fill_poke64(params+idx, dev_ptr, *value, flags);
+                if (!retcode)
+                        ++idx;
+        }
+        else if (GDS_HAS_INLINE_COPY) {
+                // 8 bytes copied at once, even with inline copies disabled
+                // for WQEs, as two 32-bits writes could be seen torn
+                int cpy_flags = (flags & GDS_MEMORY_MASK);
+                // an inline copy has no pre-barrier, use a barrier on the previous op
+                if ((flags & GDS_WRITE_PRE_BARRIER) && !gds_enable_membar(gds_db_strategy_current(NULL))) {
+                        gds_err("pre-barrier needs membar support with inline copy\n");
+                        retcode = EINVAL;
+                        goto out;
+                }
+                if (flags & GDS_WRITE_PRE_BARRIER) {
+                        retcode = gds_fill_membar(params+idx, GDS_MEMBAR_SYS);
+                        if (retcode)
+                                goto out;
+                        ++idx;
+                }
+                retcode = gds_fill_inlcpy(params+idx, dev_ptr, (void*)value, sizeof(*value), cpy_flags);
+                if (!retcode)
+                        ++idx;
+        }
+        else {
+                gds_err("no exact 64-bits write, neither native nor inline copy is supported\n");
+                retcode = ENOTSUP;
+        }
+out:
+        return retcode;
+}
+
+//-----------------------------------------------------------------------------
+
+static int gds_fill_poll64(CUstreamBatchMemOpParams *param, CUdeviceptr ptr, uint64_t magic, int cond_flag, int flags)
+{
+        int retcode = 0;
+#if GDS_HAS_MEMOPS64
+        const char *cond_str = NULL;
+
+        assert(ptr);
+        assert((((unsigned long)ptr) & 0x7) == 0);
+
+        bool need_flush = (flags & GDS_WAIT_POST_FLUSH) ? true : false;
+
+        param->operation = CU_STREAM_MEM_OP_WAIT_VALUE_64;
+        param->waitValue.address = ptr;
+        param->waitValue.value64 = magic;
+        retcode = gds_wait_cond_to_cu(cond_flag, &param->waitValue.flags, &cond_str);
+        if (retcode)
+                goto out;
+        if (need_flush)
+                param->waitValue.flags |= CU_STREAM_WAIT_VALUE_FLUSH;
+        gds_dbg("op=%d addr=%p value=%016"PRIx64" cond=%s flags=%08x\n",
+                param->operation,
+                (void*)param->waitValue.address,
+                (uint64_t)param->waitValue.value64,
+                cond_str,
+                param->waitValue.flags);
+out:
+#else
+        gds_err("error, 64-bits wait is unsupported\n");
+        retcode = EINVAL;
+#endif
+        return retcode;
+}
+
+int gds_fill_poll64(CUstreamBatchMemOpParams *params, int &idx, uint64_t *ptr, uint64_t magic, int cond_flag, int flags,
+                    const gds_gpu_caps_t &caps)
 {
-        CUresult result = CUDA_SUCCESS;
         int retcode = 0;
+        CUdeviceptr dev_ptr = 0;
+        CUdeviceptr lo_ptr, hi_ptr;
+        uint32_t lo = gds_qword_lo(magic);
+        uint32_t hi = gds_qword_hi(magic);
+        // flush only after the last op of the sequence
+        int nf_flags = flags & ~GDS_WAIT_POST_FLUSH;
+
+        gds_dbg("addr=%p value=%016"PRIx64" cond=%08x flags=%08x\n", ptr, magic, cond_flag, flags);
+
+        if (((unsigned long)ptr) & 0x7) {
+                gds_err("misaligned 64-bits word %p\n", ptr);
+                retcode = EINVAL;
+                goto out;
+        }
+        retcode = gds_map_mem(ptr, sizeof(*ptr), memtype_from_flags(flags), &dev_ptr);
+        if (retcode) {
+                gds_err("could not lookup %p\n", ptr);
+                goto out;
+        }
+
+        if (GDS_HAS_MEMOPS64 && caps.memops64) {
+                retcode = gds_fill_poll64(params+idx, dev_ptr, magic, cond_flag, flags);
+                if (!retcode)
+                        ++idx;
+                goto out;
+        }
+
+        // little endian
+        lo_ptr = dev_ptr;
+        hi_ptr = dev_ptr + sizeof(uint32_t);
+        switch(cond_flag) {
+        case GDS_WAIT_COND_GEQ:
+                // GEQ is cyclic, i.e. (int32_t)(*ptr - value) >= 0
+                retcode = gds_fill_poll(params+idx, lo_ptr, lo, GDS_WAIT_COND_GEQ, flags);
+                if (!retcode)
+                        ++idx;
+                break;
+        case GDS_WAIT_COND_EQ:
+                // the high word is the same before and after the low one matched
+                retcode = gds_fill_poll(params+idx, hi_ptr, hi, GDS_WAIT_COND_EQ, nf_flags);
+                if (retcode)
+                        break;
+                ++idx;
+                retcode = gds_fill_poll(params+idx, lo_ptr, lo, GDS_WAIT_COND_EQ, nf_flags);
+                if (retcode)
+                        break;
+                ++idx;
+                retcode = gds_fill_poll(params+idx, hi_ptr, hi, GDS_WAIT_COND_EQ, flags);
+                if (!retcode)
+                        ++idx;
+                break;
+        case GDS_WAIT_COND_AND:
+                if (!hi) {
+                        retcode = gds_fill_poll(params+idx, lo_ptr, lo, GDS_WAIT_COND_AND, flags);
+                } else if (!lo) {
+                        retcode = gds_fill_poll(params+idx, hi_ptr, hi, GDS_WAIT_COND_AND, flags);
+                } else {
+                        gds_err("64-bits AND mask %016"PRIx64" spans both words\n", magic);
+                        retcode = ENOTSUP;
+                        break;
+                }
+                if (!retcode)
+                        ++idx;
+                break;
+        case GDS_WAIT_COND_NOR:
+                // an all ones half never satisfies NOR, only the other one matters
+                if (hi == 0xffffffffU) {
+                        retcode = gds_fill_poll(params+idx, lo_ptr, lo, GDS_WAIT_COND_NOR, flags);
+                } else if (lo == 0xffffffffU) {
+                        retcode = gds_fill_poll(params+idx, hi_ptr, hi, GDS_WAIT_COND_NOR, flags);
+                } else {
+                        gds_err("64-bits NOR value %016"PRIx64" spans both words\n", magic);
+                        retcode = ENOTSUP;
+                        break;
+                }
+                if (!retcode)
+                        ++idx;
+                break;
+        default:
+                gds_err("64-bits wait condition %d cannot be emulated\n", cond_flag);
+                retcode = ENOTSUP;
+                break;
+        }
+out:
+        return retcode;
+}
+
+//-----------------------------------------------------------------------------
+
+unsigned int gds_batch_ops_flags()
+{
         unsigned int cuflags = 0;
 #if GDS_HAS_WEAK_API
         cuflags |= gds_enable_weak_consistency() ? CU_STREAM_BATCH_MEM_OP_CONSISTENCY_WEAK : 0;
 #endif
+        return cuflags;
+}
+
+//-----------------------------------------------------------------------------
+
+int gds_stream_batch_ops(CUstream stream, int nops, CUstreamBatchMemOpParams *params, int flags)
+{
+        CUresult result = CUDA_SUCCESS;
+        int retcode = 0;
+        unsigned int cuflags = gds_batch_ops_flags();
         gds_dbg("nops=%d flags=%08x\n", nops, cuflags);
 
         if (nops > 256) {
@@ -483,7 +938,16 @@ int gds_stream_batch_ops(CUstream stream, int nops, CUstreamBatchMemOpParams *pa
                 //return EINVAL;
         }
 
+        if (gds_trace_enabled()) {
+                gds_trace_record(GDS_TRACE_EV_SUBMIT_BEGIN, 0, (uintptr_t)stream, nops);
+                gds_trace_record_memops(nops, params);
+        }
+
         result = cuStreamBatchMemOp(stream, nops, params, cuflags);
+
+        if (gds_trace_enabled())
+                gds_trace_record(GDS_TRACE_EV_SUBMIT_END, 0, gds_curesult_to_errno(result), 0);
+
 	if (CUDA_SUCCESS != result) {
                 const char *err_str = NULL;
                 cuGetErrorString(result, &err_str);
@@ -536,24 +1000,54 @@ out:
   INLCPY 128B
 */
 
+// peer owning the memory targeted by the ops, NULL if none does
+static gds_peer *gds_ops_peer(size_t n_ops, struct peer_op_wr *op)
+{
+        for (size_t n = 0; op && n < n_ops; op = op->next, ++n) {
+                switch(op->type) {
+                case IBV_EXP_PEER_OP_STORE_DWORD:
+                case IBV_EXP_PEER_OP_POLL_AND_DWORD:
+                case IBV_EXP_PEER_OP_POLL_GEQ_DWORD:
+                case IBV_EXP_PEER_OP_POLL_NOR_DWORD:
+                        return range_from_id(op->wr.dword_va.target_id)->peer;
+                case IBV_EXP_PEER_OP_STORE_QWORD:
+                        return range_from_id(op->wr.qword_va.target_id)->peer;
+                case IBV_EXP_PEER_OP_COPY_BLOCK:
+                        return range_from_id(op->wr.copy_op.target_id)->peer;
+                default:
+                        break;
+                }
+        }
+        return NULL;
+}
+
 int gds_post_ops(size_t n_ops, struct peer_op_wr *op, CUstreamBatchMemOpParams *params, int &idx, int post_flags)
 {
         int retcode = 0;
         size_t n = 0;
         bool prev_was_fence = false;
         bool use_inlcpy_for_dword = false;
+        gds_peer *peer = gds_ops_peer(n_ops, op);
+        // caps cached at peer registration, only ops not made by a peer,
+        // e.g. those of the autotuner, fall back to the current context
+        const gds_gpu_caps_t caps = peer ? peer->caps : gds_current_gpu_caps();
+        const int strategy = gds_db_strategy_current(peer);
+        const bool write64 = gds_enable_write64(caps);
+        const bool inlcpy = gds_enable_inlcpy(strategy);
+        const bool sim64 = gds_simulate_write64(strategy);
+        const bool membar = gds_enable_membar(strategy);
 
         gds_dbg("n_ops=%zu idx=%d\n", n_ops, idx);
 
         // divert the request to the same engine handling 64bits
         // to avoid out-of-order execution
         // caveat: can't use membar if inlcpy is used for 4B writes (to simulate 8B writes)
-        if (gds_enable_inlcpy()) {
-                if (!gds_enable_membar())
+        if (inlcpy) {
+                if (!membar)
                         use_inlcpy_for_dword = true; // F
         }
-        if (gds_simulate_write64()) {
-                if (!gds_enable_membar()) {
+        if (sim64) {
+                if (!membar) {
                         gds_warn_once("enabling use_inlcpy_for_dword\n");
                         use_inlcpy_for_dword = true; // D
                 }
@@ -575,7 +1069,7 @@ int gds_post_ops(size_t n_ops, struct peer_op_wr *op, CUstreamBatchMemOpParams *
                                 break;
                         }
                         else {
-                                if (!gds_enable_membar()) {
+                                if (!membar) {
                                         if (use_inlcpy_for_dword) {
                                                 assert(idx-1 >= 0);
                                                 gds_dbg("patching previous param\n");
@@ -621,7 +1115,7 @@ int gds_post_ops(size_t n_ops, struct peer_op_wr *op, CUstreamBatchMemOpParams *
                         gds_dbg("OP_STORE_DWORD dev_ptr=%llx data=%"PRIx32"\n", dev_ptr, data);
                         if (use_inlcpy_for_dword) { // F || D
                                 // membar may be out of order WRT inlcpy
-                                if (gds_enable_membar()) {
+                                if (membar) {
                                         gds_err("invalid feature combination, inlcpy + membar\n");
                                         retcode = EINVAL;
                                         break;
@@ -635,7 +1129,7 @@ int gds_post_ops(size_t n_ops, struct peer_op_wr *op, CUstreamBatchMemOpParams *
                                 // can't guarantee ordering of write32+inlcpy unless
                                 // a membar is there
                                 // TODO: fix driver when !weak
-                                if (gds_enable_inlcpy() && !gds_enable_membar()) {
+                                if (inlcpy && !membar) {
                                         gds_err("invalid feature combination, inlcpy needs membar\n");
                                         retcode = EINVAL;
                                         break;
@@ -656,17 +1150,27 @@ int gds_post_ops(size_t n_ops, struct peer_op_wr *op, CUstreamBatchMemOpParams *
                         uint64_t data = op->wr.qword_va.data;
                         int flags = 0;
                         gds_dbg("OP_STORE_QWORD dev_ptr=%llx data=%"PRIx64"\n", dev_ptr, data);
-                        // C || D
-                        if (gds_enable_write64()) {
-                                gds_err("write64 is not supported\n");
-                                retcode = EINVAL;
+                        // single native op, ordered like the 32-bits ones,
+                        // unless sim64 is asked for, so that the plain and
+                        // sim64 strategies differ on GPUs with native ops
+                        if (write64 && !sim64) {
+                                if (prev_was_fence) {
+                                        gds_dbg("enabling PRE_BARRIER\n");
+                                        flags |= GDS_WRITE_PRE_BARRIER;
+                                        prev_was_fence = false;
+                                }
+                                retcode = gds_fill_poke64(params+idx, dev_ptr, data, flags);
+                                if (!retcode)
+                                        ++idx;
                                 break;
                         }
 
+                        // C || D
+
                         // simulate 64-bit poke by inline copy
 
-                        if (gds_simulate_write64()){
-                                if (!gds_enable_membar()) {
+                        if (sim64){
+                                if (!membar) {
                                         gds_err("invalid feature combination, inlcpy needs membar\n");
                                         retcode = EINVAL;
                                         break;
@@ -675,9 +1179,15 @@ int gds_post_ops(size_t n_ops, struct peer_op_wr *op, CUstreamBatchMemOpParams *
                                 // tail flush is never useful here
                                 //flags |= GDS_IMMCOPY_POST_TAIL_FLUSH;
                                 retcode = gds_fill_inlcpy(params+idx, dev_ptr, &data, sizeof(data), flags);
-                                ++idx;
+                                if (!retcode)
+                                        ++idx;
                         }
                         else {
+                                // QWORD stores only target the UAR doorbell,
+                                // which the HCA assembles out of two ordered
+                                // 32-bits writes, as libmlx5 rings it on
+                                // 32-bits hosts. Memory words go through
+                                // gds_fill_poke64, which never splits them.
                                 uint32_t datalo = gds_qword_lo(op->wr.qword_va.data);
                                 uint32_t datahi = gds_qword_hi(op->wr.qword_va.data);
 
@@ -687,6 +1197,8 @@ int gds_post_ops(size_t n_ops, struct peer_op_wr *op, CUstreamBatchMemOpParams *
                                         prev_was_fence = false;
                                 }
                                 retcode = gds_fill_poke(params+idx, dev_ptr, datalo, flags);
+                                if (retcode)
+                                        break;
                                 ++idx;
 
                                 // get rid of the barrier, if there
@@ -695,7 +1207,8 @@ int gds_post_ops(size_t n_ops, struct peer_op_wr *op, CUstreamBatchMemOpParams *
                                 // advance to next DWORD
                                 dev_ptr += sizeof(uint32_t);
                                 retcode = gds_fill_poke(params+idx, dev_ptr, datahi, flags);
-                                ++idx;
+                                if (!retcode)
+                                        ++idx;
                         }
 
                         break;
@@ -708,13 +1221,17 @@ int gds_post_ops(size_t n_ops, struct peer_op_wr *op, CUstreamBatchMemOpParams *
                         int flags = 0;
                         gds_dbg("OP_COPY_BLOCK dev_ptr=%llx src=%p len=%zu\n", dev_ptr, src, len);
                         // catching any other size here
-                        if (!gds_enable_inlcpy()) {
+                        if (!inlcpy) {
                                 gds_err("inline copy is not supported\n");
                                 retcode = EINVAL;
                                 break;
                         }
-                        // IB Verbs bug
-                        assert(len <= GDS_GPU_MAX_INLINE_SIZE);
+                        // the doorbell is the leading 8 bytes of the WQE, ringing
+                        // it by inline copy keeps it ordered with the previous ones
+                        if (len > gds_inline_wqe_max_size()) {
+                                gds_dbg("WQE of %zu bytes, ringing doorbell only\n", len);
+                                len = sizeof(uint64_t);
+                        }
                         //if (desc->need_flush) {
                         //        flags |= GDS_IMMCOPY_POST_TAIL_FLUSH;
                         //}
@@ -738,11 +1255,10 @@ int gds_post_ops(size_t n_ops, struct peer_op_wr *op, CUstreamBatchMemOpParams *
 
                         switch(op->type) {
                         case IBV_EXP_PEER_OP_POLL_NOR_DWORD:
-                                //poll_cond = GDS_WAIT_COND_NOR;
-                                // TODO: lookup and pass peer down
-                                assert(gpu_does_support_nor(NULL));
-                                retcode = EINVAL;
-                                goto out;
+                                // only advertised when supported, see
+                                // gds_init_peer_attr, still the current
+                                // GPU may differ from the one of the CQ
+                                poll_cond = GDS_WAIT_COND_NOR;
                                 break;
                         case IBV_EXP_PEER_OP_POLL_GEQ_DWORD:
                                 poll_cond = GDS_WAIT_COND_GEQ;
@@ -823,7 +1339,26 @@ out:
 
 //-----------------------------------------------------------------------------
 
-static int gds_post_ops_on_cpu(size_t n_descs, struct peer_op_wr *op)
+// send queue bounds of the QP, used to handle BlueFlame copies of WQEs
+// which wrap around the end of the SQ, left NULL when they are unknown
+static void gds_qp_init_sq_bounds(struct gds_qp *gqp)
+{
+        gqp->sq_begin = gqp->sq_end = NULL;
+#if HAVE_DECL_IBV_MLX5_EXP_GET_QP_INFO
+        struct ibv_mlx5_qp_info info;
+        if (ibv_mlx5_exp_get_qp_info(gqp->qp, &info)) {
+                gds_dbg("cannot query SQ of QP %p, no wrap-around check\n", gqp->qp);
+                return;
+        }
+        gqp->sq_begin = (const uint64_t *)info.sq.buf;
+        gqp->sq_end = (const uint64_t *)((uintptr_t)info.sq.buf + (uintptr_t)info.sq.wqe_cnt * info.sq.stride);
+        gds_dbg("QP %p SQ=[%p,%p)\n", gqp->qp, gqp->sq_begin, gqp->sq_end);
+#endif
+}
+
+//-----------------------------------------------------------------------------
+
+static int gds_post_ops_on_cpu(size_t n_descs, struct peer_op_wr *op, const uint64_t *sq_begin, const uint64_t *sq_end)
 {
         int retcode = 0;
         size_t n = 0;
@@ -884,7 +1419,7 @@ static int gds_post_ops_on_cpu(size_t n_descs, struct peer_op_wr *op)
                         uint64_t *ptr = (uint64_t*)((ptrdiff_t)range_from_id(op->wr.copy_op.target_id)->va + op->wr.copy_op.offset);
                         uint64_t *src = (uint64_t*)op->wr.copy_op.src;
                         size_t n_bytes = op->wr.copy_op.len;
-                        gds_bf_copy(ptr, src, n_bytes);
+                        gds_bf_copy_wq(gds_bf_copy_impl(), ptr, src, n_bytes, sq_begin, sq_end);
                         gds_dbg("%p <- %p len=%zu\n", ptr, src, n_bytes);
                         break;
                 }
@@ -914,19 +1449,145 @@ out:
 
 //-----------------------------------------------------------------------------
 
+// doorbell of a send request, in the DBREC store, fence, doorbell form
+// that the mlx5 provider generates
+struct gds_cpu_doorbell {
+        uint32_t *dbrec;
+        uint32_t dbrec_value;
+        uint64_t *db;
+        uint64_t db_value;
+        const uint64_t *src;
+        size_t len;
+        const uint64_t *sq_begin;
+        const uint64_t *sq_end;
+};
+
+static bool gds_parse_doorbell(gds_send_request_t *info, struct gds_cpu_doorbell *db)
+{
+        struct peer_op_wr *op = info->commit.storage;
+        size_t n = 0;
+
+        memset(db, 0, sizeof(*db));
+        for (; op && n < info->commit.entries; op = op->next, ++n) {
+                switch(op->type) {
+                case IBV_EXP_PEER_OP_STORE_DWORD:
+                        if (n != 0)
+                                return false;
+                        db->dbrec = (uint32_t*)((ptrdiff_t)range_from_id(op->wr.dword_va.target_id)->va + op->wr.dword_va.offset);
+                        db->dbrec_value = op->wr.dword_va.data;
+                        break;
+                case IBV_EXP_PEER_OP_FENCE:
+                        if (n != 1 || (op->wr.fence.fence_flags & IBV_EXP_PEER_FENCE_FROM_CPU))
+                                return false;
+                        break;
+                case IBV_EXP_PEER_OP_STORE_QWORD:
+                        if (n != 2)
+                                return false;
+                        db->db = (uint64_t*)((ptrdiff_t)range_from_id(op->wr.qword_va.target_id)->va + op->wr.qword_va.offset);
+                        db->db_value = op->wr.qword_va.data;
+                        break;
+                case IBV_EXP_PEER_OP_COPY_BLOCK:
+                        if (n != 2 || op->wr.copy_op.len % 64)
+                                return false;
+                        db->db = (uint64_t*)((ptrdiff_t)range_from_id(op->wr.copy_op.target_id)->va + op->wr.copy_op.offset);
+                        db->src = (const uint64_t*)op->wr.copy_op.src;
+                        db->len = op->wr.copy_op.len;
+                        db->db_value = *db->src;
+                        db->sq_begin = info->sq_begin;
+                        db->sq_end = info->sq_end;
+                        break;
+                default:
+                        return false;
+                }
+        }
+        return n == 3 && db->dbrec && db->db;
+}
+
+// max number of requests whose doorbells are rung together
+#define GDS_DB_BATCH_MAX 64
+
+// Rings the doorbells of count requests, at most GDS_DB_BATCH_MAX, with
+// two store fences in total: all DBRECs first, then all doorbells, then a
+// single flush of the write-combining buffers. Requests on the same QP,
+// i.e. sharing the DBREC, are coalesced into one doorbell for the last
+// WQE, which is rung with an 8 bytes write as libmlx5 does when posting
+// more than one WQE. Nothing is rung unless all the requests parse.
+static int gds_post_doorbells_on_cpu(int count, gds_send_request_t *info)
+{
+        struct gds_cpu_doorbell dbs[GDS_DB_BATCH_MAX];
+        int n_wqes[GDS_DB_BATCH_MAX];
+        int n_dbs = 0;
+        // open addressing DBREC -> dbs index
+        const size_t n_slots = 2 * GDS_DB_BATCH_MAX;
+        int slots[n_slots];
+
+        assert(count > 0 && count <= GDS_DB_BATCH_MAX);
+        for (size_t h = 0; h < n_slots; ++h)
+                slots[h] = -1;
+
+        for (int j = 0; j < count; ++j) {
+                struct gds_cpu_doorbell db;
+                if (!gds_parse_doorbell(info + j, &db))
+                        return EINVAL;
+                size_t h = ((uintptr_t)db.dbrec >> 6) & (n_slots - 1);
+                while (slots[h] >= 0 && dbs[slots[h]].dbrec != db.dbrec)
+                        h = (h + 1) & (n_slots - 1);
+                if (slots[h] >= 0) {
+                        // DBREC values grow with each post, keep the latest
+                        dbs[slots[h]] = db;
+                        ++n_wqes[slots[h]];
+                } else {
+                        slots[h] = n_dbs;
+                        dbs[n_dbs] = db;
+                        n_wqes[n_dbs] = 1;
+                        ++n_dbs;
+                }
+        }
+
+        for (int k = 0; k < n_dbs; ++k) {
+                ACCESS_ONCE(*dbs[k].dbrec) = dbs[k].dbrec_value;
+                gds_dbg("dbrec %p <- %08x\n", dbs[k].dbrec, dbs[k].dbrec_value);
+        }
+        wmb();
+        for (int k = 0; k < n_dbs; ++k) {
+                if (dbs[k].src && n_wqes[k] == 1) {
+                        gds_bf_copy_wq(gds_bf_copy_impl(), dbs[k].db, dbs[k].src, dbs[k].len, dbs[k].sq_begin, dbs[k].sq_end);
+                } else {
+                        ACCESS_ONCE(*dbs[k].db) = dbs[k].db_value;
+                }
+                gds_dbg("db %p <- %016"PRIx64" n_wqes=%d\n", dbs[k].db, dbs[k].db_value, n_wqes[k]);
+        }
+        wmb();
+        return 0;
+}
+
 int gds_post_pokes_on_cpu(int count, gds_send_request_t *info, uint32_t *dw, uint32_t val)
 {
         int retcode = 0;
-        int idx = 0;
+        bool batching = gds_enable_db_batching();
 
-        assert(info);
+        if (count < 1 || !info) {
+                gds_err("invalid arguments count=%d info=%p\n", count, info);
+                retcode = EINVAL;
+                goto out;
+        }
 
-	for (int j=0; j<count; j++) {
-                gds_dbg("peer_commit:%d idx=%d\n", j, idx);
-                retcode = gds_post_ops_on_cpu(info[j].commit.entries, info[j].commit.storage);
-                if (retcode) {
-                        goto out;
+        // requests are rung in chunks, so that a chunk which cannot be
+        // batched falls back to posting its ops one by one, in order
+        for (int j = 0; j < count; j += GDS_DB_BATCH_MAX) {
+                int n = std::min(count - j, GDS_DB_BATCH_MAX);
+                if (batching && !gds_post_doorbells_on_cpu(n, info + j))
+                        continue;
+                for (int i = j; i < j + n; i++) {
+                        gds_dbg("peer_commit:%d\n", i);
+                        retcode = gds_post_ops_on_cpu(info[i].commit.entries, info[i].commit.storage,
+                                                      info[i].sq_begin, info[i].sq_end);
+                        if (retcode) {
+                                goto out;
+                        }
                 }
+                // push BlueFlame copies out of the write-combining buffers
+                wmb();
         }
 
         if (dw) {
@@ -1105,7 +1766,7 @@ void gds_dump_wait_request(gds_wait_request_t *request, size_t count)
 
 //-----------------------------------------------------------------------------
 
-int gds_stream_post_wait_cq_multi(CUstream stream, int count, gds_wait_request_t *request, uint32_t *dw, uint32_t val)
+int gds_stream_post_wait_cq_multi(CUstream stream, int count, gds_wait_request_t *request, uint32_t *dw, uint32_t val, int dw_flags)
 {
         int retcode = 0;
         int n_mem_ops = 0;
@@ -1132,8 +1793,7 @@ int gds_stream_post_wait_cq_multi(CUstream stream, int count, gds_wait_request_t
 	assert(idx <= n_mem_ops);
 
         if (dw) {
-                // assume host mem
-                retcode = gds_fill_poke(params + idx, dw, val, GDS_MEMORY_HOST);
+                retcode = gds_fill_poke(params + idx, dw, val, dw_flags);
                 if (retcode) {
                         gds_err("error %d at tracking entry\n", retcode);
                         goto out;
@@ -1219,7 +1879,15 @@ static void gds_init_peer(gds_peer *peer, int gpu_id)
         assert(peer);
 
         peer->gpu_id = gpu_id;
-        peer->gpu_dev = 0;
+        memset(&peer->caps, 0, sizeof(peer->caps));
+        if (CUDA_SUCCESS != cuDeviceGet(&peer->gpu_dev, gpu_id)) {
+                gds_warn("cannot get CUDA device %d\n", gpu_id);
+                peer->gpu_dev = -1;
+        } else {
+                peer->caps = gds_gpu_caps(peer->gpu_dev);
+        }
+        // tuned or restored from the caps cache before the peer is set up
+        peer->db_strategy = gds_enable_autotune() ? gds_db_strategy_get(peer->gpu_dev) : -1;
         peer->gpu_ctx = 0;
 }
 
@@ -1229,6 +1897,8 @@ static void gds_init_peer_attr(gds_peer_attr *attr, gds_peer *peer)
 
         peer->alloc_type = gds_peer::NONE;
         peer->alloc_flags = 0;
+        peer->alloc_done = 0;
+        peer->alloc_numa_node = -1;
 
         attr->peer_id = peer_to_id(peer);
         attr->buf_alloc = gds_buf_alloc;
@@ -1246,10 +1916,10 @@ static void gds_init_peer_attr(gds_peer_attr *attr, gds_peer *peer)
         else
                 attr->caps |= IBV_EXP_PEER_OP_POLL_GEQ_DWORD_CAP;
 
-        if (gds_enable_inlcpy()) {
+        if (gds_enable_inlcpy(peer->db_strategy)) {
                 attr->caps |= IBV_EXP_PEER_OP_COPY_BLOCK_CAP;
         }
-        else if (gds_enable_write64() || gds_simulate_write64()) {
+        else if (gds_enable_write64(peer->caps) || gds_simulate_write64(peer->db_strategy)) {
                 attr->caps |= IBV_EXP_PEER_OP_STORE_QWORD_CAP;
         }
         gds_dbg("caps=%016lx\n", attr->caps);
@@ -1283,9 +1953,16 @@ int gds_register_peer_ex(struct ibv_context *context, unsigned gpu_id, gds_peer
         if (gpu_registered[gpu_id]) {
                 gds_dbg("gds_peer for GPU %d already initialized\n", gpu_id);
         } else {
+                bool cached = gds_caps_cache_restore(context, gpu_id);
+                // the peer caps depend on the doorbell strategy
+                // no-op if restored from the cache
+                if (gds_enable_autotune())
+                        gds_autotune_db_strategy(gpu_id);
                 gds_init_peer(peer, gpu_id);
                 gds_init_peer_attr(peer_attr, peer);
                 gpu_registered[gpu_id] = true;
+                if (!cached)
+                        gds_caps_cache_save(context, gpu_id);
         }
 
         if (p_peer)
@@ -1299,15 +1976,16 @@ int gds_register_peer_ex(struct ibv_context *context, unsigned gpu_id, gds_peer
 
 //-----------------------------------------------------------------------------
 
-struct ibv_cq *
-gds_create_cq(struct ibv_context *context, int cqe,
-              void *cq_context, struct ibv_comp_channel *channel,
-              int comp_vector, int gpu_id, gds_alloc_cq_flags_t flags)
+static struct ibv_cq *
+gds_create_cq_on_node(struct ibv_context *context, int cqe,
+                      void *cq_context, struct ibv_comp_channel *channel,
+                      int comp_vector, int gpu_id, gds_alloc_cq_flags_t flags,
+                      int numa_node)
 {
         int ret = 0;
         struct ibv_cq *cq = NULL;
 
-        gds_dbg("cqe=%d gpu_id=%d cq_flags=%08x\n", cqe, gpu_id, flags);
+        gds_dbg("cqe=%d gpu_id=%d cq_flags=%08x numa_node=%d\n", cqe, gpu_id, flags, numa_node);
 
         // TODO: add support for res_domain
 
@@ -1323,6 +2001,7 @@ gds_create_cq(struct ibv_context *context, int cqe,
 
         peer->alloc_type = gds_peer::CQ;
         peer->alloc_flags = flags;
+        peer->alloc_numa_node = numa_node;
 
         ibv_exp_cq_init_attr attr;
         attr.comp_mask = IBV_EXP_CQ_INIT_ATTR_PEER_DIRECT;
@@ -1331,7 +2010,12 @@ gds_create_cq(struct ibv_context *context, int cqe,
         attr.peer_direct_attrs = peer_attr;
 
         int old_errno = errno;
-        cq = ibv_exp_create_cq(context, cqe, cq_context, channel, comp_vector, &attr);
+        {
+                // host side CQ buffers come from gds_peer::alloc_host, the
+                // scope covers whatever the provider still allocates itself
+                gds_numa_scope numa_scope(numa_node);
+                cq = ibv_exp_create_cq(context, cqe, cq_context, channel, comp_vector, &attr);
+        }
         if (!cq) {
                 gds_err("error %d in ibv_exp_create_cq, old errno %d\n", errno, old_errno);
         }
@@ -1339,9 +2023,191 @@ gds_create_cq(struct ibv_context *context, int cqe,
         return cq;
 }
 
+struct ibv_cq *
+gds_create_cq(struct ibv_context *context, int cqe,
+              void *cq_context, struct ibv_comp_channel *channel,
+              int comp_vector, int gpu_id, gds_alloc_cq_flags_t flags)
+{
+        return gds_create_cq_on_node(context, cqe, cq_context, channel, comp_vector, gpu_id, flags,
+                                     gds_hca_numa_node(context));
+}
+
 //-----------------------------------------------------------------------------
 
 struct gds_qp *gds_create_qp(struct ibv_pd *pd, struct ibv_context *context, gds_qp_init_attr_t *qp_attr, int gpu_id, int flags)
+{
+        return gds_create_qp_ex(pd, context, qp_attr, gpu_id, flags, NULL);
+}
+
+//-----------------------------------------------------------------------------
+
+// the public gds_cq must come first, see gds_cq::shared
+struct gds_shared_cq {
+        struct gds_cq gcq;
+        pthread_mutex_t lock;
+        std::map<uint32_t, struct gds_qp *> qps;
+};
+
+static inline gds_shared_cq *to_shared_cq(struct gds_cq *cq)
+{
+        return reinterpret_cast<gds_shared_cq *>(cq);
+}
+
+static inline bool gds_is_shared_cq(struct gds_cq *cq)
+{
+        return cq && cq->shared == cq;
+}
+
+struct gds_cq *gds_create_shared_cq(struct ibv_context *context, int cqe, int gpu_id, int flags)
+{
+        gds_shared_cq *scq = NULL;
+        struct ibv_cq *cq = NULL;
+
+        gds_dbg("context=%p cqe=%d gpu_id=%d flags=%08x\n", context, cqe, gpu_id, flags);
+        assert(context);
+
+        if (flags & ~GDS_CREATE_CQ_ON_GPU) {
+                gds_err("invalid flags %08x\n", flags);
+                return NULL;
+        }
+        // the CQ cursor is cache line aligned
+        if (posix_memalign((void **)&scq, GDS_CACHELINE_SIZE, sizeof(*scq))) {
+                gds_err("cannot allocate memory\n");
+                return NULL;
+        }
+        cq = gds_create_cq(context, cqe, NULL, NULL, 0, gpu_id,
+                           (flags & GDS_CREATE_CQ_ON_GPU) ? GDS_ALLOC_CQ_ON_GPU : GDS_ALLOC_CQ_DEFAULT);
+        if (!cq) {
+                gds_err("error %d while creating shared CQ\n", errno);
+                free(scq);
+                return NULL;
+        }
+        new (scq) gds_shared_cq;
+        memset(&scq->gcq, 0, sizeof(scq->gcq));
+        scq->gcq.cq = cq;
+        scq->gcq.shared = &scq->gcq;
+        scq->gcq.curr_offset = 0;
+        pthread_mutex_init(&scq->lock, NULL);
+
+        gds_dbg("created shared gds_cq=%p\n", &scq->gcq);
+        return &scq->gcq;
+}
+
+int gds_destroy_shared_cq(struct gds_cq *cq)
+{
+        int retcode = 0;
+        gds_shared_cq *scq;
+
+        if (!gds_is_shared_cq(cq)) {
+                gds_err("%p is not a shared CQ\n", cq);
+                return EINVAL;
+        }
+        scq = to_shared_cq(cq);
+        pthread_mutex_lock(&scq->lock);
+        size_t n_qps = scq->qps.size();
+        pthread_mutex_unlock(&scq->lock);
+        if (n_qps) {
+                gds_err("shared CQ still used by %zu QPs\n", n_qps);
+                return EBUSY;
+        }
+        retcode = ibv_destroy_cq(cq->cq);
+        if (retcode) {
+                gds_err("error %d in destroy_cq\n", retcode);
+                return retcode;
+        }
+        pthread_mutex_destroy(&scq->lock);
+        scq->~gds_shared_cq();
+        free(scq);
+        return retcode;
+}
+
+struct gds_qp *gds_shared_cq_qp(struct gds_cq *cq, uint32_t qp_num)
+{
+        struct gds_qp *qp = NULL;
+        gds_shared_cq *scq;
+
+        if (!gds_is_shared_cq(cq))
+                return NULL;
+        scq = to_shared_cq(cq);
+        pthread_mutex_lock(&scq->lock);
+        std::map<uint32_t, struct gds_qp *>::iterator it = scq->qps.find(qp_num);
+        if (it != scq->qps.end())
+                qp = it->second;
+        pthread_mutex_unlock(&scq->lock);
+        return qp;
+}
+
+// no peer-direct flavour of SRQs in verbs, which is fine as only the CPU
+// posts receives
+struct gds_srq *gds_create_srq(struct ibv_pd *pd, struct ibv_context *context, uint32_t max_wr, uint32_t max_sge)
+{
+        struct gds_srq *gsrq = NULL;
+        struct ibv_srq_init_attr attr;
+
+        gds_dbg("pd=%p context=%p max_wr=%u max_sge=%u\n", pd, context, max_wr, max_sge);
+        assert(pd);
+        assert(context);
+
+        gsrq = (struct gds_srq *)calloc(1, sizeof(*gsrq));
+        if (!gsrq) {
+                gds_err("cannot allocate memory\n");
+                return NULL;
+        }
+        memset(&attr, 0, sizeof(attr));
+        attr.attr.max_wr = max_wr;
+        attr.attr.max_sge = max_sge;
+        {
+                gds_numa_scope numa_scope(gds_hca_numa_node(context));
+                gsrq->srq = ibv_create_srq(pd, &attr);
+        }
+        if (!gsrq->srq) {
+                gds_err("error %d in ibv_create_srq\n", errno);
+                free(gsrq);
+                return NULL;
+        }
+        // the provider may round it up
+        gsrq->max_wr = attr.attr.max_wr;
+        gds_dbg("created gds_srq=%p max_wr=%u\n", gsrq, gsrq->max_wr);
+        return gsrq;
+}
+
+int gds_destroy_srq(struct gds_srq *srq)
+{
+        int retcode = 0;
+        assert(srq);
+        assert(srq->srq);
+        // fails with EBUSY while QPs are still attached
+        retcode = ibv_destroy_srq(srq->srq);
+        if (retcode) {
+                gds_err("error %d in destroy_srq\n", retcode);
+                return retcode;
+        }
+        free(srq);
+        return retcode;
+}
+
+//-----------------------------------------------------------------------------
+
+static void gds_shared_cq_attach(struct gds_cq *cq, struct gds_qp *qp)
+{
+        gds_shared_cq *scq = to_shared_cq(cq);
+        pthread_mutex_lock(&scq->lock);
+        scq->qps[qp->qp->qp_num] = qp;
+        pthread_mutex_unlock(&scq->lock);
+}
+
+static void gds_shared_cq_detach(struct gds_cq *cq, struct gds_qp *qp)
+{
+        gds_shared_cq *scq = to_shared_cq(cq);
+        pthread_mutex_lock(&scq->lock);
+        scq->qps.erase(qp->qp->qp_num);
+        pthread_mutex_unlock(&scq->lock);
+}
+
+//-----------------------------------------------------------------------------
+
+struct gds_qp *gds_create_qp_ex(struct ibv_pd *pd, struct ibv_context *context, gds_qp_init_attr_t *qp_attr, int gpu_id, int flags,
+                                gds_create_qp_attr_t *attr)
 {
         int ret = 0;
         struct gds_qp *gqp = NULL;
@@ -1350,6 +2216,9 @@ struct gds_qp *gds_create_qp(struct ibv_pd *pd, struct ibv_context *context, gds
         gds_peer *peer = NULL;
         gds_peer_attr *peer_attr = NULL;
         int old_errno = errno;
+        int numa_node;
+        struct gds_cq *shared_tx_cq = NULL, *shared_rx_cq = NULL;
+        int rx_cqe;
 
         gds_dbg("pd=%p context=%p gpu_id=%d flags=%08x errno=%d\n", pd, context, gpu_id, flags, errno);
         assert(pd);
@@ -1360,27 +2229,73 @@ struct gds_qp *gds_create_qp(struct ibv_pd *pd, struct ibv_context *context, gds
                 gds_err("invalid flags");
                 return NULL;
         }
+        if (attr && (attr->comp_mask & ~(GDS_CREATE_QP_ATTR_NUMA_NODE|GDS_CREATE_QP_ATTR_SEND_CQ|GDS_CREATE_QP_ATTR_RECV_CQ|GDS_CREATE_QP_ATTR_SRQ))) {
+                gds_err("invalid attr comp_mask %08x\n", attr->comp_mask);
+                return NULL;
+        }
+        if (attr && (attr->comp_mask & GDS_CREATE_QP_ATTR_SEND_CQ)) {
+                shared_tx_cq = attr->send_cq;
+                if (!gds_is_shared_cq(shared_tx_cq)) {
+                        gds_err("send_cq %p is not a shared CQ\n", shared_tx_cq);
+                        return NULL;
+                }
+        }
+        if (attr && (attr->comp_mask & GDS_CREATE_QP_ATTR_RECV_CQ)) {
+                shared_rx_cq = attr->recv_cq;
+                if (!gds_is_shared_cq(shared_rx_cq)) {
+                        gds_err("recv_cq %p is not a shared CQ\n", shared_rx_cq);
+                        return NULL;
+                }
+        }
+        rx_cqe = qp_attr->cap.max_recv_wr;
+        if (attr && (attr->comp_mask & GDS_CREATE_QP_ATTR_SRQ)) {
+                if (!attr->srq || !attr->srq->srq) {
+                        gds_err("invalid srq\n");
+                        return NULL;
+                }
+                qp_attr->srq = attr->srq->srq;
+                qp_attr->cap.max_recv_wr = 0;
+                qp_attr->cap.max_recv_sge = 0;
+                rx_cqe = attr->srq->max_wr;
+        }
+
+        // host memory of CQs, WQ and DBREC goes next to the HCA by default
+        if (attr && (attr->comp_mask & GDS_CREATE_QP_ATTR_NUMA_NODE))
+                numa_node = attr->numa_node;
+        else
+                numa_node = gds_hca_numa_node(context);
 
-        gqp = (struct gds_qp*)calloc(1, sizeof(struct gds_qp));
-        if (!gqp) {
+        // the CQ cursors are cache line aligned
+        if (posix_memalign((void **)&gqp, GDS_CACHELINE_SIZE, sizeof(struct gds_qp))) {
                 gds_err("cannot allocate memory\n");
                 return NULL;
         }
+        memset(gqp, 0, sizeof(*gqp));
 
-        gds_dbg("creating TX CQ\n");
-        tx_cq = gds_create_cq(context, qp_attr->cap.max_send_wr, NULL, NULL, 0, gpu_id, 
-                              (flags & GDS_CREATE_QP_TX_CQ_ON_GPU) ? 
-                              GDS_ALLOC_CQ_ON_GPU : GDS_ALLOC_CQ_DEFAULT);
+        if (shared_tx_cq) {
+                gds_dbg("using shared TX CQ %p\n", shared_tx_cq);
+                tx_cq = shared_tx_cq->cq;
+        } else {
+                gds_dbg("creating TX CQ\n");
+                tx_cq = gds_create_cq_on_node(context, qp_attr->cap.max_send_wr, NULL, NULL, 0, gpu_id,
+                                              (flags & GDS_CREATE_QP_TX_CQ_ON_GPU) ?
+                                              GDS_ALLOC_CQ_ON_GPU : GDS_ALLOC_CQ_DEFAULT, numa_node);
+        }
 	if (!tx_cq) {
                 ret = errno;
 		gds_err("error %d while creating TX CQ, old_errno=%d\n", ret, old_errno);
 		goto err;
 	}
 
-        gds_dbg("creating RX CQ\n");
-        rx_cq = gds_create_cq(context, qp_attr->cap.max_recv_wr, NULL, NULL, 0, gpu_id, 
-                              (flags & GDS_CREATE_QP_RX_CQ_ON_GPU) ? 
-                              GDS_ALLOC_CQ_ON_GPU : GDS_ALLOC_CQ_DEFAULT);
+        if (shared_rx_cq) {
+                gds_dbg("using shared RX CQ %p\n", shared_rx_cq);
+                rx_cq = shared_rx_cq->cq;
+        } else {
+                gds_dbg("creating RX CQ\n");
+                rx_cq = gds_create_cq_on_node(context, rx_cqe, NULL, NULL, 0, gpu_id,
+                                              (flags & GDS_CREATE_QP_RX_CQ_ON_GPU) ?
+                                              GDS_ALLOC_CQ_ON_GPU : GDS_ALLOC_CQ_DEFAULT, numa_node);
+        }
 	if (!rx_cq) {
                 ret = errno;
                 gds_err("error %d while creating RX CQ\n", ret);
@@ -1403,9 +2318,13 @@ struct gds_qp *gds_create_qp(struct ibv_pd *pd, struct ibv_context *context, gds
 
         peer->alloc_type = gds_peer::WQ;
         peer->alloc_flags = GDS_ALLOC_WQ_DEFAULT | GDS_ALLOC_DBREC_DEFAULT;
+        peer->alloc_done = 0;
+        peer->alloc_numa_node = numa_node;
         if (flags & GDS_CREATE_QP_WQ_ON_GPU) {
-                gds_err("error, QP WQ on GPU is not supported yet\n");
-                goto err_free_cqs;
+                // the CPU posts through the GDRcopy mapping, which is slow to
+                // read, e.g. when the provider copies a WQE to BlueFlame
+                gds_warn("QP WQ on GPU\n");
+                peer->alloc_flags |= GDS_ALLOC_WQ_ON_GPU;
         }
         if (flags & GDS_CREATE_QP_WQ_DBREC_ON_GPU) {
                 gds_warn("QP WQ DBREC on GPU\n");
@@ -1414,7 +2333,12 @@ struct gds_qp *gds_create_qp(struct ibv_pd *pd, struct ibv_context *context, gds
         qp_attr->comp_mask |= IBV_EXP_QP_INIT_ATTR_PEER_DIRECT;
         qp_attr->peer_direct_attrs = peer_attr;
 
-        qp = ibv_exp_create_qp(context, qp_attr);
+        {
+                // as for CQs, host WQ and DBREC buffers are bound by
+                // gds_peer::alloc_host
+                gds_numa_scope numa_scope(numa_node);
+                qp = ibv_exp_create_qp(context, qp_attr);
+        }
         if (!qp)  {
                 ret = EINVAL;
                 gds_err("error in ibv_exp_create_qp\n");
@@ -1423,9 +2347,26 @@ struct gds_qp *gds_create_qp(struct ibv_pd *pd, struct ibv_context *context, gds
 
         gqp->qp = qp;
         gqp->send_cq.cq = qp->send_cq;
+        gqp->send_cq.shared = shared_tx_cq;
         gqp->send_cq.curr_offset = 0;
         gqp->recv_cq.cq = qp->recv_cq;
+        gqp->recv_cq.shared = shared_rx_cq;
         gqp->recv_cq.curr_offset = 0;
+        if (shared_tx_cq)
+                gds_shared_cq_attach(shared_tx_cq, gqp);
+        if (shared_rx_cq && shared_rx_cq != shared_tx_cq)
+                gds_shared_cq_attach(shared_rx_cq, gqp);
+
+        gds_qp_init_sq_bounds(gqp);
+
+        // the provider falls back to host memory when buf_alloc fails
+        if (peer->alloc_done & GDS_ALLOC_WQ_ON_GPU)
+                gqp->on_gpu |= GDS_CREATE_QP_WQ_ON_GPU;
+        if (peer->alloc_done & GDS_ALLOC_DBREC_ON_GPU)
+                gqp->on_gpu |= GDS_CREATE_QP_WQ_DBREC_ON_GPU;
+        if ((flags & (GDS_CREATE_QP_WQ_ON_GPU|GDS_CREATE_QP_WQ_DBREC_ON_GPU)) != gqp->on_gpu)
+                gds_warn("QP WQ flags=%08x requested, only %08x in GPU memory\n",
+                         flags & (GDS_CREATE_QP_WQ_ON_GPU|GDS_CREATE_QP_WQ_DBREC_ON_GPU), gqp->on_gpu);
 
         gds_dbg("created gds_qp=%p\n", gqp);
 
@@ -1436,17 +2377,21 @@ err_free_qp:
         ibv_destroy_qp(qp);
 
 err_free_cqs:
-        gds_dbg("destroying RX CQ\n");
-	ret = ibv_destroy_cq(rx_cq);
-        if (ret) {
-                gds_err("error %d destroying RX CQ\n", ret);
+        if (!shared_rx_cq) {
+                gds_dbg("destroying RX CQ\n");
+                ret = ibv_destroy_cq(rx_cq);
+                if (ret) {
+                        gds_err("error %d destroying RX CQ\n", ret);
+                }
         }
 
 err_free_tx_cq:
-        gds_dbg("destroying TX CQ\n");
-	ret = ibv_destroy_cq(tx_cq);
-        if (ret) {
-                gds_err("error %d destroying TX CQ\n", ret);
+        if (!shared_tx_cq) {
+                gds_dbg("destroying TX CQ\n");
+                ret = ibv_destroy_cq(tx_cq);
+                if (ret) {
+                        gds_err("error %d destroying TX CQ\n", ret);
+                }
         }
 
 err:
@@ -1464,24 +2409,33 @@ int gds_destroy_qp(struct gds_qp *qp)
         assert(qp);
 
         assert(qp->qp);
+        if (qp->send_cq.shared)
+                gds_shared_cq_detach(qp->send_cq.shared, qp);
+        if (qp->recv_cq.shared && qp->recv_cq.shared != qp->send_cq.shared)
+                gds_shared_cq_detach(qp->recv_cq.shared, qp);
         ret = ibv_destroy_qp(qp->qp);
         if (ret) {
                 gds_err("error %d in destroy_qp\n", ret);
                 retcode = ret;
         }
 
+        // shared CQs are released by gds_destroy_shared_cq
         assert(qp->send_cq.cq);
-        ret = ibv_destroy_cq(qp->send_cq.cq);
-        if (ret) {
-                gds_err("error %d in destroy_cq send_cq\n", ret);
-                retcode = ret;
+        if (!qp->send_cq.shared) {
+                ret = ibv_destroy_cq(qp->send_cq.cq);
+                if (ret) {
+                        gds_err("error %d in destroy_cq send_cq\n", ret);
+                        retcode = ret;
+                }
         }
 
         assert(qp->recv_cq.cq);
-        ret = ibv_destroy_cq(qp->recv_cq.cq);
-        if (ret) {
-                gds_err("error %d in destroy_cq recv_cq\n", ret);
-                retcode = ret;
+        if (!qp->recv_cq.shared) {
+                ret = ibv_destroy_cq(qp->recv_cq.cq);
+                if (ret) {
+                        gds_err("error %d in destroy_cq recv_cq\n", ret);
+                        retcode = ret;
+                }
         }
 
         free(qp);
@@ -1501,6 +2455,15 @@ int gds_query_param(gds_param_t param, int *value)
         case GDS_PARAM_VERSION:
                 *value = (GDS_API_MAJOR_VERSION << 16)|GDS_API_MINOR_VERSION;
                 break;
+        case GDS_PARAM_DB_STRATEGY: {
+                CUdevice dev;
+                if (CUDA_SUCCESS != cuCtxGetDevice(&dev)) {
+                        ret = EINVAL;
+                        break;
+                }
+                *value = gds_db_strategy_get(dev);
+                break;
+        }
         default:
                 ret = EINVAL;
                 break;
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <utility> //for pair
+#include <vector>
+#include <map>
+#include <assert.h>
+
+// Disjoint half-open intervals [begin,end), each carrying a value, kept in a
+// std::map (i.e. a red-black tree) keyed by the interval begin.
+//
+// Unlike RangeSet, an overlapping insert is refused rather than merged into
+// a bigger range: callers look for the gaps of a range, fill them and insert
+// the missing pieces. Values must be invariant under translation, e.g. the
+// offset between a host and a device address, so that an interval can be
+// split by copying its value and two adjacent intervals with equal values
+// can be coalesced into one.
+//
+// Lookups, inserts and erases cost O(log n) plus the number of intervals
+// they touch.
+
+template <typename T>
+class IntervalMap {
+public:
+        typedef unsigned long key_type;
+
+        struct interval {
+                key_type end;
+                T        value;
+                interval(key_type e, const T &v) : end(e), value(v) {}
+        };
+
+        typedef std::map<key_type, interval> map_type;
+        typedef typename map_type::iterator iterator;
+        // [first,second)
+        typedef std::pair<key_type, key_type> extent;
+
+        iterator begin() { return m.begin(); }
+        iterator end() { return m.end(); }
+        size_t size() const { return m.size(); }
+        bool empty() const { return m.empty(); }
+        void clear() { m.clear(); }
+
+        // first interval which contains or follows addr
+        iterator lower(key_type addr) {
+                iterator it = m.upper_bound(addr);
+                if (it != m.begin()) {
+                        iterator prev = it;
+                        --prev;
+                        if (prev->second.end > addr)
+                                return prev;
+                }
+                return it;
+        }
+
+        // interval containing the whole of [b,e), or end()
+        iterator find(key_type b, key_type e) {
+                assert(b < e);
+                iterator it = lower(b);
+                if (it != m.end() && it->first <= b && it->second.end >= e)
+                        return it;
+                return m.end();
+        }
+
+        bool overlaps(key_type b, key_type e) {
+                iterator it = lower(b);
+                return it != m.end() && it->first < e;
+        }
+
+        // appends the pieces of [b,e) not covered by any interval to out,
+        // returns how many were found
+        size_t gaps(key_type b, key_type e, std::vector<extent> &out) {
+                size_t n = 0;
+                key_type cur = b;
+                for (iterator it = lower(b); it != m.end() && it->first < e; ++it) {
+                        if (it->first > cur) {
+                                out.push_back(extent(cur, it->first));
+                                ++n;
+                        }
+                        cur = it->second.end;
+                }
+                if (cur < e) {
+                        out.push_back(extent(cur, e));
+                        ++n;
+                }
+                return n;
+        }
+
+        // inserts [b,e), which must not overlap any existing interval, and
+        // coalesces it with neighbours holding an equal value
+        // returns the interval now containing [b,e), or end() on overlap
+        iterator insert(key_type b, key_type e, const T &value) {
+                assert(b < e);
+                iterator next = m.lower_bound(b);
+                if (next != m.end() && next->first < e)
+                        return m.end();
+                iterator it = m.end();
+                if (next != m.begin()) {
+                        iterator prev = next;
+                        --prev;
+                        if (prev->second.end > b)
+                                return m.end();
+                        if (prev->second.end == b && prev->second.value == value) {
+                                prev->second.end = e;
+                                it = prev;
+                        }
+                }
+                if (it == m.end())
+                        it = m.insert(next, std::make_pair(b, interval(e, value)));
+                if (next != m.end() && next->first == e && next->second.value == value) {
+                        it->second.end = next->second.end;
+                        m.erase(next);
+                }
+                return it;
+        }
+
+        // removes [b,e), splitting the intervals which straddle either end
+        // returns the number of intervals which have been cut or dropped
+        size_t erase(key_type b, key_type e) {
+                size_t n = 0;
+                iterator it = lower(b);
+                while (it != m.end() && it->first < e) {
+                        iterator next = it;
+                        ++next;
+                        key_type ie = it->second.end;
+                        T value = it->second.value;
+                        if (it->first < b)
+                                it->second.end = b;
+                        else
+                                m.erase(it);
+                        if (ie > e)
+                                m.insert(next, std::make_pair(e, interval(ie, value)));
+                        ++n;
+                        it = next;
+                }
+                return n;
+        }
+
+private:
+        map_type m;
+};
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ *  indent-tabs-mode: nil
+ * End:
+ */
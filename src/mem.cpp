@@ -30,6 +30,7 @@
 #endif /* HAVE_CONFIG_H */
 
 #include <unistd.h>
+#include <sys/mman.h>
 #include <string.h>
 #include <assert.h>
 #include <inttypes.h>
@@ -49,6 +50,7 @@ using namespace std;
 #include "utils.hpp"
 #include "mem.hpp"
 #include "memmgr.hpp"
+#include "topo.hpp"
 
 #ifndef GDS_GPU_PAGE_SIZE
 #define GDR_GPU_PAGE_SHIFT   GPU_PAGE_SHIFT 
@@ -230,13 +232,20 @@ static int gds_alloc_pinned_memory(gds_mem_desc_t *desc, size_t size, int flags)
         }
 #else
         assert(desc);
-        desc->h_ptr = NULL;
-        ret = posix_memalign(&desc->h_ptr, GDS_HOST_PAGE_SIZE, size);
-        if (ret) {
+        desc->d_ptr = 0;
+        // whole pages of our own, so that binding them to a NUMA node
+        // does not move unrelated heap objects sharing those pages
+        desc->h_ptr = mmap(NULL, ROUND_UP(size, GDS_HOST_PAGE_SIZE), PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (MAP_FAILED == desc->h_ptr) {
+                ret = errno;
+                gds_err("error %d in mmap\n", ret);
+                desc->h_ptr = NULL;
                 goto out;
         }
-        desc->d_ptr = 0;
-        ret = gds_register_mem(desc->h_ptr, size, GDS_MEMORY_HOST, &desc->d_ptr);
+        // flags are mostly polled by the GPU, keep them on its node
+        gds_numa_bind_range(desc->h_ptr, ROUND_UP(size, GDS_HOST_PAGE_SIZE), gds_current_gpu_numa_node());
+        ret = gds_pin_mem(desc->h_ptr, size, GDS_MEMORY_HOST, &desc->d_ptr);
         if (ret) {
                 goto out;
         }
@@ -250,8 +259,9 @@ out:
         if (ret) {
                 if (desc->h_ptr) {
                         if (desc->d_ptr)
-                                gds_unregister_mem(desc->h_ptr, desc->alloc_size);
-                        free(desc->h_ptr);
+                                gds_unpin_mem(desc->h_ptr, size);
+                        munmap(desc->h_ptr, ROUND_UP(size, GDS_HOST_PAGE_SIZE));
+                        desc->h_ptr = NULL;
                 }
         }
 #endif
@@ -273,8 +283,8 @@ static int gds_free_pinned_memory(gds_mem_desc_t *desc)
 #else
         gds_dbg("d_ptr=%lx h_ptr=%p flags=0x%08x alloc_size=%zd\n",
                 (unsigned long)desc->d_ptr, desc->h_ptr, desc->flags, desc->alloc_size);
-        ret = gds_unregister_mem(desc->h_ptr, desc->alloc_size);
-        free(desc->h_ptr);
+        ret = gds_unpin_mem(desc->h_ptr, desc->alloc_size);
+        munmap(desc->h_ptr, ROUND_UP(desc->alloc_size, GDS_HOST_PAGE_SIZE));
         desc->h_ptr = NULL;
         desc->d_ptr = 0;
         desc->alloc_size = 0;
@@ -357,10 +367,13 @@ int gds_peer_malloc_ex(int peer_id, uint64_t peer_data, void **host_addr, CUdevi
 
         // NOTE: gpu_id's primary context is assumed to be the right one
         // breaks horribly with multiple contexts
-        int num_gpus;
-        do {
-                CUresult err = cuDeviceGetCount(&num_gpus);
+        // the device count cannot change during the process lifetime
+        static int num_gpus = -1;
+        while (num_gpus < 0) {
+                int n = 0;
+                CUresult err = cuDeviceGetCount(&n);
                 if (CUDA_SUCCESS == err) {
+                        num_gpus = n;
                         break;
                 } else if (CUDA_ERROR_NOT_INITIALIZED == err) {
                         gds_err("CUDA error %d in cuDeviceGetCount, calling cuInit\n", err);
@@ -371,7 +384,7 @@ int gds_peer_malloc_ex(int peer_id, uint64_t peer_data, void **host_addr, CUdevi
                         gds_err("CUDA error %d in cuDeviceGetCount, returning EIO\n", err);
                         return EIO;
                 }
-        } while(0);
+        }
         gds_dbg("num_gpus=%d\n", num_gpus);
         if (gpu_id >= num_gpus) {
                 gds_err("invalid num_GPUs=%d while requesting GPU id %d\n", num_gpus, gpu_id);
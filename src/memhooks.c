@@ -0,0 +1,173 @@
+/* Copyright (c) 2016, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <dlfcn.h>
+#include <sys/mman.h>
+
+// Opt-in interposer for the libgdsync pin-down cache:
+//
+//   LD_PRELOAD=libgdsync_memhooks.so ./app
+//
+// Reports every range which is about to be unmapped or to lose its pages
+// to gds_mem_notify_unmap(). Hooking free() and realloc() covers what
+// glibc does internally when releasing memory, i.e. munmap of large
+// chunks, heap trimming through brk and madvise, none of which goes
+// through the dynamic linker. Only the whole pages strictly inside a freed
+// chunk are reported: the pin-down cache drops every registration which
+// overlaps a reported range, unpinning it, so reporting a partial page
+// would unpin a live buffer sharing that page with a small heap object.
+//
+// The hooks stay inert unless libgdsync is linked into the executable: a
+// libgdsync loaded later with dlopen is not seen.
+
+void gds_mem_notify_unmap(void *ptr, size_t size) __attribute__((weak));
+
+typedef int   (*munmap_fn_t)(void *, size_t);
+typedef void *(*mremap_fn_t)(void *, size_t, size_t, int, ...);
+typedef int   (*madvise_fn_t)(void *, size_t, int);
+typedef void  (*free_fn_t)(void *);
+typedef void *(*realloc_fn_t)(void *, size_t);
+
+static munmap_fn_t  real_munmap;
+static mremap_fn_t  real_mremap;
+static madvise_fn_t real_madvise;
+static free_fn_t    real_free;
+static realloc_fn_t real_realloc;
+
+// dlsym may allocate and free memory itself
+static __thread int resolving;
+
+static void *next_fn(const char *name)
+{
+        void *fn;
+        resolving = 1;
+        fn = dlsym(RTLD_NEXT, name);
+        resolving = 0;
+        return fn;
+}
+
+static inline void notify(void *ptr, size_t size)
+{
+        if (gds_mem_notify_unmap && ptr && size)
+                gds_mem_notify_unmap(ptr, size);
+}
+
+// pages glibc may give back out of a heap chunk
+static inline void notify_chunk(void *ptr)
+{
+        static uintptr_t page_size;
+        uintptr_t begin, end;
+        if (!page_size)
+                page_size = sysconf(_SC_PAGESIZE);
+        begin = ((uintptr_t)ptr + page_size - 1) & ~(page_size - 1);
+        end = ((uintptr_t)ptr + malloc_usable_size(ptr)) & ~(page_size - 1);
+        if (begin < end)
+                notify((void *)begin, end - begin);
+}
+
+int munmap(void *addr, size_t length)
+{
+        if (!real_munmap)
+                real_munmap = (munmap_fn_t)next_fn("munmap");
+        notify(addr, length);
+        return real_munmap(addr, length);
+}
+
+void *mremap(void *old_address, size_t old_size, size_t new_size, int flags, ...)
+{
+        void *new_address = NULL;
+        if (!real_mremap)
+                real_mremap = (mremap_fn_t)next_fn("mremap");
+        if (flags & MREMAP_FIXED) {
+                va_list ap;
+                va_start(ap, flags);
+                new_address = va_arg(ap, void *);
+                va_end(ap);
+        }
+        notify(old_address, old_size);
+        return real_mremap(old_address, old_size, new_size, flags, new_address);
+}
+
+int madvise(void *addr, size_t length, int advice)
+{
+        if (!real_madvise)
+                real_madvise = (madvise_fn_t)next_fn("madvise");
+        switch (advice) {
+        case MADV_DONTNEED:
+#ifdef MADV_FREE
+        case MADV_FREE:
+#endif
+        case MADV_REMOVE:
+                notify(addr, length);
+                break;
+        default:
+                break;
+        }
+        return real_madvise(addr, length, advice);
+}
+
+void free(void *ptr)
+{
+        if (!ptr)
+                return;
+        if (!real_free) {
+                // leaked, it comes from dlsym resolving real_free
+                if (resolving)
+                        return;
+                real_free = (free_fn_t)next_fn("free");
+        }
+        notify_chunk(ptr);
+        real_free(ptr);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+        if (!real_realloc)
+                real_realloc = (realloc_fn_t)next_fn("realloc");
+        // the chunk may move, or shrink and give pages back
+        if (ptr)
+                notify_chunk(ptr);
+        return real_realloc(ptr, size);
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ *  indent-tabs-mode: nil
+ * End:
+ */
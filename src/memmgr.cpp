@@ -30,11 +30,14 @@
 #endif /* HAVE_CONFIG_H */
 
 #include <unistd.h>
+#include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include <assert.h>
 #include <inttypes.h>
 
 #include <map>
+#include <vector>
 #include <algorithm>
 #include <string>
 using namespace std;
@@ -53,13 +56,27 @@ using namespace std;
 // pin-down cache
 //--------------
 
-#include "rangeset.hpp"
-typedef Range range;
-typedef RangeSet range_set;
-
-static range_set rset;
-
-typedef std::map<unsigned long, CUdeviceptr> pindown_cache_t;
+#include "intervalmap.hpp"
+
+// host address ranges which are known to the GPU, mapped to the offset
+// between device and host address, so that ranges pinned back to back
+// coalesce whenever their device mappings are contiguous
+typedef IntervalMap<unsigned long> xlat_map;
+static xlat_map xlat;
+
+// one entry per cuMemHostRegister, i.e. per call to gds_register_mem_internal
+typedef struct gds_pin {
+        size_t            len;
+        CUdeviceptr       dev_ptr;
+        gds_memory_type_t type;
+        // false if the range was registered with CUDA by somebody else
+        bool              owned;
+        // made by gds_pin_mem for memory of the library, whose device
+        // pointer is kept around, only dropped by gds_unpin_mem
+        bool              library;
+} gds_pin_t;
+
+typedef std::map<unsigned long, gds_pin_t> pindown_cache_t;
 static pindown_cache_t pinned_ranges;
 
 // cache for last known translation
@@ -68,13 +85,189 @@ static struct {
         CUdeviceptr   dev_addr;
 } last_pinned = { 0, 0 };
 
-static int gds_register_mem_internal(void *ptr, size_t size, gds_memory_type_t type, CUdeviceptr *dev_ptr);
+// the cache is shared by all threads
+static pthread_mutex_t gds_mem_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t gds_invalidate_mem_internal(unsigned long begin, unsigned long end, bool library);
+
+//-----------------------------------------------------------------------------
+// Ranges reported by gds_mem_notify_unmap(), which can run on any thread,
+// including CUDA and verbs internal ones, and therefore neither takes
+// gds_mem_lock nor calls into CUDA. Notifiers queue the range into a
+// lock-free ring, the registrations are dropped by the next thread taking
+// gds_mem_lock. If the ring fills up, the whole cache is dropped instead,
+// except for the pins of the library itself.
+
+#define GDS_MEM_STALE_RING_SIZE 1024
+
+struct gds_stale_range {
+        unsigned long begin;
+        unsigned long end;
+        // set once begin/end are valid, cleared by the consumer
+        volatile int  ready;
+};
+
+static struct gds_stale_range stale_ring[GDS_MEM_STALE_RING_SIZE];
+// slots claimed by notifiers
+static volatile unsigned long stale_head = 0;
+// slots consumed under gds_mem_lock
+static volatile unsigned long stale_tail = 0;
+static volatile int stale_overflow = 0;
+
+// Read-only copy of the pinned extents, which lets notifiers skip the
+// ranges not touching the cache, e.g. most free() calls, or touching only
+// pins of the library, which unmaps never drop. It is republished
+// under gds_mem_lock whenever the cache changes; replaced copies are freed
+// once no notifier is reading any. NULL means that every range is queued.
+struct gds_pin_snapshot {
+        size_t        n;
+        unsigned long ext[0][2];
+};
+
+static struct gds_pin_snapshot pin_snap_empty = { 0 };
+static struct gds_pin_snapshot *volatile pin_snap = &pin_snap_empty;
+static volatile int pin_snap_readers = 0;
+static std::vector<struct gds_pin_snapshot *> pin_snap_retired;
+static bool pin_snap_dirty = false;
+
+static bool gds_pin_snapshot_overlaps(const struct gds_pin_snapshot *s, unsigned long begin, unsigned long end)
+{
+        // first extent which ends past begin
+        size_t lo = 0, hi = s->n;
+        while (lo < hi) {
+                size_t mid = (lo + hi) / 2;
+                if (s->ext[mid][1] <= begin)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        return lo < s->n && s->ext[lo][0] < end;
+}
+
+static void gds_mem_push_stale(unsigned long begin, unsigned long end)
+{
+        unsigned long head;
+        for (;;) {
+                head = ACCESS_ONCE(stale_head);
+                if (head - ACCESS_ONCE(stale_tail) >= GDS_MEM_STALE_RING_SIZE) {
+                        stale_overflow = 1;
+                        __sync_synchronize();
+                        return;
+                }
+                if (__sync_bool_compare_and_swap(&stale_head, head, head + 1))
+                        break;
+        }
+        struct gds_stale_range *r = &stale_ring[head % GDS_MEM_STALE_RING_SIZE];
+        r->begin = begin;
+        r->end = end;
+        __sync_synchronize();
+        r->ready = 1;
+}
+
+void gds_mem_notify_unmap(void *ptr, size_t size)
+{
+        unsigned long begin = (unsigned long)ptr;
+        unsigned long end = begin + size;
+        bool hit;
+
+        if (!size)
+                return;
+        // full barrier, pairs with the one in gds_mem_publish_snapshot
+        __sync_fetch_and_add(&pin_snap_readers, 1);
+        struct gds_pin_snapshot *s = pin_snap;
+        hit = !s || gds_pin_snapshot_overlaps(s, begin, end);
+        __sync_fetch_and_sub(&pin_snap_readers, 1);
+        if (hit)
+                gds_mem_push_stale(begin, end);
+}
+
+// called with gds_mem_lock held
+static void gds_mem_drain_stale()
+{
+        unsigned long tail = stale_tail;
+
+        if (ACCESS_ONCE(stale_overflow)) {
+                stale_overflow = 0;
+                __sync_synchronize();
+                gds_warn("too many unmapped ranges, dropping the whole pin-down cache\n");
+                gds_invalidate_mem_internal(0, ~0UL, false);
+        }
+        while (tail != ACCESS_ONCE(stale_head)) {
+                struct gds_stale_range *r = &stale_ring[tail % GDS_MEM_STALE_RING_SIZE];
+                // still being filled in, its munmap has not happened yet
+                if (!ACCESS_ONCE(r->ready))
+                        break;
+                __sync_synchronize();
+                unsigned long begin = r->begin;
+                unsigned long end = r->end;
+                r->ready = 0;
+                __sync_synchronize();
+                stale_tail = ++tail;
+                gds_dbg("dropping unmapped range [%lx,%lx)\n", begin, end);
+                gds_invalidate_mem_internal(begin, end, false);
+        }
+}
+
+// called with gds_mem_lock held
+static void gds_mem_publish_snapshot()
+{
+        size_t n = 0;
+        struct gds_pin_snapshot *s = NULL;
+        struct gds_pin_snapshot *old;
+
+        for (pindown_cache_t::iterator it = pinned_ranges.begin(); it != pinned_ranges.end(); ++it)
+                if (!it->second.library)
+                        ++n;
+        if (n) {
+                s = (struct gds_pin_snapshot *)malloc(sizeof(*s) + n * sizeof(s->ext[0]));
+                if (s) {
+                        size_t i = 0;
+                        for (pindown_cache_t::iterator it = pinned_ranges.begin(); it != pinned_ranges.end(); ++it) {
+                                if (it->second.library)
+                                        continue;
+                                s->ext[i][0] = it->first;
+                                s->ext[i][1] = it->first + it->second.len;
+                                ++i;
+                        }
+                        s->n = n;
+                } else {
+                        gds_warn("cannot allocate snapshot of %zu extents, all unmaps will be queued\n", n);
+                }
+        } else {
+                s = &pin_snap_empty;
+        }
+        old = __sync_lock_test_and_set(&pin_snap, s);
+        if (old && old != &pin_snap_empty)
+                pin_snap_retired.push_back(old);
+        __sync_synchronize();
+        if (!ACCESS_ONCE(pin_snap_readers)) {
+                for (size_t i = 0; i < pin_snap_retired.size(); ++i)
+                        free(pin_snap_retired[i]);
+                pin_snap_retired.clear();
+        }
+        pin_snap_dirty = false;
+}
+
+static void gds_mem_cache_lock()
+{
+        pthread_mutex_lock(&gds_mem_lock);
+        gds_mem_drain_stale();
+}
+
+static void gds_mem_cache_unlock()
+{
+        if (pin_snap_dirty)
+                gds_mem_publish_snapshot();
+        pthread_mutex_unlock(&gds_mem_lock);
+}
+
+static int gds_register_mem_internal(void *ptr, size_t size, gds_memory_type_t type, CUdeviceptr *dev_ptr, bool library = false);
 
 
 // map whole pages contained in [ptr,ptr+size)
 // return the CUdeviceptr corresponding to ptr
-// BUG: after destroying a GPU context, all the GPU mappings will be invalidated 
-//      but this is not reflected here
+// NOTE: after destroying a GPU context, all the GPU mappings are invalidated,
+//       call gds_invalidate_mem(NULL, 0) to drop them from the cache
 // BUG: convert CUCHECK into error checks and return an error
 
                 // loop over overlapping ranges, 
@@ -87,43 +280,44 @@ static int gds_register_mem_internal(void *ptr, size_t size, gds_memory_type_t t
 
 int gds_map_mem(void *ptr, size_t size, gds_memory_type_t mem_type, CUdeviceptr *dev_ptr)
 {
+        int ret = 0;
+        unsigned long addr = (unsigned long)ptr;
+        std::vector<xlat_map::extent> missing;
+        xlat_map::iterator found;
+
         assert(dev_ptr);
 
         gds_dbg("ptr=%p size=%zu mem_type=%08x\n", ptr, size, mem_type);
 
-        range r((ptrdiff_t)ptr, (ptrdiff_t)ptr + size -1);
-
-        range_set::find_result res = rset.find(r);
-        switch(res.second) {
-        case range_set::not_found:
-                return gds_register_mem_internal(ptr, size, mem_type, dev_ptr);
-                break;
-        case range_set::partial_overlap:
-                gds_err("partial overlap, buffer already registered?\n");
+        if (!size) {
+                gds_err("invalid 0 size buffer\n");
                 return EINVAL;
-        case range_set::fully_contained: {
-                range r = *res.first;
-                if (dev_ptr) {
-                        pindown_cache_t::iterator found = pinned_ranges.find(r.first);
-                        if (found != pinned_ranges.end()) {
-                                CUdeviceptr page_dev_ptr = (*found).second;
-                                ptrdiff_t off = (ptrdiff_t)ptr - (ptrdiff_t)r.first;
-                                *dev_ptr = page_dev_ptr + off;
-                        }
-                        else {
-                                gds_err("can't find dev_ptr for page_addr=%lx\n", r.first);
-                                return EINVAL;
+        }
+
+        gds_mem_cache_lock();
+        found = xlat.find(addr, addr + size);
+        if (found == xlat.end()) {
+                // the buffer may extend past, or span, earlier registrations,
+                // so pin only the pieces which are still missing
+                xlat.gaps(addr, addr + size, missing);
+                for (size_t i = 0; i < missing.size(); ++i) {
+                        ret = gds_register_mem_internal((void*)missing[i].first, missing[i].second - missing[i].first, mem_type, NULL);
+                        if (ret) {
+                                gds_err("error %d while registering missing range [%lx,%lx)\n", ret, missing[i].first, missing[i].second);
+                                goto out;
                         }
                 }
-                break;
-        }
-        default:
-                gds_err("unexpected result");
-                return EINVAL;
+                found = xlat.find(addr, addr + size);
+                if (found == xlat.end()) {
+                        gds_err("ptr=%p size=%zu spans registrations which are not contiguous on the GPU\n", ptr, size);
+                        ret = EINVAL;
+                        goto out;
+                }
         }
-
-        return 0;
-
+        *dev_ptr = (CUdeviceptr)(addr + found->second.value);
+out:
+        gds_mem_cache_unlock();
+        return ret;
 }
 
 //-----------------------------------------------------------------------------
@@ -135,7 +329,92 @@ int gds_register_mem(void *ptr, size_t size, gds_memory_type_t mem_type, CUdevic
 
 //-----------------------------------------------------------------------------
 
-int gds_register_mem_internal(void *ptr, size_t size, gds_memory_type_t type, CUdeviceptr *dev_ptr)
+int gds_register_mem_bulk(gds_mem_range_t *ranges, size_t n_ranges, int flags)
+{
+        int ret = 0;
+        gds_memory_type_t mem_type = memtype_from_flags(flags);
+        unsigned long page_size;
+        std::vector<std::pair<unsigned long, unsigned long> > extents;
+        // extents pinned by this call, undone if a later one fails
+        std::vector<xlat_map::extent> pinned;
+
+        gds_dbg("n_ranges=%zu flags=%08x\n", n_ranges, flags);
+
+        switch (mem_type) {
+        case GDS_MEMORY_GPU:
+                page_size = GDS_GPU_PAGE_SIZE;
+                break;
+        case GDS_MEMORY_HOST:
+        case GDS_MEMORY_IO:
+                page_size = GDS_HOST_PAGE_SIZE;
+                break;
+        default:
+                gds_err("invalid mem type %d\n", mem_type);
+                return EINVAL;
+        }
+
+        if (n_ranges && !ranges) {
+                gds_err("invalid ranges array\n");
+                return EINVAL;
+        }
+
+        // page-rounded [begin,end) extents
+        extents.reserve(n_ranges);
+        for (size_t i = 0; i < n_ranges; ++i) {
+                unsigned long addr = (unsigned long)ranges[i].ptr;
+                if (!ranges[i].size) {
+                        gds_dbg("skipping empty range %zu\n", i);
+                        continue;
+                }
+                unsigned long begin = addr & ~(page_size - 1);
+                unsigned long end = ROUND_UP(addr + ranges[i].size, page_size);
+                extents.push_back(std::make_pair(begin, end));
+        }
+        std::sort(extents.begin(), extents.end());
+
+        // coalesce adjacent and overlapping extents in place
+        size_t n_merged = 0;
+        for (size_t i = 0; i < extents.size(); ++i) {
+                if (n_merged && extents[i].first <= extents[n_merged-1].second) {
+                        extents[n_merged-1].second = std::max(extents[n_merged-1].second, extents[i].second);
+                } else {
+                        extents[n_merged++] = extents[i];
+                }
+        }
+        gds_dbg("%zu ranges coalesced into %zu extents\n", n_ranges, n_merged);
+
+        gds_mem_cache_lock();
+
+        for (size_t i = 0; i < n_merged; ++i) {
+                std::vector<xlat_map::extent> missing;
+                // skip whatever is already pinned, e.g. by gds_map_mem
+                xlat.gaps(extents[i].first, extents[i].second, missing);
+                for (size_t j = 0; j < missing.size(); ++j) {
+                        unsigned long begin = missing[j].first;
+                        size_t len = missing[j].second - begin;
+                        ret = gds_register_mem_internal((void*)begin, len, mem_type, NULL);
+                        if (ret) {
+                                gds_err("error %d while registering extent %p size=%zu\n", ret, (void*)begin, len);
+                                goto out;
+                        }
+                        pinned.push_back(missing[j]);
+                }
+        }
+        gds_dbg("pinned %zu new extents\n", pinned.size());
+out:
+        if (ret) {
+                // all or nothing, the gaps did not overlap any previous pin
+                for (size_t i = 0; i < pinned.size(); ++i)
+                        gds_invalidate_mem_internal(pinned[i].first, pinned[i].second, false);
+                gds_dbg("unpinned %zu extents after error %d\n", pinned.size(), ret);
+        }
+        gds_mem_cache_unlock();
+        return ret;
+}
+
+//-----------------------------------------------------------------------------
+
+int gds_register_mem_internal(void *ptr, size_t size, gds_memory_type_t type, CUdeviceptr *dev_ptr, bool library)
 {
         gds_dbg("ptr=%p size=%zu memtype=%d\n", ptr, size, type);
         unsigned long addr = (unsigned long)ptr;
@@ -173,6 +452,11 @@ int gds_register_mem_internal(void *ptr, size_t size, gds_memory_type_t type, CU
         unsigned long page_off = addr & target_page_off;
         size_t len = ROUND_UP(size + page_off, target_page_size);
 
+        if (xlat.overlaps(page_addr, page_addr + len)) {
+                gds_err("page=%p size=%zu overlaps with an existing registration\n", (void*)page_addr, len);
+                return EEXIST;
+        }
+
         if (need_cuda_registration) {
                 gds_dbg("calling cuMemHostRegister(%p, %zu, 0x%x)\n", (void*)page_addr, len, flags);
                 CUresult res = cuMemHostRegister((void*)page_addr, len, flags);
@@ -209,38 +493,161 @@ int gds_register_mem_internal(void *ptr, size_t size, gds_memory_type_t type, CU
         if (dev_ptr)
                 *dev_ptr = page_dev_ptr + page_off;
 
-        // add to rangeset
-        {
-                range r(page_addr, page_addr+len-1);
-                range_set::insert_result res = rset.insert(r);
-                if (!res.second) {
-                        range r = *res.first;
-                        gds_dbg("range overlaps with existing\n");
-                        if (!cuda_registered) {
-                                gds_err("overlapping range not tracked by CUDA\n");
-                                return EEXIST;
-                        }
-                }
+        if (xlat.insert(page_addr, page_addr + len, (unsigned long)page_dev_ptr - page_addr) == xlat.end()) {
+                gds_err("failed to track page=%p size=%zu\n", (void*)page_addr, len);
+                return EEXIST;
         }
 
-        // store page dev_ptr
-        pinned_ranges[page_addr] = page_dev_ptr;
+        {
+                gds_pin_t pin;
+                pin.len = len;
+                pin.dev_ptr = page_dev_ptr;
+                pin.type = type;
+                pin.owned = need_cuda_registration && !cuda_registered;
+                pin.library = library;
+                pinned_ranges[page_addr] = pin;
+                pin_snap_dirty = true;
+        }
 
         return 0;
 }
 
 //-----------------------------------------------------------------------------
-// TODO: !!!
 int gds_unregister_mem(void *ptr, size_t size)
 {
+        unsigned long begin = (unsigned long)ptr;
+        size_t n;
+
+        gds_dbg("ptr=%p size=%zu\n", ptr, size);
+
+        if (!ptr || !size || begin + size < begin) {
+                gds_err("invalid range ptr=%p size=%zu\n", ptr, size);
+                return EINVAL;
+        }
+
+        gds_mem_cache_lock();
+        n = gds_invalidate_mem_internal(begin, begin + size, false);
+        gds_mem_cache_unlock();
+        // e.g. the whole cache has been dropped already
+        if (!n)
+                gds_dbg("ptr=%p size=%zu was not registered\n", ptr, size);
+
+        return 0;
+}
+
+//-----------------------------------------------------------------------------
+
+int gds_pin_mem(void *ptr, size_t size, gds_memory_type_t type, CUdeviceptr *dev_ptr)
+{
+        unsigned long begin = (unsigned long)ptr;
+        int ret;
+
+        gds_dbg("ptr=%p size=%zu type=%d\n", ptr, size, type);
+
+        if (!ptr || !size || begin + size < begin) {
+                gds_err("invalid range ptr=%p size=%zu\n", ptr, size);
+                return EINVAL;
+        }
+
+        gds_mem_cache_lock();
+        // ptr has just been mapped, so whatever is cached there is stale
+        gds_invalidate_mem_internal(begin, begin + size, false);
+        ret = gds_register_mem_internal(ptr, size, type, dev_ptr, true);
+        gds_mem_cache_unlock();
+        return ret;
+}
+
+//-----------------------------------------------------------------------------
+
+int gds_unpin_mem(void *ptr, size_t size)
+{
+        unsigned long begin = (unsigned long)ptr;
+        size_t n;
+
+        gds_dbg("ptr=%p size=%zu\n", ptr, size);
+
+        if (!ptr || !size || begin + size < begin) {
+                gds_err("invalid range ptr=%p size=%zu\n", ptr, size);
+                return EINVAL;
+        }
+
+        gds_mem_cache_lock();
+        n = gds_invalidate_mem_internal(begin, begin + size, true);
+        gds_mem_cache_unlock();
+        if (!n) {
+                gds_err("ptr=%p size=%zu was not pinned\n", ptr, size);
+                return EINVAL;
+        }
+        return 0;
+}
+
+//-----------------------------------------------------------------------------
+
+// drops every registration which overlaps [begin,end), together with its
+// translations; CUDA cannot unpin part of a registration, so the pages
+// outside [begin,end) which are still mapped get re-registered on next use
+// the pins of gds_pin_mem are kept unless library is true
+// returns the number of registrations dropped
+static size_t gds_invalidate_mem_internal(unsigned long begin, unsigned long end, bool library)
+{
+        size_t n = 0;
+        pindown_cache_t::iterator it = pinned_ranges.upper_bound(begin);
+        if (it != pinned_ranges.begin()) {
+                pindown_cache_t::iterator prev = it;
+                --prev;
+                if (prev->first + prev->second.len > begin)
+                        it = prev;
+        }
+        while (it != pinned_ranges.end() && it->first < end) {
+                unsigned long page_addr = it->first;
+                gds_pin_t &pin = it->second;
+                if (pin.library && !library) {
+                        gds_dbg("keeping library page=%p size=%zu\n", (void*)page_addr, pin.len);
+                        ++it;
+                        continue;
+                }
+                gds_dbg("invalidating page=%p size=%zu owned=%d\n", (void*)page_addr, pin.len, pin.owned);
+                if (pin.owned) {
+                        CUresult res = cuMemHostUnregister((void*)page_addr);
+                        if (res != CUDA_SUCCESS) {
+                                // e.g. the context has gone already
+                                const char *err_str = NULL;
+                                cuGetErrorString(res, &err_str);
+                                gds_dbg("error %d (%s) while unregistering page=%p\n", res, err_str, (void*)page_addr);
+                        }
+                }
+                xlat.erase(page_addr, page_addr + pin.len);
+                pinned_ranges.erase(it++);
+                ++n;
+        }
+        if (n)
+                pin_snap_dirty = true;
+        if (last_pinned.page_addr >= begin && last_pinned.page_addr < end)
+                last_pinned.page_addr = 0;
+        return n;
+}
+
+//-----------------------------------------------------------------------------
+
+int gds_invalidate_mem(void *ptr, size_t size)
+{
+        unsigned long begin = (unsigned long)ptr;
+        unsigned long end = begin + size;
+
         gds_dbg("ptr=%p size=%zu\n", ptr, size);
-        // r = rangeset.find()
-        // if not_found
-        //   return EINVAL;
-        // if overlapping with other ranges
-        //   return EINVAL;
-        // if fully_contained
-        //   remove from rangeset
+
+        if (!ptr && !size) {
+                // everything
+                end = ~0UL;
+        } else if (!size || end < begin) {
+                gds_err("invalid range ptr=%p size=%zu\n", ptr, size);
+                return EINVAL;
+        }
+
+        gds_mem_cache_lock();
+        gds_invalidate_mem_internal(begin, end, false);
+        gds_mem_cache_unlock();
+
         return 0;
 }
 
@@ -7,6 +7,11 @@ int gds_map_mem(void *_ptr, size_t size, gds_memory_type_t mem_type, CUdeviceptr
 // 1st time registration of memory, for HOST and IO
 int gds_register_mem(void *_ptr, size_t size, gds_memory_type_t type, CUdeviceptr *dev_ptr);
 int gds_unregister_mem(void *_ptr, size_t size);
+// registration of memory allocated by the library, whose device pointer is
+// kept for good: neither unmap notifications nor gds_invalidate_mem drop
+// it, only gds_unpin_mem does
+int gds_pin_mem(void *ptr, size_t size, gds_memory_type_t type, CUdeviceptr *dev_ptr);
+int gds_unpin_mem(void *ptr, size_t size);
 //int gds_lookup_devptr(void *va, CUdeviceptr *dev_ptr);
 //int gds_unmap_mem(void *_ptr, size_t size);
 
@@ -65,16 +65,88 @@
 	*dst++ = *src++
 
 #endif
-// no WQ wrap-around check!!!
-static void gds_bf_copy(uint64_t *dest, uint64_t *src, size_t n_bytes)
+static void gds_bf_copy_generic(uint64_t *dest, const uint64_t *src, size_t n_bytes)
 {
-        assert(n_bytes % sizeof(uint64_t) == 0);
+        uint64_t *s = (uint64_t *)src;
+        assert(n_bytes % (8 * sizeof(uint64_t)) == 0);
 	while (n_bytes > 0) {
-		COPY_64B_NT(dest, src);
+		COPY_64B_NT(dest, s);
 		n_bytes -= 8 * sizeof(*dest);
 	}
 }
 
+// wider non-temporal stores, so that a WQE reaches the write-combining
+// buffer in fewer instructions. dest must be 64 bytes aligned, as
+// BlueFlame registers are.
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+static void gds_bf_copy_avx2(uint64_t *dest, const uint64_t *src, size_t n_bytes)
+{
+        assert(n_bytes % (8 * sizeof(uint64_t)) == 0);
+        while (n_bytes > 0) {
+                __m256i y0 = _mm256_loadu_si256((const __m256i *)src);
+                __m256i y1 = _mm256_loadu_si256((const __m256i *)src + 1);
+                _mm256_stream_si256((__m256i *)dest, y0);
+                _mm256_stream_si256((__m256i *)dest + 1, y1);
+                dest += 8;
+                src += 8;
+                n_bytes -= 8 * sizeof(*dest);
+        }
+}
+
+__attribute__((target("avx512f")))
+static void gds_bf_copy_avx512(uint64_t *dest, const uint64_t *src, size_t n_bytes)
+{
+        assert(n_bytes % (8 * sizeof(uint64_t)) == 0);
+        while (n_bytes > 0) {
+                __m512i z0 = _mm512_loadu_si512((const void *)src);
+                _mm512_stream_si512((__m512i *)dest, z0);
+                dest += 8;
+                src += 8;
+                n_bytes -= 8 * sizeof(*dest);
+        }
+}
+#endif
+
+typedef void (*gds_bf_copy_fn_t)(uint64_t *dest, const uint64_t *src, size_t n_bytes);
+
+// name is one of generic, avx2, avx512 or NULL for the widest one the CPU
+// supports. Returns NULL if the requested kernel cannot run here.
+static gds_bf_copy_fn_t gds_bf_copy_select(const char *name)
+{
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+        if (!name)
+                name = __builtin_cpu_supports("avx512f") ? "avx512" :
+                        __builtin_cpu_supports("avx2") ? "avx2" : "generic";
+        if (!strcmp(name, "avx512"))
+                return __builtin_cpu_supports("avx512f") ? gds_bf_copy_avx512 : NULL;
+        if (!strcmp(name, "avx2"))
+                return __builtin_cpu_supports("avx2") ? gds_bf_copy_avx2 : NULL;
+#endif
+        if (!name || !strcmp(name, "generic"))
+                return gds_bf_copy_generic;
+        return NULL;
+}
+
+// copy out of a circular WQ. wq_begin/wq_end bound the send queue, when
+// NULL src is assumed not to wrap. WQEs are made of 64 bytes basic
+// blocks, so the split always falls on a 64 bytes boundary.
+static inline void gds_bf_copy_wq(gds_bf_copy_fn_t copy, uint64_t *dest, const uint64_t *src, size_t n_bytes,
+                                  const uint64_t *wq_begin, const uint64_t *wq_end)
+{
+        if (wq_end && src + n_bytes / sizeof(uint64_t) > wq_end) {
+                size_t head = (wq_end - src) * sizeof(uint64_t);
+                copy(dest, src, head);
+                dest += head / sizeof(uint64_t);
+                src = wq_begin;
+                n_bytes -= head;
+        }
+        copy(dest, src, n_bytes);
+}
+
 
 /*
  * Local variables:
@@ -125,7 +125,9 @@ int gds_mlx5_get_send_descs(gds_mlx5_send_info_t *mlx5_i, const gds_send_request
                         size_t len = op->wr.copy_op.len;
                         void *src = op->wr.copy_op.src;
                         gds_dbg("send inline detected\n");
-                        if (len < 8 || len > 64) {
+                        // whole WQE for BlueFlame, whose leading 8 bytes are
+                        // also a valid doorbell
+                        if (len < 8 || len > GDS_GPU_MAX_INLINE_SIZE || (len & 0x7)) {
                                 gds_err("unexpected len %zu\n", len);
                                 retcode = EINVAL;
                                 break;
@@ -32,6 +32,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <assert.h>
+#include <sys/mman.h>
 
 //#include <map>
 #include <algorithm>
@@ -48,6 +49,7 @@ using namespace std;
 #include "utils.hpp"
 #include "memmgr.hpp"
 #include "mem.hpp"
+#include "topo.hpp"
 
 //-----------------------------------------------------------------------------
 
@@ -67,6 +69,42 @@ gds_buf *gds_peer::alloc(size_t sz, uint32_t alignment)
         return buf;
 }
 
+// whole pages of our own, bound to alloc_numa_node before the provider
+// first touches them, and pinned for as long as the buffer lives; NULL
+// makes the provider allocate the buffer itself
+gds_buf *gds_peer::alloc_host(size_t length, uint32_t alignment)
+{
+        size_t size = ROUND_UP(length, GDS_HOST_PAGE_SIZE);
+        gds_buf *buf;
+        void *addr;
+        int ret;
+
+        if (alloc_numa_node < 0 || !gds_enable_numa_bind())
+                return NULL;
+        if (alignment > GDS_HOST_PAGE_SIZE) {
+                gds_dbg("alignment %u larger than a page, left to the provider\n", alignment);
+                return NULL;
+        }
+        addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (MAP_FAILED == addr) {
+                gds_warn("error %d in mmap, left to the provider\n", errno);
+                return NULL;
+        }
+        gds_numa_bind_range(addr, size, alloc_numa_node);
+        buf = new gds_buf(this, length);
+        buf->addr = addr;
+        buf->type = GDS_MEMORY_HOST;
+        ret = gds_pin_mem(addr, length, GDS_MEMORY_HOST, &buf->peer_addr);
+        if (ret) {
+                gds_warn("error %d while pinning host buffer, left to the provider\n", ret);
+                munmap(addr, size);
+                delete buf;
+                return NULL;
+        }
+        gds_dbg("host buffer %p size=%zu on NUMA node %d\n", addr, length, alloc_numa_node);
+        return buf;
+}
+
 gds_buf *gds_peer::buf_alloc_cq(size_t length, uint32_t dir, uint32_t alignment, int flags)
 {
         gds_buf *buf = NULL;
@@ -78,6 +116,7 @@ gds_buf *gds_peer::buf_alloc_cq(size_t length, uint32_t dir, uint32_t alignment,
                         buf = alloc(length, alignment);
                 } else {
                         gds_dbg("allocating CQ on Host mem\n");
+                        buf = alloc_host(length, alignment);
                 }
                 break;
         case (IBV_EXP_PEER_DIRECTION_FROM_PEER|IBV_EXP_PEER_DIRECTION_TO_CPU):
@@ -86,9 +125,11 @@ gds_buf *gds_peer::buf_alloc_cq(size_t length, uint32_t dir, uint32_t alignment,
                 // GPU does a store to the 'busy' field as part of the peek_cq task
                 // CPU polls on that field
                 gds_dbg("allocating CQ peer buf on Host mem\n");
+                buf = alloc_host(length, alignment);
                 break;
         case (IBV_EXP_PEER_DIRECTION_FROM_PEER|IBV_EXP_PEER_DIRECTION_TO_HCA):
                 gds_dbg("allocating CQ dbrec on Host mem\n");
+                buf = alloc_host(length, alignment);
                 break;
         default:
                 gds_err("unexpected dir 0x%x\n", dir);
@@ -106,8 +147,24 @@ gds_buf *gds_peer::buf_alloc_wq(size_t length, uint32_t dir, uint32_t alignment,
                 if (GDS_ALLOC_DBREC_ON_GPU == (flags & GDS_ALLOC_DBREC_MASK)) {
                         gds_dbg("allocating DBREC on GPU mem\n");
                         buf = alloc(length, alignment);
+                        if (buf)
+                                alloc_done |= GDS_ALLOC_DBREC_ON_GPU;
                 } else {
                         gds_dbg("allocating DBREC on Host mem\n");
+                        buf = alloc_host(length, alignment);
+                }
+                break;
+        case IBV_EXP_PEER_DIRECTION_FROM_CPU|IBV_EXP_PEER_DIRECTION_TO_HCA:
+        case IBV_EXP_PEER_DIRECTION_FROM_CPU|IBV_EXP_PEER_DIRECTION_FROM_PEER|IBV_EXP_PEER_DIRECTION_TO_HCA:
+                // WQ buf, CPU writes go through the GDRcopy mapping
+                if (GDS_ALLOC_WQ_ON_GPU == (flags & GDS_ALLOC_WQ_MASK)) {
+                        gds_dbg("allocating WQ on GPU mem\n");
+                        buf = alloc(length, alignment);
+                        if (buf)
+                                alloc_done |= GDS_ALLOC_WQ_ON_GPU;
+                } else {
+                        gds_dbg("allocating WQ on Host mem\n");
+                        buf = alloc_host(length, alignment);
                 }
                 break;
         default:
@@ -138,14 +195,20 @@ gds_buf *gds_peer::buf_alloc(obj_type type, size_t length, uint32_t dir, uint32_
 
 void gds_peer::free(gds_buf *buf)
 {
-        int ret = gds_peer_mfree(gpu_id, 0, buf->addr, buf->handle);
-        if (ret) {
-                gds_err("error freeing GPU mapped memory\n");
+        if (buf->type == GDS_MEMORY_HOST) {
+                gds_unpin_mem(buf->addr, buf->length);
+                munmap(buf->addr, ROUND_UP(buf->length, GDS_HOST_PAGE_SIZE));
+        } else {
+                int ret = gds_peer_mfree(gpu_id, 0, buf->addr, buf->handle);
+                if (ret) {
+                        gds_err("error freeing GPU mapped memory\n");
+                }
         }
         delete buf;
 }
 
-// buf is a GPU mem buffer, which has a CPU mapping thanks to GDRcopy
+// buf is either a GPU mem buffer, which has a CPU mapping thanks to
+// GDRcopy, or pinned host memory, both already mapped for the GPU
 gds_range *gds_peer::range_from_buf(gds_buf *buf, void *start, size_t length)
 {
         gds_range *range = new gds_range;
@@ -156,7 +219,8 @@ gds_range *gds_peer::range_from_buf(gds_buf *buf, void *start, size_t length)
         range->dptr = buf->peer_addr + ((ptrdiff_t)start - (ptrdiff_t)buf->addr);
         range->size = length;
         range->buf = buf;
-        range->type = GDS_MEMORY_GPU;
+        range->type = buf->type;
+        range->peer = this;
         return range;
 }
 
@@ -180,6 +244,7 @@ gds_range *gds_peer::register_range(void *start, size_t length, int flags)
         range->size = length;
         range->buf = NULL;
         range->type = mem_type;
+        range->peer = this;
 out:
         gds_dbg("range=%p\n", range);
         return range;
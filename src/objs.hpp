@@ -27,6 +27,8 @@
 
 #pragma once
 
+#include "utils.hpp" // gds_gpu_caps_t
+
 static const size_t max_gpus = 16;
 
 typedef struct ibv_exp_peer_direct_attr gds_peer_attr;
@@ -37,8 +39,10 @@ struct gds_buf: ibv_exp_peer_buf {
         gds_peer   *peer;
         CUdeviceptr peer_addr;
         void       *handle;
+        // GPU memory with a GDRcopy mapping, or host pages of our own
+        gds_memory_type_t type;
 
-        gds_buf(gds_peer *p, size_t sz): peer(p), peer_addr(0), handle(NULL) {
+        gds_buf(gds_peer *p, size_t sz): peer(p), peer_addr(0), handle(NULL), type(GDS_MEMORY_GPU) {
                 addr = NULL;
                 length = sz;
                 comp_mask = 0;
@@ -51,6 +55,7 @@ struct gds_range {
         size_t size;
         gds_buf *buf;
         gds_memory_type_t type;
+        gds_peer *peer; // owner, NULL for ranges not made by a peer
 };
 
 static inline uint64_t range_to_id(gds_range *range)
@@ -69,10 +74,20 @@ struct gds_peer {
         int gpu_id;
         CUdevice gpu_dev;
         CUcontext gpu_ctx;
+        // probed once at registration, used when posting the ops of this peer
+        gds_gpu_caps_t caps;
+        // gds_db_strategy_t in use, -1 for the env defaults
+        int db_strategy;
 
         // before calling ibv_exp_create_cq(), patch flags with appropriate values
         enum obj_type { NONE, CQ, WQ, N_IBV_OBJS } alloc_type;
         int alloc_flags; // out of gds_flags_t
+        // GDS_ALLOC_*_ON_GPU flags actually served in GPU memory since
+        // alloc_flags was last set
+        int alloc_done;
+        // NUMA node of the host buffers, set together with alloc_flags,
+        // -1 to leave them to the provider
+        int alloc_numa_node;
 
         // register peer memory
         gds_range *range_from_buf(gds_buf *buf, void *start, size_t length);
@@ -83,6 +98,7 @@ struct gds_peer {
         void unregister(gds_range *range);
 
         gds_buf *alloc(size_t length, uint32_t alignment);
+        gds_buf *alloc_host(size_t length, uint32_t alignment);
         gds_buf *buf_alloc_cq(size_t length, uint32_t dir, uint32_t alignment, int flags);
         gds_buf *buf_alloc_wq(size_t length, uint32_t dir, uint32_t alignment, int flags);
         gds_buf *buf_alloc(obj_type type, size_t length, uint32_t dir, uint32_t alignment, int flags);
@@ -0,0 +1,453 @@
+/* Copyright (c) 2016, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include <map>
+#include <deque>
+
+#include <gdsync.h>
+#include <gdsync/tools.h>
+
+#include "utils.hpp"
+#include "archutils.h"
+
+//-----------------------------------------------------------------------------
+// GPU timestamp probes, enabled by GDS_ENABLE_PROBES=1.
+//
+// A probe is a single-thread kernel which stores %globaltimer into a slot of
+// a ring of host memory. gds_stream_post_descriptors launches one before the
+// batch and one after each group of consecutive descriptors of the same kind,
+// so that the GPU time spent in a group is the difference of the two
+// timestamps around it. The flush of a wait, which is folded into its last
+// poll, is posted on its own so that it gets a group of its own.
+//
+// The offset between %globaltimer and CLOCK_MONOTONIC is measured when the
+// ring of a CUDA context is set up, which gives the delay between the host
+// posting a batch and the GPU front end reaching it.
+//
+// The kernel launches are far from free and serialize the batch, so the
+// absolute numbers are inflated; they are meant to compare waits to sends
+// and flushes, not to measure end-to-end latencies.
+
+static const char gds_probe_ptx[] =
+        ".version 5.0\n"
+        ".target sm_50\n"
+        ".address_size 64\n"
+        ".visible .entry gds_probe_ts(.param .u64 slot)\n"
+        "{\n"
+        "        .reg .u64 %rd<4>;\n"
+        "        ld.param.u64 %rd1, [slot];\n"
+        "        cvta.to.global.u64 %rd2, %rd1;\n"
+        "        mov.u64 %rd3, %globaltimer;\n"
+        "        st.volatile.global.u64 [%rd2], %rd3;\n"
+        "        membar.sys;\n"
+        "        ret;\n"
+        "}\n";
+
+enum {
+        GDS_PROBE_CALIB_ITERS = 8,
+};
+
+struct gds_probe_group {
+        int kind;
+        // slot sequence numbers, begin is the end of the previous group
+        // unless this is the first group of the batch
+        uint64_t begin;
+        uint64_t end;
+        bool last;
+        // host time of the post, first group of the batch only
+        uint64_t host_ns;
+};
+
+struct gds_probe_ctx {
+        CUmodule mod;
+        CUfunction fn;
+        gds_mem_desc_t ring;
+        volatile uint64_t *ts;
+        // slots in [tail,head) are in use
+        uint64_t head;
+        uint64_t tail;
+        // CLOCK_MONOTONIC minus %globaltimer
+        int64_t offset_ns;
+        std::deque<gds_probe_group> pending;
+};
+
+typedef std::map<CUcontext, gds_probe_ctx *> gds_probe_ctx_map;
+
+static pthread_mutex_t gds_probe_lock = PTHREAD_MUTEX_INITIALIZER;
+static gds_probe_ctx_map gds_probe_ctxs;
+static gds_probe_hist_t gds_probe_hists[GDS_PROBE_NUM_KINDS];
+static size_t gds_probe_ring_size = 4096;
+static size_t gds_probe_dropped = 0;
+int gds_probe_level = -1;
+
+void gds_probe_init()
+{
+        int level = 0;
+        const char *env;
+
+        pthread_mutex_lock(&gds_probe_lock);
+        if (gds_probe_level >= 0)
+                goto out;
+        env = getenv("GDS_ENABLE_PROBES");
+        if (env)
+                level = !!atoi(env);
+        if (level) {
+                env = getenv("GDS_PROBE_RING_SIZE");
+                if (env) {
+                        size_t size = strtoul(env, NULL, 0);
+                        gds_probe_ring_size = size < 64 ? 64 : size;
+                }
+                for (int k = 0; k < GDS_PROBE_NUM_KINDS; ++k)
+                        gds_probe_hists[k].min_ns = UINT64_MAX;
+                gds_dbg("GDS_ENABLE_PROBES=%d ring_size=%zu\n", level, gds_probe_ring_size);
+        }
+        ACCESS_ONCE(gds_probe_level) = level;
+out:
+        pthread_mutex_unlock(&gds_probe_lock);
+}
+
+//-----------------------------------------------------------------------------
+
+static void gds_probe_hist_add(int kind, uint64_t ns)
+{
+        gds_probe_hist_t *h = &gds_probe_hists[kind];
+        int b = ns ? 63 - __builtin_clzll(ns) : 0;
+        if (b >= GDS_PROBE_HIST_BUCKETS)
+                b = GDS_PROBE_HIST_BUCKETS - 1;
+        h->buckets[b]++;
+        h->count++;
+        h->sum_ns += ns;
+        if (ns < h->min_ns)
+                h->min_ns = ns;
+        if (ns > h->max_ns)
+                h->max_ns = ns;
+}
+
+static inline volatile uint64_t *gds_probe_slot(gds_probe_ctx *pc, uint64_t seq)
+{
+        return pc->ts + seq % gds_probe_ring_size;
+}
+
+static int gds_probe_launch(gds_probe_ctx *pc, CUstream stream, uint64_t seq)
+{
+        CUdeviceptr slot = pc->ring.d_ptr + (seq % gds_probe_ring_size) * sizeof(uint64_t);
+        void *args[] = { &slot };
+        CUresult res = cuLaunchKernel(pc->fn, 1, 1, 1, 1, 1, 1, 0, stream, args, NULL);
+        if (CUDA_SUCCESS != res) {
+                gds_err("got CUDA result %d while launching probe\n", res);
+                return gds_curesult_to_errno(res);
+        }
+        return 0;
+}
+
+// consumes the groups whose probes have both landed, in posting order
+static void gds_probe_drain(gds_probe_ctx *pc)
+{
+        while (!pc->pending.empty()) {
+                const gds_probe_group &g = pc->pending.front();
+                uint64_t b = *gds_probe_slot(pc, g.begin);
+                uint64_t e = *gds_probe_slot(pc, g.end);
+                if (!b || !e)
+                        break;
+                rmb();
+                gds_probe_hist_add(g.kind, e > b ? e - b : 0);
+                if (g.host_ns) {
+                        int64_t delay = (int64_t)(b + pc->offset_ns - g.host_ns);
+                        gds_probe_hist_add(GDS_PROBE_LAUNCH, delay > 0 ? delay : 0);
+                }
+                uint64_t new_tail = g.last ? g.end + 1 : g.end;
+                for (; pc->tail < new_tail; ++pc->tail)
+                        *gds_probe_slot(pc, pc->tail) = 0;
+                pc->pending.pop_front();
+        }
+}
+
+static int gds_probe_calibrate(gds_probe_ctx *pc)
+{
+        int retcode = 0;
+        CUstream stream = NULL;
+        uint64_t best = UINT64_MAX;
+
+        if (CUDA_SUCCESS != cuStreamCreate(&stream, CU_STREAM_NON_BLOCKING)) {
+                gds_err("error while creating calibration stream\n");
+                return EINVAL;
+        }
+        for (int i = 0; i < GDS_PROBE_CALIB_ITERS; ++i) {
+                volatile uint64_t *slot = gds_probe_slot(pc, pc->head);
+                uint64_t h0 = gds_now_ns();
+                retcode = gds_probe_launch(pc, stream, pc->head);
+                if (retcode)
+                        break;
+                if (CUDA_SUCCESS != cuStreamSynchronize(stream)) {
+                        retcode = EINVAL;
+                        break;
+                }
+                uint64_t h1 = gds_now_ns();
+                // the tightest bracket gives the best estimate
+                if (h1 - h0 < best) {
+                        best = h1 - h0;
+                        pc->offset_ns = (int64_t)(h0 + (h1 - h0) / 2) - (int64_t)*slot;
+                }
+                *slot = 0;
+        }
+        cuStreamDestroy(stream);
+        if (!retcode)
+                gds_dbg("probe clock offset %lld ns, bracket %llu ns\n",
+                        (long long)pc->offset_ns, (unsigned long long)best);
+        return retcode;
+}
+
+static void gds_probe_ctx_free(gds_probe_ctx *pc)
+{
+        if (pc->mod)
+                cuModuleUnload(pc->mod);
+        if (pc->ts)
+                gds_free_mapped_memory(&pc->ring);
+        delete pc;
+}
+
+// NULL if probes cannot be used on the context of stream
+static gds_probe_ctx *gds_probe_get_ctx(CUstream stream)
+{
+        CUcontext ctx = NULL, cur = NULL;
+        gds_probe_ctx *pc;
+        gds_probe_ctx_map::iterator it;
+        CUresult res;
+
+        if (CUDA_SUCCESS != cuStreamGetCtx(stream, &ctx))
+                return NULL;
+        it = gds_probe_ctxs.find(ctx);
+        if (it != gds_probe_ctxs.end())
+                return it->second;
+
+        // an entry is added anyway, so that a failing context is not retried
+        gds_probe_ctxs[ctx] = NULL;
+        if (CUDA_SUCCESS != cuCtxGetCurrent(&cur) || cur != ctx) {
+                gds_warn("stream context %p is not current, disabling probes on it\n", ctx);
+                return NULL;
+        }
+        pc = new gds_probe_ctx();
+        if (gds_alloc_mapped_memory(&pc->ring, gds_probe_ring_size * sizeof(uint64_t), GDS_MEMORY_HOST)) {
+                gds_err("error while allocating probe ring\n");
+                goto err;
+        }
+        pc->ts = (volatile uint64_t *)pc->ring.h_ptr;
+        memset(pc->ring.h_ptr, 0, gds_probe_ring_size * sizeof(uint64_t));
+        res = cuModuleLoadData(&pc->mod, gds_probe_ptx);
+        if (CUDA_SUCCESS != res) {
+                gds_err("got CUDA result %d while loading probe kernel\n", res);
+                pc->mod = NULL;
+                goto err;
+        }
+        res = cuModuleGetFunction(&pc->fn, pc->mod, "gds_probe_ts");
+        if (CUDA_SUCCESS != res) {
+                gds_err("got CUDA result %d while looking up probe kernel\n", res);
+                goto err;
+        }
+        if (gds_probe_calibrate(pc)) {
+                gds_err("error while calibrating probe clock\n");
+                goto err;
+        }
+        gds_probe_ctxs[ctx] = pc;
+        return pc;
+err:
+        gds_warn("disabling probes on context %p\n", ctx);
+        gds_probe_ctx_free(pc);
+        return NULL;
+}
+
+static int gds_probe_kind(gds_descriptor_t *desc)
+{
+        switch (desc->tag) {
+        case GDS_TAG_SEND:
+                return GDS_PROBE_SEND;
+        case GDS_TAG_WRITE_VALUE32:
+        case GDS_TAG_WRITE_VALUE64:
+                return GDS_PROBE_WRITE;
+        default:
+                return GDS_PROBE_WAIT;
+        }
+}
+
+// detaches the trailing flush of the memops of a wait group into flush
+// returns false if there is none
+static bool gds_probe_split_flush(CUstreamBatchMemOpParams *params, int &n_params, CUstreamBatchMemOpParams *flush)
+{
+        CUstreamBatchMemOpParams *last;
+        if (!n_params)
+                return false;
+        last = &params[n_params - 1];
+        if (last->operation == CU_STREAM_MEM_OP_FLUSH_REMOTE_WRITES) {
+                *flush = *last;
+                --n_params;
+                return true;
+        }
+        if ((last->operation == CU_STREAM_MEM_OP_WAIT_VALUE_32 ||
+             last->operation == CU_STREAM_MEM_OP_WAIT_VALUE_64) &&
+            (last->waitValue.flags & CU_STREAM_WAIT_VALUE_FLUSH)) {
+                last->waitValue.flags &= ~CU_STREAM_WAIT_VALUE_FLUSH;
+                memset(flush, 0, sizeof(*flush));
+                flush->operation = CU_STREAM_MEM_OP_FLUSH_REMOTE_WRITES;
+                flush->flushRemoteWrites.flags = 0;
+                return true;
+        }
+        return false;
+}
+
+static int gds_probe_post_group(gds_probe_ctx *pc, CUstream stream, int kind, int n_params,
+                                CUstreamBatchMemOpParams *params, uint64_t host_ns)
+{
+        int retcode = 0;
+        gds_probe_group g;
+
+        if (n_params) {
+                retcode = gds_stream_batch_ops(stream, n_params, params, 0);
+                if (retcode)
+                        return retcode;
+        }
+        g.kind = kind;
+        g.begin = pc->head - 1;
+        g.end = pc->head;
+        g.last = false;
+        g.host_ns = host_ns;
+        retcode = gds_probe_launch(pc, stream, pc->head);
+        if (retcode)
+                return retcode;
+        pc->head++;
+        pc->pending.push_back(g);
+        return 0;
+}
+
+int gds_probe_post_descriptors(CUstream stream, size_t n_descs, gds_descriptor_t *descs,
+                               CUstreamBatchMemOpParams *params, const int *first_param)
+{
+        int retcode = 0;
+        gds_probe_ctx *pc;
+        uint64_t host_ns;
+        size_t i, j;
+
+        pthread_mutex_lock(&gds_probe_lock);
+        pc = gds_probe_get_ctx(stream);
+        if (!pc)
+                goto unprobed;
+        gds_probe_drain(pc);
+        // a probe per descriptor and per flush in the worst case
+        if (gds_probe_ring_size - (pc->head - pc->tail) < 2 * n_descs + 1) {
+                ++gds_probe_dropped;
+                goto unprobed;
+        }
+
+        host_ns = gds_now_ns();
+        retcode = gds_probe_launch(pc, stream, pc->head);
+        if (retcode)
+                goto out;
+        pc->head++;
+        for (i = 0; i < n_descs; i = j) {
+                int kind = gds_probe_kind(descs + i);
+                for (j = i + 1; j < n_descs && gds_probe_kind(descs + j) == kind; ++j)
+                        ;
+                int n_params = first_param[j] - first_param[i];
+                CUstreamBatchMemOpParams flush;
+                bool has_flush = kind == GDS_PROBE_WAIT && gds_probe_split_flush(params + first_param[i], n_params, &flush);
+                retcode = gds_probe_post_group(pc, stream, kind, n_params, params + first_param[i], host_ns);
+                if (!retcode && has_flush)
+                        retcode = gds_probe_post_group(pc, stream, GDS_PROBE_FLUSH, 1, &flush, 0);
+                if (retcode)
+                        goto out;
+                host_ns = 0;
+        }
+        assert(!pc->pending.empty());
+        pc->pending.back().last = true;
+out:
+        if (retcode)
+                // the slots of a broken batch are never released, the ring
+                // eventually fills up and later batches go unprobed
+                gds_err("error %d while posting probed batch\n", retcode);
+        pthread_mutex_unlock(&gds_probe_lock);
+        return retcode;
+
+unprobed:
+        pthread_mutex_unlock(&gds_probe_lock);
+        return gds_stream_batch_ops(stream, first_param[n_descs], params, 0);
+}
+
+//-----------------------------------------------------------------------------
+
+int gds_probe_get_hist(gds_probe_kind_t kind, gds_probe_hist_t *hist)
+{
+        if (kind < 0 || kind >= GDS_PROBE_NUM_KINDS || !hist)
+                return EINVAL;
+        if (!gds_probe_enabled())
+                return ENOTSUP;
+        pthread_mutex_lock(&gds_probe_lock);
+        for (gds_probe_ctx_map::iterator it = gds_probe_ctxs.begin(); it != gds_probe_ctxs.end(); ++it)
+                if (it->second)
+                        gds_probe_drain(it->second);
+        *hist = gds_probe_hists[kind];
+        if (!hist->count)
+                hist->min_ns = 0;
+        if (gds_probe_dropped)
+                gds_dbg("%zu batches went unprobed, ring full\n", gds_probe_dropped);
+        pthread_mutex_unlock(&gds_probe_lock);
+        return 0;
+}
+
+void gds_probe_reset()
+{
+        pthread_mutex_lock(&gds_probe_lock);
+        for (gds_probe_ctx_map::iterator it = gds_probe_ctxs.begin(); it != gds_probe_ctxs.end(); ++it)
+                if (it->second)
+                        gds_probe_drain(it->second);
+        memset(gds_probe_hists, 0, sizeof(gds_probe_hists));
+        for (int k = 0; k < GDS_PROBE_NUM_KINDS; ++k)
+                gds_probe_hists[k].min_ns = UINT64_MAX;
+        gds_probe_dropped = 0;
+        pthread_mutex_unlock(&gds_probe_lock);
+}
+
+//-----------------------------------------------------------------------------
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ *  indent-tabs-mode: nil
+ * End:
+ */
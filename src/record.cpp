@@ -0,0 +1,470 @@
+/* Copyright (c) 2016, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <vector>
+
+#include <gdsync.h>
+#include <gdsync/tools.h>
+
+#include "utils.hpp"
+#include "objs.hpp"
+
+//-----------------------------------------------------------------------------
+// Capture of descriptor batches, enabled by GDS_RECORD_FILE=<prefix>, which
+// writes to <prefix>.<pid>.
+//
+// For every batch translated by gds_descriptors_to_params, the peer ops of
+// the send and wait descriptors are stored with their target addresses
+// resolved, together with the memops they were translated into. Replay
+// rebuilds the peer op lists on top of fake ranges and translates them again
+// with gds_post_ops, so it needs neither a GPU nor an HCA. The memops of the
+// other descriptors are copied over as they were captured.
+
+#define GDS_REC_MAGIC   "GDSREC"
+#define GDS_REC_VERSION 1
+
+struct gds_rec_file_hdr {
+        char     magic[8];
+        uint32_t version;
+        uint32_t pid;
+        uint32_t param_size;
+        uint32_t op_size;
+};
+
+struct gds_rec_batch_hdr {
+        uint32_t n_descs;
+        uint32_t n_params;
+        uint64_t translate_ns;
+};
+
+// followed by n_ops gds_rec_op
+struct gds_rec_desc_hdr {
+        uint32_t tag;
+        uint32_t post_flags;
+        uint32_t first_param;
+        uint32_t n_params;
+        uint32_t n_ops;
+        uint32_t pad;
+};
+
+// COPY_BLOCK ops are followed by their len bytes, padded to 8
+struct gds_rec_op {
+        uint32_t type;
+        uint32_t len;
+        uint64_t data;
+        uint64_t dptr;
+        uint32_t mem_type;
+        uint32_t pad;
+};
+
+static inline size_t gds_rec_pad8(size_t len)
+{
+        return (len + 7) & ~(size_t)7;
+}
+
+static pthread_mutex_t gds_record_lock = PTHREAD_MUTEX_INITIALIZER;
+static int gds_record_fd = -1;
+int gds_record_level = -1;
+
+uint64_t gds_now_ns()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int gds_record_write_all(int fd, const void *buf, size_t size)
+{
+        const char *p = (const char *)buf;
+        while (size) {
+                ssize_t ret = write(fd, p, size);
+                if (ret < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return errno;
+                }
+                p += ret;
+                size -= ret;
+        }
+        return 0;
+}
+
+void gds_record_init()
+{
+        int level = 0;
+        const char *env;
+
+        pthread_mutex_lock(&gds_record_lock);
+        if (gds_record_level >= 0)
+                goto out;
+        env = getenv("GDS_RECORD_FILE");
+        if (env && *env) {
+                char path[4096];
+                struct gds_rec_file_hdr hdr;
+                snprintf(path, sizeof(path), "%s.%d", env, getpid());
+                gds_record_fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+                if (gds_record_fd < 0) {
+                        gds_warn("cannot create %s, error %d, recording disabled\n", path, errno);
+                        goto set;
+                }
+                memset(&hdr, 0, sizeof(hdr));
+                memcpy(hdr.magic, GDS_REC_MAGIC, sizeof(GDS_REC_MAGIC));
+                hdr.version = GDS_REC_VERSION;
+                hdr.pid = getpid();
+                hdr.param_size = sizeof(CUstreamBatchMemOpParams);
+                hdr.op_size = sizeof(struct gds_rec_op);
+                if (gds_record_write_all(gds_record_fd, &hdr, sizeof(hdr))) {
+                        gds_warn("error while writing %s, recording disabled\n", path);
+                        close(gds_record_fd);
+                        gds_record_fd = -1;
+                        goto set;
+                }
+                gds_dbg("recording descriptor batches to %s\n", path);
+                level = 1;
+        }
+set:
+        ACCESS_ONCE(gds_record_level) = level;
+out:
+        pthread_mutex_unlock(&gds_record_lock);
+}
+
+//-----------------------------------------------------------------------------
+
+static void gds_record_append(std::vector<char> &buf, const void *p, size_t size)
+{
+        buf.insert(buf.end(), (const char *)p, (const char *)p + size);
+}
+
+static uint32_t gds_record_ops(std::vector<char> &buf, size_t n_ops, struct peer_op_wr *op)
+{
+        uint32_t n;
+        for (n = 0; op && n < n_ops; op = op->next, ++n) {
+                struct gds_rec_op rop;
+                gds_range *range = NULL;
+                memset(&rop, 0, sizeof(rop));
+                rop.type = op->type;
+                switch (op->type) {
+                case IBV_EXP_PEER_OP_FENCE:
+                        rop.data = op->wr.fence.fence_flags;
+                        break;
+                case IBV_EXP_PEER_OP_STORE_DWORD:
+                case IBV_EXP_PEER_OP_POLL_AND_DWORD:
+                case IBV_EXP_PEER_OP_POLL_GEQ_DWORD:
+                case IBV_EXP_PEER_OP_POLL_NOR_DWORD:
+                        range = range_from_id(op->wr.dword_va.target_id);
+                        rop.data = op->wr.dword_va.data;
+                        rop.dptr = range->dptr + op->wr.dword_va.offset;
+                        break;
+                case IBV_EXP_PEER_OP_STORE_QWORD:
+                        range = range_from_id(op->wr.qword_va.target_id);
+                        rop.data = op->wr.qword_va.data;
+                        rop.dptr = range->dptr + op->wr.qword_va.offset;
+                        break;
+                case IBV_EXP_PEER_OP_COPY_BLOCK:
+                        range = range_from_id(op->wr.copy_op.target_id);
+                        rop.len = op->wr.copy_op.len;
+                        rop.dptr = range->dptr + op->wr.copy_op.offset;
+                        break;
+                default:
+                        break;
+                }
+                if (range)
+                        rop.mem_type = range->type;
+                gds_record_append(buf, &rop, sizeof(rop));
+                if (op->type == IBV_EXP_PEER_OP_COPY_BLOCK) {
+                        gds_record_append(buf, op->wr.copy_op.src, rop.len);
+                        buf.resize(buf.size() + gds_rec_pad8(rop.len) - rop.len, 0);
+                }
+        }
+        return n;
+}
+
+void gds_record_batch(size_t n_descs, gds_descriptor_t *descs, const int *first_param, const int *post_flags,
+                      int n_params, CUstreamBatchMemOpParams *params, uint64_t translate_ns)
+{
+        std::vector<char> buf;
+        struct gds_rec_batch_hdr bhdr;
+
+        bhdr.n_descs = n_descs;
+        bhdr.n_params = n_params;
+        bhdr.translate_ns = translate_ns;
+        gds_record_append(buf, &bhdr, sizeof(bhdr));
+        for (size_t i = 0; i < n_descs; ++i) {
+                gds_descriptor_t *desc = descs + i;
+                struct gds_rec_desc_hdr dhdr;
+                size_t hdr_pos = buf.size();
+
+                memset(&dhdr, 0, sizeof(dhdr));
+                dhdr.tag = desc->tag;
+                dhdr.post_flags = post_flags[i];
+                dhdr.first_param = first_param[i];
+                dhdr.n_params = first_param[i+1] - first_param[i];
+                gds_record_append(buf, &dhdr, sizeof(dhdr));
+                if (desc->tag == GDS_TAG_SEND)
+                        dhdr.n_ops = gds_record_ops(buf, desc->send->commit.entries, desc->send->commit.storage);
+                else if (desc->tag == GDS_TAG_WAIT)
+                        dhdr.n_ops = gds_record_ops(buf, desc->wait->peek.entries, desc->wait->peek.storage);
+                memcpy(&buf[hdr_pos], &dhdr, sizeof(dhdr));
+        }
+        gds_record_append(buf, params, n_params * sizeof(*params));
+
+        pthread_mutex_lock(&gds_record_lock);
+        if (gds_record_fd >= 0 && gds_record_write_all(gds_record_fd, &buf[0], buf.size())) {
+                gds_warn("error while recording, recording disabled\n");
+                close(gds_record_fd);
+                gds_record_fd = -1;
+                ACCESS_ONCE(gds_record_level) = 0;
+        }
+        pthread_mutex_unlock(&gds_record_lock);
+}
+
+//-----------------------------------------------------------------------------
+
+// checked cursor over the file contents
+struct gds_rec_reader {
+        const char *p;
+        const char *end;
+        const void *get(size_t size) {
+                if ((size_t)(end - p) < size)
+                        return NULL;
+                const void *ret = p;
+                p += size;
+                return ret;
+        }
+};
+
+static int gds_replay_batch(gds_rec_reader &rd, gds_replay_stats_t *stats)
+{
+        int retcode = 0;
+        const struct gds_rec_batch_hdr *bhdr;
+        std::vector<const struct gds_rec_desc_hdr *> dhdrs;
+        std::vector<struct peer_op_wr> ops;
+        std::vector<gds_range> ranges;
+        std::vector<size_t> first_op;
+        std::vector<CUstreamBatchMemOpParams> params;
+        const CUstreamBatchMemOpParams *rec_params;
+        size_t n_ops = 0;
+        uint64_t t0;
+        int idx = 0;
+
+        bhdr = (const struct gds_rec_batch_hdr *)rd.get(sizeof(*bhdr));
+        if (!bhdr)
+                return EINVAL;
+
+        // first pass, count ops so that ops and ranges are never reallocated
+        const char *descs_begin = rd.p;
+        for (uint32_t i = 0; i < bhdr->n_descs; ++i) {
+                const struct gds_rec_desc_hdr *dhdr = (const struct gds_rec_desc_hdr *)rd.get(sizeof(*dhdr));
+                if (!dhdr)
+                        return EINVAL;
+                for (uint32_t n = 0; n < dhdr->n_ops; ++n) {
+                        const struct gds_rec_op *rop = (const struct gds_rec_op *)rd.get(sizeof(*rop));
+                        if (!rop)
+                                return EINVAL;
+                        if (rop->type == IBV_EXP_PEER_OP_COPY_BLOCK && !rd.get(gds_rec_pad8(rop->len)))
+                                return EINVAL;
+                }
+                n_ops += dhdr->n_ops;
+        }
+        rec_params = (const CUstreamBatchMemOpParams *)rd.get(bhdr->n_params * sizeof(CUstreamBatchMemOpParams));
+        if (!rec_params)
+                return EINVAL;
+
+        // second pass, rebuild the op lists
+        gds_rec_reader drd = { descs_begin, rd.p };
+        ops.resize(n_ops);
+        ranges.resize(n_ops);
+        memset(&ops[0], 0, n_ops * sizeof(ops[0]));
+        n_ops = 0;
+        for (uint32_t i = 0; i < bhdr->n_descs; ++i) {
+                const struct gds_rec_desc_hdr *dhdr = (const struct gds_rec_desc_hdr *)drd.get(sizeof(*dhdr));
+                dhdrs.push_back(dhdr);
+                first_op.push_back(n_ops);
+                if (dhdr->first_param + dhdr->n_params > bhdr->n_params)
+                        return EINVAL;
+                for (uint32_t n = 0; n < dhdr->n_ops; ++n, ++n_ops) {
+                        const struct gds_rec_op *rop = (const struct gds_rec_op *)drd.get(sizeof(*rop));
+                        struct peer_op_wr *op = &ops[n_ops];
+                        gds_range *range = &ranges[n_ops];
+                        range->va = NULL;
+                        range->dptr = rop->dptr;
+                        range->size = rop->len ? rop->len : sizeof(uint64_t);
+                        range->buf = NULL;
+                        range->type = (gds_memory_type_t)rop->mem_type;
+                        op->type = (enum ibv_exp_peer_op)rop->type;
+                        op->next = (n + 1 < dhdr->n_ops) ? op + 1 : NULL;
+                        switch (rop->type) {
+                        case IBV_EXP_PEER_OP_FENCE:
+                                op->wr.fence.fence_flags = rop->data;
+                                break;
+                        case IBV_EXP_PEER_OP_STORE_DWORD:
+                        case IBV_EXP_PEER_OP_POLL_AND_DWORD:
+                        case IBV_EXP_PEER_OP_POLL_GEQ_DWORD:
+                        case IBV_EXP_PEER_OP_POLL_NOR_DWORD:
+                                op->wr.dword_va.data = rop->data;
+                                op->wr.dword_va.target_id = range_to_id(range);
+                                op->wr.dword_va.offset = 0;
+                                break;
+                        case IBV_EXP_PEER_OP_STORE_QWORD:
+                                op->wr.qword_va.data = rop->data;
+                                op->wr.qword_va.target_id = range_to_id(range);
+                                op->wr.qword_va.offset = 0;
+                                break;
+                        case IBV_EXP_PEER_OP_COPY_BLOCK:
+                                op->wr.copy_op.src = (void *)drd.get(gds_rec_pad8(rop->len));
+                                op->wr.copy_op.len = rop->len;
+                                op->wr.copy_op.target_id = range_to_id(range);
+                                op->wr.copy_op.offset = 0;
+                                break;
+                        default:
+                                break;
+                        }
+                }
+        }
+
+        // worst case for the peer ops, plus the memops copied over
+        params.resize(n_ops * GDS_MAX_OPS_PER_VALUE64 + bhdr->n_params + 1);
+        t0 = gds_now_ns();
+        for (uint32_t i = 0; i < bhdr->n_descs; ++i) {
+                const struct gds_rec_desc_hdr *dhdr = dhdrs[i];
+                switch (dhdr->tag) {
+                case GDS_TAG_SEND:
+                case GDS_TAG_WAIT:
+                        if (!dhdr->n_ops)
+                                break;
+                        retcode = gds_post_ops(dhdr->n_ops, &ops[first_op[i]], &params[0], idx, dhdr->post_flags);
+                        if (retcode) {
+                                gds_err("error %d while translating descriptor %u\n", retcode, i);
+                                return retcode;
+                        }
+                        break;
+                default:
+                        memcpy(&params[idx], rec_params + dhdr->first_param, dhdr->n_params * sizeof(CUstreamBatchMemOpParams));
+                        idx += dhdr->n_params;
+                        break;
+                }
+        }
+        stats->translate_us += (gds_now_ns() - t0) / 1000.0;
+        stats->recorded_translate_us += bhdr->translate_ns / 1000.0;
+        stats->n_batches++;
+        stats->n_descs += bhdr->n_descs;
+        stats->n_peer_ops += n_ops;
+        stats->n_recorded_params += bhdr->n_params;
+        stats->n_params += idx;
+        return retcode;
+}
+
+int gds_replay_file(const char *path, int db_strategy, gds_replay_stats_t *stats)
+{
+        int retcode = 0;
+        int fd = -1;
+        struct stat st;
+        std::vector<char> buf;
+        const struct gds_rec_file_hdr *hdr;
+        gds_rec_reader rd;
+
+        if (!path || !stats)
+                return EINVAL;
+        memset(stats, 0, sizeof(*stats));
+        if (db_strategy >= GDS_DB_NUM_STRATEGIES ||
+            (db_strategy >= 0 && !gds_db_strategy_is_available(db_strategy))) {
+                gds_err("doorbell strategy %d is not available\n", db_strategy);
+                return ENOTSUP;
+        }
+
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+                retcode = errno;
+                gds_err("error %d while opening %s\n", retcode, path);
+                return retcode;
+        }
+        if (fstat(fd, &st)) {
+                retcode = errno;
+                goto out;
+        }
+        buf.resize(st.st_size);
+        if (st.st_size && read(fd, &buf[0], st.st_size) != st.st_size) {
+                gds_err("error while reading %s\n", path);
+                retcode = EIO;
+                goto out;
+        }
+        rd.p = buf.empty() ? NULL : &buf[0];
+        rd.end = rd.p + buf.size();
+        hdr = (const struct gds_rec_file_hdr *)rd.get(sizeof(*hdr));
+        if (!hdr ||
+            memcmp(hdr->magic, GDS_REC_MAGIC, sizeof(GDS_REC_MAGIC)) ||
+            hdr->version != GDS_REC_VERSION ||
+            hdr->param_size != sizeof(CUstreamBatchMemOpParams) ||
+            hdr->op_size != sizeof(struct gds_rec_op)) {
+                gds_err("%s is not a compatible capture\n", path);
+                retcode = EINVAL;
+                goto out;
+        }
+
+        // replay is single threaded, no one else sees the override
+        if (db_strategy >= 0)
+                gds_db_strategy_force(db_strategy);
+        while (rd.p < rd.end) {
+                retcode = gds_replay_batch(rd, stats);
+                if (retcode) {
+                        if (retcode == EINVAL)
+                                gds_err("truncated or corrupted batch %zu in %s\n", stats->n_batches, path);
+                        break;
+                }
+        }
+        if (db_strategy >= 0)
+                gds_db_strategy_force(-1);
+out:
+        close(fd);
+        return retcode;
+}
+
+//-----------------------------------------------------------------------------
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ *  indent-tabs-mode: nil
+ * End:
+ */
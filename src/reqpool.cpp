@@ -0,0 +1,419 @@
+/* Copyright (c) 2016, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <assert.h>
+
+#include <new>
+#include <vector>
+#include <deque>
+
+#include <gdsync.h>
+#include <gdsync/tools.h>
+
+#include "utils.hpp"
+
+//-----------------------------------------------------------------------------
+
+enum gds_pool_kind {
+        GDS_POOL_SEND = 0,
+        GDS_POOL_WAIT,
+        GDS_POOL_N_KINDS
+};
+
+enum gds_pool_state {
+        GDS_POOL_FREE = 0,
+        GDS_POOL_PREPARED,      // handed out, not posted yet
+        GDS_POOL_IN_FLIGHT
+};
+
+struct gds_pool_ref {
+        uint32_t seq;
+        int      kind;
+        int      idx;
+};
+
+// requests posted on one stream, tracked by a word which only that stream
+// writes, so completions on one stream never recycle requests still
+// queued on another
+struct gds_pool_stream {
+        CUstream stream;
+        gds_mem_desc_t done_desc;
+        // last seq executed by the stream
+        uint32_t *done;
+        uint32_t seq;
+        // posted, in seq order
+        std::deque<gds_pool_ref> in_flight;
+};
+
+struct gds_request_pool {
+        size_t n_reqs;
+        gds_send_request_t *send_reqs;
+        gds_wait_request_t *wait_reqs;
+        std::vector<int> free_send;
+        std::vector<int> free_wait;
+        // gds_pool_state of each request, indexed by kind and request
+        std::vector<unsigned char> state[GDS_POOL_N_KINDS];
+        std::vector<gds_pool_stream *> streams;
+        // descriptors plus the tracking write, reused across posts
+        std::vector<gds_descriptor_t> descs;
+};
+
+//-----------------------------------------------------------------------------
+
+static void gds_pool_reclaim(gds_request_pool_t *pool)
+{
+        for (size_t s = 0; s < pool->streams.size(); ++s) {
+                gds_pool_stream *ps = pool->streams[s];
+                uint32_t done = ACCESS_ONCE(*ps->done);
+                while (!ps->in_flight.empty()) {
+                        gds_pool_ref &ref = ps->in_flight.front();
+                        if ((int32_t)(done - ref.seq) < 0)
+                                break;
+                        pool->state[ref.kind][ref.idx] = GDS_POOL_FREE;
+                        if (ref.kind == GDS_POOL_SEND)
+                                pool->free_send.push_back(ref.idx);
+                        else
+                                pool->free_wait.push_back(ref.idx);
+                        ps->in_flight.pop_front();
+                }
+        }
+}
+
+static int gds_pool_get(gds_request_pool_t *pool, std::vector<int> &free_list)
+{
+        if (free_list.empty())
+                gds_pool_reclaim(pool);
+        if (free_list.empty())
+                return -1;
+        int idx = free_list.back();
+        free_list.pop_back();
+        return idx;
+}
+
+static gds_pool_stream *gds_pool_get_stream(gds_request_pool_t *pool, CUstream stream)
+{
+        int ret;
+        gds_pool_stream *ps;
+
+        for (size_t s = 0; s < pool->streams.size(); ++s)
+                if (pool->streams[s]->stream == stream)
+                        return pool->streams[s];
+
+        ps = new (std::nothrow) gds_pool_stream;
+        if (!ps)
+                return NULL;
+        ps->stream = stream;
+        ps->seq = 0;
+        memset(&ps->done_desc, 0, sizeof(ps->done_desc));
+        ret = gds_alloc_mapped_memory(&ps->done_desc, sizeof(uint32_t), GDS_MEMORY_HOST);
+        if (ret) {
+                gds_err("error %d while allocating tracking word\n", ret);
+                delete ps;
+                return NULL;
+        }
+        ps->done = (uint32_t *)ps->done_desc.h_ptr;
+        ACCESS_ONCE(*ps->done) = 0;
+        pool->streams.push_back(ps);
+        gds_dbg("pool=%p stream=%p done=%p\n", pool, stream, ps->done);
+        return ps;
+}
+
+// index of the pool request referenced by desc, -1 if it is not a send or
+// wait out of pool
+static int gds_pool_desc_idx(gds_request_pool_t *pool, const gds_descriptor_t *desc, int *kind)
+{
+        switch (desc->tag) {
+        case GDS_TAG_SEND:
+                if (desc->send >= pool->send_reqs && desc->send < pool->send_reqs + pool->n_reqs) {
+                        *kind = GDS_POOL_SEND;
+                        return desc->send - pool->send_reqs;
+                }
+                break;
+        case GDS_TAG_WAIT:
+                if (desc->wait >= pool->wait_reqs && desc->wait < pool->wait_reqs + pool->n_reqs) {
+                        *kind = GDS_POOL_WAIT;
+                        return desc->wait - pool->wait_reqs;
+                }
+                break;
+        default:
+                break;
+        }
+        return -1;
+}
+
+//-----------------------------------------------------------------------------
+
+int gds_create_request_pool(size_t n_reqs, gds_request_pool_t **ppool)
+{
+        int retcode = 0;
+        gds_request_pool_t *pool = NULL;
+
+        if (!n_reqs || !ppool) {
+                gds_err("invalid arguments\n");
+                return EINVAL;
+        }
+
+        pool = new (std::nothrow) gds_request_pool;
+        if (!pool) {
+                retcode = ENOMEM;
+                goto out;
+        }
+        pool->n_reqs = n_reqs;
+        pool->send_reqs = NULL;
+        pool->wait_reqs = NULL;
+
+        if (posix_memalign((void **)&pool->send_reqs, 64, n_reqs * sizeof(gds_send_request_t)) ||
+            posix_memalign((void **)&pool->wait_reqs, 64, n_reqs * sizeof(gds_wait_request_t))) {
+                gds_err("cannot allocate %zu requests\n", n_reqs);
+                retcode = ENOMEM;
+                goto out;
+        }
+        // storage==NULL makes the first reset link the op lists
+        memset(pool->send_reqs, 0, n_reqs * sizeof(gds_send_request_t));
+        memset(pool->wait_reqs, 0, n_reqs * sizeof(gds_wait_request_t));
+        pool->free_send.reserve(n_reqs);
+        pool->free_wait.reserve(n_reqs);
+        pool->state[GDS_POOL_SEND].assign(n_reqs, GDS_POOL_FREE);
+        pool->state[GDS_POOL_WAIT].assign(n_reqs, GDS_POOL_FREE);
+        for (size_t i = 0; i < n_reqs; ++i) {
+                gds_reset_send_info(pool->send_reqs + i);
+                gds_reset_wait_request(pool->wait_reqs + i, 0);
+                pool->free_send.push_back(n_reqs - 1 - i);
+                pool->free_wait.push_back(n_reqs - 1 - i);
+        }
+
+        gds_dbg("pool=%p n_reqs=%zu\n", pool, n_reqs);
+        *ppool = pool;
+out:
+        if (retcode && pool) {
+                free(pool->send_reqs);
+                free(pool->wait_reqs);
+                delete pool;
+        }
+        return retcode;
+}
+
+//-----------------------------------------------------------------------------
+
+int gds_destroy_request_pool(gds_request_pool_t *pool)
+{
+        int retcode = 0;
+
+        if (!pool)
+                return EINVAL;
+
+        gds_pool_reclaim(pool);
+        for (size_t s = 0; s < pool->streams.size(); ++s) {
+                if (!pool->streams[s]->in_flight.empty()) {
+                        gds_err("%zu requests still in flight on stream %p, synchronize it first\n",
+                                pool->streams[s]->in_flight.size(), pool->streams[s]->stream);
+                        return EBUSY;
+                }
+        }
+
+        for (size_t s = 0; s < pool->streams.size(); ++s) {
+                int ret = gds_free_mapped_memory(&pool->streams[s]->done_desc);
+                if (ret) {
+                        gds_err("error %d while freeing tracking word\n", ret);
+                        retcode = retcode ? retcode : ret;
+                }
+                delete pool->streams[s];
+        }
+        free(pool->send_reqs);
+        free(pool->wait_reqs);
+        delete pool;
+        return retcode;
+}
+
+//-----------------------------------------------------------------------------
+
+int gds_request_pool_prepare_send(gds_request_pool_t *pool, struct gds_qp *qp, gds_send_wr *p_ewr, gds_send_wr **bad_ewr, gds_send_request_t **prequest)
+{
+        int retcode = 0;
+        gds_send_request_t *request;
+
+        assert(pool);
+        assert(prequest);
+
+        int idx = gds_pool_get(pool, pool->free_send);
+        if (idx < 0) {
+                gds_dbg("pool=%p out of send requests\n", pool);
+                return EAGAIN;
+        }
+        request = pool->send_reqs + idx;
+        gds_reset_send_info(request);
+        retcode = gds_prepare_send_ops(qp, p_ewr, bad_ewr, request);
+        if (retcode) {
+                pool->free_send.push_back(idx);
+                goto out;
+        }
+        pool->state[GDS_POOL_SEND][idx] = GDS_POOL_PREPARED;
+        *prequest = request;
+out:
+        return retcode;
+}
+
+//-----------------------------------------------------------------------------
+
+int gds_request_pool_prepare_wait_cq(gds_request_pool_t *pool, struct gds_cq *cq, gds_wait_request_t **prequest, int flags)
+{
+        int retcode = 0;
+        gds_wait_request_t *request;
+
+        assert(pool);
+        assert(cq);
+        assert(prequest);
+
+        if (flags != 0) {
+                gds_err("invalid flags != 0\n");
+                return EINVAL;
+        }
+
+        int idx = gds_pool_get(pool, pool->free_wait);
+        if (idx < 0) {
+                gds_dbg("pool=%p out of wait requests\n", pool);
+                return EAGAIN;
+        }
+        request = pool->wait_reqs + idx;
+        gds_reset_wait_request(request, gds_cq_claim_offset(cq));
+        retcode = gds_prepare_wait_ops(cq, request);
+        if (retcode) {
+                pool->free_wait.push_back(idx);
+                goto out;
+        }
+        pool->state[GDS_POOL_WAIT][idx] = GDS_POOL_PREPARED;
+        *prequest = request;
+out:
+        return retcode;
+}
+
+//-----------------------------------------------------------------------------
+
+int gds_request_pool_post_descriptors(CUstream stream, gds_request_pool_t *pool, size_t n_descs, gds_descriptor_t *descs, int flags)
+{
+        int retcode = 0;
+        uint32_t seq;
+        gds_pool_stream *ps;
+        gds_descriptor_t desc;
+
+        assert(pool);
+
+        ps = gds_pool_get_stream(pool, stream);
+        if (!ps) {
+                retcode = ENOMEM;
+                goto out;
+        }
+        seq = ps->seq + 1;
+        desc.tag = GDS_TAG_WRITE_VALUE32;
+        retcode = gds_prepare_write_value32(&desc.write32, ps->done, seq, GDS_MEMORY_HOST);
+        if (retcode) {
+                gds_err("error %d while preparing tracking write\n", retcode);
+                goto out;
+        }
+        pool->descs.assign(descs, descs + n_descs);
+        pool->descs.push_back(desc);
+
+        retcode = gds_stream_post_descriptors(stream, pool->descs.size(), &pool->descs[0], flags);
+        if (retcode) {
+                // prepared requests stay with the caller, who can post
+                // them again or give them back with gds_request_pool_release
+                gds_err("error %d in gds_stream_post_descriptors\n", retcode);
+                goto out;
+        }
+
+        ps->seq = seq;
+        // only the requests in this batch, others may be posted later on
+        for (size_t i = 0; i < n_descs; ++i) {
+                int kind;
+                int idx = gds_pool_desc_idx(pool, descs + i, &kind);
+                if (idx < 0)
+                        continue;
+                if (pool->state[kind][idx] != GDS_POOL_PREPARED) {
+                        gds_dbg("pool=%p request %d posted twice\n", pool, idx);
+                        continue;
+                }
+                gds_pool_ref ref;
+                ref.seq = seq;
+                ref.kind = kind;
+                ref.idx = idx;
+                ps->in_flight.push_back(ref);
+                pool->state[kind][idx] = GDS_POOL_IN_FLIGHT;
+        }
+out:
+        return retcode;
+}
+
+//-----------------------------------------------------------------------------
+
+int gds_request_pool_release(gds_request_pool_t *pool, size_t n_descs, gds_descriptor_t *descs)
+{
+        int retcode = 0;
+
+        assert(pool);
+
+        // check first, so that nothing is released on error
+        for (size_t i = 0; i < n_descs; ++i) {
+                int kind;
+                int idx = gds_pool_desc_idx(pool, descs + i, &kind);
+                if (idx >= 0 && pool->state[kind][idx] != GDS_POOL_PREPARED) {
+                        gds_err("pool=%p request %d of desc %zu is not prepared\n", pool, idx, i);
+                        retcode = EINVAL;
+                        goto out;
+                }
+        }
+        for (size_t i = 0; i < n_descs; ++i) {
+                int kind;
+                int idx = gds_pool_desc_idx(pool, descs + i, &kind);
+                if (idx < 0 || pool->state[kind][idx] != GDS_POOL_PREPARED)
+                        continue;
+                pool->state[kind][idx] = GDS_POOL_FREE;
+                if (kind == GDS_POOL_SEND)
+                        pool->free_send.push_back(idx);
+                else
+                        pool->free_wait.push_back(idx);
+        }
+out:
+        return retcode;
+}
+
+//-----------------------------------------------------------------------------
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ *  indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,195 @@
+/* Copyright (c) 2016, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include <map>
+
+#include <gdsync.h>
+
+#include "utils.hpp"
+#include "topo.hpp"
+
+// from linux/mempolicy.h, not pulling in libnuma for three syscalls
+enum {
+        GDS_MPOL_DEFAULT   = 0,
+        GDS_MPOL_PREFERRED = 1,
+        GDS_MPOL_MF_MOVE   = 1<<1
+};
+
+//-----------------------------------------------------------------------------
+
+bool gds_enable_numa_bind()
+{
+        static int gds_disable_numa_bind = -1;
+        if (-1 == gds_disable_numa_bind) {
+                const char *env = getenv("GDS_DISABLE_NUMA_BIND");
+                if (env)
+                        gds_disable_numa_bind = !!atoi(env);
+                else
+                        gds_disable_numa_bind = 0;
+                gds_dbg("GDS_DISABLE_NUMA_BIND=%d\n", gds_disable_numa_bind);
+        }
+        return !gds_disable_numa_bind;
+}
+
+static int gds_read_numa_node(const char *path)
+{
+        int node = -1;
+        FILE *f = fopen(path, "r");
+        if (!f) {
+                gds_dbg("cannot open %s\n", path);
+                return -1;
+        }
+        if (fscanf(f, "%d", &node) != 1)
+                node = -1;
+        fclose(f);
+        gds_dbg("%s: node %d\n", path, node);
+        // -1 as well on single node systems
+        return node;
+}
+
+int gds_hca_numa_node(struct ibv_context *context)
+{
+        char path[PATH_MAX];
+        assert(context);
+        snprintf(path, sizeof(path), "%s/device/numa_node", context->device->ibdev_path);
+        return gds_read_numa_node(path);
+}
+
+static pthread_mutex_t gds_gpu_nodes_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::map<CUdevice, int> gds_gpu_nodes;
+
+int gds_gpu_numa_node(CUdevice dev)
+{
+        pthread_mutex_lock(&gds_gpu_nodes_lock);
+        std::map<CUdevice, int>::iterator it = gds_gpu_nodes.find(dev);
+        if (it != gds_gpu_nodes.end()) {
+                int node = it->second;
+                pthread_mutex_unlock(&gds_gpu_nodes_lock);
+                return node;
+        }
+        pthread_mutex_unlock(&gds_gpu_nodes_lock);
+
+        char bus_id[32];
+        char path[PATH_MAX];
+        int node = -1;
+        if (CUDA_SUCCESS == cuDeviceGetPCIBusId(bus_id, sizeof(bus_id), dev)) {
+                // sysfs uses lower case hex digits
+                for (char *c = bus_id; *c; ++c)
+                        *c = tolower(*c);
+                snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/numa_node", bus_id);
+                node = gds_read_numa_node(path);
+        } else {
+                gds_warn("cannot get PCI bus id of GPU device %d\n", dev);
+        }
+        // racing threads read the same sysfs file, either result is fine
+        pthread_mutex_lock(&gds_gpu_nodes_lock);
+        gds_gpu_nodes[dev] = node;
+        pthread_mutex_unlock(&gds_gpu_nodes_lock);
+        return node;
+}
+
+int gds_current_gpu_numa_node()
+{
+        CUdevice dev;
+        if (CUDA_SUCCESS != cuCtxGetDevice(&dev))
+                return -1;
+        return gds_gpu_numa_node(dev);
+}
+
+//-----------------------------------------------------------------------------
+
+int gds_numa_bind_range(void *ptr, size_t size, int node)
+{
+        unsigned long mask[gds_numa_scope::MAX_NODES / (8 * sizeof(unsigned long))];
+        const size_t bits = 8 * sizeof(unsigned long);
+
+        if (node < 0 || node >= gds_numa_scope::MAX_NODES || !gds_enable_numa_bind())
+                return 0;
+        memset(mask, 0, sizeof(mask));
+        mask[node / bits] |= 1UL << (node % bits);
+        if (syscall(SYS_mbind, ptr, size, GDS_MPOL_PREFERRED, mask, gds_numa_scope::MAX_NODES, GDS_MPOL_MF_MOVE)) {
+                // not fatal, the memory is just not placed
+                gds_warn("error %d while binding %p:%zu to NUMA node %d\n", errno, ptr, size, node);
+                return errno;
+        }
+        gds_dbg("bound %p:%zu to NUMA node %d\n", ptr, size, node);
+        return 0;
+}
+
+gds_numa_scope::gds_numa_scope(int node): active(false), saved_mode(GDS_MPOL_DEFAULT)
+{
+        unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))];
+        const size_t bits = 8 * sizeof(unsigned long);
+
+        if (node < 0 || node >= MAX_NODES || !gds_enable_numa_bind())
+                return;
+        memset(saved_mask, 0, sizeof(saved_mask));
+        if (syscall(SYS_get_mempolicy, &saved_mode, saved_mask, MAX_NODES, NULL, 0)) {
+                gds_warn("error %d in get_mempolicy\n", errno);
+                return;
+        }
+        memset(mask, 0, sizeof(mask));
+        mask[node / bits] |= 1UL << (node % bits);
+        if (syscall(SYS_set_mempolicy, GDS_MPOL_PREFERRED, mask, MAX_NODES)) {
+                gds_warn("error %d while preferring NUMA node %d\n", errno, node);
+                return;
+        }
+        gds_dbg("preferring NUMA node %d\n", node);
+        active = true;
+}
+
+gds_numa_scope::~gds_numa_scope()
+{
+        if (!active)
+                return;
+        if (syscall(SYS_set_mempolicy, saved_mode, saved_mode == GDS_MPOL_DEFAULT ? NULL : saved_mask, MAX_NODES))
+                gds_warn("error %d while restoring the memory policy\n", errno);
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ *  indent-tabs-mode: nil
+ * End:
+ */
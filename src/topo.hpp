@@ -0,0 +1,40 @@
+#pragma once
+
+// NUMA placement of the host memory backing CQs, WQs, DBRECs and flags.
+//
+// Nodes are read from sysfs: the HCA one through ibdev_path, the GPU one
+// through its PCI bus id. -1 means unknown, in which case nothing is bound.
+// Set GDS_DISABLE_NUMA_BIND=1 to leave placement to the kernel.
+
+bool gds_enable_numa_bind();
+int gds_hca_numa_node(struct ibv_context *context);
+int gds_gpu_numa_node(CUdevice dev);
+// node of the GPU of the current CUDA context
+int gds_current_gpu_numa_node();
+
+// binds [ptr, ptr+size) to node, moving pages already touched. The range
+// must cover whole pages owned by the caller, e.g. a private mmap, as the
+// policy applies to all the pages it touches.
+int gds_numa_bind_range(void *ptr, size_t size, int node);
+
+// prefers node for the pages first touched by this thread while in scope;
+// heap pages faulted in earlier stay where they are, hence the CQ/WQ/DBREC
+// buffers come from gds_peer::alloc_host instead, this only covers what
+// the provider allocates by itself, e.g. SRQs
+struct gds_numa_scope {
+        enum { MAX_NODES = 1024 };
+        bool active;
+        int saved_mode;
+        unsigned long saved_mask[MAX_NODES / (8 * sizeof(unsigned long))];
+        gds_numa_scope(int node);
+        ~gds_numa_scope();
+};
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ *  indent-tabs-mode: nil
+ * End:
+ */
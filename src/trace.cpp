@@ -0,0 +1,464 @@
+/* Copyright (c) 2016, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+#include <gdsync.h>
+#include <gdsync/tools.h>
+
+#include "utils.hpp"
+#include "trace.hpp"
+
+//-----------------------------------------------------------------------------
+
+// one cache line per record, memops are stored verbatim in arg[]
+struct gds_trace_rec {
+        uint64_t ts;
+        uint16_t event;
+        uint16_t id;
+        uint32_t n;
+        uint64_t arg[6];
+};
+
+typedef char gds_trace_memop_fits_in_rec[(sizeof(CUstreamBatchMemOpParams) <= sizeof(((gds_trace_rec*)0)->arg)) ? 1 : -1];
+
+struct gds_trace_ring {
+        struct gds_trace_ring *next;
+        uint32_t tid;
+        uint32_t mask;
+        uint64_t head; // number of records ever written
+        struct gds_trace_rec *recs;
+};
+
+// on-disk format: file header, then for each ring a ring header
+// followed by its records, oldest first
+#define GDS_TRACE_MAGIC   "GDSTRACE"
+#define GDS_TRACE_VERSION 1
+
+struct gds_trace_file_hdr {
+        char     magic[8];
+        uint32_t version;
+        uint32_t rec_size;
+        uint32_t pid;
+        uint32_t n_rings;
+};
+
+struct gds_trace_ring_hdr {
+        uint32_t tid;
+        uint32_t n_recs;
+        uint64_t head;
+};
+
+int gds_trace_level = -1;
+static size_t gds_trace_ring_size = 1<<16;
+static char gds_trace_sig_path[256];
+static struct gds_trace_ring *gds_trace_rings = NULL;
+static __thread struct gds_trace_ring *gds_trace_tls_ring = NULL;
+
+static const char *gds_trace_api_names[GDS_TRACE_API_MAX] = {
+        "gds_post_send",
+        "gds_post_recv",
+        "gds_prepare_send",
+        "gds_stream_queue_send",
+        "gds_stream_post_send",
+        "gds_stream_post_send_all",
+        "gds_prepare_wait_cq",
+        "gds_stream_post_wait_cq",
+        "gds_stream_post_wait_cq_all",
+        "gds_stream_wait_cq",
+        "gds_post_wait_cq",
+        "gds_stream_post_poll_dword",
+        "gds_stream_post_poke_dword",
+        "gds_stream_post_inline_copy",
+        "gds_stream_post_descriptors",
+        "gds_prepare_send_multi",
+        "gds_post_send_all",
+        "gds_stream_wait_cq_bcast",
+        "gds_graph_add_descriptors_node",
+        "gds_graph_exec_update_descriptors",
+        "gds_post_srq_recv"
+};
+
+//-----------------------------------------------------------------------------
+
+static inline uint64_t gds_trace_now()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int gds_trace_write_all(int fd, const void *buf, size_t size)
+{
+        const char *p = (const char *)buf;
+        while (size) {
+                ssize_t ret = write(fd, p, size);
+                if (ret < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return errno;
+                }
+                p += ret;
+                size -= ret;
+        }
+        return 0;
+}
+
+// only async-signal-safe calls in here
+static int gds_trace_write(int fd)
+{
+        int retcode = 0;
+        struct gds_trace_file_hdr hdr;
+        struct gds_trace_ring *ring;
+
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, GDS_TRACE_MAGIC, sizeof(hdr.magic));
+        hdr.version = GDS_TRACE_VERSION;
+        hdr.rec_size = sizeof(struct gds_trace_rec);
+        hdr.pid = getpid();
+        for (ring = ACCESS_ONCE(gds_trace_rings); ring; ring = ring->next)
+                ++hdr.n_rings;
+        retcode = gds_trace_write_all(fd, &hdr, sizeof(hdr));
+        if (retcode)
+                goto out;
+
+        for (ring = ACCESS_ONCE(gds_trace_rings); ring && hdr.n_rings; ring = ring->next, --hdr.n_rings) {
+                struct gds_trace_ring_hdr rhdr;
+                uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+                uint64_t size = (uint64_t)ring->mask + 1;
+                uint64_t first = head > size ? head - size : 0;
+                size_t pos = first & ring->mask;
+                size_t n = head - first;
+                size_t n_tail = n < size - pos ? n : size - pos;
+
+                rhdr.tid = ring->tid;
+                rhdr.n_recs = n;
+                rhdr.head = head;
+                retcode = gds_trace_write_all(fd, &rhdr, sizeof(rhdr));
+                if (retcode)
+                        goto out;
+                retcode = gds_trace_write_all(fd, ring->recs + pos, n_tail * sizeof(struct gds_trace_rec));
+                if (retcode)
+                        goto out;
+                retcode = gds_trace_write_all(fd, ring->recs, (n - n_tail) * sizeof(struct gds_trace_rec));
+                if (retcode)
+                        goto out;
+        }
+out:
+        return retcode;
+}
+
+static void gds_trace_sig_handler(int sig)
+{
+        int saved_errno = errno;
+        int fd = open(gds_trace_sig_path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if (fd >= 0) {
+                gds_trace_write(fd);
+                close(fd);
+        }
+        errno = saved_errno;
+}
+
+//-----------------------------------------------------------------------------
+
+void gds_trace_init()
+{
+        int level = 0;
+        const char *env = getenv("GDS_ENABLE_TRACE");
+        if (env)
+                level = !!atoi(env);
+
+        if (level) {
+                env = getenv("GDS_TRACE_RING_SIZE");
+                if (env) {
+                        size_t size = strtoul(env, NULL, 0);
+                        gds_trace_ring_size = 1;
+                        while (gds_trace_ring_size < size)
+                                gds_trace_ring_size <<= 1;
+                }
+
+                env = getenv("GDS_TRACE_FILE");
+                if (env)
+                        snprintf(gds_trace_sig_path, sizeof(gds_trace_sig_path), "%s", env);
+                else
+                        snprintf(gds_trace_sig_path, sizeof(gds_trace_sig_path), "gds_trace.%d.bin", getpid());
+
+                env = getenv("GDS_TRACE_SIGNAL");
+                if (env) {
+                        struct sigaction sa;
+                        int sig = atoi(env);
+                        memset(&sa, 0, sizeof(sa));
+                        sa.sa_handler = gds_trace_sig_handler;
+                        sa.sa_flags = SA_RESTART;
+                        sigemptyset(&sa.sa_mask);
+                        if (sigaction(sig, &sa, NULL))
+                                gds_warn("cannot install trace handler for signal %d\n", sig);
+                }
+                gds_dbg("GDS_ENABLE_TRACE=%d ring_size=%zu file=%s\n", level, gds_trace_ring_size, gds_trace_sig_path);
+        }
+        ACCESS_ONCE(gds_trace_level) = level;
+}
+
+//-----------------------------------------------------------------------------
+
+static struct gds_trace_ring *gds_trace_get_ring()
+{
+        struct gds_trace_ring *ring = gds_trace_tls_ring;
+        if (!ring) {
+                ring = (struct gds_trace_ring *)calloc(1, sizeof(*ring));
+                if (!ring)
+                        return NULL;
+                if (posix_memalign((void **)&ring->recs, 64, gds_trace_ring_size * sizeof(struct gds_trace_rec))) {
+                        free(ring);
+                        return NULL;
+                }
+                ring->tid = syscall(SYS_gettid);
+                ring->mask = gds_trace_ring_size - 1;
+                // lock-free push, rings are never unlinked
+                do {
+                        ring->next = ACCESS_ONCE(gds_trace_rings);
+                } while (!__sync_bool_compare_and_swap(&gds_trace_rings, ring->next, ring));
+                gds_trace_tls_ring = ring;
+        }
+        return ring;
+}
+
+static inline struct gds_trace_rec *gds_trace_begin_rec(struct gds_trace_ring *ring, int event, int id)
+{
+        struct gds_trace_rec *rec = ring->recs + (ring->head & ring->mask);
+        rec->ts = gds_trace_now();
+        rec->event = event;
+        rec->id = id;
+        return rec;
+}
+
+static inline void gds_trace_commit_rec(struct gds_trace_ring *ring)
+{
+        __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+void gds_trace_record(int event, int id, uint64_t arg0, uint64_t arg1)
+{
+        struct gds_trace_ring *ring = gds_trace_get_ring();
+        if (!ring)
+                return;
+        struct gds_trace_rec *rec = gds_trace_begin_rec(ring, event, id);
+        rec->n = 0;
+        rec->arg[0] = arg0;
+        rec->arg[1] = arg1;
+        gds_trace_commit_rec(ring);
+}
+
+void gds_trace_record_memops(unsigned int nops, CUstreamBatchMemOpParams *params)
+{
+        struct gds_trace_ring *ring = gds_trace_get_ring();
+        if (!ring)
+                return;
+        for (unsigned int n = 0; n < nops; ++n) {
+                struct gds_trace_rec *rec = gds_trace_begin_rec(ring, GDS_TRACE_EV_MEMOP, 0);
+                rec->n = n;
+                memcpy(rec->arg, params + n, sizeof(CUstreamBatchMemOpParams));
+                gds_trace_commit_rec(ring);
+        }
+}
+
+//-----------------------------------------------------------------------------
+
+int gds_trace_dump(const char *path)
+{
+        int retcode = 0;
+        int fd;
+
+        if (!gds_trace_enabled()) {
+                gds_err("tracing is not enabled, set GDS_ENABLE_TRACE=1\n");
+                return EINVAL;
+        }
+        if (!path)
+                path = gds_trace_sig_path;
+
+        fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if (fd < 0) {
+                retcode = errno;
+                gds_err("error %d while opening %s\n", retcode, path);
+                goto out;
+        }
+        retcode = gds_trace_write(fd);
+        if (retcode)
+                gds_err("error %d while writing %s\n", retcode, path);
+        close(fd);
+out:
+        return retcode;
+}
+
+//-----------------------------------------------------------------------------
+
+static void gds_trace_export_memop(FILE *fp, CUstreamBatchMemOpParams *param)
+{
+        switch(param->operation) {
+        case CU_STREAM_MEM_OP_WAIT_VALUE_32:
+                fprintf(fp, "\"name\":\"WAIT32\",\"args\":{\"addr\":\"%p\",\"value\":\"%08x\",\"flags\":\"%08x\"}",
+                        (void*)param->waitValue.address, param->waitValue.value, param->waitValue.flags);
+                break;
+        case CU_STREAM_MEM_OP_WRITE_VALUE_32:
+                fprintf(fp, "\"name\":\"WRITE32\",\"args\":{\"addr\":\"%p\",\"value\":\"%08x\",\"flags\":\"%08x\"}",
+                        (void*)param->writeValue.address, param->writeValue.value, param->writeValue.flags);
+                break;
+        case CU_STREAM_MEM_OP_FLUSH_REMOTE_WRITES:
+                fprintf(fp, "\"name\":\"FLUSH\",\"args\":{}");
+                break;
+#if HAVE_DECL_CU_STREAM_MEM_OP_INLINE_COPY
+        case CU_STREAM_MEM_OP_INLINE_COPY:
+                fprintf(fp, "\"name\":\"INLINECOPY\",\"args\":{\"addr\":\"%p\",\"len\":%zu,\"flags\":\"%08x\"}",
+                        (void*)param->inlineCopy.address, param->inlineCopy.byteCount, param->inlineCopy.flags);
+                break;
+#endif
+#if HAVE_DECL_CU_STREAM_MEM_OP_MEMORY_BARRIER
+        case CU_STREAM_MEM_OP_MEMORY_BARRIER:
+                fprintf(fp, "\"name\":\"MEMORY_BARRIER\",\"args\":{\"flags\":\"%08x\"}",
+                        param->memoryBarrier.flags);
+                break;
+#endif
+        default:
+                fprintf(fp, "\"name\":\"MEMOP\",\"args\":{\"operation\":%d}", param->operation);
+                break;
+        }
+}
+
+static void gds_trace_export_rec(FILE *fp, uint32_t pid, uint32_t tid, struct gds_trace_rec *rec)
+{
+        const char *api = rec->id < GDS_TRACE_API_MAX ? gds_trace_api_names[rec->id] : "unknown";
+
+        fprintf(fp, "{\"pid\":%u,\"tid\":%u,\"ts\":%.3f,", pid, tid, rec->ts / 1000.0);
+        switch (rec->event) {
+        case GDS_TRACE_EV_API_BEGIN:
+                fprintf(fp, "\"ph\":\"B\",\"cat\":\"api\",\"name\":\"%s\"", api);
+                break;
+        case GDS_TRACE_EV_API_END:
+                fprintf(fp, "\"ph\":\"E\",\"cat\":\"api\",\"name\":\"%s\"", api);
+                break;
+        case GDS_TRACE_EV_SUBMIT_BEGIN:
+                fprintf(fp, "\"ph\":\"B\",\"cat\":\"submit\",\"name\":\"cuStreamBatchMemOp\",\"args\":{\"stream\":\"%p\",\"nops\":%" PRIu64 "}",
+                        (void*)rec->arg[0], rec->arg[1]);
+                break;
+        case GDS_TRACE_EV_SUBMIT_END:
+                fprintf(fp, "\"ph\":\"E\",\"cat\":\"submit\",\"name\":\"cuStreamBatchMemOp\",\"args\":{\"retcode\":%d}",
+                        (int)rec->arg[0]);
+                break;
+        case GDS_TRACE_EV_MEMOP: {
+                CUstreamBatchMemOpParams param;
+                memcpy(&param, rec->arg, sizeof(param));
+                fprintf(fp, "\"ph\":\"i\",\"s\":\"t\",\"cat\":\"memop\",");
+                gds_trace_export_memop(fp, &param);
+                break;
+        }
+        default:
+                fprintf(fp, "\"ph\":\"i\",\"s\":\"t\",\"name\":\"event%u\"", rec->event);
+                break;
+        }
+        fprintf(fp, "}");
+}
+
+int gds_trace_export_chrome(const char *trace_path, const char *json_path)
+{
+        int retcode = 0;
+        FILE *in = NULL, *out = NULL;
+        struct gds_trace_file_hdr hdr;
+        bool first = true;
+
+        in = fopen(trace_path, "r");
+        if (!in) {
+                retcode = errno;
+                gds_err("error %d while opening %s\n", retcode, trace_path);
+                goto out;
+        }
+        if (1 != fread(&hdr, sizeof(hdr), 1, in) ||
+            memcmp(hdr.magic, GDS_TRACE_MAGIC, sizeof(hdr.magic)) ||
+            hdr.version != GDS_TRACE_VERSION ||
+            hdr.rec_size != sizeof(struct gds_trace_rec)) {
+                gds_err("%s is not a compatible trace file\n", trace_path);
+                retcode = EINVAL;
+                goto out;
+        }
+        out = fopen(json_path, "w");
+        if (!out) {
+                retcode = errno;
+                gds_err("error %d while opening %s\n", retcode, json_path);
+                goto out;
+        }
+
+        fprintf(out, "{\"traceEvents\":[\n");
+        for (uint32_t r = 0; r < hdr.n_rings; ++r) {
+                struct gds_trace_ring_hdr rhdr;
+                if (1 != fread(&rhdr, sizeof(rhdr), 1, in)) {
+                        gds_err("truncated trace file %s\n", trace_path);
+                        retcode = EINVAL;
+                        goto out;
+                }
+                for (uint32_t n = 0; n < rhdr.n_recs; ++n) {
+                        struct gds_trace_rec rec;
+                        if (1 != fread(&rec, sizeof(rec), 1, in)) {
+                                gds_err("truncated trace file %s\n", trace_path);
+                                retcode = EINVAL;
+                                goto out;
+                        }
+                        if (!first)
+                                fprintf(out, ",\n");
+                        gds_trace_export_rec(out, hdr.pid, rhdr.tid, &rec);
+                        first = false;
+                }
+        }
+        fprintf(out, "\n],\"displayTimeUnit\":\"ns\"}\n");
+out:
+        if (out && fclose(out) && !retcode)
+                retcode = errno;
+        if (in)
+                fclose(in);
+        return retcode;
+}
+
+//-----------------------------------------------------------------------------
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ *  indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,79 @@
+#pragma once
+
+// Binary event tracing, enabled with GDS_ENABLE_TRACE=1.
+//
+// Each thread appends fixed-size records to its own ring, no locks and no
+// formatting on the hot path. Rings are written out in binary form by
+// gds_trace_dump(), either on demand or from the signal handler installed
+// when GDS_TRACE_SIGNAL is set, and converted into Chrome/Perfetto JSON by
+// gds_trace_export_chrome().
+
+enum gds_trace_event {
+        GDS_TRACE_EV_API_BEGIN = 1,
+        GDS_TRACE_EV_API_END,
+        GDS_TRACE_EV_MEMOP,
+        GDS_TRACE_EV_SUBMIT_BEGIN,
+        GDS_TRACE_EV_SUBMIT_END
+};
+
+enum gds_trace_api {
+        GDS_TRACE_API_POST_SEND = 0,
+        GDS_TRACE_API_POST_RECV,
+        GDS_TRACE_API_PREPARE_SEND,
+        GDS_TRACE_API_STREAM_QUEUE_SEND,
+        GDS_TRACE_API_STREAM_POST_SEND,
+        GDS_TRACE_API_STREAM_POST_SEND_ALL,
+        GDS_TRACE_API_PREPARE_WAIT_CQ,
+        GDS_TRACE_API_STREAM_POST_WAIT_CQ,
+        GDS_TRACE_API_STREAM_POST_WAIT_CQ_ALL,
+        GDS_TRACE_API_STREAM_WAIT_CQ,
+        GDS_TRACE_API_POST_WAIT_CQ,
+        GDS_TRACE_API_STREAM_POST_POLL_DWORD,
+        GDS_TRACE_API_STREAM_POST_POKE_DWORD,
+        GDS_TRACE_API_STREAM_POST_INLINE_COPY,
+        GDS_TRACE_API_STREAM_POST_DESCRIPTORS,
+        GDS_TRACE_API_PREPARE_SEND_MULTI,
+        GDS_TRACE_API_POST_SEND_ALL,
+        GDS_TRACE_API_STREAM_WAIT_CQ_BCAST,
+        GDS_TRACE_API_GRAPH_ADD_DESCRIPTORS_NODE,
+        GDS_TRACE_API_GRAPH_EXEC_UPDATE_DESCRIPTORS,
+        GDS_TRACE_API_POST_SRQ_RECV,
+        GDS_TRACE_API_MAX
+};
+
+extern int gds_trace_level;
+void gds_trace_init();
+
+static inline bool gds_trace_enabled()
+{
+        if (gds_trace_level < 0)
+                gds_trace_init();
+        return gds_trace_level > 0;
+}
+
+void gds_trace_record(int event, int id, uint64_t arg0, uint64_t arg1);
+void gds_trace_record_memops(unsigned int nops, CUstreamBatchMemOpParams *params);
+
+// records API entry and exit for the enclosing scope
+struct gds_trace_scope {
+        int id;
+        gds_trace_scope(int _id) : id(_id) {
+                if (gds_trace_enabled())
+                        gds_trace_record(GDS_TRACE_EV_API_BEGIN, id, 0, 0);
+        }
+        ~gds_trace_scope() {
+                if (gds_trace_enabled())
+                        gds_trace_record(GDS_TRACE_EV_API_END, id, 0, 0);
+        }
+};
+
+#define GDS_TRACE_API(ID) gds_trace_scope __gds_trace_scope(GDS_TRACE_API_##ID)
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ *  indent-tabs-mode: nil
+ * End:
+ */
@@ -166,15 +166,113 @@ typedef enum gds_alloc_qp_flags {
 struct ibv_cq *gds_create_cq(struct ibv_context *context, int cqe, void *cq_context, struct ibv_comp_channel *channel, int comp_vector, int gpu_id, gds_alloc_cq_flags_t flags);
 int gds_post_pokes(CUstream stream, int count, gds_send_request_t *info, uint32_t *dw, uint32_t val);
 int gds_post_pokes_on_cpu(int count, gds_send_request_t *info, uint32_t *dw, uint32_t val);
-int gds_stream_post_wait_cq_multi(CUstream stream, int count, gds_wait_request_t *request, uint32_t *dw, uint32_t val);
+int gds_stream_post_wait_cq_multi(CUstream stream, int count, gds_wait_request_t *request, uint32_t *dw, uint32_t val, int dw_flags = GDS_MEMORY_HOST);
 void gds_dump_wait_request(gds_wait_request_t *request, size_t count);
 void gds_dump_param(CUstreamBatchMemOpParams *param);
 void gds_dump_params(unsigned int nops, CUstreamBatchMemOpParams *params);
+// largest inline copy, also the size of the BlueFlame buffer
+// TODO: use corret value
+// TODO: make it dependent upon the particular GPU
+const size_t GDS_GPU_MAX_INLINE_SIZE = 256;
 int gds_fill_membar(CUstreamBatchMemOpParams *param, int flags);
 int gds_fill_inlcpy(CUstreamBatchMemOpParams *param, void *ptr, void *data, size_t n_bytes, int flags);
 int gds_fill_poke(CUstreamBatchMemOpParams *param, uint32_t *ptr, uint32_t value, int flags);
 int gds_fill_poll(CUstreamBatchMemOpParams *param, uint32_t *ptr, uint32_t magic, int cond_flag, int flags);
 int gds_stream_batch_ops(CUstream stream, int nops, CUstreamBatchMemOpParams *params, int flags);
+// cuStreamBatchMemOp flags, also used for graph nodes
+unsigned int gds_batch_ops_flags();
+
+// stream memop features which depend on the GPU, probed once per device
+typedef struct gds_gpu_caps {
+        bool memops64;  // CU_STREAM_MEM_OP_{WAIT,WRITE}_VALUE_64
+        bool wait_nor;  // CU_STREAM_WAIT_VALUE_NOR
+} gds_gpu_caps_t;
+gds_gpu_caps_t gds_gpu_caps(CUdevice dev);
+// caps of the GPU of the current CUDA context, none if there is no context
+gds_gpu_caps_t gds_current_gpu_caps();
+// overrides the probed caps, e.g. with those found in the caps cache
+void gds_gpu_caps_seed(CUdevice dev, gds_gpu_caps_t caps);
+
+// 64-bits variants for the GPU with caps. Waits are emulated with 32-bits
+// ops when the GPU lacks the native ones, hence they fill up to
+// GDS_MAX_OPS_PER_VALUE64 params starting at idx. Writes fall back to an
+// inline copy, ENOTSUP if there is none, as they are never split.
+enum { GDS_MAX_OPS_PER_VALUE64 = 3 };
+int gds_fill_poke64(CUstreamBatchMemOpParams *params, int &idx, uint64_t *ptr, const uint64_t *value, int flags,
+                    const gds_gpu_caps_t &caps);
+int gds_fill_poll64(CUstreamBatchMemOpParams *params, int &idx, uint64_t *ptr, uint64_t magic, int cond_flag, int flags,
+                    const gds_gpu_caps_t &caps);
+
+// doorbell strategies, see gds_db_strategy_t and autotune.cpp
+bool gds_enable_autotune();
+int gds_autotune_db_strategy(int gpu_id);
+bool gds_db_strategy_is_available(int strategy);
+// overrides the env toggles until called with -1
+void gds_db_strategy_force(int strategy);
+void gds_db_strategy_set(int gpu_id, int strategy);
+// -1 if gpu_id has not been tuned
+int gds_db_strategy_get(int gpu_id);
+
+// per-node cache of the GPU caps and of the doorbell strategy, see capcache.cpp
+// restore returns true if nothing is left to be probed for gpu_id
+bool gds_caps_cache_restore(struct ibv_context *context, int gpu_id);
+int gds_caps_cache_save(struct ibv_context *context, int gpu_id);
+
+// translates descriptors into memops, params must have room for
+// gds_descriptors_n_mem_ops() entries
+size_t gds_descriptors_n_mem_ops(size_t n_descs, gds_descriptor_t *descs);
+// if not NULL, first_param[i] is set to the index, relative to idx on entry,
+// of the first memop of descs[i], and first_param[n_descs] to their total
+int gds_descriptors_to_params(size_t n_descs, gds_descriptor_t *descs, CUstreamBatchMemOpParams *params, int &idx,
+                              int *first_param = NULL);
+
+// CLOCK_MONOTONIC, in nsecs
+uint64_t gds_now_ns();
+
+// capture of the translated batches, see record.cpp
+extern int gds_record_level;
+void gds_record_init();
+static inline bool gds_record_enabled()
+{
+        if (ACCESS_ONCE(gds_record_level) < 0)
+                gds_record_init();
+        return gds_record_level > 0;
+}
+// first_param has n_descs+1 entries, relative to params
+void gds_record_batch(size_t n_descs, gds_descriptor_t *descs, const int *first_param, const int *post_flags,
+                      int n_params, CUstreamBatchMemOpParams *params, uint64_t translate_ns);
+
+// GPU timestamp probes, see probe.cpp
+extern int gds_probe_level;
+void gds_probe_init();
+static inline bool gds_probe_enabled()
+{
+        if (ACCESS_ONCE(gds_probe_level) < 0)
+                gds_probe_init();
+        return gds_probe_level > 0;
+}
+// posts params, bracketing groups of descriptors with probes
+int gds_probe_post_descriptors(CUstream stream, size_t n_descs, gds_descriptor_t *descs,
+                               CUstreamBatchMemOpParams *params, const int *first_param);
+
+// claims the next CQE of cq for a wait, safe against concurrent producers
+// the QPs using a shared CQ claim from the cursor of the latter
+static inline uint32_t gds_cq_claim_offset(struct gds_cq *cq)
+{
+        if (cq->shared)
+                cq = cq->shared;
+        return __sync_fetch_and_add(&cq->curr_offset, 1);
+}
+
+// flag slots for gds_stream_wait_cq_bcast, see flagpool.cpp
+int gds_flag_slot_get(int mem_type, uint32_t **ptr, uint32_t *value);
+void gds_flag_slot_cancel(uint32_t *ptr, uint32_t value);
+
+// prepare into an already initialized request, see gds_reset_*
+int gds_prepare_send_ops(struct gds_qp *qp, gds_send_wr *p_ewr, gds_send_wr **bad_ewr, gds_send_request_t *request);
+int gds_prepare_wait_ops(struct gds_cq *cq, gds_wait_request_t *request);
+void gds_reset_send_info(gds_send_request_t *info);
+void gds_reset_wait_request(gds_wait_request_t *request, uint32_t offset);
 
 enum gds_post_ops_flags {
         GDS_POST_OPS_DISCARD_WAIT_FLUSH = 1<<0
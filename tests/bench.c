@@ -0,0 +1,301 @@
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <time.h>
+
+#include <cuda.h>
+#include <gdsync.h>
+
+#include "bench.h"
+
+void bench_opts_init(struct bench_opts *o, int warmup)
+{
+        memset(o, 0, sizeof(*o));
+        o->warmup = warmup;
+        o->reps = 1;
+}
+
+void bench_opts_default(struct bench_opts *o, int size, int depth, int use_desc)
+{
+        if (!o->n_sizes) {
+                o->n_sizes = 1;
+                o->sizes[0] = size;
+        }
+        if (!o->n_depths) {
+                o->n_depths = 1;
+                o->depths[0] = depth;
+        }
+        if (!o->modes)
+                o->modes = use_desc ? BENCH_MODE_DESC : BENCH_MODE_LEGACY;
+}
+
+int bench_parse_list(const char *arg, int *vals, int max)
+{
+        int n = 0;
+        char *end;
+        const char *colon = strchr(arg, ':');
+
+        if (colon) {
+                long lo = strtol(arg, &end, 0);
+                long hi = strtol(colon + 1, NULL, 0);
+                long v;
+                if (end != colon || lo < 1 || hi < lo)
+                        return -1;
+                for (v = lo; v <= hi && n < max; v *= 2)
+                        vals[n++] = v;
+                return n;
+        }
+        while (*arg) {
+                long v = strtol(arg, &end, 0);
+                if (end == arg || v < 0 || n == max)
+                        return -1;
+                vals[n++] = v;
+                arg = end;
+                if (*arg == ',')
+                        ++arg;
+                else if (*arg)
+                        return -1;
+        }
+        return n ? n : -1;
+}
+
+int bench_parse_opt(struct bench_opts *o, int opt, const char *arg)
+{
+        int n;
+
+        switch (opt) {
+        case BENCH_OPT_WARMUP:
+                o->warmup = strtol(arg, NULL, 0);
+                return o->warmup < 0 ? -1 : 1;
+        case BENCH_OPT_REPS:
+                o->reps = strtol(arg, NULL, 0);
+                return o->reps < 1 ? -1 : 1;
+        case BENCH_OPT_JSON:
+                o->json_path = arg;
+                return 1;
+        case BENCH_OPT_SIZES:
+                n = bench_parse_list(arg, o->sizes, BENCH_MAX_SWEEP);
+                if (n < 0)
+                        return -1;
+                o->n_sizes = n;
+                return 1;
+        case BENCH_OPT_DEPTHS:
+                n = bench_parse_list(arg, o->depths, BENCH_MAX_SWEEP);
+                if (n < 0)
+                        return -1;
+                for (int i = 0; i < n; ++i)
+                        if (o->depths[i] < 1)
+                                return -1;
+                o->n_depths = n;
+                return 1;
+        case BENCH_OPT_MODES:
+                o->modes = 0;
+                if (strstr(arg, "legacy"))
+                        o->modes |= BENCH_MODE_LEGACY;
+                if (strstr(arg, "desc"))
+                        o->modes |= BENCH_MODE_DESC;
+                return o->modes ? 1 : -1;
+        default:
+                return 0;
+        }
+}
+
+void bench_usage(void)
+{
+        printf("\n");
+        printf("Harness options:\n");
+        printf("  --warmup=<n>           iterations discarded before sampling, per run\n");
+        printf("  --reps=<n>             runs of each configuration (default 1)\n");
+        printf("  --json=<file>          append results as JSON to <file>\n");
+        printf("  --sizes=<list>         message sizes, e.g. 8,64,4096 or 8:4096 for powers of 2\n");
+        printf("  --depths=<list>        batch depths, same syntax as --sizes\n");
+        printf("  --modes=<m>            legacy, desc or legacy,desc\n");
+}
+
+int bench_max_size(const struct bench_opts *o)
+{
+        int i, m = 0;
+        for (i = 0; i < o->n_sizes; ++i)
+                if (o->sizes[i] > m)
+                        m = o->sizes[i];
+        return m;
+}
+
+int bench_max_depth(const struct bench_opts *o)
+{
+        int i, m = 0;
+        for (i = 0; i < o->n_depths; ++i)
+                if (o->depths[i] > m)
+                        m = o->depths[i];
+        return m;
+}
+
+//-----------------------------------------------------------------------------
+
+int bench_samples_init(struct bench_samples *s, size_t cap)
+{
+        s->n = 0;
+        s->cap = cap;
+        s->v = calloc(cap ? cap : 1, sizeof(double));
+        return s->v ? 0 : ENOMEM;
+}
+
+void bench_samples_free(struct bench_samples *s)
+{
+        free(s->v);
+        s->v = NULL;
+        s->n = s->cap = 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+        double x = *(const double *)a, y = *(const double *)b;
+        return x < y ? -1 : x > y;
+}
+
+// nearest-rank percentile of sorted samples
+static double percentile(const struct bench_samples *s, double p)
+{
+        size_t rank = (size_t)(p * s->n + 0.999999);
+        if (rank < 1)
+                rank = 1;
+        if (rank > s->n)
+                rank = s->n;
+        return s->v[rank - 1];
+}
+
+void bench_compute(struct bench_samples *s, struct bench_stats *st)
+{
+        double sum = 0;
+        size_t i;
+
+        memset(st, 0, sizeof(*st));
+        if (!s->n)
+                return;
+        qsort(s->v, s->n, sizeof(double), cmp_double);
+        for (i = 0; i < s->n; ++i)
+                sum += s->v[i];
+        st->n = s->n;
+        st->avg = sum / s->n;
+        st->min = s->v[0];
+        st->p50 = percentile(s, 0.50);
+        st->p99 = percentile(s, 0.99);
+        st->p999 = percentile(s, 0.999);
+        st->max = s->v[s->n - 1];
+}
+
+//-----------------------------------------------------------------------------
+
+const char *bench_mode_name(int mode)
+{
+        return mode == BENCH_MODE_DESC ? "desc" : "legacy";
+}
+
+int bench_report_open(struct bench_report *r, const struct bench_opts *o, const char *name, int rank)
+{
+        int gds_version = 0, cuda_version = 0;
+        char host[256] = "unknown";
+        char date[64] = "";
+        time_t now = time(NULL);
+
+        memset(r, 0, sizeof(*r));
+        r->rank = rank;
+        gds_query_param(GDS_PARAM_VERSION, &gds_version);
+        cuDriverGetVersion(&cuda_version);
+        gethostname(host, sizeof(host) - 1);
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+
+        if (rank || !o->json_path)
+                return 0;
+        r->json = fopen(o->json_path, "a");
+        if (!r->json) {
+                fprintf(stderr, "cannot open %s: %s\n", o->json_path, strerror(errno));
+                return errno;
+        }
+        fprintf(r->json, "{\"bench\":\"%s\",\"date\":\"%s\",\"host\":\"%s\","
+                "\"gds_version\":\"0x%08x\",\"cuda_driver\":%d,"
+                "\"warmup\":%d,\"reps\":%d,\"unit\":\"usec\",\"results\":[",
+                name, date, host, gds_version, cuda_version, o->warmup, o->reps);
+        return 0;
+}
+
+static void bench_json_stats(struct bench_report *r, int iters, const struct bench_stats *st)
+{
+        fprintf(r->json, "\"iters\":%d,\"samples\":%zu,"
+                "\"avg\":%.3f,\"min\":%.3f,\"p50\":%.3f,\"p99\":%.3f,\"p99.9\":%.3f,\"max\":%.3f}",
+                iters, st->n, st->avg, st->min, st->p50, st->p99, st->p999, st->max);
+        r->n_results++;
+}
+
+void bench_report_add(struct bench_report *r, int size, int depth, int mode, int iters,
+                      const struct bench_stats *st)
+{
+        if (!r->n_lines++)
+                printf("[%d] %-6s %8s %6s %8s %10s %10s %10s %10s %10s\n", r->rank, "mode", "size", "depth",
+                       "samples", "avg", "p50", "p99", "p99.9", "max");
+        printf("[%d] %-6s %8d %6d %8zu %10.2f %10.2f %10.2f %10.2f %10.2f\n", r->rank, bench_mode_name(mode),
+               size, depth, st->n, st->avg, st->p50, st->p99, st->p999, st->max);
+        fflush(stdout);
+        if (!r->json)
+                return;
+        fprintf(r->json, "%s{\"mode\":\"%s\",\"size\":%d,\"depth\":%d,",
+                r->n_results ? "," : "", bench_mode_name(mode), size, depth);
+        bench_json_stats(r, iters, st);
+}
+
+void bench_report_add_params(struct bench_report *r, const char *params, int iters,
+                             const struct bench_stats *st)
+{
+        char buf[256];
+        char *save = NULL, *kv;
+
+        if (!r->n_lines++)
+                printf("[%d] %-32s %8s %10s %10s %10s %10s %10s\n", r->rank, "params",
+                       "samples", "avg", "p50", "p99", "p99.9", "max");
+        printf("[%d] %-32s %8zu %10.2f %10.2f %10.2f %10.2f %10.2f\n", r->rank, params,
+               st->n, st->avg, st->p50, st->p99, st->p999, st->max);
+        fflush(stdout);
+        if (!r->json)
+                return;
+        fprintf(r->json, "%s{", r->n_results ? "," : "");
+        snprintf(buf, sizeof(buf), "%s", params);
+        for (kv = strtok_r(buf, " \t", &save); kv; kv = strtok_r(NULL, " \t", &save)) {
+                char *val = strchr(kv, '=');
+                char *end;
+                if (!val)
+                        continue;
+                *val++ = 0;
+                strtod(val, &end);
+                // strtod also takes inf and nan, which JSON does not
+                if ((isdigit((unsigned char)*val) || *val == '-') && !*end)
+                        fprintf(r->json, "\"%s\":%s,", kv, val);
+                else
+                        fprintf(r->json, "\"%s\":\"%s\",", kv, val);
+        }
+        bench_json_stats(r, iters, st);
+}
+
+void bench_report_close(struct bench_report *r)
+{
+        if (!r->json)
+                return;
+        fprintf(r->json, "]}\n");
+        fclose(r->json);
+        r->json = NULL;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ *  indent-tabs-mode: nil
+ * End:
+ */
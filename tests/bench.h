@@ -0,0 +1,124 @@
+#pragma once
+
+// Benchmark harness shared by the latency tests: warmup, repetitions,
+// message size and batch depth sweeps, legacy vs descriptor APIs,
+// percentiles and JSON output.
+//
+// The harness options are long-only, so they never clash with the short
+// options of the tests. Splice BENCH_LONG_OPTIONS into the getopt_long
+// table and hand unknown option values to bench_parse_opt().
+
+#include <stdio.h>
+#include <stddef.h>
+#include <time.h>
+
+#define BENCH_MAX_SWEEP 32
+
+enum {
+        BENCH_MODE_LEGACY = 1 << 0,     // gds_stream_queue_send/gds_stream_wait_cq
+        BENCH_MODE_DESC   = 1 << 1,     // gds_stream_post_descriptors
+};
+
+enum {
+        BENCH_OPT_WARMUP = 0x100,
+        BENCH_OPT_REPS,
+        BENCH_OPT_JSON,
+        BENCH_OPT_SIZES,
+        BENCH_OPT_DEPTHS,
+        BENCH_OPT_MODES,
+};
+
+#define BENCH_LONG_OPTIONS                                                      \
+        { .name = "warmup", .has_arg = 1, .val = BENCH_OPT_WARMUP },            \
+        { .name = "reps",   .has_arg = 1, .val = BENCH_OPT_REPS },              \
+        { .name = "json",   .has_arg = 1, .val = BENCH_OPT_JSON },              \
+        { .name = "sizes",  .has_arg = 1, .val = BENCH_OPT_SIZES },             \
+        { .name = "depths", .has_arg = 1, .val = BENCH_OPT_DEPTHS },            \
+        { .name = "modes",  .has_arg = 1, .val = BENCH_OPT_MODES }
+
+struct bench_opts {
+        int         warmup;     // iterations run and discarded before sampling
+        int         reps;       // runs of each configuration
+        const char *json_path;  // NULL for no JSON output
+        int         n_sizes;
+        int         sizes[BENCH_MAX_SWEEP];
+        int         n_depths;
+        int         depths[BENCH_MAX_SWEEP];
+        int         modes;      // BENCH_MODE_*
+};
+
+void bench_opts_init(struct bench_opts *o, int warmup);
+// after option parsing, the sweeps which have not been given fall back to
+// the single value set by the test options
+void bench_opts_default(struct bench_opts *o, int size, int depth, int use_desc);
+// 1 if opt is a harness option, 0 if not, -1 on a bad argument
+int bench_parse_opt(struct bench_opts *o, int opt, const char *arg);
+void bench_usage(void);
+int bench_max_size(const struct bench_opts *o);
+int bench_max_depth(const struct bench_opts *o);
+// parses "a,b,c" or "lo:hi" (powers of two between lo and hi) into vals
+// returns the number of values, or -1
+int bench_parse_list(const char *arg, int *vals, int max);
+
+static inline double bench_now_us(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+struct bench_samples {
+        double *v;
+        size_t  n;
+        size_t  cap;
+};
+int bench_samples_init(struct bench_samples *s, size_t cap);
+void bench_samples_free(struct bench_samples *s);
+static inline void bench_samples_reset(struct bench_samples *s) { s->n = 0; }
+// samples past the capacity are dropped
+static inline void bench_samples_add(struct bench_samples *s, double usec)
+{
+        if (s->n < s->cap)
+                s->v[s->n++] = usec;
+}
+
+struct bench_stats {
+        size_t n;
+        double avg;
+        double min;
+        double p50;
+        double p99;
+        double p999;
+        double max;
+};
+// sorts the samples
+void bench_compute(struct bench_samples *s, struct bench_stats *st);
+
+struct bench_report {
+        FILE *json;
+        int   n_results;
+        int   n_lines;
+        int   rank;
+};
+// writes the run metadata, i.e. test name, libgdsync and CUDA driver
+// versions, host and date; JSON is written only if rank is 0
+int bench_report_open(struct bench_report *r, const struct bench_opts *o, const char *name, int rank);
+// prints a line, and a JSON record if enabled
+void bench_report_add(struct bench_report *r, int size, int depth, int mode, int iters,
+                      const struct bench_stats *st);
+// same, for tests which sweep something else than size, depth and mode
+// params is a list of key=value pairs separated by blanks, e.g.
+// "waits=8 mem=gpu", which is printed as is and stored as JSON fields
+void bench_report_add_params(struct bench_report *r, const char *params, int iters,
+                             const struct bench_stats *st);
+void bench_report_close(struct bench_report *r);
+const char *bench_mode_name(int mode);
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ *  indent-tabs-mode: nil
+ * End:
+ */
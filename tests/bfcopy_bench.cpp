@@ -0,0 +1,142 @@
+/* Copyright (c) 2016, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Microbenchmark of the BlueFlame copy kernels in mlnxutils.h, run on
+// plain memory: a 64 bytes aligned destination stands in for the BF
+// register and WQEs are taken in turn out of a circular send queue, so
+// that multi-block copies also exercise the wrap-around path.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <getopt.h>
+
+#include <archutils.h>
+#include <mlnxutils.h>
+
+static double now_ns()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int check(gds_bf_copy_fn_t copy, uint64_t *sq, size_t sq_size, uint64_t *dst)
+{
+        const uint64_t *sq_end = sq + sq_size / sizeof(uint64_t);
+        // copy the last block of the SQ plus the first three, i.e. wrap
+        for (size_t len = 64; len <= 256; len += 64) {
+                const uint64_t *src = sq_end - 8;
+                memset(dst, 0, 256);
+                gds_bf_copy_wq(copy, dst, src, len, sq, sq_end);
+                wmb();
+                if (memcmp(dst, src, 64) || memcmp(dst + 8, sq, len - 64)) {
+                        fprintf(stderr, "wrap-around mismatch at len=%zu\n", len);
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+int main(int argc, char *argv[])
+{
+        size_t sq_size = 1 << 16;
+        int iters = 1000000;
+        int c;
+
+        while ((c = getopt(argc, argv, "n:q:h")) != -1) {
+                switch (c) {
+                case 'n': iters = atoi(optarg); break;
+                case 'q': sq_size = strtoul(optarg, NULL, 0); break;
+                default:
+                        printf("Usage: %s [-n iterations] [-q SQ bytes]\n", argv[0]);
+                        return 1;
+                }
+        }
+        sq_size &= ~(size_t)63;
+        if (sq_size < 256) {
+                fprintf(stderr, "SQ must be at least 256 bytes\n");
+                return 1;
+        }
+
+        uint64_t *sq = NULL, *dst = NULL;
+        if (posix_memalign((void **)&sq, 64, sq_size) || posix_memalign((void **)&dst, 64, 4096)) {
+                fprintf(stderr, "out of memory\n");
+                return 1;
+        }
+        for (size_t i = 0; i < sq_size / sizeof(uint64_t); ++i)
+                sq[i] = 0x0101010101010101ULL * (i & 0xff) + i;
+
+        static const char *names[] = { "generic", "avx2", "avx512" };
+        static const size_t lens[] = { 64, 128, 256 };
+        int ret = 0;
+
+        printf("%-8s %6s %12s %10s\n", "kernel", "bytes", "ns/copy", "GB/s");
+        for (size_t k = 0; k < sizeof(names)/sizeof(names[0]); ++k) {
+                gds_bf_copy_fn_t copy = gds_bf_copy_select(names[k]);
+                if (!copy) {
+                        printf("%-8s %6s\n", names[k], "n/a");
+                        continue;
+                }
+                if (check(copy, sq, sq_size, dst)) {
+                        ret = 1;
+                        continue;
+                }
+                for (size_t l = 0; l < sizeof(lens)/sizeof(lens[0]); ++l) {
+                        size_t len = lens[l];
+                        const uint64_t *sq_end = sq + sq_size / sizeof(uint64_t);
+                        size_t off = 0;
+                        unsigned bf_offset = 0;
+                        double t0 = now_ns();
+                        for (int i = 0; i < iters; ++i) {
+                                // alternate between the two BF buffers, as libmlx5 does
+                                gds_bf_copy_wq(copy, dst + bf_offset, sq + off, len, sq, sq_end);
+                                wmb();
+                                bf_offset ^= 256 / sizeof(uint64_t);
+                                off = (off + len / sizeof(uint64_t)) % (sq_size / sizeof(uint64_t));
+                        }
+                        double t = (now_ns() - t0) / iters;
+                        printf("%-8s %6zu %12.2f %10.2f\n", names[k], len, t, len / t);
+                }
+        }
+
+        free(sq);
+        free(dst);
+        return ret;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ *  indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,284 @@
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+
+#include <cuda.h>
+#include <cuda_runtime_api.h>
+#include <gdsync.h>
+
+#include "loopback.h"
+#include "gpu.h"
+#include "test_utils.h"
+
+// Aggregation endpoint on a loopback UD QP: every round appends -m messages
+// of varying length, up to zero bytes, out of a device buffer and flushes
+// them, then the CPU reaps the receives, unpacks them with gds_agg_unpack
+// and checks payloads and flags. Slots fill up and are reused within a
+// round whenever -m x -l exceeds the slot size.
+
+#define GRH_SIZE 40
+
+static uint32_t msg_len(int id, int round, int max_len)
+{
+        return (id * 7 + round) % (max_len + 1);
+}
+
+static unsigned char msg_byte(int id, int round, uint32_t i)
+{
+        return (unsigned char)(id * 31 + round * 13 + i);
+}
+
+static void usage(const char *argv0)
+{
+        printf("Usage:\n");
+        printf("  %s [options]\n", argv0);
+        printf("\n");
+        printf("Options:\n");
+        loopback_usage();
+        printf("  -n, --rounds=<n>       append+flush rounds (default 100)\n");
+        printf("  -m, --msgs=<n>         messages per round (default 64)\n");
+        printf("  -l, --max-len=<bytes>  max message length (default 60)\n");
+        printf("  -s, --slot-size=<n>    bytes per send (default 1024)\n");
+        printf("  -S, --slots=<n>        staging slots (default 4)\n");
+        printf("  -M, --gpu-mem          staging buffer in GPU memory (default host)\n");
+}
+
+int main(int argc, char *argv[])
+{
+        int ret = 0;
+        struct loopback_opts lo;
+        int rounds = 100;
+        int n_msgs = 64;
+        int max_len = 60;
+        int slot_size = 1024;
+        int n_slots = 4;
+        int mem_flags = GDS_MEMORY_HOST;
+        int depth, r, i, n_pending;
+        long n_recvs = 0;
+        struct loopback_ctx ctx;
+        gds_agg_t *agg = NULL;
+        gds_agg_attr_t attr;
+        gds_send_wr ewr;
+        struct ibv_sge sge;
+        struct ibv_mr *rx_mr = NULL;
+        char *rx_buf = NULL;
+        unsigned char *h_src = NULL;
+        CUdeviceptr d_src = 0;
+        char *h_dst = NULL;
+        void **dst = NULL;
+        uint32_t *flags = NULL;
+
+        loopback_opts_init(&lo);
+        while (1) {
+                static struct option long_options[] = {
+                        LOOPBACK_LONG_OPTIONS,
+                        { .name = "rounds",    .has_arg = 1, .val = 'n' },
+                        { .name = "msgs",      .has_arg = 1, .val = 'm' },
+                        { .name = "max-len",   .has_arg = 1, .val = 'l' },
+                        { .name = "slot-size", .has_arg = 1, .val = 's' },
+                        { .name = "slots",     .has_arg = 1, .val = 'S' },
+                        { .name = "gpu-mem",   .has_arg = 0, .val = 'M' },
+                        { 0 }
+                };
+                int c = getopt_long(argc, argv, LOOPBACK_SHORT_OPTIONS "n:m:l:s:S:Mh", long_options, NULL);
+                if (c == -1)
+                        break;
+                if (loopback_parse_opt(&lo, c, optarg))
+                        continue;
+                switch (c) {
+                case 'n': rounds = strtol(optarg, NULL, 0); break;
+                case 'm': n_msgs = strtol(optarg, NULL, 0); break;
+                case 'l': max_len = strtol(optarg, NULL, 0); break;
+                case 's': slot_size = strtol(optarg, NULL, 0); break;
+                case 'S': n_slots = strtol(optarg, NULL, 0); break;
+                case 'M': mem_flags = GDS_MEMORY_GPU; break;
+                default:
+                        usage(argv[0]);
+                        return 1;
+                }
+        }
+        if (rounds < 1 || n_msgs < 1 || max_len < 0 || n_slots < 1 ||
+            slot_size % GDS_AGG_ALIGN || max_len + (int)sizeof(gds_agg_msg_hdr_t) > slot_size) {
+                usage(argv[0]);
+                return 1;
+        }
+        // the send CQ must outlast the slots in flight, the receive queue
+        // must hold every send of a round
+        depth = 2 * n_slots;
+        if (depth < n_msgs + 1)
+                depth = n_msgs + 1;
+
+        if (loopback_gpu_init(&lo))
+                return 1;
+        ret = loopback_open(&ctx, &lo, depth, GDS_AGG_ALIGN, 0, 0);
+        if (ret)
+                goto out_gpu;
+
+        rx_buf = malloc((size_t)depth * (slot_size + GRH_SIZE));
+        h_src = malloc((size_t)n_msgs * max_len + 1);
+        h_dst = malloc((size_t)n_msgs * max_len + 1);
+        dst = calloc(n_msgs, sizeof(*dst));
+        flags = calloc(n_msgs, sizeof(*flags));
+        if (!rx_buf || !h_src || !h_dst || !dst || !flags) {
+                ret = ENOMEM;
+                goto out;
+        }
+        for (i = 0; i < n_msgs; ++i)
+                dst[i] = h_dst + (size_t)i * max_len;
+        rx_mr = ibv_reg_mr(ctx.pd, rx_buf, (size_t)depth * (slot_size + GRH_SIZE), IBV_ACCESS_LOCAL_WRITE);
+        if (!rx_mr) {
+                fprintf(stderr, "cannot register receive buffers\n");
+                ret = ENOMEM;
+                goto out;
+        }
+        for (i = 0; i < depth; ++i) {
+                struct ibv_sge rsge = {
+                        .addr   = (uintptr_t)(rx_buf + (size_t)i * (slot_size + GRH_SIZE)),
+                        .length = slot_size + GRH_SIZE,
+                        .lkey   = rx_mr->lkey
+                };
+                struct ibv_recv_wr rwr = { .wr_id = i, .sg_list = &rsge, .num_sge = 1 }, *bad_rwr;
+                ret = gds_post_recv(ctx.gds_qp, &rwr, &bad_rwr);
+                if (ret) {
+                        fprintf(stderr, "error %d while posting receive %d\n", ret, i);
+                        goto out;
+                }
+        }
+        CUCHECK(cuMemAlloc(&d_src, (size_t)n_msgs * max_len + 1));
+
+        loopback_init_send(&ctx, &ewr, &sge, 0);
+        memset(&attr, 0, sizeof(attr));
+        attr.slot_size = slot_size;
+        attr.n_slots = n_slots;
+        attr.flags = mem_flags;
+        attr.wr = &ewr;
+        ret = gds_agg_create(ctx.gds_qp, ctx.pd, gpu_stream, &attr, &agg);
+        if (ret) {
+                fprintf(stderr, "error %d while creating aggregation endpoint\n", ret);
+                goto out;
+        }
+
+        for (r = 0; r < rounds; ++r) {
+                uint32_t value = r + 1;
+                int n_done = 0;
+                time_t tmout;
+
+                for (i = 0; i < n_msgs; ++i) {
+                        uint32_t k, len = msg_len(i, r, max_len);
+                        for (k = 0; k < len; ++k)
+                                h_src[(size_t)i * max_len + k] = msg_byte(i, r, k);
+                }
+                // the previous round has been fully received, d_src is idle
+                CUCHECK(cuMemcpyHtoD(d_src, h_src, (size_t)n_msgs * max_len + 1));
+                for (i = 0; i < n_msgs; ++i) {
+                        uint32_t len = msg_len(i, r, max_len);
+                        ret = gds_agg_append(agg, len ? (void *)(d_src + (size_t)i * max_len) : NULL, len, i);
+                        if (ret) {
+                                fprintf(stderr, "error %d while appending message %d of round %d\n", ret, i, r);
+                                goto out;
+                        }
+                }
+                ret = gds_agg_flush(agg);
+                if (ret) {
+                        fprintf(stderr, "error %d while flushing round %d\n", ret, r);
+                        goto out;
+                }
+
+                tmout = time(NULL) + 10;
+                while (n_done < n_msgs) {
+                        struct ibv_wc wc;
+                        int ne = ibv_poll_cq(ctx.gds_qp->recv_cq.cq, 1, &wc);
+                        if (ne < 0 || (ne && wc.status != IBV_WC_SUCCESS)) {
+                                fprintf(stderr, "receive error in round %d\n", r);
+                                ret = EIO;
+                                goto out;
+                        }
+                        if (!ne) {
+                                if (time(NULL) > tmout) {
+                                        fprintf(stderr, "timeout in round %d, %d/%d messages\n", r, n_done, n_msgs);
+                                        ret = ETIMEDOUT;
+                                        goto out;
+                                }
+                                continue;
+                        }
+                        {
+                                char *buf = rx_buf + (size_t)wc.wr_id * (slot_size + GRH_SIZE);
+                                struct ibv_sge rsge = { .addr = (uintptr_t)buf, .length = slot_size + GRH_SIZE, .lkey = rx_mr->lkey };
+                                struct ibv_recv_wr rwr = { .wr_id = wc.wr_id, .sg_list = &rsge, .num_sge = 1 }, *bad_rwr;
+                                int n = 0;
+                                ret = gds_agg_unpack(buf + GRH_SIZE, wc.byte_len - GRH_SIZE, dst, flags, n_msgs, value, &n);
+                                if (!ret)
+                                        ret = gds_post_recv(ctx.gds_qp, &rwr, &bad_rwr);
+                                if (ret) {
+                                        fprintf(stderr, "error %d while unpacking in round %d\n", ret, r);
+                                        goto out;
+                                }
+                                n_done += n;
+                                ++n_recvs;
+                        }
+                }
+                for (i = 0; i < n_msgs; ++i) {
+                        uint32_t k, len = msg_len(i, r, max_len);
+                        if (flags[i] != value) {
+                                fprintf(stderr, "round %d: flag %d is %u, expected %u\n", r, i, flags[i], value);
+                                ret = EINVAL;
+                                goto out;
+                        }
+                        for (k = 0; k < len; ++k) {
+                                if ((unsigned char)h_dst[(size_t)i * max_len + k] != msg_byte(i, r, k)) {
+                                        fprintf(stderr, "round %d: message %d differs at byte %u\n", r, i, k);
+                                        ret = EINVAL;
+                                        goto out;
+                                }
+                        }
+                }
+                ret = gds_agg_poll(agg, 0, NULL);
+                if (ret)
+                        goto out;
+        }
+        printf("%d rounds of %d messages in %ld sends, %.2f messages/send\n",
+               rounds, n_msgs, n_recvs, (double)rounds * n_msgs / n_recvs);
+
+out:
+        if (agg) {
+                time_t tmout = time(NULL) + 10;
+                CUCHECK(cuStreamSynchronize(gpu_stream));
+                do {
+                        if (gds_agg_poll(agg, GDS_AGG_POLL_ALL, &n_pending))
+                                break;
+                } while (n_pending && time(NULL) <= tmout);
+                if (gds_agg_destroy(agg) && !ret)
+                        ret = EBUSY;
+        }
+        if (d_src)
+                CUCHECK(cuMemFree(d_src));
+        if (rx_mr)
+                ibv_dereg_mr(rx_mr);
+        free(rx_buf);
+        free(h_src);
+        free(h_dst);
+        free(dst);
+        free(flags);
+        loopback_fini(&ctx);
+out_gpu:
+        gpu_finalize();
+        printf("test %s\n", ret ? "failed" : "passed");
+        return ret ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ *  indent-tabs-mode: nil
+ * End:
+ */
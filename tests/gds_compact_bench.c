@@ -0,0 +1,226 @@
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <malloc.h>
+#include <getopt.h>
+#include <time.h>
+#include <assert.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+
+#include <cuda.h>
+#include <cuda_runtime_api.h>
+#include <gdsync.h>
+
+#include "loopback.h"
+#include "gpu.h"
+#include "test_utils.h"
+
+// CPU cost of preparing and posting large batches of sends, with the
+// fixed-size gds_send_request_t vs the compact request format
+
+enum { CNT_LLC_MISSES = 0, CNT_L1D_MISSES, N_CNTS };
+
+static int perf_open(uint32_t type, uint64_t config)
+{
+        struct perf_event_attr pe;
+        memset(&pe, 0, sizeof(pe));
+        pe.type = type;
+        pe.size = sizeof(pe);
+        pe.config = config;
+        pe.disabled = 1;
+        pe.exclude_kernel = 1;
+        pe.exclude_hv = 1;
+        return syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+}
+
+static void perf_ctl(int *fds, int req)
+{
+        int i;
+        for (i = 0; i < N_CNTS; ++i)
+                if (fds[i] >= 0)
+                        ioctl(fds[i], req, 0);
+}
+
+static uint64_t perf_read(int fd)
+{
+        uint64_t val = 0;
+        if (fd < 0 || read(fd, &val, sizeof(val)) != sizeof(val))
+                return 0;
+        return val;
+}
+
+static void usage(const char *argv0)
+{
+        printf("Usage:\n");
+        printf("  %s [options]\n", argv0);
+        printf("\n");
+        printf("Options:\n");
+        printf("  -d, --ib-dev=<dev>     use IB device <dev> (default first device found)\n");
+        printf("  -i, --ib-port=<port>   use port <port> of IB device (default 1)\n");
+        printf("  -g, --gid-idx=<idx>    local port gid index (default none)\n");
+        printf("  -G, --gpu-id=<id>      use specified GPU (default 0)\n");
+        printf("  -n, --batch=<n>        sends per batch (default 1024)\n");
+        printf("  -r, --rounds=<n>       measured rounds (default 100)\n");
+        printf("  -w, --warmup=<n>       warmup rounds (default 10)\n");
+        printf("  -s, --size=<size>      message size (default 8)\n");
+}
+
+int main(int argc, char *argv[])
+{
+        int ret = 0;
+        char *ib_devname = NULL;
+        int ib_port = 1;
+        int gid_idx = -1;
+        int gpu_id = 0;
+        int batch = 1024;
+        int rounds = 100;
+        int warmup = 10;
+        int size = 8;
+        int mode, r, i;
+        int fds[N_CNTS];
+        struct loopback_ctx ctx;
+        gds_send_request_t *reqs = NULL;
+        gds_compact_requests_t creqs;
+
+        while (1) {
+                static struct option long_options[] = {
+                        { .name = "ib-dev",  .has_arg = 1, .val = 'd' },
+                        { .name = "ib-port", .has_arg = 1, .val = 'i' },
+                        { .name = "gid-idx", .has_arg = 1, .val = 'g' },
+                        { .name = "gpu-id",  .has_arg = 1, .val = 'G' },
+                        { .name = "batch",   .has_arg = 1, .val = 'n' },
+                        { .name = "rounds",  .has_arg = 1, .val = 'r' },
+                        { .name = "warmup",  .has_arg = 1, .val = 'w' },
+                        { .name = "size",    .has_arg = 1, .val = 's' },
+                        { 0 }
+                };
+                int c = getopt_long(argc, argv, "d:i:g:G:n:r:w:s:h", long_options, NULL);
+                if (c == -1)
+                        break;
+                switch (c) {
+                case 'd': ib_devname = strdup(optarg); break;
+                case 'i': ib_port = strtol(optarg, NULL, 0); break;
+                case 'g': gid_idx = strtol(optarg, NULL, 0); break;
+                case 'G': gpu_id = strtol(optarg, NULL, 0); break;
+                case 'n': batch = strtol(optarg, NULL, 0); break;
+                case 'r': rounds = strtol(optarg, NULL, 0); break;
+                case 'w': warmup = strtol(optarg, NULL, 0); break;
+                case 's': size = strtol(optarg, NULL, 0); break;
+                default:
+                        usage(argv[0]);
+                        return 1;
+                }
+        }
+
+        if (gpu_init(gpu_id, CU_CTX_SCHED_AUTO)) {
+                fprintf(stderr, "error in GPU init.\n");
+                return 1;
+        }
+        ret = loopback_init(&ctx, ib_devname, ib_port, gid_idx, gpu_id, batch, size, 0);
+        if (ret)
+                goto out_gpu;
+
+        reqs = memalign(64, batch * sizeof(*reqs));
+        if (!reqs) {
+                ret = ENOMEM;
+                goto out;
+        }
+        ret = gds_compact_requests_init(&creqs, 0);
+        if (ret)
+                goto out;
+
+        fds[CNT_LLC_MISSES] = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+        fds[CNT_L1D_MISSES] = perf_open(PERF_TYPE_HW_CACHE,
+                                        PERF_COUNT_HW_CACHE_L1D |
+                                        (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+        if (fds[CNT_LLC_MISSES] < 0 || fds[CNT_L1D_MISSES] < 0)
+                printf("perf counters not available, cache misses will read as 0\n");
+
+        printf("batch=%d rounds=%d size=%d sizeof(gds_send_request_t)=%zu\n",
+               batch, rounds, size, sizeof(gds_send_request_t));
+        printf("%-8s %12s %12s %14s %14s %12s\n",
+               "format", "usec/batch", "Mreq/s", "LLC-miss/req", "L1D-miss/req", "bytes/req");
+
+        for (mode = 0; mode < 2; ++mode) {
+                const char *name = mode ? "compact" : "legacy";
+                gds_us_t elapsed = 0;
+                size_t bytes = 0;
+                for (i = 0; i < N_CNTS; ++i)
+                        if (fds[i] >= 0)
+                                ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+
+                for (r = 0; r < warmup + rounds; ++r) {
+                        int measure = r >= warmup;
+                        struct ibv_sge sge;
+                        gds_send_wr ewr, *bad_ewr;
+                        gds_us_t start;
+
+                        loopback_init_send(&ctx, &ewr, &sge, 0);
+                        if (measure)
+                                perf_ctl(fds, PERF_EVENT_IOC_ENABLE);
+                        start = gds_get_time_us();
+                        if (mode) {
+                                gds_compact_requests_reset(&creqs);
+                                for (i = 0; i < batch && !ret; ++i)
+                                        ret = gds_compact_prepare_send(ctx.gds_qp, &ewr, &bad_ewr, &creqs);
+                                if (!ret)
+                                        ret = gds_stream_post_compact_requests(gpu_stream, &creqs, 0);
+                                bytes = creqs.used;
+                        } else {
+                                for (i = 0; i < batch && !ret; ++i)
+                                        ret = gds_prepare_send(ctx.gds_qp, &ewr, &bad_ewr, &reqs[i]);
+                                if (!ret)
+                                        ret = gds_stream_post_send_all(gpu_stream, batch, reqs);
+                                bytes = batch * sizeof(*reqs);
+                        }
+                        if (measure) {
+                                elapsed += gds_get_time_us() - start;
+                                perf_ctl(fds, PERF_EVENT_IOC_DISABLE);
+                        }
+                        if (ret) {
+                                fprintf(stderr, "error %d while posting %s batch\n", ret, name);
+                                goto out;
+                        }
+                        CUCHECK(cuStreamSynchronize(gpu_stream));
+                        ret = loopback_drain_send_cq(&ctx, batch);
+                        if (ret)
+                                goto out;
+                }
+
+                printf("%-8s %12.2f %12.3f %14.2f %14.2f %12zu\n", name,
+                       (double)elapsed / rounds,
+                       (double)batch * rounds / (elapsed ? elapsed : 1),
+                       (double)perf_read(fds[CNT_LLC_MISSES]) / ((double)batch * rounds),
+                       (double)perf_read(fds[CNT_L1D_MISSES]) / ((double)batch * rounds),
+                       bytes / batch);
+        }
+
+        for (i = 0; i < N_CNTS; ++i)
+                if (fds[i] >= 0)
+                        close(fds[i]);
+        gds_compact_requests_fini(&creqs);
+out:
+        free(reqs);
+        loopback_fini(&ctx);
+out_gpu:
+        gpu_finalize();
+        return ret ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ *  indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,163 @@
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+
+#include <cuda.h>
+#include <cuda_runtime_api.h>
+#include <gdsync.h>
+
+#include "loopback.h"
+#include "gpu.h"
+#include "test_utils.h"
+
+// Stream-triggered send+wait round trip time vs inline payload size, on a
+// loopback QP. The doorbell is rung either by pushing the whole WQE to the
+// BlueFlame register with an inline copy, or by writing its first 8 bytes
+// only, in which case the HCA fetches the WQE from memory. WQEs larger than
+// GDS_INLINE_WQE_MAX_SIZE take the latter path, -t sets it, e.g. run once
+// with -t 8 and once with -t 256 to compare the two.
+
+// GDS_INLINE_WQE_MAX_SIZE as parsed by the library: 256 bytes by default,
+// clamped to [8, 256]
+static size_t inline_wqe_max_size(const char *threshold)
+{
+        long max_size = threshold ? strtol(threshold, NULL, 0) : 256;
+        if (max_size < (long)sizeof(uint64_t))
+                max_size = sizeof(uint64_t);
+        if (max_size > 256)
+                max_size = 256;
+        return max_size;
+}
+
+// bytes pushed to the BlueFlame register by the send, with the same rule
+// as gds_post_ops: WQEs over max_size only ring the 8 bytes doorbell
+static size_t bf_bytes(gds_send_request_t *req, size_t max_size)
+{
+        struct peer_op_wr *op = req->commit.storage;
+        int n;
+        for (n = 0; op && n < req->commit.entries; op = op->next, ++n) {
+                if (op->type == IBV_EXP_PEER_OP_COPY_BLOCK)
+                        return op->wr.copy_op.len > max_size ? sizeof(uint64_t) : op->wr.copy_op.len;
+                if (op->type == IBV_EXP_PEER_OP_STORE_QWORD)
+                        return sizeof(uint64_t);
+        }
+        return 0;
+}
+
+static void usage(const char *argv0)
+{
+        printf("Usage:\n");
+        printf("  %s [options]\n", argv0);
+        printf("\n");
+        printf("Options:\n");
+        loopback_usage();
+        printf("  -n, --iters=<n>        send+wait round trips per size (default 10000)\n");
+        printf("  -m, --max-inline=<n>   largest inline payload (default 128)\n");
+        printf("  -t, --threshold=<n>    set GDS_INLINE_WQE_MAX_SIZE to <n> bytes\n");
+}
+
+int main(int argc, char *argv[])
+{
+        int ret = 0;
+        struct loopback_opts lo;
+        int iters = 10000;
+        int max_inline = 128;
+        char *threshold = NULL;
+        int i, size;
+        gds_us_t start, elapsed;
+        struct loopback_ctx ctx;
+        gds_send_request_t sreq;
+        gds_wait_request_t wreq;
+
+        loopback_opts_init(&lo);
+        while (1) {
+                static struct option long_options[] = {
+                        LOOPBACK_LONG_OPTIONS,
+                        { .name = "iters",      .has_arg = 1, .val = 'n' },
+                        { .name = "max-inline", .has_arg = 1, .val = 'm' },
+                        { .name = "threshold",  .has_arg = 1, .val = 't' },
+                        { 0 }
+                };
+                int c = getopt_long(argc, argv, LOOPBACK_SHORT_OPTIONS "n:m:t:h", long_options, NULL);
+                if (c == -1)
+                        break;
+                if (loopback_parse_opt(&lo, c, optarg))
+                        continue;
+                switch (c) {
+                case 'n': iters = strtol(optarg, NULL, 0); break;
+                case 'm': max_inline = strtol(optarg, NULL, 0); break;
+                case 't': threshold = optarg; break;
+                default:
+                        usage(argv[0]);
+                        return 1;
+                }
+        }
+        if (iters < 1 || max_inline < 0) {
+                usage(argv[0]);
+                return 1;
+        }
+        // must be set before the first send is posted
+        if (threshold)
+                setenv("GDS_INLINE_WQE_MAX_SIZE", threshold, 1);
+
+        if (loopback_gpu_init(&lo))
+                return 1;
+        ret = loopback_open(&ctx, &lo, 16, max_inline ? max_inline : 8, 0, max_inline);
+        if (ret)
+                goto out_gpu;
+
+        printf("GDS_INLINE_WQE_MAX_SIZE=%s, %d round trips per size\n", threshold ? threshold : "default", iters);
+        printf("%10s %10s %10s\n", "payload", "bf_bytes", "usec/trip");
+        for (size = 0; size <= max_inline; size = size ? size * 2 : 8) {
+                size_t bf = 0;
+                elapsed = 0;
+                for (i = 0; i < iters; ++i) {
+                        struct ibv_sge sge;
+                        gds_send_wr ewr, *bad_ewr;
+
+                        loopback_init_send(&ctx, &ewr, &sge, IBV_EXP_SEND_INLINE);
+                        sge.length = size;
+                        ewr.num_sge = size ? 1 : 0;
+                        start = gds_get_time_us();
+                        ret = gds_prepare_send(ctx.gds_qp, &ewr, &bad_ewr, &sreq);
+                        if (!ret) {
+                                bf = bf_bytes(&sreq, inline_wqe_max_size(threshold));
+                                ret = gds_stream_post_send(gpu_stream, &sreq);
+                        }
+                        if (!ret)
+                                ret = gds_stream_wait_cq(gpu_stream, &ctx.gds_qp->send_cq, 0);
+                        if (ret) {
+                                fprintf(stderr, "error %d in round trip %d of size %d\n", ret, i, size);
+                                goto out;
+                        }
+                        CUCHECK(cuStreamSynchronize(gpu_stream));
+                        elapsed += gds_get_time_us() - start;
+                        ret = loopback_drain_send_cq(&ctx, 1);
+                        if (ret)
+                                goto out;
+                }
+                printf("%10d %10zu %10.2f\n", size, bf, (double)elapsed / iters);
+        }
+
+out:
+        loopback_fini(&ctx);
+out_gpu:
+        gpu_finalize();
+        return ret ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ *  indent-tabs-mode: nil
+ * End:
+ */
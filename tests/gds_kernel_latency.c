@@ -58,10 +58,12 @@
 #include <cuda.h>
 #include <cuda_runtime_api.h>
 #include <gdsync.h>
+#include <gdsync/tools.h>
 
 #include "pingpong.h"
 #include "gpu.h"
 #include "test_utils.h"
+#include "bench.h"
 
 //-----------------------------------------------------------------------------
 
@@ -638,6 +640,262 @@ static int pp_post_work(struct pingpong_context *ctx, int n_posts, int rcnt, uin
 	return i;
 }
 
+// one run of iters exchanges, the first warmup of which are not sampled
+// a sample is taken at each completion of a batch, i.e. the time since the
+// previous completion divided by the number of exchanges in the batch
+static int pp_run(struct pingpong_context *ctx, uint32_t rem_qpn, int is_client, int iters, int warmup,
+                  int max_batch_len, struct bench_samples *samples)
+{
+	struct timeval           start, end;
+	int                      routs;
+        int                      nposted;
+	int                      rcnt, scnt;
+        int                      ret = 0;
+        double                   last_us;
+
+        MPI_Barrier(MPI_COMM_WORLD);
+
+	if (gettimeofday(&start, NULL)) {
+		perror("gettimeofday");
+		return 1;
+	}
+
+        // for performance reasons, multiple batches back-to-back are posted here
+	rcnt = scnt = 0;
+        nposted = 0;
+        routs = 0;
+        const int n_batches = 3;
+        //int prev_batch_len = 0;
+        int last_batch_len = 0;
+        int n_post = 0;
+        int n_posted;
+        int batch;
+
+        for (batch=0; batch<n_batches; ++batch) {
+                n_post = min(min(ctx->rx_depth/2, iters-nposted), max_batch_len);
+                n_posted = pp_post_work(ctx, n_post, 0, rem_qpn, is_client);
+                if (n_posted != n_post) {
+                        fprintf(stderr, "ERROR: Couldn't post work, got %d requested %d\n", n_posted, n_post);
+                        return 1;
+                }
+                routs += n_posted;
+                nposted += n_posted;
+                //prev_batch_len = last_batch_len;
+                last_batch_len = n_posted;
+                printf("[%d] batch %d: posted %d sequences\n", my_rank, batch, n_posted);
+        }
+
+	ctx->pending = PINGPONG_RECV_WRID;
+
+        float pre_post_us = 0;
+
+	if (gettimeofday(&end, NULL)) {
+		perror("gettimeofday");
+		return 1;
+	}
+	{
+		float usec = (end.tv_sec - start.tv_sec) * 1000000 +
+			(end.tv_usec - start.tv_usec);
+		printf("pre-posting took %.2f usec\n", usec);
+                pre_post_us = usec;
+	}
+
+        if (!my_rank) {
+                puts("");
+                printf("batch info: rx+kernel+tx %d per batch\n", n_posted); // this is the last actually
+                printf("pre-posted %d sequences in %d batches\n", nposted, 2);
+                printf("GPU kernel calc buf size: %d\n", ctx->calc_size);
+                printf("iters=%d tx/rx_depth=%d\n", iters, ctx->rx_depth);
+                printf("\n");
+                printf("testing....\n");
+                fflush(stdout);
+        }
+
+	if (gettimeofday(&start, NULL)) {
+		perror("gettimeofday");
+		return 1;
+	}
+        prof_enable(&prof);
+        prof_idx = 0;
+        last_us = bench_now_us();
+        int got_error = 0;
+        int iter = 0;
+	while ((rcnt < iters || scnt < iters) && !got_error) {
+                ++iter;
+                PROF(&prof, prof_idx++);
+
+                //printf("before tracking\n"); fflush(stdout);
+                int ret = gpu_wait_tracking_event(1000*1000);
+                if (ret == ENOMEM) {
+                        printf("gpu_wait_tracking_event nothing to do (%d)\n", ret);
+                } else if (ret == EAGAIN) {
+                        printf("gpu_wait_tracking_event timout (%d), retrying\n", ret);
+                        prof_reset(&prof);
+                        continue;
+                } else if (ret) {
+                        fprintf(stderr, "gpu_wait_tracking_event failed (%d)\n", ret);
+                        got_error = ret;
+                }
+                //gpu_infoc(20, "after tracking\n");
+
+                PROF(&prof, prof_idx++);
+
+                // don't call poll_cq on events which are still being polled by the GPU
+                int n_rx_ev = 0;
+                if (!ctx->consume_rx_cqe) {
+                        struct ibv_wc wc[max_batch_len];
+                        int ne = 0, i;
+
+                        ne = ibv_poll_cq(ctx->rx_cq, max_batch_len, wc);
+                        if (ne < 0) {
+                                fprintf(stderr, "poll RX CQ failed %d\n", ne);
+                                return 1;
+                        }
+                        n_rx_ev += ne;
+                        //if (ne) printf("ne=%d\n", ne);
+                        for (i = 0; i < ne; ++i) {
+                                if (wc[i].status != IBV_WC_SUCCESS) {
+                                        fprintf(stderr, "Failed status %s (%d) for wr_id %d\n",
+                                                ibv_wc_status_str(wc[i].status),
+                                                wc[i].status, (int) wc[i].wr_id);
+                                        return 1;
+                                }
+
+                                switch ((int) wc[i].wr_id) {
+                                case PINGPONG_RECV_WRID:
+                                        ++rcnt;
+                                        break;
+                                default:
+                                        fprintf(stderr, "Completion for unknown wr_id %d\n",
+                                                (int) wc[i].wr_id);
+                                        return 1;
+                                }
+                        }
+                } else {
+                        n_rx_ev = last_batch_len;
+                        rcnt += last_batch_len;
+                }
+
+                PROF(&prof, prof_idx++);
+                int n_tx_ev = 0;
+                {
+                        struct ibv_wc wc[max_batch_len];
+                        int ne, i;
+
+                        ne = ibv_poll_cq(ctx->tx_cq, max_batch_len, wc);
+                        if (ne < 0) {
+                                fprintf(stderr, "poll TX CQ failed %d\n", ne);
+                                return 1;
+                        }
+                        n_tx_ev += ne;
+                        for (i = 0; i < ne; ++i) {
+                                if (wc[i].status != IBV_WC_SUCCESS) {
+                                        fprintf(stderr, "Failed status %s (%d) for wr_id %d\n",
+                                                ibv_wc_status_str(wc[i].status),
+                                                wc[i].status, (int) wc[i].wr_id);
+                                        return 1;
+                                }
+
+                                switch ((int) wc[i].wr_id) {
+                                case PINGPONG_SEND_WRID:
+                                        ++scnt;
+                                        break;
+                                default:
+                                        fprintf(stderr, "Completion for unknown wr_id %d\n",
+                                                (int) wc[i].wr_id);
+                                        return 1;
+                                }
+                        }
+                }
+                if (n_tx_ev) {
+                        double now_us = bench_now_us();
+                        if (scnt > warmup)
+                                bench_samples_add(samples, (now_us - last_us) / n_tx_ev);
+                        last_us = now_us;
+                }
+                PROF(&prof, prof_idx++);
+                if (1 && (n_tx_ev || n_rx_ev)) {
+                        //fprintf(stderr, "iter=%d n_rx_ev=%d, n_tx_ev=%d\n", iter, n_rx_ev, n_tx_ev); fflush(stdout);
+                }
+                if (n_tx_ev || n_rx_ev) {
+                        // update counters
+                        routs -= last_batch_len;
+                        //prev_batch_len = last_batch_len;
+                        if (n_tx_ev != last_batch_len)
+                                fprintf(stderr, "[%d] unexpected tx ev %d, batch len %d\n", iter, n_tx_ev, last_batch_len);
+                        if (n_rx_ev != last_batch_len)
+                                fprintf(stderr, "[%d] unexpected rx ev %d, batch len %d\n", iter, n_rx_ev, last_batch_len);
+                        if (nposted < iters) {
+                                //fprintf(stdout, "rcnt=%d scnt=%d routs=%d nposted=%d\n", rcnt, scnt, routs, nposted); fflush(stdout);
+                                // potentially submit new work
+                                n_post = min(min(ctx->rx_depth/2, iters-nposted), max_batch_len);
+                                int n = pp_post_work(ctx, n_post, nposted, rem_qpn, is_client);
+                                if (n != n_post) {
+                                        fprintf(stderr, "ERROR: post_work error (%d) rcnt=%d n_post=%d routs=%d\n", n, rcnt, n_post, routs);
+                                        return 1;
+                                }
+                                last_batch_len = n;
+                                routs += n;
+                                nposted += n;
+                                //fprintf(stdout, "n_post=%d n=%d\n", n_post, n);
+                        }
+                }
+                //usleep(10);
+                PROF(&prof, prof_idx++);
+		prof_update(&prof);
+		prof_idx = 0;
+
+                //fprintf(stdout, "%d %d\n", rcnt, scnt); fflush(stdout);
+
+
+                if (got_error) {
+                        fprintf(stderr, "exiting for error\n");
+                        return 1;
+                }
+	}
+
+	if (gettimeofday(&end, NULL)) {
+		perror("gettimeofday");
+		ret = 1;
+	}
+
+
+        int rid;
+        for (rid = 0; rid < comm_size; ++rid) {
+                MPI_Barrier(MPI_COMM_WORLD);
+                if (my_rank == rid) {
+                        float usec = (end.tv_sec - start.tv_sec) * 1000000 +
+                                (end.tv_usec - start.tv_usec) + pre_post_us;
+                        long long bytes = (long long) ctx->size * iters * 2;
+
+                        printf("[%d] %lld bytes in %.2f seconds = %.2f Mbit/sec\n",
+                               my_rank, bytes, usec / 1000000., bytes * 8. / usec);
+                        printf("[%d] %d iters in %.2f seconds = %.2f usec/iter\n",
+                               my_rank, iters, usec / 1000000., usec / iters);
+                }
+        }
+
+        return ret;
+}
+
+// with GDS_ENABLE_PROBES=1, GPU side latency of each kind of descriptor
+static void print_probes(int my_rank)
+{
+        static const char *names[GDS_PROBE_NUM_KINDS] = { "wait", "send", "flush", "write", "launch" };
+        gds_probe_hist_t h;
+        int k, b;
+
+        for (k = 0; k < GDS_PROBE_NUM_KINDS; ++k) {
+                if (gds_probe_get_hist((gds_probe_kind_t)k, &h) || !h.count)
+                        continue;
+                printf("[%d] probe %-6s n=%lu avg=%.2f min=%.2f max=%.2f usecs\n", my_rank, names[k],
+                       (unsigned long)h.count, h.sum_ns / 1000. / h.count, h.min_ns / 1000., h.max_ns / 1000.);
+                for (b = 0; b < GDS_PROBE_HIST_BUCKETS; ++b)
+                        if (h.buckets[b])
+                                printf("[%d]   >= %10llu ns: %lu\n", my_rank, 1ULL << b, (unsigned long)h.buckets[b]);
+        }
+}
+
 static void usage(const char *argv0)
 {
 	printf("Usage:\n");
@@ -664,6 +922,7 @@ static void usage(const char *argv0)
 	printf("  -T, --time-gds-ops        evaluate time needed to execute gds operations using cuda events\n");
 	printf("  -K, --qp-kind             select IB transport kind used by GDS QPs. (-K 1) for UD, (-K 2) for RC\n");
 	printf("  -M, --gpu-sched-mode      set CUDA context sched mode, default (A)UTO, (S)PIN, (Y)IELD, (B)LOCKING\n");
+        bench_usage();
 }
 
 int main(int argc, char *argv[])
@@ -673,7 +932,7 @@ int main(int argc, char *argv[])
 	struct pingpong_context *ctx;
 	struct pingpong_dest     my_dest;
 	struct pingpong_dest    *rem_dest = NULL;
-	struct timeval           rstart, start, end;
+	struct timeval           rstart;
 	const char              *ib_devname = NULL;
 	char                    *servername = NULL;
 	int                      port = 18515;
@@ -683,9 +942,6 @@ int main(int argc, char *argv[])
 	int                      rx_depth = 2*512;
 	int                      iters = 1000;
 	int                      use_event = 0;
-	int                      routs;
-        int                      nposted;
-	int                      rcnt, scnt;
 	int                      num_cq_events = 0;
 	int                      sl = 0;
 	int			 gidx = -1;
@@ -701,6 +957,11 @@ int main(int argc, char *argv[])
         int                      sched_mode = CU_CTX_SCHED_AUTO;
         int                      ret = 0;
         int                      use_desc_apis = 0;
+        struct bench_opts        bench;
+        struct bench_samples     samples;
+        struct bench_report      report;
+        struct bench_stats       st;
+        int                      m, is, id, rep, rid, ii;
 
         MPI_CHECK(MPI_Init(&argc, &argv));
         MPI_CHECK(MPI_Comm_size(MPI_COMM_WORLD, &comm_size));
@@ -726,6 +987,7 @@ int main(int argc, char *argv[])
         }
 
 	srand48(getpid() * time(NULL));
+        bench_opts_init(&bench, warmup);
 
 	while (1) {
 		int c;
@@ -751,6 +1013,7 @@ int main(int argc, char *argv[])
 			{ .name = "time-gds-ops",  .has_arg = 0, .val = 'T' },
 			{ .name = "qp-kind",          .has_arg = 1, .val = 'K' },
 			{ .name = "gpu-sched-mode",  .has_arg = 1, .val = 'M' },
+                        BENCH_LONG_OPTIONS,
 			{ 0 }
 		};
 
@@ -872,10 +1135,19 @@ int main(int argc, char *argv[])
                         break;
                         
 		default:
+                        ret = bench_parse_opt(&bench, c, optarg);
+                        if (ret > 0) {
+                                ret = 0;
+                                break;
+                        }
 			usage(argv[0]);
 			return 1;
 		}
 	}
+        bench_opts_default(&bench, size, max_batch_len, use_desc_apis);
+        // the buffers and the pre-posted receives fit the largest run
+        size = bench_max_size(&bench);
+        max_batch_len = bench_max_depth(&bench);
         assert(comm_size == 2);
         char hostnames[comm_size][MPI_MAX_PROCESSOR_NAME];
         int name_len;
@@ -1071,26 +1343,6 @@ int main(int argc, char *argv[])
 		}
 	}
 
-        MPI_Barrier(MPI_COMM_WORLD);
-
-	if (gettimeofday(&start, NULL)) {
-		perror("gettimeofday");
-		ret = 1;
-                goto out;
-	}
-
-        // for performance reasons, multiple batches back-to-back are posted here
-	rcnt = scnt = 0;
-        nposted = 0;
-        routs = 0;
-        const int n_batches = 3;
-        //int prev_batch_len = 0;
-        int last_batch_len = 0;
-        int n_post = 0;
-        int n_posted;
-        int batch;
-	int ii;
-
 	if (gds_enable_event_prof) {
 		for (ii = 0; ii < MAX_EVENTS; ii++) {
 			cudaEventCreate(&start_time[ii]);
@@ -1098,208 +1350,40 @@ int main(int argc, char *argv[])
 		}
 	}
 
-        for (batch=0; batch<n_batches; ++batch) {
-                n_post = min(min(ctx->rx_depth/2, iters-nposted), max_batch_len);
-                n_posted = pp_post_work(ctx, n_post, 0, rem_dest->qpn, servername?1:0);
-                if (n_posted != n_post) {
-                        fprintf(stderr, "ERROR: Couldn't post work, got %d requested %d\n", n_posted, n_post);
-                        ret = 1;
-                        goto out;
-                }
-                routs += n_posted;
-                nposted += n_posted;
-                //prev_batch_len = last_batch_len;
-                last_batch_len = n_posted;
-                printf("[%d] batch %d: posted %d sequences\n", my_rank, batch, n_posted);
-        }
-
-	ctx->pending = PINGPONG_RECV_WRID;
-
-        float pre_post_us = 0;
-
-	if (gettimeofday(&end, NULL)) {
-		perror("gettimeofday");
-		ret = 1;
+        if (bench_samples_init(&samples, (size_t)iters * bench.reps) ||
+            bench_report_open(&report, &bench, "gds_kernel_latency", my_rank)) {
+                ret = 1;
                 goto out;
-	}
-	{
-		float usec = (end.tv_sec - start.tv_sec) * 1000000 +
-			(end.tv_usec - start.tv_usec);
-		printf("pre-posting took %.2f usec\n", usec);
-                pre_post_us = usec;
-	}
-
-        if (!my_rank) {
-                puts("");
-                printf("batch info: rx+kernel+tx %d per batch\n", n_posted); // this is the last actually
-                printf("pre-posted %d sequences in %d batches\n", nposted, 2);
-                printf("GPU kernel calc buf size: %d\n", ctx->calc_size);
-                printf("iters=%d tx/rx_depth=%d\n", iters, ctx->rx_depth);
-                printf("\n");
-                printf("testing....\n");
-                fflush(stdout);
         }
-
-	if (gettimeofday(&start, NULL)) {
-		perror("gettimeofday");
-		return 1;
-	}
-        prof_enable(&prof);
-        prof_idx = 0;
-        int got_error = 0;
-        int iter = 0;
-	while ((rcnt < iters || scnt < iters) && !got_error) {
-                ++iter;
-                PROF(&prof, prof_idx++);
-
-                //printf("before tracking\n"); fflush(stdout);
-                int ret = gpu_wait_tracking_event(1000*1000);
-                if (ret == ENOMEM) {
-                        printf("gpu_wait_tracking_event nothing to do (%d)\n", ret);
-                } else if (ret == EAGAIN) {
-                        printf("gpu_wait_tracking_event timout (%d), retrying\n", ret);
-                        prof_reset(&prof);
+        for (m = BENCH_MODE_LEGACY; m <= BENCH_MODE_DESC; m <<= 1) {
+                if (!(bench.modes & m))
                         continue;
-                } else if (ret) {
-                        fprintf(stderr, "gpu_wait_tracking_event failed (%d)\n", ret);
-                        got_error = ret;
-                }
-                //gpu_infoc(20, "after tracking\n");
-
-                PROF(&prof, prof_idx++);
-
-                // don't call poll_cq on events which are still being polled by the GPU
-                int n_rx_ev = 0;
-                if (!ctx->consume_rx_cqe) {
-                        struct ibv_wc wc[max_batch_len];
-                        int ne = 0, i;
-
-                        ne = ibv_poll_cq(ctx->rx_cq, max_batch_len, wc);
-                        if (ne < 0) {
-                                fprintf(stderr, "poll RX CQ failed %d\n", ne);
-                                return 1;
-                        }
-                        n_rx_ev += ne;
-                        //if (ne) printf("ne=%d\n", ne);
-                        for (i = 0; i < ne; ++i) {
-                                if (wc[i].status != IBV_WC_SUCCESS) {
-                                        fprintf(stderr, "Failed status %s (%d) for wr_id %d\n",
-                                                ibv_wc_status_str(wc[i].status),
-                                                wc[i].status, (int) wc[i].wr_id);
-                                        return 1;
-                                }
-
-                                switch ((int) wc[i].wr_id) {
-                                case PINGPONG_RECV_WRID:
-                                        ++rcnt;
-                                        break;
-                                default:
-                                        fprintf(stderr, "Completion for unknown wr_id %d\n",
-                                                (int) wc[i].wr_id);
-                                        return 1;
+                for (is = 0; is < bench.n_sizes; ++is) {
+                        for (id = 0; id < bench.n_depths; ++id) {
+                                int depth = min(bench.depths[id], ctx->rx_depth/2);
+                                ctx->size = bench.sizes[is];
+                                ctx->use_desc_apis = (m == BENCH_MODE_DESC);
+                                bench_samples_reset(&samples);
+                                for (rep = 0; rep < bench.reps; ++rep) {
+                                        if (pp_run(ctx, rem_dest->qpn, servername?1:0, iters + bench.warmup,
+                                                   bench.warmup, depth, &samples)) {
+                                                ret = 1;
+                                                goto out;
+                                        }
                                 }
+                                bench_compute(&samples, &st);
+                                bench_report_add(&report, ctx->size, depth, m, iters, &st);
                         }
-                } else {
-                        n_rx_ev = last_batch_len;
-                        rcnt += last_batch_len;
-                }
-
-                PROF(&prof, prof_idx++);
-                int n_tx_ev = 0;
-                {
-                        struct ibv_wc wc[max_batch_len];
-                        int ne, i;
-
-                        ne = ibv_poll_cq(ctx->tx_cq, max_batch_len, wc);
-                        if (ne < 0) {
-                                fprintf(stderr, "poll TX CQ failed %d\n", ne);
-                                return 1;
-                        }
-                        n_tx_ev += ne;
-                        for (i = 0; i < ne; ++i) {
-                                if (wc[i].status != IBV_WC_SUCCESS) {
-                                        fprintf(stderr, "Failed status %s (%d) for wr_id %d\n",
-                                                ibv_wc_status_str(wc[i].status),
-                                                wc[i].status, (int) wc[i].wr_id);
-                                        return 1;
-                                }
-
-                                switch ((int) wc[i].wr_id) {
-                                case PINGPONG_SEND_WRID:
-                                        ++scnt;
-                                        break;
-                                default:
-                                        fprintf(stderr, "Completion for unknown wr_id %d\n",
-                                                (int) wc[i].wr_id);
-                                        ret = 1;
-                                        goto out;
-                                }
-                        }
-                }
-                PROF(&prof, prof_idx++);
-                if (1 && (n_tx_ev || n_rx_ev)) {
-                        //fprintf(stderr, "iter=%d n_rx_ev=%d, n_tx_ev=%d\n", iter, n_rx_ev, n_tx_ev); fflush(stdout);
                 }
-                if (n_tx_ev || n_rx_ev) {
-                        // update counters
-                        routs -= last_batch_len;
-                        //prev_batch_len = last_batch_len;
-                        if (n_tx_ev != last_batch_len)
-                                fprintf(stderr, "[%d] unexpected tx ev %d, batch len %d\n", iter, n_tx_ev, last_batch_len);
-                        if (n_rx_ev != last_batch_len)
-                                fprintf(stderr, "[%d] unexpected rx ev %d, batch len %d\n", iter, n_rx_ev, last_batch_len);
-                        if (nposted < iters) {
-                                //fprintf(stdout, "rcnt=%d scnt=%d routs=%d nposted=%d\n", rcnt, scnt, routs, nposted); fflush(stdout);
-                                // potentially submit new work
-                                n_post = min(min(ctx->rx_depth/2, iters-nposted), max_batch_len);
-                                int n = pp_post_work(ctx, n_post, nposted, rem_dest->qpn, servername?1:0);
-                                if (n != n_post) {
-                                        fprintf(stderr, "ERROR: post_work error (%d) rcnt=%d n_post=%d routs=%d\n", n, rcnt, n_post, routs);
-                                        return 1;
-                                }
-                                last_batch_len = n;
-                                routs += n;
-                                nposted += n;
-                                //fprintf(stdout, "n_post=%d n=%d\n", n_post, n);
-                        }
-                }
-                //usleep(10);
-                PROF(&prof, prof_idx++);
-		prof_update(&prof);
-		prof_idx = 0;
-
-                //fprintf(stdout, "%d %d\n", rcnt, scnt); fflush(stdout);
-
-
-                if (got_error) {
-                        fprintf(stderr, "exiting for error\n");
-                        return 1;
-                }
-	}
-
-	if (gettimeofday(&end, NULL)) {
-		perror("gettimeofday");
-		ret = 1;
-	}
-
+        }
+        bench_report_close(&report);
+        bench_samples_free(&samples);
 
-        int rid;
         for (rid = 0; rid < comm_size; ++rid) {
                 MPI_Barrier(MPI_COMM_WORLD);
-                if (my_rank == rid) {
-                        float usec = (end.tv_sec - start.tv_sec) * 1000000 +
-                                (end.tv_usec - start.tv_usec) + pre_post_us;
-                        long long bytes = (long long) size * iters * 2;
-
-                        printf("[%d] %lld bytes in %.2f seconds = %.2f Mbit/sec\n",
-                               my_rank, bytes, usec / 1000000., bytes * 8. / usec);
-                        printf("[%d] %d iters in %.2f seconds = %.2f usec/iter\n",
-                               my_rank, iters, usec / 1000000., usec / iters);
-
-                        if (prof_enabled(&prof)) {
-                                printf("[%d] dumping prof\n", my_rank);
-                                prof_dump(&prof);
-                        }
+                if (my_rank == rid && prof_enabled(&prof)) {
+                        printf("[%d] dumping prof\n", my_rank);
+                        prof_dump(&prof);
                 }
         }
 
@@ -1307,6 +1391,8 @@ int main(int argc, char *argv[])
 
 	//expect work to be completed by now
 
+        print_probes(my_rank);
+
 	if (gds_enable_event_prof) {
 		for (ii = 0; ii < event_idx; ii++) {
 			cudaEventElapsedTime(&elapsed_time, start_time[ii], stop_time[ii]);
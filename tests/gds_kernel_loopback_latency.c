@@ -63,6 +63,7 @@
 #include "pingpong.h"
 #include "gpu.h"
 #include "test_utils.h"
+#include "bench.h"
 
 //-----------------------------------------------------------------------------
 
@@ -620,6 +621,255 @@ out:
 	return retcode;
 }
 
+// one run of iters exchanges, the first warmup of which are not sampled
+// a sample is taken at each completion of a batch, i.e. the time since the
+// previous completion divided by the number of exchanges in the batch
+static int pp_run(struct pingpong_context *ctx, uint32_t rem_qpn, int is_client, int iters, int warmup,
+                  int max_batch_len, int wait_key, struct bench_samples *samples)
+{
+	struct timeval           start, end;
+	int                      routs;
+        int                      nposted;
+	int                      rcnt, scnt;
+        int                      ret = 0;
+        double                   last_us;
+
+	if (gettimeofday(&start, NULL)) {
+		perror("gettimeofday");
+		return 1;
+	}
+
+        //printf("sleeping 10s\n");
+        //sleep(10);
+
+        // for performance reasons, multiple batches back-to-back are posted here
+	rcnt = scnt = 0;
+        nposted = 0;
+        routs = 0;
+        const int n_batches = 3;
+        //int prev_batch_len = 0;
+        int last_batch_len = 0;
+        int n_post = 0;
+        int n_posted;
+        int batch;
+
+        for (batch=0; batch<n_batches; ++batch) {
+                n_post = min(min(ctx->rx_depth/2, iters-nposted), max_batch_len);
+                n_posted = pp_post_work(ctx, n_post, 0, rem_qpn, is_client);
+                if (n_posted < 0) {
+                        fprintf(stderr, "ERROR: got error %d\n", n_posted);
+                        return 1;
+                }
+                else if (n_posted != n_post) {
+                        fprintf(stderr, "ERROR: Couldn't post work, got %d requested %d\n", n_posted, n_post);
+                        return 1;
+                }
+                routs += n_posted;
+                nposted += n_posted;
+                //prev_batch_len = last_batch_len;
+                last_batch_len = n_posted;
+                printf("[%d] batch %d: posted %d sequences\n", my_rank, batch, n_posted);
+        }
+
+	ctx->pending = PINGPONG_RECV_WRID;
+
+        float pre_post_us = 0;
+
+	if (gettimeofday(&end, NULL)) {
+		perror("gettimeofday");
+		return 1;
+	}
+	{
+		float usec = (end.tv_sec - start.tv_sec) * 1000000 +
+			(end.tv_usec - start.tv_usec);
+		printf("pre-posting took %.2f usec\n", usec);
+                pre_post_us = usec;
+	}
+
+        if (!my_rank) {
+                puts("");
+                printf("batch info: rx+kernel+tx %d per batch\n", n_posted); // this is the last actually
+                printf("pre-posted %d sequences in %d batches\n", nposted, 2);
+                printf("GPU kernel calc buf size: %d\n", ctx->calc_size);
+                printf("iters=%d tx/rx_depth=%d\n", iters, ctx->rx_depth);
+                printf("\n");
+                printf("testing....\n");
+                fflush(stdout);
+        }
+
+	if (gettimeofday(&start, NULL)) {
+		perror("gettimeofday");
+		return 1;
+	}
+        prof_enable(&prof);
+        prof_idx = 0;
+        last_us = bench_now_us();
+        int got_error = 0;
+        int iter = 0;
+	while ((rcnt < iters && scnt < iters) && !got_error) {
+                ++iter;
+                PROF(&prof, prof_idx++);
+
+                //printf("before tracking\n"); fflush(stdout);
+                int ret = gpu_wait_tracking_event(1000*1000);
+                if (ret == ENOMEM) {
+                        dbg("gpu_wait_tracking_event nothing to do (%d)\n", ret);
+                } else if (ret == EAGAIN) {
+                        fprintf(stderr, "gpu_wait_tracking_event timout (%d), retrying\n", ret);
+                        prof_reset(&prof);
+                        continue;
+                } else if (ret) {
+                        fprintf(stderr, "gpu_wait_tracking_event failed (%d)\n", ret);
+                        got_error = ret;
+                }
+                //gpu_infoc(20, "after tracking\n");
+
+                PROF(&prof, prof_idx++);
+
+                // don't call poll_cq on events which are still being polled by the GPU
+                int n_rx_ev = 0;
+                if (!ctx->consume_rx_cqe) {
+                        struct ibv_wc wc[max_batch_len];
+                        int ne = 0, i;
+
+                        ne = ibv_poll_cq(ctx->rx_cq, max_batch_len, wc);
+                        if (ne < 0) {
+                                fprintf(stderr, "poll RX CQ failed %d\n", ne);
+                                return 1;
+                        }
+                        n_rx_ev += ne;
+                        //if (ne) printf("ne=%d\n", ne);
+                        for (i = 0; i < ne; ++i) {
+                                if (wc[i].status != IBV_WC_SUCCESS) {
+                                        fprintf(stderr, "Failed status %s (%d) for wr_id %d\n",
+                                                ibv_wc_status_str(wc[i].status),
+                                                wc[i].status, (int) wc[i].wr_id);
+                                        return 1;
+                                }
+
+                                switch ((int) wc[i].wr_id) {
+                                case PINGPONG_RECV_WRID:
+                                        ++rcnt;
+                                        break;
+                                default:
+                                        fprintf(stderr, "Completion for unknown wr_id %d\n",
+                                                (int) wc[i].wr_id);
+                                        return 1;
+                                }
+                        }
+                } else {
+                        n_rx_ev = last_batch_len;
+                        rcnt += last_batch_len;
+                }
+
+                PROF(&prof, prof_idx++);
+                int n_tx_ev = 0;
+                {
+                        struct ibv_wc wc[max_batch_len];
+                        int ne, i;
+
+                        ne = ibv_poll_cq(ctx->tx_cq, max_batch_len, wc);
+                        if (ne < 0) {
+                                fprintf(stderr, "poll TX CQ failed %d\n", ne);
+                                return 1;
+                        }
+                        n_tx_ev += ne;
+                        for (i = 0; i < ne; ++i) {
+                                if (wc[i].status != IBV_WC_SUCCESS) {
+                                        fprintf(stderr, "Failed status %s (%d) for wr_id %d\n",
+                                                ibv_wc_status_str(wc[i].status),
+                                                wc[i].status, (int) wc[i].wr_id);
+                                        return 1;
+                                }
+
+                                switch ((int) wc[i].wr_id) {
+                                case PINGPONG_SEND_WRID:
+                                        ++scnt;
+                                        break;
+                                default:
+                                        fprintf(stderr, "Completion for unknown wr_id %d\n",
+                                                (int) wc[i].wr_id);
+                                        return 1;
+                                }
+                        }
+                }
+                if (n_tx_ev) {
+                        double now_us = bench_now_us();
+                        if (scnt > warmup)
+                                bench_samples_add(samples, (now_us - last_us) / n_tx_ev);
+                        last_us = now_us;
+                }
+                PROF(&prof, prof_idx++);
+                if (1 && (n_tx_ev || n_rx_ev)) {
+                        //fprintf(stderr, "iter=%d n_rx_ev=%d, n_tx_ev=%d\n", iter, n_rx_ev, n_tx_ev); fflush(stdout);
+                }
+                if (n_tx_ev || n_rx_ev) {
+                        // update counters
+                        routs -= last_batch_len;
+                        //prev_batch_len = last_batch_len;
+                        if (n_tx_ev != last_batch_len)
+                                dbg("[%d] partially completed batch, got tx ev %d, batch len %d\n", iter, n_tx_ev, last_batch_len);
+                        if (n_rx_ev != last_batch_len)
+                                dbg("[%d] partially completed batch, got rx ev %d, batch len %d\n", iter, n_rx_ev, last_batch_len);
+                        if (nposted < iters) {
+                                //fprintf(stdout, "rcnt=%d scnt=%d routs=%d nposted=%d\n", rcnt, scnt, routs, nposted); fflush(stdout);
+                                // potentially submit new work
+                                n_post = min(min(ctx->rx_depth/2, iters-nposted), max_batch_len);
+                                int n = pp_post_work(ctx, n_post, nposted, rem_qpn, is_client);
+                                if (n != n_post) {
+                                        fprintf(stderr, "ERROR: post_work error (%d) rcnt=%d n_post=%d routs=%d\n", n, rcnt, n_post, routs);
+                                        return 1;
+                                }
+                                last_batch_len = n;
+                                routs += n;
+                                nposted += n;
+                                //fprintf(stdout, "n_post=%d n=%d\n", n_post, n);
+                        }
+                }
+                //usleep(10);
+                PROF(&prof, prof_idx++);
+		prof_update(&prof);
+		prof_idx = 0;
+
+                //fprintf(stdout, "%d %d\n", rcnt, scnt); fflush(stdout);
+
+
+                if (got_error) {
+                        //fprintf(stderr, "sleeping 10s then exiting for error\n");
+                        //sleep(10);
+                        fprintf(stderr, "exiting for error\n");
+                        return 1;
+                }
+
+                if (wait_key >= 0) {
+                        int c;
+                        if (iter == wait_key) {
+                                puts("press any key");
+                                c = getchar();
+                        }
+                }
+	}
+
+	if (gettimeofday(&end, NULL)) {
+		perror("gettimeofday");
+		ret = 1;
+	}
+
+	{
+		float usec = (end.tv_sec - start.tv_sec) * 1000000 +
+			(end.tv_usec - start.tv_usec) + pre_post_us;
+		long long bytes = (long long) ctx->size * iters * 2;
+
+		printf("[%d] %lld bytes in %.2f seconds = %.2f Mbit/sec\n",
+		       my_rank, bytes, usec / 1000000., bytes * 8. / usec);
+		printf("[%d] %d iters in %.2f seconds = %.2f usec/iter\n",
+		       my_rank, iters, usec / 1000000., usec / iters);
+	}
+
+
+        return ret;
+}
+
 static void usage(const char *argv0)
 {
 	printf("Usage:\n");
@@ -644,6 +894,7 @@ static void usage(const char *argv0)
 	printf("  -U, --peersync-desc-apis  use batched descriptor APIs (default disabled)\n");
 	printf("  -Q, --consume-rx-cqe      enable GPU consumes RX CQE support (default disabled)\n");
 	printf("  -M, --gpu-sched-mode      set CUDA context sched mode, default (A)UTO, (S)PIN, (Y)IELD, (B)LOCKING\n");
+        bench_usage();
 }
 
 int main(int argc, char *argv[])
@@ -653,7 +904,7 @@ int main(int argc, char *argv[])
 	struct pingpong_context *ctx;
 	struct pingpong_dest     my_dest;
 	struct pingpong_dest    *rem_dest;
-	struct timeval           rstart, start, end;
+	struct timeval           rstart;
 	const char              *ib_devname = NULL;
 	char                    *servername = NULL;
 	int                      port = 18515;
@@ -663,9 +914,6 @@ int main(int argc, char *argv[])
 	int                      rx_depth = 2*512;
 	int                      iters = 1000;
 	int                      use_event = 0;
-	int                      routs;
-        int                      nposted;
-	int                      rcnt, scnt;
 	int                      num_cq_events = 0;
 	int                      sl = 0;
 	int			 gidx = -1;
@@ -682,6 +930,11 @@ int main(int argc, char *argv[])
         int                      wait_key = -1;
         int                      use_gpumem = 0;
         int                      use_desc_apis = 0;
+        struct bench_opts        bench;
+        struct bench_samples     samples;
+        struct bench_report      report;
+        struct bench_stats       st;
+        int                      m, is, id, rep;
 
         fprintf(stdout, "libgdsync build version 0x%08x, major=%d minor=%d\n", GDS_API_VERSION, GDS_API_MAJOR_VERSION, GDS_API_MINOR_VERSION);
 
@@ -698,6 +951,7 @@ int main(int argc, char *argv[])
         }
 
 	srand48(getpid() * time(NULL));
+        bench_opts_init(&bench, warmup);
 
 	while (1) {
 		int c;
@@ -723,6 +977,7 @@ int main(int argc, char *argv[])
 			{ .name = "gpu-sched-mode",  .has_arg = 1, .val = 'M' },
 			{ .name = "gpu-mem",         .has_arg = 0, .val = 'E' },
 			{ .name = "wait-key",        .has_arg = 1, .val = 'W' },
+                        BENCH_LONG_OPTIONS,
 			{ 0 }
 		};
 
@@ -841,10 +1096,19 @@ int main(int argc, char *argv[])
                         break;
 
 		default:
+                        ret = bench_parse_opt(&bench, c, optarg);
+                        if (ret > 0) {
+                                ret = 0;
+                                break;
+                        }
 			usage(argv[0]);
 			return 1;
 		}
 	}
+        bench_opts_default(&bench, size, max_batch_len, use_desc_apis);
+        // the buffers and the pre-posted receives fit the largest run
+        size = bench_max_size(&bench);
+        max_batch_len = bench_max_depth(&bench);
         assert(comm_size == 1);
         char *hostnames[1] = {"localhost"};
 
@@ -959,235 +1223,34 @@ int main(int argc, char *argv[])
                 //sleep(1);
         }
 
-	if (gettimeofday(&start, NULL)) {
-		perror("gettimeofday");
-		ret = 1;
+        if (bench_samples_init(&samples, (size_t)iters * bench.reps) ||
+            bench_report_open(&report, &bench, "gds_kernel_loopback_latency", my_rank)) {
+                ret = 1;
                 goto out;
-	}
-
-        //printf("sleeping 10s\n");
-        //sleep(10);
-
-        // for performance reasons, multiple batches back-to-back are posted here
-	rcnt = scnt = 0;
-        nposted = 0;
-        routs = 0;
-        const int n_batches = 3;
-        //int prev_batch_len = 0;
-        int last_batch_len = 0;
-        int n_post = 0;
-        int n_posted;
-        int batch;
-
-        for (batch=0; batch<n_batches; ++batch) {
-                n_post = min(min(ctx->rx_depth/2, iters-nposted), max_batch_len);
-                n_posted = pp_post_work(ctx, n_post, 0, rem_dest->qpn, servername?1:0);
-                if (n_posted < 0) {
-                        fprintf(stderr, "ERROR: got error %d\n", n_posted);
-                        ret = 1;
-                        goto out;
-                }
-                else if (n_posted != n_post) {
-                        fprintf(stderr, "ERROR: Couldn't post work, got %d requested %d\n", n_posted, n_post);
-                        ret = 1;
-                        goto out;
-                }
-                routs += n_posted;
-                nposted += n_posted;
-                //prev_batch_len = last_batch_len;
-                last_batch_len = n_posted;
-                printf("[%d] batch %d: posted %d sequences\n", my_rank, batch, n_posted);
         }
-
-	ctx->pending = PINGPONG_RECV_WRID;
-
-        float pre_post_us = 0;
-
-	if (gettimeofday(&end, NULL)) {
-		perror("gettimeofday");
-		ret = 1;
-                goto out;
-	}
-	{
-		float usec = (end.tv_sec - start.tv_sec) * 1000000 +
-			(end.tv_usec - start.tv_usec);
-		printf("pre-posting took %.2f usec\n", usec);
-                pre_post_us = usec;
-	}
-
-        if (!my_rank) {
-                puts("");
-                printf("batch info: rx+kernel+tx %d per batch\n", n_posted); // this is the last actually
-                printf("pre-posted %d sequences in %d batches\n", nposted, 2);
-                printf("GPU kernel calc buf size: %d\n", ctx->calc_size);
-                printf("iters=%d tx/rx_depth=%d\n", iters, ctx->rx_depth);
-                printf("\n");
-                printf("testing....\n");
-                fflush(stdout);
-        }
-
-	if (gettimeofday(&start, NULL)) {
-		perror("gettimeofday");
-		return 1;
-	}
-        prof_enable(&prof);
-        prof_idx = 0;
-        int got_error = 0;
-        int iter = 0;
-	while ((rcnt < iters && scnt < iters) && !got_error) {
-                ++iter;
-                PROF(&prof, prof_idx++);
-
-                //printf("before tracking\n"); fflush(stdout);
-                int ret = gpu_wait_tracking_event(1000*1000);
-                if (ret == ENOMEM) {
-                        dbg("gpu_wait_tracking_event nothing to do (%d)\n", ret);
-                } else if (ret == EAGAIN) {
-                        fprintf(stderr, "gpu_wait_tracking_event timout (%d), retrying\n", ret);
-                        prof_reset(&prof);
+        for (m = BENCH_MODE_LEGACY; m <= BENCH_MODE_DESC; m <<= 1) {
+                if (!(bench.modes & m))
                         continue;
-                } else if (ret) {
-                        fprintf(stderr, "gpu_wait_tracking_event failed (%d)\n", ret);
-                        got_error = ret;
-                }
-                //gpu_infoc(20, "after tracking\n");
-
-                PROF(&prof, prof_idx++);
-
-                // don't call poll_cq on events which are still being polled by the GPU
-                int n_rx_ev = 0;
-                if (!ctx->consume_rx_cqe) {
-                        struct ibv_wc wc[max_batch_len];
-                        int ne = 0, i;
-
-                        ne = ibv_poll_cq(ctx->rx_cq, max_batch_len, wc);
-                        if (ne < 0) {
-                                fprintf(stderr, "poll RX CQ failed %d\n", ne);
-                                return 1;
-                        }
-                        n_rx_ev += ne;
-                        //if (ne) printf("ne=%d\n", ne);
-                        for (i = 0; i < ne; ++i) {
-                                if (wc[i].status != IBV_WC_SUCCESS) {
-                                        fprintf(stderr, "Failed status %s (%d) for wr_id %d\n",
-                                                ibv_wc_status_str(wc[i].status),
-                                                wc[i].status, (int) wc[i].wr_id);
-                                        return 1;
-                                }
-
-                                switch ((int) wc[i].wr_id) {
-                                case PINGPONG_RECV_WRID:
-                                        ++rcnt;
-                                        break;
-                                default:
-                                        fprintf(stderr, "Completion for unknown wr_id %d\n",
-                                                (int) wc[i].wr_id);
-                                        return 1;
+                for (is = 0; is < bench.n_sizes; ++is) {
+                        for (id = 0; id < bench.n_depths; ++id) {
+                                int depth = min(bench.depths[id], ctx->rx_depth/2);
+                                ctx->size = bench.sizes[is];
+                                ctx->use_desc_apis = (m == BENCH_MODE_DESC);
+                                bench_samples_reset(&samples);
+                                for (rep = 0; rep < bench.reps; ++rep) {
+                                        if (pp_run(ctx, rem_dest->qpn, servername?1:0, iters + bench.warmup,
+                                                   bench.warmup, depth, wait_key, &samples)) {
+                                                ret = 1;
+                                                goto out;
+                                        }
                                 }
+                                bench_compute(&samples, &st);
+                                bench_report_add(&report, ctx->size, depth, m, iters, &st);
                         }
-                } else {
-                        n_rx_ev = last_batch_len;
-                        rcnt += last_batch_len;
                 }
-
-                PROF(&prof, prof_idx++);
-                int n_tx_ev = 0;
-                {
-                        struct ibv_wc wc[max_batch_len];
-                        int ne, i;
-
-                        ne = ibv_poll_cq(ctx->tx_cq, max_batch_len, wc);
-                        if (ne < 0) {
-                                fprintf(stderr, "poll TX CQ failed %d\n", ne);
-                                return 1;
-                        }
-                        n_tx_ev += ne;
-                        for (i = 0; i < ne; ++i) {
-                                if (wc[i].status != IBV_WC_SUCCESS) {
-                                        fprintf(stderr, "Failed status %s (%d) for wr_id %d\n",
-                                                ibv_wc_status_str(wc[i].status),
-                                                wc[i].status, (int) wc[i].wr_id);
-                                        return 1;
-                                }
-
-                                switch ((int) wc[i].wr_id) {
-                                case PINGPONG_SEND_WRID:
-                                        ++scnt;
-                                        break;
-                                default:
-                                        fprintf(stderr, "Completion for unknown wr_id %d\n",
-                                                (int) wc[i].wr_id);
-                                        ret = 1;
-                                        goto out;
-                                }
-                        }
-                }
-                PROF(&prof, prof_idx++);
-                if (1 && (n_tx_ev || n_rx_ev)) {
-                        //fprintf(stderr, "iter=%d n_rx_ev=%d, n_tx_ev=%d\n", iter, n_rx_ev, n_tx_ev); fflush(stdout);
-                }
-                if (n_tx_ev || n_rx_ev) {
-                        // update counters
-                        routs -= last_batch_len;
-                        //prev_batch_len = last_batch_len;
-                        if (n_tx_ev != last_batch_len)
-                                dbg("[%d] partially completed batch, got tx ev %d, batch len %d\n", iter, n_tx_ev, last_batch_len);
-                        if (n_rx_ev != last_batch_len)
-                                dbg("[%d] partially completed batch, got rx ev %d, batch len %d\n", iter, n_rx_ev, last_batch_len);
-                        if (nposted < iters) {
-                                //fprintf(stdout, "rcnt=%d scnt=%d routs=%d nposted=%d\n", rcnt, scnt, routs, nposted); fflush(stdout);
-                                // potentially submit new work
-                                n_post = min(min(ctx->rx_depth/2, iters-nposted), max_batch_len);
-                                int n = pp_post_work(ctx, n_post, nposted, rem_dest->qpn, servername?1:0);
-                                if (n != n_post) {
-                                        fprintf(stderr, "ERROR: post_work error (%d) rcnt=%d n_post=%d routs=%d\n", n, rcnt, n_post, routs);
-                                        return 1;
-                                }
-                                last_batch_len = n;
-                                routs += n;
-                                nposted += n;
-                                //fprintf(stdout, "n_post=%d n=%d\n", n_post, n);
-                        }
-                }
-                //usleep(10);
-                PROF(&prof, prof_idx++);
-		prof_update(&prof);
-		prof_idx = 0;
-
-                //fprintf(stdout, "%d %d\n", rcnt, scnt); fflush(stdout);
-
-
-                if (got_error) {
-                        //fprintf(stderr, "sleeping 10s then exiting for error\n");
-                        //sleep(10);
-                        fprintf(stderr, "exiting for error\n");
-                        return 1;
-                }
-
-                if (wait_key >= 0) {
-                        int c;
-                        if (iter == wait_key) {
-                                puts("press any key");
-                                c = getchar();
-                        }
-                }
-	}
-
-	if (gettimeofday(&end, NULL)) {
-		perror("gettimeofday");
-		ret = 1;
-	}
-
-	{
-		float usec = (end.tv_sec - start.tv_sec) * 1000000 +
-			(end.tv_usec - start.tv_usec) + pre_post_us;
-		long long bytes = (long long) size * iters * 2;
-
-		printf("[%d] %lld bytes in %.2f seconds = %.2f Mbit/sec\n",
-		       my_rank, bytes, usec / 1000000., bytes * 8. / usec);
-		printf("[%d] %d iters in %.2f seconds = %.2f usec/iter\n",
-		       my_rank, iters, usec / 1000000., usec / iters);
-	}
+        }
+        bench_report_close(&report);
+        bench_samples_free(&samples);
 
         if (prof_enabled(&prof)) {
                 printf("dumping prof\n");
@@ -0,0 +1,335 @@
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+
+#include <cuda.h>
+#include <cuda_runtime_api.h>
+#include <gdsync.h>
+#include <gdsync/tools.h>
+
+#include "gpu.h"
+#include "test_utils.h"
+#include "bench.h"
+
+// Wake-up latency of many streams blocked at once on a 32-bit wait.
+//
+// Each of the n streams waits on a flag, GEQ the iteration number, then
+// writes that number into its own slot of a host buffer. Once all the waits
+// had the time to be fetched, the CPU releases the flag and spins on the
+// slots, timing the first and the last stream to wake up. By default all the
+// streams wait on the same dword, -S gives each its own flag, written by the
+// CPU one after the other.
+//
+// The number of waits, the memory the flag lives in (host or GPU, through
+// gds_alloc_mapped_memory) and the flush flag of the waits are swept. When
+// the GPU cannot keep that many waits resident, the last wake-up jumps to
+// the time slice of the stream scheduler, or the run times out and larger
+// counts are skipped.
+
+enum {
+        MAX_WAITS = 1024,
+        // flags and slots of different streams in different cache lines
+        STRIDE = 16,
+};
+
+enum { MEM_HOST = 1 << 0, MEM_GPU = 1 << 1 };
+
+static CUstream streams[MAX_WAITS];
+static uint32_t seq = 0;
+
+struct sweep {
+        int n_waits;
+        int gpu_mem;
+        int flush;
+        int separate;
+        int iters;
+        int warmup;
+        int sleep_us;
+        int timeout_us;
+};
+
+// returns ETIMEDOUT if some stream did not wake up
+static int run(const struct sweep *sw, gds_mem_desc_t *flags, gds_mem_desc_t *slots,
+               struct bench_samples *first, struct bench_samples *last)
+{
+        int ret = 0;
+        int it, s;
+        int poll_flags = sw->gpu_mem ? GDS_MEMORY_GPU : GDS_MEMORY_HOST;
+        uint32_t *h_flags = (uint32_t *)flags->h_ptr;
+        uint32_t *d_flags = (uint32_t *)flags->d_ptr;
+        uint32_t *h_slots = (uint32_t *)slots->h_ptr;
+        uint32_t *d_slots = (uint32_t *)slots->d_ptr;
+        char woken[sw->n_waits];
+
+        if (sw->flush)
+                poll_flags |= GDS_WAIT_POST_FLUSH;
+
+        for (it = 0; it < sw->warmup + sw->iters; ++it) {
+                uint32_t value = ++seq;
+                double t0, t_first = -1, t_last = 0;
+                int n_woken = 0;
+
+                for (s = 0; s < sw->n_waits; ++s) {
+                        gds_descriptor_t descs[2];
+                        int f = sw->separate ? s : 0;
+                        descs[0].tag = GDS_TAG_WAIT_VALUE32;
+                        ret = gds_prepare_wait_value32(&descs[0].wait32, d_flags + f * STRIDE, value,
+                                                       GDS_WAIT_COND_GEQ, poll_flags);
+                        if (ret)
+                                goto out;
+                        descs[1].tag = GDS_TAG_WRITE_VALUE32;
+                        ret = gds_prepare_write_value32(&descs[1].write32, d_slots + s * STRIDE, value,
+                                                        GDS_MEMORY_HOST);
+                        if (ret)
+                                goto out;
+                        ret = gds_stream_post_descriptors(streams[s], 2, descs, 0);
+                        if (ret) {
+                                fprintf(stderr, "error %d while posting on stream %d\n", ret, s);
+                                goto out;
+                        }
+                }
+                memset(woken, 0, sizeof(woken));
+                // let the front ends fetch the waits
+                gds_busy_wait_us(sw->sleep_us);
+
+                t0 = bench_now_us();
+                if (sw->separate) {
+                        for (s = 0; s < sw->n_waits; ++s)
+                                gds_atomic_set_dword(h_flags + s * STRIDE, value);
+                } else {
+                        gds_atomic_set_dword(h_flags, value);
+                }
+                while (n_woken < sw->n_waits) {
+                        double now = bench_now_us();
+                        for (s = 0; s < sw->n_waits; ++s) {
+                                if (woken[s] || ACCESS_ONCE(h_slots[s * STRIDE]) != value)
+                                        continue;
+                                woken[s] = 1;
+                                ++n_woken;
+                                if (t_first < 0)
+                                        t_first = now;
+                                t_last = now;
+                        }
+                        if (now - t0 > sw->timeout_us)
+                                break;
+                }
+                if (n_woken < sw->n_waits) {
+                        fprintf(stderr, "%d waits: only %d woke up within %d usecs\n",
+                                sw->n_waits, n_woken, sw->timeout_us);
+                        ret = ETIMEDOUT;
+                        goto out;
+                }
+                if (it >= sw->warmup) {
+                        bench_samples_add(first, t_first - t0);
+                        bench_samples_add(last, t_last - t0);
+                }
+        }
+out:
+        if (ret) {
+                // release whatever is still blocked
+                uint32_t value = ++seq;
+                for (s = 0; s < sw->n_waits; ++s)
+                        gds_atomic_set_dword(h_flags + s * STRIDE, value);
+        }
+        for (s = 0; s < sw->n_waits; ++s)
+                CUCHECK(cuStreamSynchronize(streams[s]));
+        return ret;
+}
+
+static void usage(const char *argv0)
+{
+        printf("Usage:\n");
+        printf("  %s [options]\n", argv0);
+        printf("\n");
+        printf("Options:\n");
+        printf("  -d <gpu>           use specified GPU (default 0)\n");
+        printf("  -n <iters>         wake-ups per configuration (default 1000)\n");
+        printf("  -N <list>          concurrent waits, e.g. 1,8,64 or 1:256 (default 1:128)\n");
+        printf("  -M <mem>           flag memory, host, gpu or host,gpu (default both)\n");
+        printf("  -F <list>          flush flag of the waits, 0, 1 or 0,1 (default both)\n");
+        printf("  -S                 a flag per stream instead of a shared one\n");
+        printf("  -s <usecs>         delay before the release (default 20)\n");
+        printf("  -t <usecs>         wake-up time-out (default 1000000)\n");
+        printf("  --warmup=<n>       wake-ups discarded before sampling (default 10)\n");
+        printf("  --reps=<n>         runs of each configuration (default 1)\n");
+        printf("  --json=<file>      append results as JSON to <file>\n");
+}
+
+int main(int argc, char *argv[])
+{
+        int ret = 0;
+        int gpu_id = 0;
+        int waits[BENCH_MAX_SWEEP] = { 0 };
+        int n_waits_list = 0;
+        int flushes[2] = { 0, 1 };
+        int n_flushes = 2;
+        int mem = MEM_HOST | MEM_GPU;
+        int max_waits = 0;
+        int i, m, f, w, rep;
+        struct sweep sw;
+        struct bench_opts bench;
+        struct bench_report report;
+        struct bench_samples first, last;
+        struct bench_stats st;
+        gds_mem_desc_t flags[2], slots;
+
+        memset(&sw, 0, sizeof(sw));
+        sw.iters = 1000;
+        sw.sleep_us = 20;
+        sw.timeout_us = 1000000;
+        bench_opts_init(&bench, 10);
+
+        while (1) {
+                static struct option long_options[] = {
+                        BENCH_LONG_OPTIONS,
+                        { 0 }
+                };
+                int c = getopt_long(argc, argv, "d:n:N:M:F:Ss:t:h", long_options, NULL);
+                if (c == -1)
+                        break;
+                switch (c) {
+                case 'd': gpu_id = strtol(optarg, NULL, 0); break;
+                case 'n': sw.iters = strtol(optarg, NULL, 0); break;
+                case 'N':
+                        n_waits_list = bench_parse_list(optarg, waits, BENCH_MAX_SWEEP);
+                        if (n_waits_list < 0) {
+                                usage(argv[0]);
+                                return 1;
+                        }
+                        break;
+                case 'M':
+                        mem = 0;
+                        if (strstr(optarg, "host"))
+                                mem |= MEM_HOST;
+                        if (strstr(optarg, "gpu"))
+                                mem |= MEM_GPU;
+                        break;
+                case 'F':
+                        n_flushes = bench_parse_list(optarg, flushes, 2);
+                        break;
+                case 'S': sw.separate = 1; break;
+                case 's': sw.sleep_us = strtol(optarg, NULL, 0); break;
+                case 't': sw.timeout_us = strtol(optarg, NULL, 0); break;
+                default:
+                        if (bench_parse_opt(&bench, c, optarg) > 0)
+                                break;
+                        usage(argv[0]);
+                        return 1;
+                }
+        }
+        if (!n_waits_list)
+                n_waits_list = bench_parse_list("1:128", waits, BENCH_MAX_SWEEP);
+        for (i = 0; i < n_waits_list; ++i) {
+                if (waits[i] < 1 || waits[i] > MAX_WAITS) {
+                        fprintf(stderr, "waits must be within 1 and %d\n", MAX_WAITS);
+                        return 1;
+                }
+                if (waits[i] > max_waits)
+                        max_waits = waits[i];
+        }
+        if (!mem || n_flushes < 1 || sw.iters < 1) {
+                usage(argv[0]);
+                return 1;
+        }
+        sw.warmup = bench.warmup;
+
+        if (gpu_init(gpu_id, CU_CTX_SCHED_AUTO)) {
+                fprintf(stderr, "error in GPU init.\n");
+                return 1;
+        }
+        memset(flags, 0, sizeof(flags));
+        memset(&slots, 0, sizeof(slots));
+        for (m = 0; m < 2; ++m) {
+                if (!(mem & (1 << m)))
+                        continue;
+                ret = gds_alloc_mapped_memory(&flags[m], max_waits * STRIDE * sizeof(uint32_t),
+                                              m ? GDS_MEMORY_GPU : GDS_MEMORY_HOST);
+                if (ret) {
+                        fprintf(stderr, "error %d while allocating %s flags\n", ret, m ? "GPU" : "host");
+                        goto out;
+                }
+                memset(flags[m].h_ptr, 0, max_waits * STRIDE * sizeof(uint32_t));
+        }
+        ret = gds_alloc_mapped_memory(&slots, max_waits * STRIDE * sizeof(uint32_t), GDS_MEMORY_HOST);
+        if (ret) {
+                fprintf(stderr, "error %d while allocating slots\n", ret);
+                goto out;
+        }
+        memset(slots.h_ptr, 0, max_waits * STRIDE * sizeof(uint32_t));
+        for (i = 0; i < max_waits; ++i)
+                CUCHECK(cuStreamCreate(&streams[i], CU_STREAM_NON_BLOCKING));
+
+        if (bench_samples_init(&first, (size_t)sw.iters * bench.reps) ||
+            bench_samples_init(&last, (size_t)sw.iters * bench.reps) ||
+            bench_report_open(&report, &bench, "gds_poll_scaling_bench", 0)) {
+                ret = 1;
+                goto out_streams;
+        }
+        for (m = 0; m < 2; ++m) {
+                if (!(mem & (1 << m)))
+                        continue;
+                sw.gpu_mem = m;
+                for (f = 0; f < n_flushes; ++f) {
+                        sw.flush = flushes[f];
+                        for (w = 0; w < n_waits_list; ++w) {
+                                char params[128];
+                                int err = 0;
+                                sw.n_waits = waits[w];
+                                bench_samples_reset(&first);
+                                bench_samples_reset(&last);
+                                for (rep = 0; rep < bench.reps && !err; ++rep)
+                                        err = run(&sw, &flags[m], &slots, &first, &last);
+                                if (err == ETIMEDOUT) {
+                                        printf("%d waits on %s memory time out, skipping larger counts\n",
+                                               sw.n_waits, m ? "GPU" : "host");
+                                        break;
+                                }
+                                if (err) {
+                                        ret = err;
+                                        goto out_report;
+                                }
+                                snprintf(params, sizeof(params), "waits=%d mem=%s flush=%d wake=first",
+                                         sw.n_waits, m ? "gpu" : "host", sw.flush);
+                                bench_compute(&first, &st);
+                                bench_report_add_params(&report, params, sw.iters, &st);
+                                snprintf(params, sizeof(params), "waits=%d mem=%s flush=%d wake=last",
+                                         sw.n_waits, m ? "gpu" : "host", sw.flush);
+                                bench_compute(&last, &st);
+                                bench_report_add_params(&report, params, sw.iters, &st);
+                        }
+                }
+        }
+
+out_report:
+        bench_report_close(&report);
+        bench_samples_free(&first);
+        bench_samples_free(&last);
+out_streams:
+        for (i = 0; i < max_waits; ++i)
+                if (streams[i])
+                        CUCHECK(cuStreamDestroy(streams[i]));
+out:
+        for (m = 0; m < 2; ++m)
+                if (flags[m].h_ptr)
+                        gds_free_mapped_memory(&flags[m]);
+        if (slots.h_ptr)
+                gds_free_mapped_memory(&slots);
+        gpu_finalize();
+        return ret ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ *  indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,124 @@
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+
+#include <gdsync.h>
+#include <gdsync/tools.h>
+
+// Translates again the descriptor batches captured with
+// GDS_RECORD_FILE=<prefix>, under each doorbell strategy, and reports the
+// memop count and the host time spent in the translation. No GPU nor HCA is
+// needed, so captures taken on a cluster can be compared offline.
+
+static const char *strategy_names[GDS_DB_NUM_STRATEGIES] = {
+        "plain+membar", "plain", "sim64+membar", "sim64", "inlcpy+membar", "inlcpy"
+};
+
+static void usage(const char *argv0)
+{
+        printf("Usage:\n");
+        printf("  %s [options] <capture file>\n", argv0);
+        printf("\n");
+        printf("Options:\n");
+        printf("  -s, --strategy=<s>     replay with doorbell strategy <s> only, see gds_db_strategy_t\n");
+        printf("                         (default env settings, then every strategy)\n");
+        printf("  -r, --repeat=<n>       replay the whole file <n> times (default 1)\n");
+}
+
+static int replay(const char *path, int strategy, int repeat)
+{
+        int ret = 0;
+        int r;
+        gds_replay_stats_t stats, tot;
+        const char *name = strategy < 0 ? "env" : strategy_names[strategy];
+
+        memset(&tot, 0, sizeof(tot));
+        for (r = 0; r < repeat; ++r) {
+                ret = gds_replay_file(path, strategy, &stats);
+                if (ret)
+                        break;
+                tot.n_batches += stats.n_batches;
+                tot.n_descs += stats.n_descs;
+                tot.n_peer_ops += stats.n_peer_ops;
+                tot.n_recorded_params += stats.n_recorded_params;
+                tot.n_params += stats.n_params;
+                tot.translate_us += stats.translate_us;
+                tot.recorded_translate_us += stats.recorded_translate_us;
+        }
+        if (ret == ENOTSUP) {
+                printf("%-14s %10s\n", name, "n/a");
+                return 0;
+        }
+        if (ret) {
+                fprintf(stderr, "error %d while replaying %s\n", ret, path);
+                return ret;
+        }
+        if (!tot.n_batches) {
+                printf("%-14s %10s\n", name, "empty");
+                return 0;
+        }
+        printf("%-14s %10zu %10zu %10zu %12zu %12zu %10.3f %10.3f\n", name,
+               tot.n_batches / repeat, tot.n_descs / repeat, tot.n_peer_ops / repeat,
+               tot.n_recorded_params / repeat, tot.n_params / repeat,
+               tot.recorded_translate_us / tot.n_batches, tot.translate_us / tot.n_batches);
+        return 0;
+}
+
+int main(int argc, char *argv[])
+{
+        int ret = 0;
+        int strategy = -1;
+        int repeat = 1;
+        const char *path;
+        int s;
+
+        while (1) {
+                static struct option long_options[] = {
+                        { .name = "strategy", .has_arg = 1, .val = 's' },
+                        { .name = "repeat",   .has_arg = 1, .val = 'r' },
+                        { 0 }
+                };
+                int c = getopt_long(argc, argv, "s:r:h", long_options, NULL);
+                if (c == -1)
+                        break;
+                switch (c) {
+                case 's': strategy = strtol(optarg, NULL, 0); break;
+                case 'r': repeat = strtol(optarg, NULL, 0); break;
+                default:
+                        usage(argv[0]);
+                        return 1;
+                }
+        }
+        if (optind != argc - 1 || strategy < -1 || strategy >= GDS_DB_NUM_STRATEGIES || repeat < 1) {
+                usage(argv[0]);
+                return 1;
+        }
+        path = argv[optind];
+
+        printf("%-14s %10s %10s %10s %12s %12s %10s %10s\n", "strategy", "batches", "descs", "peer ops",
+               "memops rec", "memops", "usec rec", "usec/batch");
+        if (strategy >= 0) {
+                ret = replay(path, strategy, repeat);
+        } else {
+                ret = replay(path, -1, repeat);
+                for (s = 0; !ret && s < GDS_DB_NUM_STRATEGIES; ++s)
+                        ret = replay(path, s, repeat);
+        }
+        return ret ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ *  indent-tabs-mode: nil
+ * End:
+ */
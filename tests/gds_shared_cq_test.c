@@ -0,0 +1,248 @@
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+
+#include <cuda.h>
+#include <cuda_runtime_api.h>
+#include <gdsync.h>
+
+#include "loopback.h"
+#include "gpu.h"
+
+// Two loopback QPs on one shared send CQ and one shared receive CQ, with
+// their receives posted on a shared receive queue. Each send alternates
+// between the QPs, the stream waits go through the CQs of the other QP,
+// which only works if the CQE cursor really is shared, then the CPU polls
+// both CQs and checks that gds_shared_cq_qp() names the QP which sent.
+
+#define N_QPS    2
+#define GRH_SIZE 40
+
+static int poll_one(struct gds_cq *cq, struct ibv_wc *wc)
+{
+        time_t tmout = time(NULL) + 10;
+        int ne;
+        do {
+                ne = ibv_poll_cq(cq->cq, 1, wc);
+                if (ne < 0) {
+                        fprintf(stderr, "error %d in ibv_poll_cq\n", ne);
+                        return EIO;
+                }
+                if (!ne && time(NULL) > tmout) {
+                        fprintf(stderr, "timeout while waiting for a completion\n");
+                        return ETIMEDOUT;
+                }
+        } while (!ne);
+        if (wc->status != IBV_WC_SUCCESS) {
+                fprintf(stderr, "completion error %d (%s)\n", wc->status, ibv_wc_status_str(wc->status));
+                return EIO;
+        }
+        return 0;
+}
+
+static int post_srq_recv(struct gds_srq *srq, struct ibv_mr *mr, char *rx_buf, size_t slot, int i)
+{
+        struct ibv_sge rsge = {
+                .addr   = (uintptr_t)(rx_buf + (size_t)i * slot),
+                .length = slot,
+                .lkey   = mr->lkey
+        };
+        struct ibv_recv_wr rwr = { .wr_id = i, .sg_list = &rsge, .num_sge = 1 }, *bad_rwr;
+        return gds_post_srq_recv(srq, &rwr, &bad_rwr);
+}
+
+static void usage(const char *argv0)
+{
+        printf("Usage:\n");
+        printf("  %s [options]\n", argv0);
+        printf("\n");
+        printf("Options:\n");
+        loopback_usage();
+        printf("  -n, --iters=<n>        sends, alternating between the QPs (default 1000)\n");
+        printf("  -D, --depth=<n>        receives kept posted on the SRQ (default 16)\n");
+        printf("  -s, --size=<n>         message size (default 8)\n");
+}
+
+int main(int argc, char *argv[])
+{
+        int ret = 0;
+        struct loopback_opts lo;
+        int iters = 1000;
+        int depth = 16;
+        int size = 8;
+        int i, q;
+        struct loopback_ctx ctx;
+        struct gds_cq *scq = NULL, *rcq = NULL;
+        struct gds_srq *srq = NULL;
+        struct gds_qp *qps[N_QPS] = { NULL };
+        gds_create_qp_attr_t attr;
+        char *rx_buf = NULL;
+        struct ibv_mr *rx_mr = NULL;
+        size_t slot;
+
+        loopback_opts_init(&lo);
+        while (1) {
+                static struct option long_options[] = {
+                        LOOPBACK_LONG_OPTIONS,
+                        { .name = "iters", .has_arg = 1, .val = 'n' },
+                        { .name = "depth", .has_arg = 1, .val = 'D' },
+                        { .name = "size",  .has_arg = 1, .val = 's' },
+                        { 0 }
+                };
+                int c = getopt_long(argc, argv, LOOPBACK_SHORT_OPTIONS "n:D:s:h", long_options, NULL);
+                if (c == -1)
+                        break;
+                if (loopback_parse_opt(&lo, c, optarg))
+                        continue;
+                switch (c) {
+                case 'n': iters = strtol(optarg, NULL, 0); break;
+                case 'D': depth = strtol(optarg, NULL, 0); break;
+                case 's': size = strtol(optarg, NULL, 0); break;
+                default:
+                        usage(argv[0]);
+                        return 1;
+                }
+        }
+        if (iters < 1 || depth < 1 || size < 1) {
+                usage(argv[0]);
+                return 1;
+        }
+        slot = size + GRH_SIZE;
+
+        if (loopback_gpu_init(&lo))
+                return 1;
+        ret = loopback_open(&ctx, &lo, depth, size, 0, 0);
+        if (ret)
+                goto out_gpu;
+
+        scq = gds_create_shared_cq(ctx.context, depth * N_QPS, lo.gpu_id, 0);
+        rcq = gds_create_shared_cq(ctx.context, depth * N_QPS, lo.gpu_id, 0);
+        srq = gds_create_srq(ctx.pd, ctx.context, depth, 1);
+        if (!scq || !rcq || !srq) {
+                fprintf(stderr, "error while creating the shared CQs and SRQ\n");
+                ret = EINVAL;
+                goto out;
+        }
+        memset(&attr, 0, sizeof(attr));
+        attr.comp_mask = GDS_CREATE_QP_ATTR_SEND_CQ | GDS_CREATE_QP_ATTR_RECV_CQ | GDS_CREATE_QP_ATTR_SRQ;
+        attr.send_cq = scq;
+        attr.recv_cq = rcq;
+        attr.srq = srq;
+        for (q = 0; q < N_QPS; ++q) {
+                ret = loopback_create_qp(&ctx, lo.gpu_id, 0, 0, &attr, &qps[q]);
+                if (ret) {
+                        fprintf(stderr, "error %d while creating QP %d\n", ret, q);
+                        goto out;
+                }
+                ASSERT(qps[q]->send_cq.shared == scq);
+                ASSERT(qps[q]->recv_cq.shared == rcq);
+                ASSERT(gds_shared_cq_qp(scq, qps[q]->qp->qp_num) == qps[q]);
+                ASSERT(gds_shared_cq_qp(rcq, qps[q]->qp->qp_num) == qps[q]);
+        }
+        // the QP of ctx has private CQs
+        ASSERT(gds_shared_cq_qp(scq, ctx.gds_qp->qp->qp_num) == NULL);
+        ASSERT(gds_destroy_shared_cq(scq) == EBUSY);
+
+        rx_buf = malloc((size_t)depth * slot);
+        if (!rx_buf) {
+                ret = ENOMEM;
+                goto out;
+        }
+        rx_mr = ibv_reg_mr(ctx.pd, rx_buf, (size_t)depth * slot, IBV_ACCESS_LOCAL_WRITE);
+        if (!rx_mr) {
+                fprintf(stderr, "cannot register receive buffers\n");
+                ret = ENOMEM;
+                goto out;
+        }
+        for (i = 0; i < depth; ++i) {
+                ret = post_srq_recv(srq, rx_mr, rx_buf, slot, i);
+                if (ret) {
+                        fprintf(stderr, "error %d while posting receive %d\n", ret, i);
+                        goto out;
+                }
+        }
+
+        for (i = 0; i < iters; ++i) {
+                int k = i % N_QPS;
+                struct gds_qp *other = qps[(k + 1) % N_QPS];
+                struct ibv_sge sge;
+                gds_send_wr ewr, *bad_ewr;
+                gds_send_request_t sreq;
+                struct ibv_wc wc;
+
+                loopback_init_send(&ctx, &ewr, &sge, 0);
+                ewr.wr.ud.remote_qpn = qps[k]->qp->qp_num;
+                ret = gds_prepare_send(qps[k], &ewr, &bad_ewr, &sreq);
+                if (!ret)
+                        ret = gds_stream_post_send(gpu_stream, &sreq);
+                if (!ret)
+                        ret = gds_stream_wait_cq(gpu_stream, &other->send_cq, 0);
+                if (!ret)
+                        ret = gds_stream_wait_cq(gpu_stream, &other->recv_cq, 0);
+                if (ret) {
+                        fprintf(stderr, "error %d while posting on QP %d at iteration %d\n", ret, k, i);
+                        goto out;
+                }
+                CUCHECK(cuStreamSynchronize(gpu_stream));
+
+                // the stream waits do not tell which QP completed, the CQE does
+                ret = poll_one(scq, &wc);
+                if (ret)
+                        goto out;
+                if (gds_shared_cq_qp(scq, wc.qp_num) != qps[k]) {
+                        fprintf(stderr, "iteration %d: send CQE of qp_num %u, expected QP %d\n", i, wc.qp_num, k);
+                        ret = EINVAL;
+                        goto out;
+                }
+                ret = poll_one(rcq, &wc);
+                if (ret)
+                        goto out;
+                if (gds_shared_cq_qp(rcq, wc.qp_num) != qps[k] || wc.byte_len != slot) {
+                        fprintf(stderr, "iteration %d: receive CQE of qp_num %u len %u, expected QP %d len %zu\n",
+                                i, wc.qp_num, wc.byte_len, k, slot);
+                        ret = EINVAL;
+                        goto out;
+                }
+                ret = post_srq_recv(srq, rx_mr, rx_buf, slot, wc.wr_id);
+                if (ret) {
+                        fprintf(stderr, "error %d while reposting receive %d\n", ret, (int)wc.wr_id);
+                        goto out;
+                }
+        }
+        printf("%d sends over %d QPs sharing CQs and SRQ: OK\n", iters, N_QPS);
+
+out:
+        for (q = 0; q < N_QPS; ++q)
+                if (qps[q] && gds_destroy_qp(qps[q]) && !ret)
+                        ret = EBUSY;
+        if (rx_mr)
+                ibv_dereg_mr(rx_mr);
+        free(rx_buf);
+        if (srq && gds_destroy_srq(srq) && !ret)
+                ret = EBUSY;
+        if (rcq && gds_destroy_shared_cq(rcq) && !ret)
+                ret = EBUSY;
+        if (scq && gds_destroy_shared_cq(scq) && !ret)
+                ret = EBUSY;
+        loopback_fini(&ctx);
+out_gpu:
+        gpu_finalize();
+        return ret ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ *  indent-tabs-mode: nil
+ * End:
+ */
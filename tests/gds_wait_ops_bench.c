@@ -0,0 +1,171 @@
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+
+#include <cuda.h>
+#include <cuda_runtime_api.h>
+#include <gdsync.h>
+
+#include "loopback.h"
+#include "gpu.h"
+#include "test_utils.h"
+
+// Peer ops per CQ wait, and send+wait round trip time, on a loopback QP.
+// The HCA provider builds the peek sequence out of the ops advertised by
+// libgdsync, i.e. NOR polls when the GPU supports them and GEQ polls
+// otherwise. Run it once as is and once with -N, which sets
+// GDS_DISABLE_WAIT_NOR=1, to compare the two.
+
+enum { OPS_POLL_AND = 0, OPS_POLL_GEQ, OPS_POLL_NOR, OPS_STORE, OPS_FENCE, OPS_OTHER, N_OPS };
+
+static const char *ops_names[N_OPS] = { "AND", "GEQ", "NOR", "STORE", "FENCE", "other" };
+
+static void count_ops(gds_wait_request_t *req, unsigned long *cnt)
+{
+        struct peer_op_wr *op = req->peek.storage;
+        int n;
+        for (n = 0; op && n < req->peek.entries; op = op->next, ++n) {
+                switch (op->type) {
+                case IBV_EXP_PEER_OP_POLL_AND_DWORD: ++cnt[OPS_POLL_AND]; break;
+                case IBV_EXP_PEER_OP_POLL_GEQ_DWORD: ++cnt[OPS_POLL_GEQ]; break;
+                case IBV_EXP_PEER_OP_POLL_NOR_DWORD: ++cnt[OPS_POLL_NOR]; break;
+                case IBV_EXP_PEER_OP_STORE_DWORD:
+                case IBV_EXP_PEER_OP_STORE_QWORD: ++cnt[OPS_STORE]; break;
+                case IBV_EXP_PEER_OP_FENCE: ++cnt[OPS_FENCE]; break;
+                default: ++cnt[OPS_OTHER]; break;
+                }
+        }
+}
+
+static void usage(const char *argv0)
+{
+        printf("Usage:\n");
+        printf("  %s [options]\n", argv0);
+        printf("\n");
+        printf("Options:\n");
+        printf("  -d, --ib-dev=<dev>     use IB device <dev> (default first device found)\n");
+        printf("  -i, --ib-port=<port>   use port <port> of IB device (default 1)\n");
+        printf("  -g, --gid-idx=<idx>    local port gid index (default none)\n");
+        printf("  -G, --gpu-id=<id>      use specified GPU (default 0)\n");
+        printf("  -n, --iters=<n>        send+wait round trips (default 10000)\n");
+        printf("  -N, --no-nor           do not use NOR polls, even if supported\n");
+}
+
+int main(int argc, char *argv[])
+{
+        int ret = 0;
+        char *ib_devname = NULL;
+        int ib_port = 1;
+        int gid_idx = -1;
+        int gpu_id = 0;
+        int iters = 10000;
+        int no_nor = 0;
+        int i, k;
+        unsigned long cnt[N_OPS];
+        unsigned long n_ops = 0;
+        gds_us_t start, elapsed;
+        struct loopback_ctx ctx;
+        gds_send_request_t sreq;
+        gds_wait_request_t wreq;
+
+        while (1) {
+                static struct option long_options[] = {
+                        { .name = "ib-dev",  .has_arg = 1, .val = 'd' },
+                        { .name = "ib-port", .has_arg = 1, .val = 'i' },
+                        { .name = "gid-idx", .has_arg = 1, .val = 'g' },
+                        { .name = "gpu-id",  .has_arg = 1, .val = 'G' },
+                        { .name = "iters",   .has_arg = 1, .val = 'n' },
+                        { .name = "no-nor",  .has_arg = 0, .val = 'N' },
+                        { 0 }
+                };
+                int c = getopt_long(argc, argv, "d:i:g:G:n:Nh", long_options, NULL);
+                if (c == -1)
+                        break;
+                switch (c) {
+                case 'd': ib_devname = strdup(optarg); break;
+                case 'i': ib_port = strtol(optarg, NULL, 0); break;
+                case 'g': gid_idx = strtol(optarg, NULL, 0); break;
+                case 'G': gpu_id = strtol(optarg, NULL, 0); break;
+                case 'n': iters = strtol(optarg, NULL, 0); break;
+                case 'N': no_nor = 1; break;
+                default:
+                        usage(argv[0]);
+                        return 1;
+                }
+        }
+        if (iters < 1) {
+                usage(argv[0]);
+                return 1;
+        }
+        // must be set before the peer is registered
+        if (no_nor)
+                setenv("GDS_DISABLE_WAIT_NOR", "1", 1);
+
+        if (gpu_init(gpu_id, CU_CTX_SCHED_AUTO)) {
+                fprintf(stderr, "error in GPU init.\n");
+                return 1;
+        }
+        ret = loopback_init(&ctx, ib_devname, ib_port, gid_idx, gpu_id, 16, 8, 0);
+        if (ret)
+                goto out_gpu;
+
+        memset(cnt, 0, sizeof(cnt));
+        elapsed = 0;
+        for (i = 0; i < iters; ++i) {
+                struct ibv_sge sge;
+                gds_send_wr ewr, *bad_ewr;
+
+                loopback_init_send(&ctx, &ewr, &sge, 0);
+                start = gds_get_time_us();
+                ret = gds_prepare_send(ctx.gds_qp, &ewr, &bad_ewr, &sreq);
+                if (!ret)
+                        ret = gds_stream_post_send(gpu_stream, &sreq);
+                if (!ret)
+                        ret = gds_prepare_wait_cq(&ctx.gds_qp->send_cq, &wreq, 0);
+                if (ret) {
+                        fprintf(stderr, "error %d while preparing round trip %d\n", ret, i);
+                        goto out;
+                }
+                count_ops(&wreq, cnt);
+                n_ops += wreq.peek.entries;
+                ret = gds_stream_post_wait_cq(gpu_stream, &wreq);
+                if (ret) {
+                        fprintf(stderr, "error %d while posting wait %d\n", ret, i);
+                        goto out;
+                }
+                CUCHECK(cuStreamSynchronize(gpu_stream));
+                elapsed += gds_get_time_us() - start;
+                ret = loopback_drain_send_cq(&ctx, 1);
+                if (ret)
+                        goto out;
+        }
+
+        printf("NOR %s, %d round trips\n", no_nor ? "disabled" : "allowed", iters);
+        printf("%-12s %10.2f\n", "ops/wait", (double)n_ops / iters);
+        for (k = 0; k < N_OPS; ++k)
+                if (cnt[k])
+                        printf("  %-10s %10.2f\n", ops_names[k], (double)cnt[k] / iters);
+        printf("%-12s %10.2f\n", "usec/trip", (double)elapsed / iters);
+
+out:
+        loopback_fini(&ctx);
+out_gpu:
+        gpu_finalize();
+        return ret ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ *  indent-tabs-mode: nil
+ * End:
+ */
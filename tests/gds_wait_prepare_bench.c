@@ -0,0 +1,243 @@
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <cuda.h>
+#include <cuda_runtime_api.h>
+#include <gdsync.h>
+
+#include "loopback.h"
+#include "gpu.h"
+#include "test_utils.h"
+
+// Throughput of gds_prepare_wait_cq with several threads claiming CQEs out
+// of the same CQ. With -c, only the CQ cursor is exercised, no HCA or GPU
+// is needed, comparing the cache line padded cursor of struct gds_cq with
+// a packed layout where the cursor shares the line with the ibv_cq
+// pointer, and with an unsynchronized increment.
+// In prepare mode each peek is aborted right away, as a real CQ only has
+// room for as many outstanding peeks as CQEs, so the rate includes the
+// abort.
+
+enum bench_mode {
+        MODE_PREPARE = 0,       // gds_prepare_wait_cq on a real CQ
+        MODE_PADDED,            // atomic cursor on its own cache line
+        MODE_PACKED,            // atomic cursor next to the ibv_cq pointer
+        MODE_RACY,              // plain ++, counts lost claims
+        N_MODES
+};
+
+static const char *mode_names[N_MODES] = { "prepare", "padded", "packed", "racy" };
+
+struct packed_cq {
+        struct ibv_cq *cq;
+        uint32_t curr_offset;
+};
+
+struct bench {
+        int mode;
+        int n_threads;
+        int iters;
+        struct gds_cq *cq;
+        struct packed_cq *pcq;
+        pthread_barrier_t barrier;
+        int error;
+};
+
+static struct ibv_cq *volatile sink;
+
+static void *worker(void *arg)
+{
+        struct bench *b = (struct bench *)arg;
+        gds_wait_request_t *req = NULL;
+        int i;
+
+        if (b->mode == MODE_PREPARE) {
+                req = (gds_wait_request_t *)calloc(1, sizeof(*req));
+                if (!req)
+                        b->error = ENOMEM;
+        }
+        pthread_barrier_wait(&b->barrier);
+        if (b->error)
+                return NULL;
+
+        for (i = 0; i < b->iters; ++i) {
+                switch (b->mode) {
+                case MODE_PREPARE: {
+                        struct ibv_exp_peer_abort_peek abort_ctx;
+                        if (gds_prepare_wait_cq(b->cq, req, 0)) {
+                                b->error = EIO;
+                                goto out;
+                        }
+                        abort_ctx.peek_id = req->peek.peek_id;
+                        abort_ctx.comp_mask = 0;
+                        if (ibv_exp_peer_abort_peek_cq(b->cq->cq, &abort_ctx)) {
+                                b->error = EIO;
+                                goto out;
+                        }
+                        break;
+                }
+                case MODE_PADDED:
+                        __sync_fetch_and_add(&b->cq->curr_offset, 1);
+                        sink = b->cq->cq;
+                        break;
+                case MODE_PACKED:
+                        __sync_fetch_and_add(&b->pcq->curr_offset, 1);
+                        sink = b->pcq->cq;
+                        break;
+                case MODE_RACY:
+                        ACCESS_ONCE(b->cq->curr_offset) = ACCESS_ONCE(b->cq->curr_offset) + 1;
+                        sink = b->cq->cq;
+                        break;
+                }
+        }
+out:
+        free(req);
+        return NULL;
+}
+
+static int run(int mode, int n_threads, int iters, struct gds_cq *cq, struct packed_cq *pcq)
+{
+        struct bench b;
+        pthread_t tids[n_threads];
+        uint32_t start_offset;
+        uint32_t claimed;
+        gds_us_t start, elapsed;
+        int i;
+
+        memset(&b, 0, sizeof(b));
+        b.mode = mode;
+        b.n_threads = n_threads;
+        b.iters = iters;
+        b.cq = cq;
+        b.pcq = pcq;
+        pthread_barrier_init(&b.barrier, NULL, n_threads + 1);
+
+        start_offset = mode == MODE_PACKED ? pcq->curr_offset : cq->curr_offset;
+        for (i = 0; i < n_threads; ++i)
+                pthread_create(&tids[i], NULL, worker, &b);
+        pthread_barrier_wait(&b.barrier);
+        start = gds_get_time_us();
+        for (i = 0; i < n_threads; ++i)
+                pthread_join(tids[i], NULL);
+        elapsed = gds_get_time_us() - start;
+        pthread_barrier_destroy(&b.barrier);
+
+        if (b.error) {
+                fprintf(stderr, "error %d in %s mode\n", b.error, mode_names[mode]);
+                return 1;
+        }
+        claimed = (mode == MODE_PACKED ? pcq->curr_offset : cq->curr_offset) - start_offset;
+        printf("%-8s %8d %12.2f %12u\n", mode_names[mode], n_threads,
+               (double)n_threads * iters / (elapsed ? elapsed : 1),
+               (uint32_t)(n_threads * iters) - claimed);
+        // every claim must be accounted for, except in racy mode
+        return mode != MODE_RACY && claimed != (uint32_t)(n_threads * iters);
+}
+
+static void usage(const char *argv0)
+{
+        printf("Usage:\n");
+        printf("  %s [options]\n", argv0);
+        printf("\n");
+        printf("Options:\n");
+        printf("  -c, --cpu-only         exercise the CQ cursor only, no HCA or GPU needed\n");
+        printf("  -d, --ib-dev=<dev>     use IB device <dev> (default first device found)\n");
+        printf("  -i, --ib-port=<port>   use port <port> of IB device (default 1)\n");
+        printf("  -g, --gid-idx=<idx>    local port gid index (default none)\n");
+        printf("  -G, --gpu-id=<id>      use specified GPU (default 0)\n");
+        printf("  -t, --threads=<n>      max number of threads, doubling from 1 (default 8)\n");
+        printf("  -n, --iters=<n>        prepares per thread (default 100000)\n");
+}
+
+int main(int argc, char *argv[])
+{
+        int ret = 0;
+        int cpu_only = 0;
+        char *ib_devname = NULL;
+        int ib_port = 1;
+        int gid_idx = -1;
+        int gpu_id = 0;
+        int max_threads = 8;
+        int iters = 100000;
+        int mode, n;
+        struct loopback_ctx ctx;
+        struct gds_cq *cq = NULL;
+        struct packed_cq pcq;
+
+        while (1) {
+                static struct option long_options[] = {
+                        { .name = "cpu-only", .has_arg = 0, .val = 'c' },
+                        { .name = "ib-dev",   .has_arg = 1, .val = 'd' },
+                        { .name = "ib-port",  .has_arg = 1, .val = 'i' },
+                        { .name = "gid-idx",  .has_arg = 1, .val = 'g' },
+                        { .name = "gpu-id",   .has_arg = 1, .val = 'G' },
+                        { .name = "threads",  .has_arg = 1, .val = 't' },
+                        { .name = "iters",    .has_arg = 1, .val = 'n' },
+                        { 0 }
+                };
+                int c = getopt_long(argc, argv, "cd:i:g:G:t:n:h", long_options, NULL);
+                if (c == -1)
+                        break;
+                switch (c) {
+                case 'c': cpu_only = 1; break;
+                case 'd': ib_devname = strdup(optarg); break;
+                case 'i': ib_port = strtol(optarg, NULL, 0); break;
+                case 'g': gid_idx = strtol(optarg, NULL, 0); break;
+                case 'G': gpu_id = strtol(optarg, NULL, 0); break;
+                case 't': max_threads = strtol(optarg, NULL, 0); break;
+                case 'n': iters = strtol(optarg, NULL, 0); break;
+                default:
+                        usage(argv[0]);
+                        return 1;
+                }
+        }
+
+        if (cpu_only) {
+                if (posix_memalign((void **)&cq, GDS_CACHELINE_SIZE, sizeof(*cq)))
+                        return 1;
+                memset(cq, 0, sizeof(*cq));
+        } else {
+                if (gpu_init(gpu_id, CU_CTX_SCHED_AUTO)) {
+                        fprintf(stderr, "error in GPU init.\n");
+                        return 1;
+                }
+                ret = loopback_init(&ctx, ib_devname, ib_port, gid_idx, gpu_id, 16, 8, 0);
+                if (ret)
+                        goto out_gpu;
+                cq = &ctx.gds_qp->send_cq;
+        }
+        memset(&pcq, 0, sizeof(pcq));
+
+        printf("%-8s %8s %12s %12s\n", "mode", "threads", "Mprep/s", "lost");
+        for (mode = cpu_only ? MODE_PADDED : MODE_PREPARE; mode < (cpu_only ? N_MODES : MODE_PADDED); ++mode)
+                for (n = 1; n <= max_threads; n *= 2)
+                        ret |= run(mode, n, iters, cq, &pcq);
+
+        if (cpu_only) {
+                free(cq);
+                return ret;
+        }
+        loopback_fini(&ctx);
+out_gpu:
+        gpu_finalize();
+        return ret ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ *  indent-tabs-mode: nil
+ * End:
+ */
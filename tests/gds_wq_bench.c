@@ -0,0 +1,153 @@
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+
+#include <cuda.h>
+#include <cuda_runtime_api.h>
+#include <gdsync.h>
+
+#include "loopback.h"
+#include "gpu.h"
+#include "test_utils.h"
+
+// Host-resident vs GPU-resident send WQ, on a loopback QP.
+// latency: one stream send+wait round trip at a time.
+// throughput: batches of depth sends posted on the stream, then depth waits.
+
+enum { WQ_ON_HOST = 0, WQ_ON_GPU, N_WQ_PLACEMENTS };
+
+static const char *wq_names[N_WQ_PLACEMENTS] = { "host", "gpu" };
+
+static int send_batch(struct loopback_ctx *ctx, int n)
+{
+        int ret = 0;
+        int i;
+        gds_send_request_t sreq;
+
+        for (i = 0; i < n; ++i) {
+                struct ibv_sge sge;
+                gds_send_wr ewr, *bad_ewr;
+
+                loopback_init_send(ctx, &ewr, &sge, 0);
+                ret = gds_prepare_send(ctx->gds_qp, &ewr, &bad_ewr, &sreq);
+                if (!ret)
+                        ret = gds_stream_post_send(gpu_stream, &sreq);
+                if (ret) {
+                        fprintf(stderr, "error %d while posting send %d\n", ret, i);
+                        return ret;
+                }
+        }
+        for (i = 0; i < n; ++i) {
+                ret = gds_stream_wait_cq(gpu_stream, &ctx->gds_qp->send_cq, 0);
+                if (ret) {
+                        fprintf(stderr, "error %d while posting wait %d\n", ret, i);
+                        return ret;
+                }
+        }
+        CUCHECK(cuStreamSynchronize(gpu_stream));
+        return loopback_drain_send_cq(ctx, n);
+}
+
+static void usage(const char *argv0)
+{
+        printf("Usage:\n");
+        printf("  %s [options]\n", argv0);
+        printf("\n");
+        printf("Options:\n");
+        loopback_usage();
+        printf("  -n, --iters=<n>        round trips, and batches, per placement (default 10000)\n");
+        printf("  -D, --depth=<n>        sends per throughput batch (default 64)\n");
+        printf("  -s, --size=<n>         message size (default 8)\n");
+}
+
+int main(int argc, char *argv[])
+{
+        int ret = 0;
+        struct loopback_opts lo;
+        int iters = 10000;
+        int depth = 64;
+        int size = 8;
+        int i, w;
+        gds_us_t start, lat[N_WQ_PLACEMENTS], tput[N_WQ_PLACEMENTS];
+        struct loopback_ctx ctx;
+
+        loopback_opts_init(&lo);
+        while (1) {
+                static struct option long_options[] = {
+                        LOOPBACK_LONG_OPTIONS,
+                        { .name = "iters",   .has_arg = 1, .val = 'n' },
+                        { .name = "depth",   .has_arg = 1, .val = 'D' },
+                        { .name = "size",    .has_arg = 1, .val = 's' },
+                        { 0 }
+                };
+                int c = getopt_long(argc, argv, LOOPBACK_SHORT_OPTIONS "n:D:s:h", long_options, NULL);
+                if (c == -1)
+                        break;
+                if (loopback_parse_opt(&lo, c, optarg))
+                        continue;
+                switch (c) {
+                case 'n': iters = strtol(optarg, NULL, 0); break;
+                case 'D': depth = strtol(optarg, NULL, 0); break;
+                case 's': size = strtol(optarg, NULL, 0); break;
+                default:
+                        usage(argv[0]);
+                        return 1;
+                }
+        }
+        if (iters < 1 || depth < 1 || size < 1) {
+                usage(argv[0]);
+                return 1;
+        }
+
+        if (loopback_gpu_init(&lo))
+                return 1;
+
+        for (w = 0; w < N_WQ_PLACEMENTS; ++w) {
+                int gds_flags = (w == WQ_ON_GPU) ? GDS_CREATE_QP_WQ_ON_GPU : 0;
+                ret = loopback_open(&ctx, &lo, depth, size, gds_flags, 0);
+                if (ret) {
+                        fprintf(stderr, "error %d while creating QP with WQ on %s\n", ret, wq_names[w]);
+                        goto out_gpu;
+                }
+                // otherwise the provider fell back to a host WQ
+                ASSERT((ctx.gds_qp->on_gpu & GDS_CREATE_QP_WQ_ON_GPU) == (gds_flags & GDS_CREATE_QP_WQ_ON_GPU));
+                start = gds_get_time_us();
+                for (i = 0; i < iters && !ret; ++i)
+                        ret = send_batch(&ctx, 1);
+                lat[w] = gds_get_time_us() - start;
+                start = gds_get_time_us();
+                for (i = 0; i < iters && !ret; ++i)
+                        ret = send_batch(&ctx, depth);
+                tput[w] = gds_get_time_us() - start;
+                loopback_fini(&ctx);
+                if (ret)
+                        goto out_gpu;
+        }
+
+        printf("%d round trips, %d batches of %d sends of %d bytes\n", iters, iters, depth, size);
+        printf("%-8s %12s %12s\n", "WQ", "usec/trip", "Msends/s");
+        for (w = 0; w < N_WQ_PLACEMENTS; ++w)
+                printf("%-8s %12.2f %12.3f\n", wq_names[w],
+                       (double)lat[w] / iters,
+                       (double)iters * depth / tput[w]);
+
+out_gpu:
+        gpu_finalize();
+        return ret ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ *  indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,223 @@
+/* Copyright (c) 2016, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Randomized test and microbenchmark of the IntervalMap behind the pin-down
+// cache. The fuzzer runs inserts and erases against a flat per-unit model
+// and checks the map invariants after every step; the benchmark pins
+// page-sized ranges and looks them up, side by side with the RangeSet which
+// memmgr used before.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <getopt.h>
+
+#include <vector>
+
+#include <rangeset.hpp>
+#include <intervalmap.hpp>
+
+typedef IntervalMap<int> imap;
+
+static double now_ns()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// model[i] is the value stored at unit i, -1 when not covered
+static int check(imap &m, std::vector<int> &model, int step)
+{
+        unsigned long cur = 0;
+        imap::iterator prev = m.end();
+        for (imap::iterator it = m.begin(); it != m.end(); ++it) {
+                if (it->first >= it->second.end) {
+                        fprintf(stderr, "step %d: empty interval at %lu\n", step, it->first);
+                        return 1;
+                }
+                if (prev != m.end() && prev->second.end == it->first && prev->second.value == it->second.value) {
+                        fprintf(stderr, "step %d: adjacent intervals at %lu not coalesced\n", step, it->first);
+                        return 1;
+                }
+                for (; cur < it->first; ++cur) {
+                        if (model[cur] != -1) {
+                                fprintf(stderr, "step %d: unit %lu missing\n", step, cur);
+                                return 1;
+                        }
+                }
+                for (; cur < it->second.end; ++cur) {
+                        if (model[cur] != it->second.value) {
+                                fprintf(stderr, "step %d: unit %lu has %d instead of %d\n", step, cur, it->second.value, model[cur]);
+                                return 1;
+                        }
+                }
+                prev = it;
+        }
+        for (; cur < model.size(); ++cur) {
+                if (model[cur] != -1) {
+                        fprintf(stderr, "step %d: unit %lu missing\n", step, cur);
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+static int fuzz(int steps, unsigned long units)
+{
+        imap m;
+        std::vector<int> model(units, -1);
+
+        for (int step = 0; step < steps; ++step) {
+                unsigned long b = rand() % units;
+                unsigned long e = b + 1 + rand() % std::min(units - b, 64UL);
+                if (rand() % 3) {
+                        // fill the gaps of [b,e), as gds_map_mem does
+                        std::vector<imap::extent> missing;
+                        int value = rand() % 3;
+                        m.gaps(b, e, missing);
+                        for (size_t i = 0; i < missing.size(); ++i) {
+                                if (m.insert(missing[i].first, missing[i].second, value) == m.end()) {
+                                        fprintf(stderr, "step %d: insert of a gap failed\n", step);
+                                        return 1;
+                                }
+                                for (unsigned long u = missing[i].first; u < missing[i].second; ++u)
+                                        model[u] = value;
+                        }
+                        if (!missing.empty() && m.insert(b, e, value) != m.end()) {
+                                fprintf(stderr, "step %d: overlapping insert accepted\n", step);
+                                return 1;
+                        }
+                } else {
+                        m.erase(b, e);
+                        for (unsigned long u = b; u < e; ++u)
+                                model[u] = -1;
+                }
+                // cross-check lookups on a random range
+                unsigned long qb = rand() % units;
+                unsigned long qe = qb + 1 + rand() % std::min(units - qb, 16UL);
+                bool covered = true, any = false;
+                for (unsigned long u = qb; u < qe; ++u) {
+                        covered = covered && model[u] == model[qb] && model[u] != -1;
+                        any = any || model[u] != -1;
+                }
+                if ((m.find(qb, qe) != m.end()) != covered || m.overlaps(qb, qe) != any) {
+                        fprintf(stderr, "step %d: wrong lookup of [%lu,%lu)\n", step, qb, qe);
+                        return 1;
+                }
+                if (check(m, model, step))
+                        return 1;
+        }
+        printf("fuzz: %d steps passed, %zu intervals left\n", steps, m.size());
+        return 0;
+}
+
+static void bench(int n_ranges, int n_lookups)
+{
+        const unsigned long page = 4096;
+        std::vector<unsigned long> addrs(n_ranges);
+        // one page every other page, in random order, so nothing coalesces
+        for (int i = 0; i < n_ranges; ++i)
+                addrs[i] = 0x10000000UL + 2 * page * i;
+        for (int i = n_ranges - 1; i > 0; --i)
+                std::swap(addrs[i], addrs[rand() % (i + 1)]);
+
+        std::vector<unsigned long> queries(n_lookups);
+        for (int i = 0; i < n_lookups; ++i)
+                queries[i] = addrs[rand() % n_ranges] + rand() % (page - 64);
+
+        RangeSet rs;
+        imap m;
+        size_t hits = 0;
+        double t0, t_rs_ins, t_rs_find, t_im_ins, t_im_find;
+
+        t0 = now_ns();
+        for (int i = 0; i < n_ranges; ++i)
+                rs.insert(Range(addrs[i], addrs[i] + page - 1));
+        t_rs_ins = now_ns() - t0;
+        t0 = now_ns();
+        for (int i = 0; i < n_lookups; ++i)
+                hits += rs.find(Range(queries[i], queries[i] + 63)).second == RangeSet::fully_contained;
+        t_rs_find = now_ns() - t0;
+
+        t0 = now_ns();
+        for (int i = 0; i < n_ranges; ++i)
+                m.insert(addrs[i], addrs[i] + page, i);
+        t_im_ins = now_ns() - t0;
+        t0 = now_ns();
+        for (int i = 0; i < n_lookups; ++i)
+                hits += m.find(queries[i], queries[i] + 64) != m.end();
+        t_im_find = now_ns() - t0;
+
+        if (hits != 2 * (size_t)n_lookups)
+                fprintf(stderr, "unexpected misses: %zu hits\n", hits);
+
+        printf("%-12s %10s %14s %14s\n", "structure", "ranges", "ns/insert", "ns/lookup");
+        printf("%-12s %10d %14.1f %14.1f\n", "RangeSet", n_ranges, t_rs_ins / n_ranges, t_rs_find / n_lookups);
+        printf("%-12s %10d %14.1f %14.1f\n", "IntervalMap", n_ranges, t_im_ins / n_ranges, t_im_find / n_lookups);
+}
+
+int main(int argc, char *argv[])
+{
+        int steps = 100000;
+        int n_ranges = 100000;
+        int n_lookups = 1000000;
+        unsigned seed = time(NULL);
+        int c;
+
+        while ((c = getopt(argc, argv, "f:r:l:s:h")) != -1) {
+                switch (c) {
+                case 'f': steps = atoi(optarg); break;
+                case 'r': n_ranges = atoi(optarg); break;
+                case 'l': n_lookups = atoi(optarg); break;
+                case 's': seed = strtoul(optarg, NULL, 0); break;
+                default:
+                        printf("Usage: %s [-f fuzz steps] [-r ranges] [-l lookups] [-s seed]\n", argv[0]);
+                        return 1;
+                }
+        }
+        if (n_ranges < 1 || n_lookups < 1) {
+                fprintf(stderr, "invalid number of ranges or lookups\n");
+                return 1;
+        }
+
+        printf("seed=%u\n", seed);
+        srand(seed);
+        if (fuzz(steps, 1024))
+                return 1;
+        bench(n_ranges, n_lookups);
+        return 0;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ *  indent-tabs-mode: nil
+ * End:
+ */
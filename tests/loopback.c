@@ -0,0 +1,304 @@
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <malloc.h>
+#include <errno.h>
+#include <time.h>
+
+#include <infiniband/verbs_exp.h>
+#include <gdsync.h>
+
+#include "loopback.h"
+#include "gpu.h"
+
+#define LOOPBACK_QKEY 0x11111111
+
+static struct ibv_device *find_device(struct ibv_device **dev_list, const char *ib_devname)
+{
+        int i;
+        if (!ib_devname)
+                return dev_list[0];
+        for (i = 0; dev_list[i]; ++i)
+                if (!strcmp(ibv_get_device_name(dev_list[i]), ib_devname))
+                        return dev_list[i];
+        return NULL;
+}
+
+void loopback_opts_init(struct loopback_opts *o)
+{
+        o->ib_devname = NULL;
+        o->ib_port = 1;
+        o->gid_idx = -1;
+        o->gpu_id = 0;
+}
+
+int loopback_parse_opt(struct loopback_opts *o, int opt, const char *arg)
+{
+        switch (opt) {
+        case 'd': o->ib_devname = arg; break;
+        case 'i': o->ib_port = strtol(arg, NULL, 0); break;
+        case 'g': o->gid_idx = strtol(arg, NULL, 0); break;
+        case 'G': o->gpu_id = strtol(arg, NULL, 0); break;
+        default:
+                return 0;
+        }
+        return 1;
+}
+
+void loopback_usage(void)
+{
+        printf("  -d, --ib-dev=<dev>     use IB device <dev> (default first device found)\n");
+        printf("  -i, --ib-port=<port>   use port <port> of IB device (default 1)\n");
+        printf("  -g, --gid-idx=<idx>    local port gid index (default none)\n");
+        printf("  -G, --gpu-id=<id>      use specified GPU (default 0)\n");
+}
+
+int loopback_gpu_init(const struct loopback_opts *o)
+{
+        if (gpu_init(o->gpu_id, CU_CTX_SCHED_AUTO)) {
+                fprintf(stderr, "error in GPU init.\n");
+                return EIO;
+        }
+        return 0;
+}
+
+int loopback_open(struct loopback_ctx *ctx, const struct loopback_opts *o,
+                  int depth, size_t size, int gds_flags, int max_inline)
+{
+        return loopback_init_ex(ctx, o->ib_devname, o->ib_port, o->gid_idx, o->gpu_id,
+                                depth, size, gds_flags, max_inline);
+}
+
+int loopback_create_qp(struct loopback_ctx *ctx, int gpu_id, int gds_flags, int max_inline,
+                       gds_create_qp_attr_t *qp_attr, struct gds_qp **out_qp)
+{
+        int ret = 0;
+        struct gds_qp *qp;
+
+        {
+                gds_qp_init_attr_t attr = {
+                        .send_cq = 0,
+                        .recv_cq = 0,
+                        .cap     = {
+                                .max_send_wr  = ctx->depth,
+                                .max_recv_wr  = ctx->depth,
+                                .max_send_sge = 1,
+                                .max_recv_sge = 1,
+                                .max_inline_data = max_inline
+                        },
+                        .qp_type = IBV_QPT_UD,
+                };
+                qp = gds_create_qp_ex(ctx->pd, ctx->context, &attr, gpu_id, gds_flags, qp_attr);
+                if (!qp) {
+                        fprintf(stderr, "Couldn't create QP (%d/%s)\n", errno, strerror(errno));
+                        return errno ? errno : EINVAL;
+                }
+        }
+
+        {
+                struct ibv_qp_attr attr = {
+                        .qp_state        = IBV_QPS_INIT,
+                        .pkey_index      = 0,
+                        .port_num        = ctx->port,
+                        .qkey            = LOOPBACK_QKEY
+                };
+                if (ibv_modify_qp(qp->qp, &attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_QKEY)) {
+                        fprintf(stderr, "Failed to modify QP to INIT\n");
+                        ret = EINVAL;
+                        goto out;
+                }
+                attr.qp_state = IBV_QPS_RTR;
+                if (ibv_modify_qp(qp->qp, &attr, IBV_QP_STATE)) {
+                        fprintf(stderr, "Failed to modify QP to RTR\n");
+                        ret = EINVAL;
+                        goto out;
+                }
+                attr.qp_state = IBV_QPS_RTS;
+                attr.sq_psn = 0;
+                if (ibv_modify_qp(qp->qp, &attr, IBV_QP_STATE | IBV_QP_SQ_PSN)) {
+                        fprintf(stderr, "Failed to modify QP to RTS\n");
+                        ret = EINVAL;
+                        goto out;
+                }
+        }
+out:
+        if (ret)
+                gds_destroy_qp(qp);
+        else
+                *out_qp = qp;
+        return ret;
+}
+
+int loopback_init(struct loopback_ctx *ctx, const char *ib_devname, int port, int gid_idx,
+                  int gpu_id, int depth, size_t size, int gds_flags)
+{
+        return loopback_init_ex(ctx, ib_devname, port, gid_idx, gpu_id, depth, size, gds_flags, 0);
+}
+
+int loopback_init_ex(struct loopback_ctx *ctx, const char *ib_devname, int port, int gid_idx,
+                     int gpu_id, int depth, size_t size, int gds_flags, int max_inline)
+{
+        int ret = 0;
+        struct ibv_device **dev_list = NULL;
+        struct ibv_device *ib_dev;
+        struct ibv_port_attr port_attr;
+        union ibv_gid gid;
+
+        memset(ctx, 0, sizeof(*ctx));
+        ctx->size = size;
+        ctx->depth = depth;
+        ctx->port = port;
+
+        dev_list = ibv_get_device_list(NULL);
+        if (!dev_list) {
+                fprintf(stderr, "Failed to get IB devices list\n");
+                return ENODEV;
+        }
+        ib_dev = find_device(dev_list, ib_devname);
+        if (!ib_dev) {
+                fprintf(stderr, "IB device %s not found\n", ib_devname ? ib_devname : "");
+                ret = ENODEV;
+                goto out;
+        }
+        ctx->context = ibv_open_device(ib_dev);
+        if (!ctx->context) {
+                fprintf(stderr, "Couldn't get context for %s\n", ibv_get_device_name(ib_dev));
+                ret = ENODEV;
+                goto out;
+        }
+        ctx->pd = ibv_alloc_pd(ctx->context);
+        if (!ctx->pd) {
+                fprintf(stderr, "Couldn't allocate PD\n");
+                ret = ENOMEM;
+                goto out;
+        }
+        ctx->buf = memalign(sysconf(_SC_PAGESIZE), size + 40);
+        if (!ctx->buf) {
+                ret = ENOMEM;
+                goto out;
+        }
+        memset(ctx->buf, 0, size + 40);
+        ctx->mr = ibv_reg_mr(ctx->pd, ctx->buf, size + 40, IBV_ACCESS_LOCAL_WRITE);
+        if (!ctx->mr) {
+                fprintf(stderr, "Couldn't register MR\n");
+                ret = ENOMEM;
+                goto out;
+        }
+
+        ret = loopback_create_qp(ctx, gpu_id, gds_flags, max_inline, NULL, &ctx->gds_qp);
+        if (ret)
+                goto out;
+
+        if (ibv_query_port(ctx->context, port, &port_attr)) {
+                fprintf(stderr, "Couldn't query port %d\n", port);
+                ret = EINVAL;
+                goto out;
+        }
+        {
+                struct ibv_ah_attr ah_attr = {
+                        .is_global     = 0,
+                        .dlid          = port_attr.lid,
+                        .sl            = 0,
+                        .src_path_bits = 0,
+                        .port_num      = port
+                };
+                if (gid_idx >= 0) {
+                        if (ibv_query_gid(ctx->context, port, gid_idx, &gid)) {
+                                fprintf(stderr, "Couldn't query gid %d\n", gid_idx);
+                                ret = EINVAL;
+                                goto out;
+                        }
+                        ah_attr.is_global = 1;
+                        ah_attr.grh.hop_limit = 1;
+                        ah_attr.grh.dgid = gid;
+                        ah_attr.grh.sgid_index = gid_idx;
+                }
+                ctx->ah = ibv_create_ah(ctx->pd, &ah_attr);
+                if (!ctx->ah) {
+                        fprintf(stderr, "Failed to create AH\n");
+                        ret = EINVAL;
+                        goto out;
+                }
+        }
+out:
+        ibv_free_device_list(dev_list);
+        if (ret)
+                loopback_fini(ctx);
+        return ret;
+}
+
+int loopback_fini(struct loopback_ctx *ctx)
+{
+        if (ctx->ah)
+                ibv_destroy_ah(ctx->ah);
+        if (ctx->gds_qp)
+                gds_destroy_qp(ctx->gds_qp);
+        if (ctx->mr)
+                ibv_dereg_mr(ctx->mr);
+        if (ctx->pd)
+                ibv_dealloc_pd(ctx->pd);
+        if (ctx->context)
+                ibv_close_device(ctx->context);
+        free(ctx->buf);
+        memset(ctx, 0, sizeof(*ctx));
+        return 0;
+}
+
+void loopback_init_send(struct loopback_ctx *ctx, gds_send_wr *ewr, struct ibv_sge *sge, int send_flags)
+{
+        memset(sge, 0, sizeof(*sge));
+        sge->addr = (uintptr_t)ctx->buf;
+        sge->length = ctx->size;
+        sge->lkey = ctx->mr->lkey;
+
+        memset(ewr, 0, sizeof(*ewr));
+        ewr->wr_id = 1;
+        ewr->sg_list = sge;
+        ewr->num_sge = 1;
+        ewr->exp_opcode = IBV_EXP_WR_SEND;
+        ewr->exp_send_flags = IBV_EXP_SEND_SIGNALED | send_flags;
+        ewr->wr.ud.ah = ctx->ah;
+        ewr->wr.ud.remote_qpn = ctx->gds_qp->qp->qp_num;
+        ewr->wr.ud.remote_qkey = LOOPBACK_QKEY;
+        ewr->comp_mask = 0;
+}
+
+int loopback_drain_send_cq(struct loopback_ctx *ctx, int n)
+{
+        struct ibv_wc wc[16];
+        time_t tmout = time(NULL) + 10;
+        while (n > 0) {
+                int ne = ibv_poll_cq(ctx->gds_qp->send_cq.cq, n < 16 ? n : 16, wc);
+                int i;
+                if (ne < 0) {
+                        fprintf(stderr, "error %d in ibv_poll_cq\n", ne);
+                        return EIO;
+                }
+                for (i = 0; i < ne; ++i) {
+                        if (wc[i].status != IBV_WC_SUCCESS) {
+                                fprintf(stderr, "send completion error %d (%s)\n", wc[i].status, ibv_wc_status_str(wc[i].status));
+                                return EIO;
+                        }
+                }
+                n -= ne;
+                if (!ne && time(NULL) > tmout) {
+                        fprintf(stderr, "timeout while waiting for %d send completions\n", n);
+                        return ETIMEDOUT;
+                }
+        }
+        return 0;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ *  indent-tabs-mode: nil
+ * End:
+ */
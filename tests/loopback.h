@@ -0,0 +1,72 @@
+#pragma once
+
+// UD QP sending to itself, shared by the single-process benchmarks
+
+#include <infiniband/verbs_exp.h>
+#include <gdsync.h>
+
+// IB device and GPU options, common to the tests built on loopback_ctx.
+// Prepend LOOPBACK_SHORT_OPTIONS to the short options, splice
+// LOOPBACK_LONG_OPTIONS into the getopt_long table and hand unknown option
+// values to loopback_parse_opt().
+#define LOOPBACK_SHORT_OPTIONS "d:i:g:G:"
+
+#define LOOPBACK_LONG_OPTIONS                                                   \
+        { .name = "ib-dev",  .has_arg = 1, .val = 'd' },                        \
+        { .name = "ib-port", .has_arg = 1, .val = 'i' },                        \
+        { .name = "gid-idx", .has_arg = 1, .val = 'g' },                        \
+        { .name = "gpu-id",  .has_arg = 1, .val = 'G' }
+
+struct loopback_opts {
+        const char *ib_devname; // NULL for the first device found
+        int         ib_port;
+        int         gid_idx;    // -1 for no GRH
+        int         gpu_id;
+};
+
+void loopback_opts_init(struct loopback_opts *o);
+// 1 if opt is a loopback option, 0 if not
+int loopback_parse_opt(struct loopback_opts *o, int opt, const char *arg);
+void loopback_usage(void);
+// gpu_init() on the GPU selected by o
+int loopback_gpu_init(const struct loopback_opts *o);
+
+struct loopback_ctx {
+        struct ibv_context *context;
+        struct ibv_pd      *pd;
+        struct ibv_mr      *mr;
+        struct ibv_ah      *ah;
+        struct gds_qp      *gds_qp;
+        void               *buf;
+        size_t              size;
+        int                 depth;
+        int                 port;
+};
+
+// gpu_init() must have been called already
+int loopback_init(struct loopback_ctx *ctx, const char *ib_devname, int port, int gid_idx,
+                  int gpu_id, int depth, size_t size, int gds_flags);
+// same as loopback_init, with room for max_inline bytes of inline send data
+int loopback_init_ex(struct loopback_ctx *ctx, const char *ib_devname, int port, int gid_idx,
+                     int gpu_id, int depth, size_t size, int gds_flags, int max_inline);
+// same as loopback_init_ex, on the IB device and GPU selected by o
+int loopback_open(struct loopback_ctx *ctx, const struct loopback_opts *o,
+                  int depth, size_t size, int gds_flags, int max_inline);
+int loopback_fini(struct loopback_ctx *ctx);
+// one more UD QP on the device of ctx, in RTS state, qp_attr can be NULL
+// the caller destroys it with gds_destroy_qp before loopback_fini
+int loopback_create_qp(struct loopback_ctx *ctx, int gpu_id, int gds_flags, int max_inline,
+                       gds_create_qp_attr_t *qp_attr, struct gds_qp **qp);
+// fills ewr/sge with a signaled send of ctx->size bytes to the QP itself
+void loopback_init_send(struct loopback_ctx *ctx, gds_send_wr *ewr, struct ibv_sge *sge, int send_flags);
+// polls the send CQ until n completions have been reaped, returns 0 or error
+int loopback_drain_send_cq(struct loopback_ctx *ctx, int n);
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ *  indent-tabs-mode: nil
+ * End:
+ */